@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2018 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * This keeps the wg_indices map of xdp-prefilter.o in sync with the receiver
+ * indices that are live on a WireGuard interface, so that the XDP program can
+ * drop data packets for any other index. It joins the interface's index events
+ * first, then dumps the whole set, and only then applies what queued up in the
+ * meantime, as described in uapi/wireguard.h. Until that first pass is done,
+ * and again whenever it has to start over, wg_indices_synced is cleared, which
+ * has the XDP program let data packets through for the kernel to judge.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include "../../../src/uapi/wireguard.h"
+
+#define DEFAULT_MAP_DIR "/sys/fs/bpf/xdp/globals"
+
+static volatile sig_atomic_t should_exit;
+static int indices_fd = -1, synced_fd = -1;
+static uint16_t family_id;
+static uint32_t group_id;
+static unsigned int ifindex;
+static char buf[1 << 16];
+
+static int bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_open(const char *dir, const char *name)
+{
+	union bpf_attr attr = { 0 };
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	attr.pathname = (uint64_t)(unsigned long)path;
+	return bpf(BPF_OBJ_GET, &attr);
+}
+
+static int map_update(int fd, const void *key, const void *value)
+{
+	union bpf_attr attr = { 0 };
+
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	attr.value = (uint64_t)(unsigned long)value;
+	attr.flags = BPF_ANY;
+	return bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_delete(int fd, const void *key)
+{
+	union bpf_attr attr = { 0 };
+
+	attr.map_fd = fd;
+	attr.key = (uint64_t)(unsigned long)key;
+	return bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static int map_first_key(int fd, void *key)
+{
+	union bpf_attr attr = { 0 };
+
+	attr.map_fd = fd;
+	attr.next_key = (uint64_t)(unsigned long)key;
+	return bpf(BPF_MAP_GET_NEXT_KEY, &attr);
+}
+
+static int set_synced(uint32_t synced)
+{
+	uint32_t zero = 0;
+
+	return map_update(synced_fd, &zero, &synced);
+}
+
+static int add_index(uint32_t index)
+{
+	uint8_t one = 1;
+
+	if (map_update(indices_fd, &index, &one) < 0) {
+		perror("Unable to add index, so leaving data packets unfiltered");
+		return -1;
+	}
+	return 0;
+}
+
+static void del_index(uint32_t index)
+{
+	map_delete(indices_fd, &index);
+}
+
+#define nla_for_each(pos, start, len) \
+	for (pos = (struct nlattr *)(start); \
+	     (char *)(pos) + NLA_HDRLEN <= (char *)(start) + (len) && \
+	     (pos)->nla_len >= NLA_HDRLEN && \
+	     (char *)(pos) + (pos)->nla_len <= (char *)(start) + (len); \
+	     pos = (struct nlattr *)((char *)(pos) + NLA_ALIGN((pos)->nla_len)))
+#define nla_data(nla) ((void *)((char *)(nla) + NLA_HDRLEN))
+#define nla_payload(nla) ((nla)->nla_len - NLA_HDRLEN)
+#define nla_type(nla) ((nla)->nla_type & NLA_TYPE_MASK)
+
+static void *put_attr(struct nlmsghdr *nlh, uint16_t type, const void *data,
+		      uint16_t len)
+{
+	struct nlattr *nla = (struct nlattr *)((char *)nlh +
+					       NLMSG_ALIGN(nlh->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy(nla_data(nla), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return nla;
+}
+
+static int request(int fd, uint16_t type, uint16_t flags, uint8_t cmd,
+		   uint16_t attr, const void *data, uint16_t len)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		char attrs[256];
+	} req = {
+		.nlh = {
+			.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN),
+			.nlmsg_type = type,
+			.nlmsg_flags = NLM_F_REQUEST | flags
+		},
+		.genl = { .cmd = cmd, .version = WG_GENL_VERSION }
+	};
+
+	put_attr(&req.nlh, attr, data, len);
+	return send(fd, &req, req.nlh.nlmsg_len, 0) < 0 ? -1 : 0;
+}
+
+/* Calls cb on the attributes of each generic netlink message that comes back,
+ * until the final one.
+ */
+static int receive(int fd, bool multi, int (*cb)(uint8_t cmd, struct nlattr *attrs, int len))
+{
+	for (;;) {
+		struct nlmsghdr *nlh;
+		ssize_t len = recv(fd, buf, sizeof(buf), 0);
+
+		if (len < 0)
+			return -1;
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+			if (nlh->nlmsg_type == NLMSG_ERROR ||
+			    nlh->nlmsg_type == NLMSG_DONE) {
+				int err = *(int *)NLMSG_DATA(nlh);
+
+				if (err < 0) {
+					errno = -err;
+					return -1;
+				}
+				return 0;
+			}
+			if (cb(genl->cmd, (struct nlattr *)((char *)genl + GENL_HDRLEN),
+			       nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN)) < 0)
+				return -1;
+			if (!multi)
+				return 0;
+		}
+	}
+}
+
+static int parse_family(uint8_t cmd, struct nlattr *attrs, int len)
+{
+	struct nlattr *attr, *group, *nested;
+
+	nla_for_each(attr, attrs, len) {
+		if (nla_type(attr) == CTRL_ATTR_FAMILY_ID)
+			family_id = *(uint16_t *)nla_data(attr);
+		if (nla_type(attr) != CTRL_ATTR_MCAST_GROUPS)
+			continue;
+		nla_for_each(group, nla_data(attr), nla_payload(attr)) {
+			const char *name = NULL;
+			uint32_t id = 0;
+
+			nla_for_each(nested, nla_data(group), nla_payload(group)) {
+				if (nla_type(nested) == CTRL_ATTR_MCAST_GRP_NAME)
+					name = nla_data(nested);
+				else if (nla_type(nested) == CTRL_ATTR_MCAST_GRP_ID)
+					id = *(uint32_t *)nla_data(nested);
+			}
+			if (name && !strcmp(name, WG_MULTICAST_GROUP_INDICES))
+				group_id = id;
+		}
+	}
+	return 0;
+}
+
+static int parse_indices(uint8_t cmd, struct nlattr *attrs, int len)
+{
+	struct nlattr *attr, *index;
+
+	nla_for_each(attr, attrs, len) {
+		if (nla_type(attr) != WGDEVICE_A_INDICES)
+			continue;
+		nla_for_each(index, nla_data(attr), nla_payload(attr)) {
+			if (add_index(*(uint32_t *)nla_data(index)) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int parse_event(uint8_t cmd, struct nlattr *attrs, int len)
+{
+	uint32_t event_ifindex = 0, index = 0;
+	bool has_index = false;
+	struct nlattr *attr;
+
+	nla_for_each(attr, attrs, len) {
+		if (nla_type(attr) == WGDEVICE_A_IFINDEX)
+			event_ifindex = *(uint32_t *)nla_data(attr);
+		else if (nla_type(attr) == WGDEVICE_A_INDEX) {
+			index = *(uint32_t *)nla_data(attr);
+			has_index = true;
+		}
+	}
+	if (event_ifindex != ifindex || !has_index)
+		return 0;
+	if (cmd == WG_CMD_NEW_INDEX)
+		return add_index(index);
+	if (cmd == WG_CMD_DEL_INDEX)
+		del_index(index);
+	return 0;
+}
+
+static int apply_events(ssize_t len)
+{
+	struct nlmsghdr *nlh;
+
+	for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+		struct genlmsghdr *genl = NLMSG_DATA(nlh);
+
+		if (nlh->nlmsg_type == family_id &&
+		    parse_event(genl->cmd, (struct nlattr *)((char *)genl + GENL_HDRLEN),
+				nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int open_genl(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("Unable to open generic netlink socket");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Empties the map, dumps the live indices into it, and then applies whatever
+ * events queued up on the events socket while that was happening.
+ */
+static int sync_all(int dump_fd, int events_fd)
+{
+	uint32_t key, one = 1;
+	ssize_t len;
+
+	if (set_synced(0) < 0)
+		return -1;
+	while (!map_first_key(indices_fd, &key))
+		del_index(key);
+
+	if (request(dump_fd, family_id, NLM_F_DUMP, WG_CMD_GET_INDICES,
+		    WGDEVICE_A_IFINDEX, &ifindex, sizeof(ifindex)) < 0 ||
+	    receive(dump_fd, true, parse_indices) < 0) {
+		perror("Unable to dump indices");
+		return -1;
+	}
+
+	while ((len = recv(events_fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+		if (apply_events(len) < 0)
+			return -1;
+	}
+	if (errno == ENOBUFS) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	return set_synced(one);
+}
+
+static void handle_signal(int sig)
+{
+	should_exit = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *map_dir = argc > 2 ? argv[2] : DEFAULT_MAP_DIR;
+	struct sigaction sa = { .sa_handler = handle_signal };
+	int dump_fd, events_fd, ret;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s INTERFACE [MAP_DIRECTORY]\n", argv[0]);
+		return 1;
+	}
+	ifindex = if_nametoindex(argv[1]);
+	if (!ifindex) {
+		perror("Unable to find interface");
+		return 1;
+	}
+	indices_fd = map_open(map_dir, "wg_indices");
+	synced_fd = map_open(map_dir, "wg_indices_synced");
+	if (indices_fd < 0 || synced_fd < 0) {
+		perror("Unable to open pinned maps, so attach xdp-prefilter.o first");
+		return 1;
+	}
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	dump_fd = open_genl();
+	events_fd = open_genl();
+	if (request(dump_fd, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY,
+		    CTRL_ATTR_FAMILY_NAME, WG_GENL_NAME, sizeof(WG_GENL_NAME)) < 0 ||
+	    receive(dump_fd, false, parse_family) < 0 || !family_id || !group_id) {
+		fprintf(stderr, "Unable to find the %s generic netlink family and its %s group\n",
+			WG_GENL_NAME, WG_MULTICAST_GROUP_INDICES);
+		return 1;
+	}
+	if (setsockopt(events_fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group_id,
+		       sizeof(group_id)) < 0) {
+		perror("Unable to join index events");
+		return 1;
+	}
+
+	while (!should_exit) {
+		ret = sync_all(dump_fd, events_fd);
+		if (ret < 0 && errno == EAGAIN)
+			continue;
+		if (ret < 0)
+			break;
+		printf("synced\n");
+		fflush(stdout);
+
+		/* From here on, events are applied as they come, until the
+		 * socket overruns and we have to start over.
+		 */
+		while (!should_exit) {
+			ssize_t len = recv(events_fd, buf, sizeof(buf), 0);
+
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0)
+				break;
+			if (apply_events(len) < 0)
+				goto out;
+		}
+		if (!should_exit && errno != ENOBUFS) {
+			perror("Unable to receive index events");
+			break;
+		}
+	}
+out:
+	set_synced(0);
+	return should_exit ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2015-2018 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * This is an XDP program that drops UDP packets to a WireGuard listen port
+ * whose message type or length can't possibly be valid, before the driver
+ * allocates an skb for them. It mirrors the classifier at the top of
+ * wg_packet_receive. Data packets are also checked against wg_indices, which
+ * sync-indices keeps filled with the interface's live receiver indices; until
+ * it says that map is complete, those are left for the kernel to judge.
+ */
+
+#include <stdint.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/in.h>
+#include <linux/udp.h>
+#include <asm/byteorder.h>
+
+#ifndef WG_PORT
+#define WG_PORT 51820
+#endif
+
+#define SEC(name) __attribute__((section(name), used))
+
+/* The map definition understood by iproute2, which pins these at
+ * /sys/fs/bpf/xdp/globals/ when attaching, for sync-indices to find.
+ */
+struct bpf_elf_map {
+	uint32_t type;
+	uint32_t size_key;
+	uint32_t size_value;
+	uint32_t max_elem;
+	uint32_t flags;
+	uint32_t id;
+	uint32_t pinning;
+};
+#define PIN_GLOBAL_NS 2
+
+struct bpf_elf_map SEC("maps") wg_indices = {
+	.type = BPF_MAP_TYPE_HASH,
+	.size_key = sizeof(uint32_t),
+	.size_value = sizeof(uint8_t),
+	.max_elem = 1 << 20,
+	.flags = BPF_F_NO_PREALLOC,
+	.pinning = PIN_GLOBAL_NS
+};
+
+struct bpf_elf_map SEC("maps") wg_indices_synced = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.size_key = sizeof(uint32_t),
+	.size_value = sizeof(uint32_t),
+	.max_elem = 1,
+	.pinning = PIN_GLOBAL_NS
+};
+
+static void *(*bpf_map_lookup_elem)(void *map, const void *key) =
+	(void *)BPF_FUNC_map_lookup_elem;
+
+enum {
+	MESSAGE_HANDSHAKE_INITIATION = 1,
+	MESSAGE_HANDSHAKE_RESPONSE = 2,
+	MESSAGE_HANDSHAKE_COOKIE = 3,
+	MESSAGE_DATA = 4
+};
+
+enum {
+	MESSAGE_HANDSHAKE_INITIATION_LEN = 148,
+	MESSAGE_HANDSHAKE_RESPONSE_LEN = 92,
+	MESSAGE_HANDSHAKE_COOKIE_LEN = 64,
+	MESSAGE_MINIMUM_LENGTH = 32 /* header, key_idx, counter, and poly1305 tag */
+};
+
+static inline int check_index(const uint32_t *key_idx, const void *data_end)
+{
+	const uint32_t *synced;
+	uint32_t zero = 0, index;
+
+	if ((const void *)(key_idx + 1) > data_end)
+		return XDP_PASS;
+	synced = bpf_map_lookup_elem(&wg_indices_synced, &zero);
+	if (!synced || !*synced)
+		return XDP_PASS;
+	index = *key_idx;
+	return bpf_map_lookup_elem(&wg_indices, &index) ? XDP_PASS : XDP_DROP;
+}
+
+static inline int classify(const struct udphdr *udp, const void *data_end)
+{
+	const uint32_t *type = (const uint32_t *)(udp + 1);
+	uint16_t len;
+
+	if (udp->dest != __constant_htons(WG_PORT))
+		return XDP_PASS;
+	if ((const void *)(type + 1) > data_end)
+		return XDP_PASS;
+	len = __be16_to_cpu(udp->len);
+	if (len < sizeof(*udp) + sizeof(*type))
+		return XDP_DROP;
+	len -= sizeof(*udp);
+
+	switch (__le32_to_cpu(*type)) {
+	case MESSAGE_DATA:
+		if (len < MESSAGE_MINIMUM_LENGTH)
+			return XDP_DROP;
+		return check_index(type + 1, data_end);
+	case MESSAGE_HANDSHAKE_INITIATION:
+		return len == MESSAGE_HANDSHAKE_INITIATION_LEN ? XDP_PASS : XDP_DROP;
+	case MESSAGE_HANDSHAKE_RESPONSE:
+		return len == MESSAGE_HANDSHAKE_RESPONSE_LEN ? XDP_PASS : XDP_DROP;
+	case MESSAGE_HANDSHAKE_COOKIE:
+		return len == MESSAGE_HANDSHAKE_COOKIE_LEN ? XDP_PASS : XDP_DROP;
+	}
+	return XDP_DROP;
+}
+
+SEC("xdp")
+int xdp_wireguard_prefilter(struct xdp_md *ctx)
+{
+	const void *data = (const void *)(long)ctx->data;
+	const void *data_end = (const void *)(long)ctx->data_end;
+	const struct ethhdr *eth = data;
+	const struct udphdr *udp;
+
+	if ((const void *)(eth + 1) > data_end)
+		return XDP_PASS;
+
+	if (eth->h_proto == __constant_htons(ETH_P_IP)) {
+		const struct iphdr *ip = (const void *)(eth + 1);
+
+		if ((const void *)(ip + 1) > data_end ||
+		    ip->protocol != IPPROTO_UDP || ip->ihl < 5 ||
+		    (ip->frag_off & __constant_htons(0x3fff)))
+			return XDP_PASS;
+		udp = (const void *)ip + ip->ihl * 4;
+	} else if (eth->h_proto == __constant_htons(ETH_P_IPV6)) {
+		const struct ipv6hdr *ip6 = (const void *)(eth + 1);
+
+		/* Extension headers are rare enough to leave to the kernel. */
+		if ((const void *)(ip6 + 1) > data_end ||
+		    ip6->nexthdr != IPPROTO_UDP)
+			return XDP_PASS;
+		udp = (const void *)(ip6 + 1);
+	} else
+		return XDP_PASS;
+
+	if ((const void *)(udp + 1) > data_end)
+		return XDP_PASS;
+	return classify(udp, data_end);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -6,18 +6,50 @@
 #include "allowedips.h"
 #include "peer.h"
 
+#include <linux/sort.h>
+
+/* Lookups only ever touch the members from bit onwards, which for v4 all share
+ * a single cacheline. Since bits is sized to fit the family, each family gets
+ * its own cache.
+ */
 struct allowedips_node {
-	struct wg_peer __rcu *peer;
-	struct rcu_head rcu;
-	struct allowedips_node __rcu *bit[2];
-	/* While it may seem scandalous that we waste space for v4,
-	 * we're alloc'ing to the nearest power of 2 anyway, so this
-	 * doesn't actually make a difference.
+	/* The address of the pointer that points to this node, with the low
+	 * bits holding which of its parent's children it is, or 2 for a root.
 	 */
-	u8 bits[16] __aligned(__alignof(u64));
-	u8 cidr, bit_at_a, bit_at_b;
+	unsigned long parent_bit_packed;
+	union {
+		struct list_head peer_list;
+		struct rcu_head rcu;
+	};
+	struct allowedips_node __rcu *bit[2];
+	struct wg_peer __rcu *peer;
+	u8 cidr, bit_at_a, bit_at_b, bitlen;
+	u8 bits[] __aligned(__alignof(u64));
 };
 
+static struct kmem_cache *node_cache4 __read_mostly;
+static struct kmem_cache *node_cache6 __read_mostly;
+
+static inline struct kmem_cache *node_cache(u8 bits)
+{
+	return bits == 32 ? node_cache4 : node_cache6;
+}
+
+static struct allowedips_node *node_alloc(u8 bits)
+{
+	struct allowedips_node *node = kmem_cache_zalloc(node_cache(bits),
+							 GFP_KERNEL);
+
+	if (likely(node))
+		node->bitlen = bits;
+	return node;
+}
+
+static void node_free(struct allowedips_node *node)
+{
+	kmem_cache_free(node_cache(node->bitlen), node);
+}
+
 static __always_inline void swap_endian(u8 *dst, const u8 *src, u8 bits)
 {
 	if (bits == 32)
@@ -37,15 +69,32 @@ static void copy_and_assign_cidr(struct allowedips_node *node, const u8 *src,
 	node->bit_at_a ^= (bits / 8U - 1U) % 8U;
 #endif
 	node->bit_at_b = 7U - (cidr % 8U);
+	node->bitlen = bits;
 	memcpy(node->bits, src, bits / 8U);
 }
 
-#define choose_node(parent, key)                                               \
-	parent->bit[(key[parent->bit_at_a] >> parent->bit_at_b) & 1]
+#define choose(parent, key)                                                    \
+	((key[parent->bit_at_a] >> parent->bit_at_b) & 1)
+#define choose_node(parent, key) parent->bit[choose(parent, key)]
+
+static inline void connect_node(struct allowedips_node __rcu **parent, u8 bit,
+				struct allowedips_node *node)
+{
+	node->parent_bit_packed = (unsigned long)parent | bit;
+	rcu_assign_pointer(*parent, node);
+}
+
+static inline void choose_and_connect_node(struct allowedips_node *parent,
+					   struct allowedips_node *node)
+{
+	u8 bit = choose(parent, node->bits);
+
+	connect_node(&parent->bit[bit], bit, node);
+}
 
 static void node_free_rcu(struct rcu_head *rcu)
 {
-	kfree(container_of(rcu, struct allowedips_node, rcu));
+	node_free(container_of(rcu, struct allowedips_node, rcu));
 }
 
 #define push_rcu(stack, p, len) ({                                             \
@@ -64,98 +113,70 @@ static void root_free_rcu(struct rcu_head *rcu)
 	while (len > 0 && (node = stack[--len]) &&
 	       push_rcu(stack, node->bit[0], len) &&
 	       push_rcu(stack, node->bit[1], len))
-		kfree(node);
+		node_free(node);
 }
 
-static int
-walk_by_peer(struct allowedips_node __rcu *top, u8 bits,
-	     struct allowedips_cursor *cursor, struct wg_peer *peer,
-	     int (*func)(void *ctx, const u8 *ip, u8 cidr, int family),
-	     void *ctx, struct mutex *lock)
+/* Returns how many nodes there are under root, including itself. */
+static size_t root_remove_peer_lists(struct allowedips_node *root)
 {
-	const int address_family = bits == 32 ? AF_INET : AF_INET6;
-	u8 ip[16] __aligned(__alignof(u64));
-	struct allowedips_node *node;
-	int ret;
-
-	if (!rcu_access_pointer(top))
-		return 0;
-
-	if (!cursor->len)
-		push_rcu(cursor->stack, top, cursor->len);
-
-	for (; cursor->len > 0 && (node = cursor->stack[cursor->len - 1]);
-	     --cursor->len, push_rcu(cursor->stack, node->bit[0], cursor->len),
-	     push_rcu(cursor->stack, node->bit[1], cursor->len)) {
-		const unsigned int cidr_bytes = DIV_ROUND_UP(node->cidr, 8U);
-
-		if (rcu_dereference_protected(node->peer,
-					      lockdep_is_held(lock)) != peer)
-			continue;
-
-		swap_endian(ip, node->bits, bits);
-		memset(ip + cidr_bytes, 0, bits / 8U - cidr_bytes);
-		if (node->cidr)
-			ip[cidr_bytes - 1U] &= ~0U << (-node->cidr % 8U);
+	struct allowedips_node *node, *stack[128] = { root };
+	unsigned int len = 1;
+	size_t count = 0;
 
-		ret = func(ctx, ip, node->cidr, address_family);
-		if (ret)
-			return ret;
+	while (len > 0 && (node = stack[--len]) &&
+	       push_rcu(stack, node->bit[0], len) &&
+	       push_rcu(stack, node->bit[1], len)) {
+		if (rcu_access_pointer(node->peer))
+			list_del(&node->peer_list);
+		++count;
 	}
-	return 0;
+	return count;
 }
 #undef push_rcu
 
-#define ref(p) rcu_access_pointer(p)
-#define deref(p) rcu_dereference_protected(*p, lockdep_is_held(lock))
-#define push(p) ({                                                             \
-		WARN_ON(IS_ENABLED(DEBUG) && len >= 128);                      \
-		stack[len++] = p;                                              \
-	})
-static void walk_remove_by_peer(struct allowedips_node __rcu **top,
-				struct wg_peer *peer, struct mutex *lock)
+/* Takes node out of its peer's list, and then out of the trie if it's no
+ * longer needed for branching, along with its parent if that was only there
+ * to branch between node and its sibling.
+ */
+static void remove_node(struct allowedips_node *node, unsigned long *nodes,
+			struct mutex *lock)
 {
-	struct allowedips_node __rcu **stack[128], **nptr;
-	struct allowedips_node *node, *prev;
-	unsigned int len;
+	struct allowedips_node __rcu **parent_bit;
+	struct allowedips_node *child, *parent;
+	bool free_parent;
 
-	if (unlikely(!peer || !ref(*top)))
+	list_del_init(&node->peer_list);
+	RCU_INIT_POINTER(node->peer, NULL);
+	if (rcu_access_pointer(node->bit[0]) &&
+	    rcu_access_pointer(node->bit[1]))
 		return;
-
-	for (prev = NULL, len = 0, push(top); len > 0; prev = node) {
-		nptr = stack[len - 1];
-		node = deref(nptr);
-		if (!node) {
-			--len;
-			continue;
-		}
-		if (!prev || ref(prev->bit[0]) == node ||
-		    ref(prev->bit[1]) == node) {
-			if (ref(node->bit[0]))
-				push(&node->bit[0]);
-			else if (ref(node->bit[1]))
-				push(&node->bit[1]);
-		} else if (ref(node->bit[0]) == prev) {
-			if (ref(node->bit[1]))
-				push(&node->bit[1]);
-		} else {
-			if (rcu_dereference_protected(node->peer,
-				lockdep_is_held(lock)) == peer) {
-				RCU_INIT_POINTER(node->peer, NULL);
-				if (!node->bit[0] || !node->bit[1]) {
-					rcu_assign_pointer(*nptr,
-					deref(&node->bit[!ref(node->bit[0])]));
-					call_rcu_bh(&node->rcu, node_free_rcu);
-					node = deref(nptr);
-				}
-			}
-			--len;
-		}
-	}
+	child = rcu_dereference_protected(
+			node->bit[!rcu_access_pointer(node->bit[0])],
+			lockdep_is_held(lock));
+	if (child)
+		child->parent_bit_packed = node->parent_bit_packed;
+	parent_bit = (struct allowedips_node __rcu **)
+			(node->parent_bit_packed & ~3UL);
+	rcu_assign_pointer(*parent_bit, child);
+	parent = (void *)parent_bit - offsetof(struct allowedips_node,
+				bit[node->parent_bit_packed & 1]);
+	free_parent = !child && (node->parent_bit_packed & 3) <= 1 &&
+		      !rcu_access_pointer(parent->peer);
+	if (free_parent)
+		child = rcu_dereference_protected(
+				parent->bit[!(node->parent_bit_packed & 1)],
+				lockdep_is_held(lock));
+	call_rcu_bh(&node->rcu, node_free_rcu);
+	--*nodes;
+	if (!free_parent)
+		return;
+	if (child)
+		child->parent_bit_packed = parent->parent_bit_packed;
+	rcu_assign_pointer(*(struct allowedips_node __rcu **)
+				(parent->parent_bit_packed & ~3UL), child);
+	call_rcu_bh(&parent->rcu, node_free_rcu);
+	--*nodes;
 }
-#undef ref
-#undef deref
-#undef push
 
 static __always_inline unsigned int fls128(u64 a, u64 b)
 {
@@ -198,21 +219,86 @@ find_node(struct allowedips_node *trie, u8 bits, const u8 *key)
 	return found;
 }
 
+/* The snapshot is laid out as a Poptrie. Each node consumes the next STRIDE
+ * bits of the key, and has a bit set in vector for every slot that descends
+ * into a child, and a bit set in leafvec for every slot that begins a new run
+ * of identical leaves. Children and leaves are packed contiguously from base1
+ * and base0 respectively, so that a popcount finds either in a single load,
+ * and a walk takes at most one load per STRIDE bits instead of one per bit.
+ */
+enum { STRIDE = 6 };
+
+struct snapshot_node {
+	u64 vector, leafvec;
+	u32 base0, base1;
+};
+
+struct allowedips_snapshot {
+	struct rcu_head rcu;
+	size_t size;
+	struct wg_peer **leaves;
+	struct snapshot_node nodes[];
+};
+
+static __always_inline struct wg_peer *
+find_leaf(const struct allowedips_snapshot *snapshot, u8 bits, const u8 *key)
+{
+	const struct snapshot_node *node = snapshot->nodes;
+	unsigned int slot;
+	u64 hi, lo;
+
+	if (bits == 32) {
+		hi = (u64)*(const u32 *)key << 32;
+		lo = 0;
+	} else {
+		hi = ((const u64 *)key)[0];
+		lo = ((const u64 *)key)[1];
+	}
+
+	for (;;) {
+		slot = hi >> (64 - STRIDE);
+		if (!(node->vector & BIT_ULL(slot)))
+			break;
+		node = &snapshot->nodes[node->base1 +
+			hweight64(node->vector & (BIT_ULL(slot) - 1))];
+		hi = hi << STRIDE | lo >> (64 - STRIDE);
+		lo <<= STRIDE;
+	}
+	return snapshot->leaves[node->base0 +
+		hweight64(node->leafvec & ((2ULL << slot) - 1)) - 1];
+}
+
+/* Must be called with the rcu_read_lock_bh held, and doesn't take a reference. */
+static __always_inline struct wg_peer *
+find_peer(struct allowedips *table, u8 bits, const u8 *key)
+{
+	struct allowedips_snapshot *snapshot;
+	struct allowedips_node *node;
+
+	snapshot = rcu_dereference_bh(bits == 32 ? table->snapshot4 :
+						   table->snapshot6);
+	if (likely(snapshot))
+		return find_leaf(snapshot, bits, key);
+	node = find_node(rcu_dereference_bh(bits == 32 ? table->root4 :
+							 table->root6),
+			 bits, key);
+	return node ? rcu_dereference_bh(node->peer) : NULL;
+}
+
 /* Returns a strong reference to a peer */
 static __always_inline struct wg_peer *
-lookup(struct allowedips_node __rcu *root, u8 bits, const void *be_ip)
+lookup(struct allowedips *table, u8 bits, const void *be_ip)
 {
 	u8 ip[16] __aligned(__alignof(u64));
-	struct allowedips_node *node;
-	struct wg_peer *peer = NULL;
+	struct wg_peer *peer;
 
 	swap_endian(ip, be_ip, bits);
 
 	rcu_read_lock_bh();
 retry:
-	node = find_node(rcu_dereference_bh(root), bits, ip);
-	if (node) {
-		peer = wg_peer_get_maybe_zero(rcu_dereference_bh(node->peer));
+	peer = find_peer(table, bits, ip);
+	if (peer) {
+		peer = wg_peer_get_maybe_zero(peer);
 		if (!peer)
 			goto retry;
 	}
@@ -220,6 +306,50 @@ retry:
 	return peer;
 }
 
+/* Readers compare seq against what they cached, so it must only move after the
+ * trie changes are visible. A torn read on 32-bit could only falsely match after
+ * 2^32 updates, so we don't bother with a seqcount.
+ */
+static inline void bump_seq(struct allowedips *table)
+{
+	smp_wmb();
+	WRITE_ONCE(table->seq, table->seq + 1);
+}
+
+static bool src_is_peer(struct allowedips *table, u8 bits, const void *be_ip,
+			struct wg_peer *peer, struct allowedips_src_cache *cache)
+{
+	/* Writers bump seq only after their changes to the trie have been
+	 * published, so anything we find below is at least as new as this.
+	 */
+	const u64 seq = READ_ONCE(table->seq);
+	u8 ip[16] __aligned(__alignof(u64));
+	unsigned int i;
+	bool ret;
+
+	smp_rmb();
+	for (i = 0; i < ARRAY_SIZE(cache->entries); ++i) {
+		if (cache->entries[i].seq == seq &&
+		    cache->entries[i].bits == bits &&
+		    !memcmp(cache->entries[i].ip, be_ip, bits / 8U))
+			return true;
+	}
+
+	swap_endian(ip, be_ip, bits);
+	rcu_read_lock_bh();
+	/* We only compare pointers, so there's no need to take a reference. */
+	ret = find_peer(table, bits, ip) == peer;
+	rcu_read_unlock_bh();
+
+	if (ret) {
+		i = cache->next++ % ARRAY_SIZE(cache->entries);
+		memcpy(cache->entries[i].ip, be_ip, bits / 8U);
+		cache->entries[i].bits = bits;
+		cache->entries[i].seq = seq;
+	}
+	return ret;
+}
+
 __attribute__((nonnull(1))) static bool
 node_placement(struct allowedips_node __rcu *trie, const u8 *key, u8 cidr,
 	       u8 bits, struct allowedips_node **rnode, struct mutex *lock)
@@ -243,7 +373,8 @@ node_placement(struct allowedips_node __rcu *trie, const u8 *key, u8 cidr,
 }
 
 static int add(struct allowedips_node __rcu **trie, u8 bits, const u8 *be_key,
-	       u8 cidr, struct wg_peer *peer, struct mutex *lock)
+	       u8 cidr, struct wg_peer *peer, unsigned long *nodes,
+	       struct mutex *lock)
 {
 	struct allowedips_node *node, *parent, *down, *newnode;
 	u8 key[16] __aligned(__alignof(u64));
@@ -254,24 +385,29 @@ static int add(struct allowedips_node __rcu **trie, u8 bits, const u8 *be_key,
 	swap_endian(key, be_key, bits);
 
 	if (!rcu_access_pointer(*trie)) {
-		node = kzalloc(sizeof(*node), GFP_KERNEL);
+		node = node_alloc(bits);
 		if (unlikely(!node))
 			return -ENOMEM;
+		++*nodes;
 		RCU_INIT_POINTER(node->peer, peer);
+		list_add_tail(&node->peer_list, &peer->allowedips_list);
 		copy_and_assign_cidr(node, key, cidr, bits);
-		rcu_assign_pointer(*trie, node);
+		connect_node(trie, 2, node);
 		return 0;
 	}
 	if (node_placement(*trie, key, cidr, bits, &node, lock)) {
 		rcu_assign_pointer(node->peer, peer);
+		list_move_tail(&node->peer_list, &peer->allowedips_list);
 		return 0;
 	}
 
-	newnode = kzalloc(sizeof(*newnode), GFP_KERNEL);
+	newnode = node_alloc(bits);
 	if (unlikely(!newnode))
 		return -ENOMEM;
 	RCU_INIT_POINTER(newnode->peer, peer);
+	list_add_tail(&newnode->peer_list, &peer->allowedips_list);
 	copy_and_assign_cidr(newnode, key, cidr, bits);
+	++*nodes;
 
 	if (!node)
 		down = rcu_dereference_protected(*trie, lockdep_is_held(lock));
@@ -279,7 +415,7 @@ static int add(struct allowedips_node __rcu **trie, u8 bits, const u8 *be_key,
 		down = rcu_dereference_protected(choose_node(node, key),
 						 lockdep_is_held(lock));
 		if (!down) {
-			rcu_assign_pointer(choose_node(node, key), newnode);
+			choose_and_connect_node(node, newnode);
 			return 0;
 		}
 	}
@@ -287,74 +423,659 @@ static int add(struct allowedips_node __rcu **trie, u8 bits, const u8 *be_key,
 	parent = node;
 
 	if (newnode->cidr == cidr) {
-		rcu_assign_pointer(choose_node(newnode, down->bits), down);
+		choose_and_connect_node(newnode, down);
 		if (!parent)
-			rcu_assign_pointer(*trie, newnode);
+			connect_node(trie, 2, newnode);
 		else
-			rcu_assign_pointer(choose_node(parent, newnode->bits),
-					   newnode);
+			choose_and_connect_node(parent, newnode);
 	} else {
-		node = kzalloc(sizeof(*node), GFP_KERNEL);
+		node = node_alloc(bits);
 		if (unlikely(!node)) {
-			kfree(newnode);
+			list_del(&newnode->peer_list);
+			node_free(newnode);
+			--*nodes;
 			return -ENOMEM;
 		}
+		++*nodes;
+		INIT_LIST_HEAD(&node->peer_list);
 		copy_and_assign_cidr(node, newnode->bits, cidr, bits);
 
-		rcu_assign_pointer(choose_node(node, down->bits), down);
-		rcu_assign_pointer(choose_node(node, newnode->bits), newnode);
+		choose_and_connect_node(node, down);
+		choose_and_connect_node(node, newnode);
 		if (!parent)
-			rcu_assign_pointer(*trie, node);
+			connect_node(trie, 2, node);
 		else
-			rcu_assign_pointer(choose_node(parent, node->bits),
-					   node);
+			choose_and_connect_node(parent, node);
+	}
+	return 0;
+}
+
+static size_t free_detached(struct allowedips_node *root)
+{
+	size_t count = root_remove_peer_lists(root);
+
+	root_free_rcu(&root->rcu);
+	return count;
+}
+
+static bool prefix_equal(const struct allowedips_prefix *a,
+			 const struct allowedips_prefix *b)
+{
+	return a->family == b->family && a->cidr == b->cidr &&
+	       !memcmp(&a->ip6, &b->ip6, a->family == AF_INET ?
+				sizeof(struct in_addr) : sizeof(struct in6_addr));
+}
+
+static int prefix_cmp(const void *a, const void *b)
+{
+	const struct allowedips_prefix *x = *(const struct allowedips_prefix **)a;
+	const struct allowedips_prefix *y = *(const struct allowedips_prefix **)b;
+	int ret;
+
+	if (x->family != y->family)
+		return x->family < y->family ? -1 : 1;
+	ret = memcmp(&x->ip6, &y->ip6, x->family == AF_INET ?
+			sizeof(struct in_addr) : sizeof(struct in6_addr));
+	if (ret)
+		return ret;
+	if (x->cidr != y->cidr)
+		return x->cidr < y->cidr ? -1 : 1;
+	/* Of identical prefixes, the last one given wins, so keep them in the
+	 * order in which they were given.
+	 */
+	return x < y ? -1 : x > y;
+}
+
+/* Masked and sorted by address and then cidr, every prefix comes after all
+ * of those that contain it, so the trie can be built bottom-up along its
+ * rightmost path, with each node only ever pushed and popped once.
+ */
+static int build_detached(struct allowedips_prefix **sorted, size_t len,
+			  u8 bits, struct allowedips_node **rroot,
+			  size_t *rcount)
+{
+	/* One for each possible cidr along a path. */
+	struct allowedips_node *stack[129], *root = NULL;
+	struct allowedips_node *node, *prev, *top, *branch;
+	u8 key[16] __aligned(__alignof(u64));
+	unsigned int depth = 0;
+	size_t i, count = 0;
+
+	for (i = 0; i < len; ++i) {
+		if (i + 1 < len && prefix_equal(sorted[i], sorted[i + 1]))
+			continue;
+
+		node = node_alloc(bits);
+		if (unlikely(!node))
+			goto err;
+		swap_endian(key, (const u8 *)&sorted[i]->ip6, bits);
+		copy_and_assign_cidr(node, key, sorted[i]->cidr, bits);
+		RCU_INIT_POINTER(node->peer, sorted[i]->peer);
+		list_add_tail(&node->peer_list,
+			      &sorted[i]->peer->allowedips_list);
+		++count;
+
+		for (prev = NULL; depth > 0; prev = stack[--depth]) {
+			top = stack[depth - 1];
+			if (top->cidr <= node->cidr &&
+			    prefix_matches(top, node->bits, bits))
+				break;
+		}
+		top = depth ? stack[depth - 1] : NULL;
+
+		if (!prev) {
+			if (top)
+				choose_and_connect_node(top, node);
+			else
+				root = node;
+		} else if (top && choose(top, node->bits) !=
+				  choose(top, prev->bits)) {
+			choose_and_connect_node(top, node);
+		} else {
+			branch = node_alloc(bits);
+			if (unlikely(!branch)) {
+				list_del(&node->peer_list);
+				node_free(node);
+				goto err;
+			}
+			INIT_LIST_HEAD(&branch->peer_list);
+			copy_and_assign_cidr(branch, node->bits,
+					     common_bits(prev, node->bits, bits),
+					     bits);
+			choose_and_connect_node(branch, prev);
+			choose_and_connect_node(branch, node);
+			if (top)
+				choose_and_connect_node(top, branch);
+			else
+				root = branch;
+			stack[depth++] = branch;
+			++count;
+		}
+		stack[depth++] = node;
+	}
+	*rroot = root;
+	*rcount = count;
+	return 0;
+
+err:
+	if (root)
+		free_detached(root);
+	return -ENOMEM;
+}
+
+struct graft {
+	struct allowedips_node *parent, *node;
+	u8 bit;
+};
+
+/* Merges a detached trie into a live one. Whole subtrees that land where the
+ * live trie has nothing are published with a single pointer assignment, so a
+ * trie that started out empty takes exactly one.
+ */
+static int merge_detached(struct allowedips_node __rcu **trie, u8 bits,
+			  struct allowedips_node *root, size_t count,
+			  unsigned long *nodes, struct mutex *lock)
+{
+	struct allowedips_node *old, *node, *child, *branch;
+	struct allowedips_node __rcu **slot;
+	struct graft *grafts, graft;
+	struct wg_peer *peer;
+	size_t len = 0;
+	u8 cidr, bit;
+
+	/* Every graft is a disjoint detached subtree, so there are never more
+	 * of them than there are detached nodes.
+	 */
+	grafts = kvmalloc(count * sizeof(*grafts), GFP_KERNEL);
+	if (unlikely(!grafts)) {
+		free_detached(root);
+		return -ENOMEM;
+	}
+	*nodes += count;
+	grafts[len++] = (struct graft){ .node = root };
+
+	while (len > 0) {
+		graft = grafts[--len];
+		node = graft.node;
+		slot = graft.parent ? &graft.parent->bit[graft.bit] : trie;
+		bit = graft.parent ? graft.bit : 2;
+		old = rcu_dereference_protected(*slot, lockdep_is_held(lock));
+		if (!old) {
+			connect_node(slot, bit, node);
+			continue;
+		}
+
+		cidr = min(min(old->cidr, node->cidr),
+			   common_bits(old, node->bits, bits));
+		if (old->cidr == cidr && node->cidr == cidr) {
+			peer = rcu_dereference_protected(node->peer,
+							 lockdep_is_held(lock));
+			if (peer) {
+				rcu_assign_pointer(old->peer, peer);
+				list_move_tail(&old->peer_list,
+					       &peer->allowedips_list);
+				list_del(&node->peer_list);
+			}
+			for (bit = 0; bit < 2; ++bit) {
+				child = rcu_dereference_protected(node->bit[bit],
+							lockdep_is_held(lock));
+				if (child)
+					grafts[len++] = (struct graft){
+						old, child, bit };
+			}
+			node_free(node);
+			--*nodes;
+		} else if (old->cidr == cidr) {
+			grafts[len++] = (struct graft){
+				old, node, choose(old, node->bits) };
+		} else if (node->cidr == cidr) {
+			u8 down = choose(node, old->bits);
+
+			child = rcu_dereference_protected(node->bit[down],
+							  lockdep_is_held(lock));
+			connect_node(&node->bit[down], down, old);
+			connect_node(slot, bit, node);
+			if (child)
+				grafts[len++] = (struct graft){
+					node, child, down };
+		} else {
+			branch = node_alloc(bits);
+			if (unlikely(!branch)) {
+				*nodes -= free_detached(node);
+				goto err;
+			}
+			++*nodes;
+			INIT_LIST_HEAD(&branch->peer_list);
+			copy_and_assign_cidr(branch, node->bits, cidr, bits);
+			choose_and_connect_node(branch, old);
+			choose_and_connect_node(branch, node);
+			connect_node(slot, bit, branch);
+		}
 	}
+	kvfree(grafts);
 	return 0;
+
+err:
+	while (len > 0)
+		*nodes -= free_detached(grafts[--len].node);
+	kvfree(grafts);
+	return -ENOMEM;
+}
+
+static int insert_sorted(struct allowedips_node __rcu **trie, u8 bits,
+			 struct allowedips_prefix **sorted, size_t len,
+			 unsigned long *nodes, struct mutex *lock)
+{
+	struct allowedips_node *root;
+	size_t count;
+	int ret;
+
+	ret = build_detached(sorted, len, bits, &root, &count);
+	if (ret)
+		return ret;
+	return merge_detached(trie, bits, root, count, nodes, lock);
+}
+
+struct snapshot_prefix {
+	u64 hi, lo;
+	struct wg_peer *peer;
+	u8 cidr;
+};
+
+struct snapshot_pending {
+	u32 begin, end;
+	struct wg_peer *inherit;
+	unsigned int offset;
+};
+
+static void snapshot_free_rcu(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct allowedips_snapshot, rcu));
+}
+
+static void retire_snapshot(struct allowedips_snapshot __rcu **snapshot,
+			    struct mutex *lock)
+{
+	struct allowedips_snapshot *old = rcu_dereference_protected(*snapshot,
+						lockdep_is_held(lock));
+
+	if (!old)
+		return;
+	RCU_INIT_POINTER(*snapshot, NULL);
+	call_rcu_bh(&old->rcu, snapshot_free_rcu);
+}
+
+static void *snapshot_alloc(size_t n, size_t size)
+{
+	if (unlikely(size && n > SIZE_MAX / size))
+		return NULL;
+	return kvmalloc(n * size, GFP_KERNEL);
+}
+
+/* Fills prefixes, if non-NULL, with the masked prefixes that have a peer, in
+ * pre-order, which happens to sort them by key and then by cidr, and returns
+ * how many there are.
+ */
+static size_t walk_prefixes(struct allowedips_node *root, u8 bits,
+			    struct snapshot_prefix *prefixes,
+			    struct mutex *lock)
+{
+	/* One pending sibling per level, and both children of the deepest. */
+	struct allowedips_node *node, *stack[128 + 2] = { root };
+	unsigned int len = 1;
+	struct wg_peer *peer;
+	size_t count = 0;
+	u64 hi, lo;
+
+	while (len > 0) {
+		cond_resched();
+		node = stack[--len];
+		if (rcu_access_pointer(node->bit[1]))
+			stack[len++] = rcu_dereference_protected(node->bit[1],
+						lockdep_is_held(lock));
+		if (rcu_access_pointer(node->bit[0]))
+			stack[len++] = rcu_dereference_protected(node->bit[0],
+						lockdep_is_held(lock));
+		peer = rcu_dereference_protected(node->peer,
+						 lockdep_is_held(lock));
+		if (!peer)
+			continue;
+		if (prefixes) {
+			if (bits == 32) {
+				hi = (u64)*(const u32 *)node->bits << 32;
+				lo = 0;
+			} else {
+				hi = ((const u64 *)node->bits)[0];
+				lo = ((const u64 *)node->bits)[1];
+			}
+			if (node->cidr <= 64) {
+				hi &= node->cidr ? ~0ULL << (64 - node->cidr) : 0;
+				lo = 0;
+			} else
+				lo &= ~0ULL << (128 - node->cidr);
+			prefixes[count].hi = hi;
+			prefixes[count].lo = lo;
+			prefixes[count].peer = peer;
+			prefixes[count].cidr = node->cidr;
+		}
+		++count;
+	}
+	return count;
+}
+
+static unsigned int prefix_slot(const struct snapshot_prefix *prefix,
+				unsigned int offset)
+{
+	u64 hi = prefix->hi;
+
+	if (offset >= 64)
+		hi = prefix->lo << (offset - 64);
+	else if (offset)
+		hi = hi << offset | prefix->lo >> (64 - offset);
+	return hi >> (64 - STRIDE);
+}
+
+/* Nodes are laid out breadth first, so that each node's children are already
+ * contiguous by the time they're visited. Since every prefix lengthens the
+ * path of at most DIV_ROUND_UP(cidr, STRIDE) - 1 nodes, and can split the
+ * leaves of the one node it ends in into at most two more runs, we can size
+ * everything up front and then copy it into an exactly sized snapshot.
+ */
+static struct allowedips_snapshot *
+snapshot_build(struct allowedips_node *root, u8 bits, struct mutex *lock)
+{
+	size_t count, max_nodes = 1, nodes_len = 1, leaves_len = 0, i, j;
+	u32 from[1U << STRIDE], to[1U << STRIDE];
+	struct wg_peer **leaves = NULL, *leaf[1U << STRIDE];
+	struct allowedips_snapshot *snapshot = NULL;
+	struct snapshot_prefix *prefixes = NULL;
+	struct snapshot_pending *pending = NULL;
+	struct snapshot_node *nodes = NULL;
+	u8 best[1U << STRIDE];
+	unsigned int k;
+
+	count = walk_prefixes(root, bits, NULL, lock);
+	prefixes = snapshot_alloc(count, sizeof(*prefixes));
+	if (unlikely(!prefixes))
+		goto out;
+	walk_prefixes(root, bits, prefixes, lock);
+	for (i = 0; i < count; ++i) {
+		if (prefixes[i].cidr)
+			max_nodes += DIV_ROUND_UP(prefixes[i].cidr, STRIDE) - 1;
+	}
+
+	nodes = snapshot_alloc(max_nodes, sizeof(*nodes));
+	pending = snapshot_alloc(max_nodes, sizeof(*pending));
+	leaves = snapshot_alloc(max_nodes + 2 * count, sizeof(*leaves));
+	if (unlikely(!nodes || !pending || !leaves))
+		goto out;
+
+	/* A default route sorts first, and is simply what the root inherits. */
+	pending[0].begin = count && !prefixes[0].cidr;
+	pending[0].end = count;
+	pending[0].inherit = pending[0].begin ? prefixes[0].peer : NULL;
+	pending[0].offset = 0;
+
+	for (i = 0; i < nodes_len; ++i) {
+		const struct snapshot_pending *p = &pending[i];
+		u64 vector = 0, leafvec = 0;
+
+		for (k = 0; k < (1U << STRIDE); ++k) {
+			leaf[k] = p->inherit;
+			best[k] = 0;
+		}
+		for (j = p->begin; j < p->end; ++j) {
+			const struct snapshot_prefix *prefix = &prefixes[j];
+			unsigned int slot = prefix_slot(prefix, p->offset);
+
+			if (prefix->cidr <= p->offset)
+				continue;
+			if (prefix->cidr > p->offset + STRIDE) {
+				if (!(vector & BIT_ULL(slot)))
+					from[slot] = j;
+				vector |= BIT_ULL(slot);
+				to[slot] = j + 1;
+				continue;
+			}
+			for (k = slot; k < slot + (1U << (p->offset + STRIDE -
+							  prefix->cidr)); ++k) {
+				if (prefix->cidr >= best[k]) {
+					best[k] = prefix->cidr;
+					leaf[k] = prefix->peer;
+				}
+			}
+		}
+
+		nodes[i].vector = vector;
+		nodes[i].base0 = leaves_len;
+		nodes[i].base1 = nodes_len;
+		for (k = 0; k < (1U << STRIDE); ++k) {
+			if (vector & BIT_ULL(k))
+				continue;
+			if (!leafvec || leaves[leaves_len - 1] != leaf[k]) {
+				leafvec |= BIT_ULL(k);
+				leaves[leaves_len++] = leaf[k];
+			}
+		}
+		nodes[i].leafvec = leafvec;
+		for (k = 0; k < (1U << STRIDE); ++k) {
+			if (!(vector & BIT_ULL(k)))
+				continue;
+			if (WARN_ON(nodes_len >= max_nodes))
+				goto out;
+			pending[nodes_len].begin = from[k];
+			pending[nodes_len].end = to[k];
+			pending[nodes_len].inherit = leaf[k];
+			pending[nodes_len].offset = p->offset + STRIDE;
+			++nodes_len;
+		}
+		cond_resched();
+	}
+
+	snapshot = kvmalloc(sizeof(*snapshot) + nodes_len * sizeof(*nodes) +
+			    leaves_len * sizeof(*leaves), GFP_KERNEL);
+	if (unlikely(!snapshot))
+		goto out;
+	snapshot->size = sizeof(*snapshot) + nodes_len * sizeof(*nodes) +
+			 leaves_len * sizeof(*leaves);
+	memcpy(snapshot->nodes, nodes, nodes_len * sizeof(*nodes));
+	snapshot->leaves = (struct wg_peer **)&snapshot->nodes[nodes_len];
+	memcpy(snapshot->leaves, leaves, leaves_len * sizeof(*leaves));
+
+out:
+	kvfree(leaves);
+	kvfree(pending);
+	kvfree(nodes);
+	kvfree(prefixes);
+	return snapshot;
+}
+
+static void compile(struct allowedips_snapshot __rcu **snapshot,
+		    struct allowedips_node __rcu *root, u8 bits,
+		    struct mutex *lock)
+{
+	struct allowedips_node *node = rcu_dereference_protected(root,
+						lockdep_is_held(lock));
+
+	if (rcu_access_pointer(*snapshot) || !node)
+		return;
+	rcu_assign_pointer(*snapshot, snapshot_build(node, bits, lock));
 }
 
 void wg_allowedips_init(struct allowedips *table)
 {
 	table->root4 = table->root6 = NULL;
+	table->snapshot4 = table->snapshot6 = NULL;
+	table->nodes4 = table->nodes6 = 0;
 	table->seq = 1;
 }
 
 void wg_allowedips_free(struct allowedips *table, struct mutex *lock)
 {
 	struct allowedips_node __rcu *old4 = table->root4, *old6 = table->root6;
-	++table->seq;
+
 	RCU_INIT_POINTER(table->root4, NULL);
 	RCU_INIT_POINTER(table->root6, NULL);
-	if (rcu_access_pointer(old4))
-		call_rcu_bh(&rcu_dereference_protected(old4,
-				lockdep_is_held(lock))->rcu, root_free_rcu);
-	if (rcu_access_pointer(old6))
-		call_rcu_bh(&rcu_dereference_protected(old6,
-				lockdep_is_held(lock))->rcu, root_free_rcu);
+	retire_snapshot(&table->snapshot4, lock);
+	retire_snapshot(&table->snapshot6, lock);
+	bump_seq(table);
+	table->nodes4 = table->nodes6 = 0;
+	if (rcu_access_pointer(old4)) {
+		struct allowedips_node *node = rcu_dereference_protected(old4,
+							lockdep_is_held(lock));
+
+		root_remove_peer_lists(node);
+		call_rcu_bh(&node->rcu, root_free_rcu);
+	}
+	if (rcu_access_pointer(old6)) {
+		struct allowedips_node *node = rcu_dereference_protected(old6,
+							lockdep_is_held(lock));
+
+		root_remove_peer_lists(node);
+		call_rcu_bh(&node->rcu, root_free_rcu);
+	}
 }
 
 int wg_allowedips_insert_v4(struct allowedips *table, const struct in_addr *ip,
 			    u8 cidr, struct wg_peer *peer,
 			    struct mutex *lock)
 {
-	++table->seq;
-	return add(&table->root4, 32, (const u8 *)ip, cidr, peer, lock);
+	int ret = add(&table->root4, 32, (const u8 *)ip, cidr, peer,
+		      &table->nodes4, lock);
+
+	retire_snapshot(&table->snapshot4, lock);
+	bump_seq(table);
+	return ret;
 }
 
 int wg_allowedips_insert_v6(struct allowedips *table, const struct in6_addr *ip,
 			    u8 cidr, struct wg_peer *peer,
 			    struct mutex *lock)
 {
-	++table->seq;
-	return add(&table->root6, 128, (const u8 *)ip, cidr, peer, lock);
+	int ret = add(&table->root6, 128, (const u8 *)ip, cidr, peer,
+		      &table->nodes6, lock);
+
+	retire_snapshot(&table->snapshot6, lock);
+	bump_seq(table);
+	return ret;
+}
+
+/* Inserts many prefixes at once, which is far cheaper than inserting them one
+ * by one, since it doesn't need to walk the trie from the root for each. Later
+ * duplicates replace earlier ones, as though they'd been inserted in order.
+ * The addresses of prefixes are masked in place.
+ */
+int wg_allowedips_insert_bulk(struct allowedips *table,
+			      struct allowedips_prefix *prefixes, size_t len,
+			      struct mutex *lock)
+{
+	struct allowedips_prefix **sorted;
+	size_t i, len4;
+	int ret = 0;
+
+	for (i = 0; i < len; ++i) {
+		if (unlikely(!prefixes[i].peer ||
+			     !((prefixes[i].family == AF_INET &&
+				prefixes[i].cidr <= 32) ||
+			       (prefixes[i].family == AF_INET6 &&
+				prefixes[i].cidr <= 128))))
+			return -EINVAL;
+	}
+	if (!len)
+		return 0;
+
+	sorted = kvmalloc(len * sizeof(*sorted), GFP_KERNEL);
+	if (unlikely(!sorted))
+		return -ENOMEM;
+	for (i = 0; i < len; ++i) {
+		u8 *ip = (u8 *)&prefixes[i].ip6;
+		unsigned int cidr_bytes = DIV_ROUND_UP(prefixes[i].cidr, 8U);
+
+		memset(ip + cidr_bytes, 0, (prefixes[i].family == AF_INET ?
+			sizeof(struct in_addr) : sizeof(struct in6_addr)) -
+			cidr_bytes);
+		if (prefixes[i].cidr)
+			ip[cidr_bytes - 1U] &= ~0U << (-prefixes[i].cidr % 8U);
+		sorted[i] = &prefixes[i];
+	}
+	sort(sorted, len, sizeof(*sorted), prefix_cmp, NULL);
+
+	for (len4 = 0; len4 < len && sorted[len4]->family == AF_INET; ++len4)
+		;
+	if (len4) {
+		ret = insert_sorted(&table->root4, 32, sorted, len4,
+				    &table->nodes4, lock);
+		retire_snapshot(&table->snapshot4, lock);
+	}
+	if (!ret && len > len4) {
+		ret = insert_sorted(&table->root6, 128, sorted + len4,
+				    len - len4, &table->nodes6, lock);
+		retire_snapshot(&table->snapshot6, lock);
+	}
+	bump_seq(table);
+	kvfree(sorted);
+	return ret;
 }
 
 void wg_allowedips_remove_by_peer(struct allowedips *table,
 				  struct wg_peer *peer,
 				  struct mutex *lock)
 {
-	++table->seq;
-	walk_remove_by_peer(&table->root4, peer, lock);
-	walk_remove_by_peer(&table->root6, peer, lock);
+	struct allowedips_node *node, *tmp;
+	bool removed4 = false, removed6 = false;
+
+	if (unlikely(!peer))
+		return;
+
+	list_for_each_entry_safe (node, tmp, &peer->allowedips_list,
+				  peer_list) {
+		if (node->bitlen == 32) {
+			removed4 = true;
+			remove_node(node, &table->nodes4, lock);
+		} else {
+			removed6 = true;
+			remove_node(node, &table->nodes6, lock);
+		}
+	}
+	if (removed4)
+		retire_snapshot(&table->snapshot4, lock);
+	if (removed6)
+		retire_snapshot(&table->snapshot6, lock);
+	bump_seq(table);
+}
+
+/* Builds a snapshot for each family whose last one was retired. If that fails
+ * for lack of memory, lookups simply keep using the trie.
+ */
+void wg_allowedips_compile(struct allowedips *table, struct mutex *lock)
+{
+	compile(&table->snapshot4, table->root4, 32, lock);
+	compile(&table->snapshot6, table->root6, 128, lock);
+}
+
+/* Returns whether a family has a trie but no snapshot of it, which is what
+ * wg_allowedips_compile would build.
+ */
+bool wg_allowedips_needs_compile(struct allowedips *table)
+{
+	return (rcu_access_pointer(table->root4) &&
+		!rcu_access_pointer(table->snapshot4)) ||
+	       (rcu_access_pointer(table->root6) &&
+		!rcu_access_pointer(table->snapshot6));
+}
+
+/* Returns how many bytes the tries and their snapshots take up. */
+u64 wg_allowedips_memory(struct allowedips *table, struct mutex *lock)
+{
+	struct allowedips_snapshot *snapshot4 = rcu_dereference_protected(
+		table->snapshot4, lockdep_is_held(lock));
+	struct allowedips_snapshot *snapshot6 = rcu_dereference_protected(
+		table->snapshot6, lockdep_is_held(lock));
+
+	return (u64)table->nodes4 * kmem_cache_size(node_cache4) +
+	       (u64)table->nodes6 * kmem_cache_size(node_cache6) +
+	       (snapshot4 ? snapshot4->size : 0) +
+	       (snapshot6 ? snapshot6->size : 0);
 }
 
 int wg_allowedips_walk_by_peer(struct allowedips *table,
@@ -364,22 +1085,39 @@ int wg_allowedips_walk_by_peer(struct allowedips *table,
 					   int family),
 			       void *ctx, struct mutex *lock)
 {
+	u8 ip[16] __aligned(__alignof(u64));
+	struct allowedips_node *node;
+	unsigned int cidr_bytes;
 	int ret;
 
+	lockdep_assert_held(lock);
+
 	if (!cursor->seq)
 		cursor->seq = table->seq;
 	else if (cursor->seq != table->seq)
 		return 0;
 
-	if (!cursor->second_half) {
-		ret = walk_by_peer(table->root4, 32, cursor, peer, func, ctx,
-				   lock);
-		if (ret)
+	/* Since seq hasn't moved, nothing has been removed, so the node we
+	 * stopped at last time is still in the list.
+	 */
+	node = cursor->next ?: list_first_entry(&peer->allowedips_list,
+						struct allowedips_node,
+						peer_list);
+	list_for_each_entry_from (node, &peer->allowedips_list, peer_list) {
+		cidr_bytes = DIV_ROUND_UP(node->cidr, 8U);
+		swap_endian(ip, node->bits, node->bitlen);
+		memset(ip + cidr_bytes, 0, node->bitlen / 8U - cidr_bytes);
+		if (node->cidr)
+			ip[cidr_bytes - 1U] &= ~0U << (-node->cidr % 8U);
+
+		ret = func(ctx, ip, node->cidr,
+			   node->bitlen == 32 ? AF_INET : AF_INET6);
+		if (ret) {
+			cursor->next = node;
 			return ret;
-		cursor->len = 0;
-		cursor->second_half = true;
+		}
 	}
-	return walk_by_peer(table->root6, 128, cursor, peer, func, ctx, lock);
+	return 0;
 }
 
 /* Returns a strong reference to a peer */
@@ -387,9 +1125,9 @@ struct wg_peer *wg_allowedips_lookup_dst(struct allowedips *table,
 					 struct sk_buff *skb)
 {
 	if (skb->protocol == htons(ETH_P_IP))
-		return lookup(table->root4, 32, &ip_hdr(skb)->daddr);
+		return lookup(table, 32, &ip_hdr(skb)->daddr);
 	else if (skb->protocol == htons(ETH_P_IPV6))
-		return lookup(table->root6, 128, &ipv6_hdr(skb)->daddr);
+		return lookup(table, 128, &ipv6_hdr(skb)->daddr);
 	return NULL;
 }
 
@@ -398,10 +1136,54 @@ struct wg_peer *wg_allowedips_lookup_src(struct allowedips *table,
 					 struct sk_buff *skb)
 {
 	if (skb->protocol == htons(ETH_P_IP))
-		return lookup(table->root4, 32, &ip_hdr(skb)->saddr);
+		return lookup(table, 32, &ip_hdr(skb)->saddr);
 	else if (skb->protocol == htons(ETH_P_IPV6))
-		return lookup(table->root6, 128, &ipv6_hdr(skb)->saddr);
+		return lookup(table, 128, &ipv6_hdr(skb)->saddr);
 	return NULL;
 }
 
+/* Returns whether the source address of skb is routed to peer, without taking
+ * a reference to anything.
+ */
+bool wg_allowedips_src_is_peer(struct allowedips *table,
+			       struct allowedips_src_cache *cache,
+			       struct wg_peer *peer, struct sk_buff *skb)
+{
+	if (skb->protocol == htons(ETH_P_IP))
+		return src_is_peer(table, 32, &ip_hdr(skb)->saddr, peer,
+				   cache);
+	else if (skb->protocol == htons(ETH_P_IPV6))
+		return src_is_peer(table, 128, &ipv6_hdr(skb)->saddr, peer,
+				   cache);
+	return false;
+}
+
+int __init wg_allowedips_slab_init(void)
+{
+	/* A v4 node is just under a cacheline, so aligning it costs nothing,
+	 * whereas a v6 node is just over, so it isn't worth doubling.
+	 */
+	node_cache4 = kmem_cache_create("wg_allowedips_node4",
+					sizeof(struct allowedips_node) +
+					sizeof(struct in_addr), 0,
+					SLAB_HWCACHE_ALIGN, NULL);
+	if (!node_cache4)
+		return -ENOMEM;
+	node_cache6 = kmem_cache_create("wg_allowedips_node6",
+					sizeof(struct allowedips_node) +
+					sizeof(struct in6_addr), 0, 0, NULL);
+	if (!node_cache6) {
+		kmem_cache_destroy(node_cache4);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void wg_allowedips_slab_uninit(void)
+{
+	rcu_barrier_bh();
+	kmem_cache_destroy(node_cache6);
+	kmem_cache_destroy(node_cache4);
+}
+
 #include "selftest/allowedips.c"
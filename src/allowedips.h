@@ -12,18 +12,50 @@
 
 struct wg_peer;
 struct allowedips_node;
+struct allowedips_snapshot;
 
+/* Writers only ever change the tries. Each change retires the snapshot of its
+ * family, and lookups use the trie directly until wg_allowedips_compile is
+ * called to build a new one.
+ */
 struct allowedips {
 	struct allowedips_node __rcu *root4;
 	struct allowedips_node __rcu *root6;
+	struct allowedips_snapshot __rcu *snapshot4;
+	struct allowedips_snapshot __rcu *snapshot6;
+	unsigned long nodes4, nodes6;
 	u64 seq;
 };
 
 struct allowedips_cursor {
 	u64 seq;
-	struct allowedips_node *stack[128];
-	unsigned int len;
-	bool second_half;
+	struct allowedips_node *next;
+};
+
+/* Remembers the last few source addresses that were validated as belonging to
+ * a peer, so that the receive path can skip the trie walk. Entries are only
+ * trusted while their seq matches that of the table. This must only be used
+ * by one context at a time, which for the receive path holds because a peer
+ * is only ever drained by one napi at a time.
+ */
+struct allowedips_src_cache {
+	struct {
+		u8 ip[16] __aligned(__alignof(u64));
+		u64 seq;
+		u8 bits;
+	} entries[2];
+	unsigned int next;
+};
+
+/* A prefix for wg_allowedips_insert_bulk, with its address in network order. */
+struct allowedips_prefix {
+	union {
+		struct in_addr ip4;
+		struct in6_addr ip6;
+	};
+	struct wg_peer *peer;
+	u16 family;
+	u8 cidr;
 };
 
 void wg_allowedips_init(struct allowedips *table);
@@ -32,8 +64,14 @@ int wg_allowedips_insert_v4(struct allowedips *table, const struct in_addr *ip,
 			    u8 cidr, struct wg_peer *peer, struct mutex *lock);
 int wg_allowedips_insert_v6(struct allowedips *table, const struct in6_addr *ip,
 			    u8 cidr, struct wg_peer *peer, struct mutex *lock);
+int wg_allowedips_insert_bulk(struct allowedips *table,
+			      struct allowedips_prefix *prefixes, size_t len,
+			      struct mutex *lock);
 void wg_allowedips_remove_by_peer(struct allowedips *table,
 				  struct wg_peer *peer, struct mutex *lock);
+void wg_allowedips_compile(struct allowedips *table, struct mutex *lock);
+bool wg_allowedips_needs_compile(struct allowedips *table);
+u64 wg_allowedips_memory(struct allowedips *table, struct mutex *lock);
 int wg_allowedips_walk_by_peer(struct allowedips *table,
 			       struct allowedips_cursor *cursor,
 			       struct wg_peer *peer,
@@ -46,6 +84,12 @@ struct wg_peer *wg_allowedips_lookup_dst(struct allowedips *table,
 						struct sk_buff *skb);
 struct wg_peer *wg_allowedips_lookup_src(struct allowedips *table,
 						struct sk_buff *skb);
+bool wg_allowedips_src_is_peer(struct allowedips *table,
+			       struct allowedips_src_cache *cache,
+			       struct wg_peer *peer, struct sk_buff *skb);
+
+int wg_allowedips_slab_init(void);
+void wg_allowedips_slab_uninit(void);
 
 #ifdef DEBUG
 bool wg_allowedips_selftest(void);
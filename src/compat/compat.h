@@ -178,6 +178,12 @@ static inline void netif_keep_dst(struct net_device *dev)
 #endif
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0) && !defined(ISRHEL7)
+#include <linux/u64_stats_sync.h>
+#define u64_stats_fetch_begin_irq u64_stats_fetch_begin_bh
+#define u64_stats_fetch_retry_irq u64_stats_fetch_retry_bh
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0) && !defined(ISRHEL7)
 #include "checksum/checksum_partial_compat.h"
 static inline void *our_pskb_put(struct sk_buff *skb, struct sk_buff *tail, int len)
@@ -538,14 +544,32 @@ static inline struct nlattr **genl_family_attrbuf(const struct genl_family *fami
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0) && !defined(ISRHEL7)
 #include <net/genetlink.h>
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
-#define genl_register_family(a) genl_register_family_with_ops(a, genl_ops, ARRAY_SIZE(genl_ops))
+#define genl_register_family(a) ({ \
+	int __ret = genl_register_family_with_ops(a, genl_ops, ARRAY_SIZE(genl_ops)); \
+	if (!__ret) { \
+		__ret = genl_register_mc_group(a, &genl_mcgrps[0]); \
+		if (__ret) \
+			genl_unregister_family(a); \
+	} \
+	__ret; \
+})
+#define genlmsg_multicast_netns(family, net, skb, portid, group, flags) genlmsg_multicast_netns(net, skb, portid, genl_mcgrps[group].id, flags)
 #define COMPAT_CANNOT_USE_CONST_GENL_OPS
 #else
-#define genl_register_family(a) genl_register_family_with_ops(a, genl_ops)
+#define genl_register_family(a) genl_register_family_with_ops_groups(a, genl_ops, genl_mcgrps)
 #endif
 #define COMPAT_CANNOT_USE_GENL_NOPS
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 0, 0) && !defined(ISRHEL7)
+#include <net/genetlink.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+#define genl_has_listeners(family, net, group) netlink_has_listeners((net)->genl_sock, genl_mcgrps[group].id)
+#else
+#define genl_has_listeners(family, net, group) netlink_has_listeners((net)->genl_sock, (family)->mcgrp_offset + (group))
+#endif
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 2) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)) || (LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 16) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)) || (LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 65) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)) || (LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 101) && LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)) || LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 84)
 #define ___COMPAT_NETLINK_DUMP_BLOCK { \
 	int ret; \
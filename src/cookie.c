@@ -72,20 +72,29 @@ void wg_cookie_init(struct cookie *cookie)
 	init_rwsem(&cookie->lock);
 }
 
+static size_t mac1_len(size_t len)
+{
+	return len - sizeof(struct message_macs) +
+	       offsetof(struct message_macs, mac1);
+}
+
+static size_t mac2_len(size_t len)
+{
+	return len - sizeof(struct message_macs) +
+	       offsetof(struct message_macs, mac2);
+}
+
 static void compute_mac1(u8 mac1[COOKIE_LEN], const void *message, size_t len,
 			 const u8 key[NOISE_SYMMETRIC_KEY_LEN])
 {
-	len = len - sizeof(struct message_macs) +
-	      offsetof(struct message_macs, mac1);
-	blake2s(mac1, message, key, COOKIE_LEN, len, NOISE_SYMMETRIC_KEY_LEN);
+	blake2s(mac1, message, key, COOKIE_LEN, mac1_len(len),
+		NOISE_SYMMETRIC_KEY_LEN);
 }
 
 static void compute_mac2(u8 mac2[COOKIE_LEN], const void *message, size_t len,
 			 const u8 cookie[COOKIE_LEN])
 {
-	len = len - sizeof(struct message_macs) +
-	      offsetof(struct message_macs, mac2);
-	blake2s(mac2, message, cookie, COOKIE_LEN, len, COOKIE_LEN);
+	blake2s(mac2, message, cookie, COOKIE_LEN, mac2_len(len), COOKIE_LEN);
 }
 
 static void make_cookie(u8 cookie[COOKIE_LEN], struct sk_buff *skb,
@@ -116,41 +125,85 @@ static void make_cookie(u8 cookie[COOKIE_LEN], struct sk_buff *skb,
 	up_read(&checker->secret_lock);
 }
 
-enum cookie_mac_state wg_cookie_validate_packet(struct cookie_checker *checker,
-						struct sk_buff *skb,
-						bool check_cookie)
+static struct message_macs *skb_macs(struct sk_buff *skb)
 {
-	struct message_macs *macs = (struct message_macs *)
-		(skb->data + skb->len - sizeof(*macs));
-	enum cookie_mac_state ret;
-	u8 computed_mac[COOKIE_LEN];
-	u8 cookie[COOKIE_LEN];
-
-	ret = INVALID_MAC;
-	compute_mac1(computed_mac, skb->data, skb->len,
-		     checker->message_mac1_key);
-	if (crypto_memneq(computed_mac, macs->mac1, COOKIE_LEN))
-		goto out;
-
-	ret = VALID_MAC_BUT_NO_COOKIE;
-
-	if (!check_cookie)
-		goto out;
-
-	make_cookie(cookie, skb, checker);
-
-	compute_mac2(computed_mac, skb->data, skb->len, cookie);
-	if (crypto_memneq(computed_mac, macs->mac2, COOKIE_LEN))
-		goto out;
-
-	ret = VALID_MAC_WITH_COOKIE_BUT_RATELIMITED;
-	if (!wg_ratelimiter_allow(skb, dev_net(checker->device->dev)))
-		goto out;
+	return (struct message_macs *)(skb->data + skb->len -
+				       sizeof(struct message_macs));
+}
 
-	ret = VALID_MAC_WITH_COOKIE;
+/* Messages of the same length are hashed together, so that a flood of
+ * initiations costs one pass of the multi-message BLAKE2s per batch for mac1,
+ * and another for mac2 when under load.
+ */
+void wg_cookie_validate_packets(struct cookie_checker *checker,
+				struct sk_buff *skbs[],
+				enum cookie_mac_state states[],
+				unsigned int n, bool check_cookie)
+{
+	u8 computed_macs[MAX_HANDSHAKE_BATCH][BLAKE2S_HASH_SIZE];
+	u8 cookies[MAX_HANDSHAKE_BATCH][COOKIE_LEN];
+	const u8 *messages[MAX_HANDSHAKE_BATCH];
+	const u8 *keys[MAX_HANDSHAKE_BATCH];
+	unsigned int group[MAX_HANDSHAKE_BATCH];
+	unsigned long pending;
+	unsigned int i, j, m, k;
+	size_t len;
+
+	if (WARN_ON(n > MAX_HANDSHAKE_BATCH))
+		n = MAX_HANDSHAKE_BATCH;
+	pending = BIT(n) - 1;
+
+	for (i = 0; i < n; ++i)
+		states[i] = INVALID_MAC;
+
+	while (pending) {
+		len = skbs[__ffs(pending)]->len;
+		for (i = __ffs(pending), m = 0; i < n; ++i) {
+			if (!(pending & BIT(i)) || skbs[i]->len != len)
+				continue;
+			pending &= ~BIT(i);
+			group[m] = i;
+			messages[m] = skbs[i]->data;
+			keys[m++] = checker->message_mac1_key;
+		}
+
+		blake2s_batch(computed_macs, messages, keys, COOKIE_LEN,
+			      mac1_len(len), NOISE_SYMMETRIC_KEY_LEN, m);
+		for (j = 0, k = 0; j < m; ++j) {
+			struct sk_buff *skb = skbs[group[j]];
+
+			if (crypto_memneq(computed_macs[j], skb_macs(skb)->mac1,
+					  COOKIE_LEN))
+				continue;
+			states[group[j]] = VALID_MAC_BUT_NO_COOKIE;
+			if (!check_cookie)
+				continue;
+			make_cookie(cookies[k], skb, checker);
+			group[k] = group[j];
+			messages[k] = messages[j];
+			keys[k] = cookies[k];
+			++k;
+		}
+
+		if (!k)
+			continue;
+		blake2s_batch(computed_macs, messages, keys, COOKIE_LEN,
+			      mac2_len(len), COOKIE_LEN, k);
+		for (j = 0; j < k; ++j) {
+			struct sk_buff *skb = skbs[group[j]];
+
+			if (crypto_memneq(computed_macs[j], skb_macs(skb)->mac2,
+					  COOKIE_LEN))
+				continue;
+			states[group[j]] = VALID_MAC_WITH_COOKIE_BUT_RATELIMITED;
+			if (!wg_ratelimiter_allow(skb,
+						  dev_net(checker->device->dev)))
+				continue;
+			states[group[j]] = VALID_MAC_WITH_COOKIE;
+		}
+	}
 
-out:
-	return ret;
+	memzero_explicit(cookies, sizeof(cookies));
 }
 
 void wg_cookie_add_mac_to_packet(void *message, size_t len,
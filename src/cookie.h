@@ -44,9 +44,10 @@ void wg_cookie_checker_precompute_device_keys(struct cookie_checker *checker);
 void wg_cookie_checker_precompute_peer_keys(struct wg_peer *peer);
 void wg_cookie_init(struct cookie *cookie);
 
-enum cookie_mac_state wg_cookie_validate_packet(struct cookie_checker *checker,
-						struct sk_buff *skb,
-						bool check_cookie);
+void wg_cookie_validate_packets(struct cookie_checker *checker,
+				struct sk_buff *skbs[],
+				enum cookie_mac_state states[],
+				unsigned int n, bool check_cookie);
 void wg_cookie_add_mac_to_packet(void *message, size_t len,
 				 struct wg_peer *peer);
 
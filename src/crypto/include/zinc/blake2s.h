@@ -13,7 +13,8 @@
 enum blake2s_lengths {
 	BLAKE2S_BLOCK_SIZE = 64,
 	BLAKE2S_HASH_SIZE = 32,
-	BLAKE2S_KEY_SIZE = 32
+	BLAKE2S_KEY_SIZE = 32,
+	BLAKE2S_BATCH_LANES = 8
 };
 
 struct blake2s_state {
@@ -50,7 +51,30 @@ static inline void blake2s(u8 *out, const u8 *in, const u8 *key,
 	blake2s_final(&state, out, outlen);
 }
 
+/* Hashes n equal-length messages, each under its own key of keylen bytes, which
+ * lets the compression function work on several of them at once.
+ */
+void blake2s_batch(u8 out[][BLAKE2S_HASH_SIZE], const u8 *const in[],
+		   const u8 *const key[], const size_t outlen,
+		   const size_t inlen, const size_t keylen,
+		   const unsigned int n);
+
+struct blake2s_hmac_key {
+	struct blake2s_state inner;
+	struct blake2s_state outer;
+};
+
 void blake2s_hmac(u8 *out, const u8 *in, const u8 *key, const size_t outlen,
 		  const size_t inlen, const size_t keylen);
 
+/* Computes the inner and outer states of HMAC-BLAKE2s under key once, so that
+ * each subsequent MAC under it is two compressions cheaper. Since the key
+ * block is already compressed, the message must not be empty.
+ */
+void blake2s_hmac_key_init(struct blake2s_hmac_key *hkey, const u8 *key,
+			   const size_t keylen);
+void blake2s_hmac_precomputed(u8 *out, const u8 *in,
+			      const struct blake2s_hmac_key *hkey,
+			      const size_t outlen, const size_t inlen);
+
 #endif /* _ZINC_BLAKE2S_H */
@@ -6,6 +6,7 @@
 #ifndef _ZINC_CURVE25519_H
 #define _ZINC_CURVE25519_H
 
+#include <linux/simd.h>
 #include <linux/types.h>
 
 enum curve25519_lengths {
@@ -15,6 +16,14 @@ enum curve25519_lengths {
 bool __must_check curve25519(u8 mypublic[CURVE25519_KEY_SIZE],
 			     const u8 secret[CURVE25519_KEY_SIZE],
 			     const u8 basepoint[CURVE25519_KEY_SIZE]);
+/* Computes mypublic[i] = curve25519(secret, basepoint[i]) for i < n, setting
+ * valid[i] to what curve25519() would have returned. This is faster than n
+ * calls to curve25519() when the CPU can do several points side by side.
+ */
+void curve25519_batch(u8 mypublic[][CURVE25519_KEY_SIZE],
+		      const u8 secret[CURVE25519_KEY_SIZE],
+		      const u8 basepoint[][CURVE25519_KEY_SIZE], bool valid[],
+		      unsigned int n, simd_context_t *simd_context);
 void curve25519_generate_secret(u8 secret[CURVE25519_KEY_SIZE]);
 bool __must_check curve25519_generate_public(
 	u8 pub[CURVE25519_KEY_SIZE], const u8 secret[CURVE25519_KEY_SIZE]);
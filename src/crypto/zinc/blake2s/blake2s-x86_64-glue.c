@@ -71,3 +71,90 @@ out:
 	simd_put(&simd_context);
 	return used_arch;
 }
+
+static void blake2s_load_lane(u32 m[16][8], const unsigned int lane,
+			      const u8 *src, const size_t len)
+{
+	u8 block[BLAKE2S_BLOCK_SIZE] __aligned(__alignof__(u32)) = { 0 };
+	int i;
+
+	if (len)
+		memcpy(block, src, len);
+	for (i = 0; i < 16; ++i)
+		m[i][lane] = get_unaligned_le32(block + i * sizeof(u32));
+	memzero_explicit(block, BLAKE2S_BLOCK_SIZE);
+}
+
+static inline bool blake2s_batch_arch(u8 out[][BLAKE2S_HASH_SIZE],
+				      const u8 *const in[],
+				      const u8 *const key[],
+				      const size_t outlen, const size_t inlen,
+				      const size_t keylen, const unsigned int n)
+{
+	const size_t total = inlen + (keylen ? BLAKE2S_BLOCK_SIZE : 0);
+	const size_t nblocks =
+		max_t(size_t, 1, DIV_ROUND_UP(total, BLAKE2S_BLOCK_SIZE));
+	u32 h[8][8] __aligned(32), m[16][8] __aligned(32), tf[4];
+	unsigned int i, j, lane, lanes;
+	simd_context_t simd_context;
+	size_t block, len;
+
+	/* Below this, the one-message compression function is faster. */
+	if (!IS_ENABLED(CONFIG_AS_AVX512) || !blake2s_use_avx512 ||
+	    n < BLAKE2S_BATCH_LANES / 2)
+		return false;
+
+	simd_get(&simd_context);
+	if (!simd_use(&simd_context)) {
+		simd_put(&simd_context);
+		return false;
+	}
+
+	for (i = 0; i < n; i += lanes) {
+		lanes = min_t(unsigned int, n - i, BLAKE2S_BATCH_LANES);
+
+		for (j = 0; j < 8; ++j) {
+			for (lane = 0; lane < 8; ++lane)
+				h[j][lane] = blake2s_iv[j];
+		}
+		for (lane = 0; lane < 8; ++lane)
+			h[0][lane] ^= 0x01010000U | (keylen << 8) | outlen;
+		memset(tf, 0, sizeof(tf));
+
+		for (block = 0; block < nblocks; ++block) {
+			len = min_t(size_t, total - block * BLAKE2S_BLOCK_SIZE,
+				    BLAKE2S_BLOCK_SIZE);
+			/* Idle lanes just repeat the last message. */
+			for (lane = 0; lane < 8; ++lane) {
+				j = i + min(lane, lanes - 1);
+				if (keylen && !block)
+					blake2s_load_lane(m, lane, key[j],
+							  keylen);
+				else
+					blake2s_load_lane(m, lane,
+						in[j] + block * BLAKE2S_BLOCK_SIZE -
+						(keylen ? BLAKE2S_BLOCK_SIZE : 0),
+						len);
+			}
+			tf[0] += len;
+			tf[1] += tf[0] < len;
+			if (block == nblocks - 1)
+				tf[2] = ~0U;
+			blake2s_compress_avx512_8way(h, m, tf);
+		}
+
+		for (lane = 0; lane < lanes; ++lane) {
+			__le32 digest[8];
+
+			for (j = 0; j < 8; ++j)
+				digest[j] = cpu_to_le32(h[j][lane]);
+			memcpy(out[i + lane], digest, outlen);
+		}
+		simd_relax(&simd_context);
+	}
+
+	memzero_explicit(h, sizeof(h));
+	memzero_explicit(m, sizeof(m));
+	simd_put(&simd_context);
+	return true;
+}
@@ -123,6 +123,15 @@ static inline bool blake2s_compress_arch(struct blake2s_state *state,
 {
 	return false;
 }
+
+static inline bool blake2s_batch_arch(u8 out[][BLAKE2S_HASH_SIZE],
+				      const u8 *const in[],
+				      const u8 *const key[],
+				      const size_t outlen, const size_t inlen,
+				      const size_t keylen, const unsigned int n)
+{
+	return false;
+}
 #endif
 
 static inline void blake2s_compress(struct blake2s_state *state,
@@ -236,6 +245,75 @@ void blake2s_final(struct blake2s_state *state, u8 *out, const size_t outlen)
 }
 EXPORT_SYMBOL(blake2s_final);
 
+void blake2s_batch(u8 out[][BLAKE2S_HASH_SIZE], const u8 *const in[],
+		   const u8 *const key[], const size_t outlen,
+		   const size_t inlen, const size_t keylen,
+		   const unsigned int n)
+{
+	unsigned int i;
+
+	WARN_ON(IS_ENABLED(DEBUG) && (!outlen || outlen > BLAKE2S_HASH_SIZE ||
+		keylen > BLAKE2S_KEY_SIZE));
+
+	if (blake2s_batch_arch(out, in, key, outlen, inlen, keylen, n))
+		return;
+	for (i = 0; i < n; ++i)
+		blake2s(out[i], in[i], keylen ? key[i] : NULL, outlen, inlen,
+			keylen);
+}
+EXPORT_SYMBOL(blake2s_batch);
+
+void blake2s_hmac_key_init(struct blake2s_hmac_key *hkey, const u8 *key,
+			   const size_t keylen)
+{
+	u8 x_key[BLAKE2S_BLOCK_SIZE] __aligned(__alignof__(u32)) = { 0 };
+	int i;
+
+	if (keylen > BLAKE2S_BLOCK_SIZE)
+		blake2s(x_key, key, NULL, BLAKE2S_HASH_SIZE, keylen, 0);
+	else
+		memcpy(x_key, key, keylen);
+
+	/* The padded key fills exactly one block, so it can be compressed
+	 * right away rather than left in the buffer by blake2s_update.
+	 */
+	for (i = 0; i < BLAKE2S_BLOCK_SIZE; ++i)
+		x_key[i] ^= 0x36;
+	blake2s_init(&hkey->inner, BLAKE2S_HASH_SIZE);
+	blake2s_compress(&hkey->inner, x_key, 1, BLAKE2S_BLOCK_SIZE);
+
+	for (i = 0; i < BLAKE2S_BLOCK_SIZE; ++i)
+		x_key[i] ^= 0x5c ^ 0x36;
+	blake2s_init(&hkey->outer, BLAKE2S_HASH_SIZE);
+	blake2s_compress(&hkey->outer, x_key, 1, BLAKE2S_BLOCK_SIZE);
+
+	memzero_explicit(x_key, BLAKE2S_BLOCK_SIZE);
+}
+EXPORT_SYMBOL(blake2s_hmac_key_init);
+
+void blake2s_hmac_precomputed(u8 *out, const u8 *in,
+			      const struct blake2s_hmac_key *hkey,
+			      const size_t outlen, const size_t inlen)
+{
+	struct blake2s_state state;
+	u8 i_hash[BLAKE2S_HASH_SIZE] __aligned(__alignof__(u32));
+
+	WARN_ON(IS_ENABLED(DEBUG) &&
+		(!outlen || outlen > BLAKE2S_HASH_SIZE || !inlen));
+
+	state = hkey->inner;
+	blake2s_update(&state, in, inlen);
+	blake2s_final(&state, i_hash, BLAKE2S_HASH_SIZE);
+
+	state = hkey->outer;
+	blake2s_update(&state, i_hash, BLAKE2S_HASH_SIZE);
+	blake2s_final(&state, i_hash, BLAKE2S_HASH_SIZE);
+
+	memcpy(out, i_hash, outlen);
+	memzero_explicit(i_hash, BLAKE2S_HASH_SIZE);
+}
+EXPORT_SYMBOL(blake2s_hmac_precomputed);
+
 void blake2s_hmac(u8 *out, const u8 *in, const u8 *key, const size_t outlen,
 		  const size_t inlen, const size_t keylen)
 {
@@ -41,3 +41,12 @@ static inline bool curve25519_base_arch(u8 pub[CURVE25519_KEY_SIZE],
 {
 	return false;
 }
+
+static inline unsigned int
+curve25519_batch_arch(u8 mypublic[][CURVE25519_KEY_SIZE],
+		      const u8 secret[CURVE25519_KEY_SIZE],
+		      const u8 basepoint[][CURVE25519_KEY_SIZE], unsigned int n,
+		      simd_context_t *simd_context)
+{
+	return 0;
+}
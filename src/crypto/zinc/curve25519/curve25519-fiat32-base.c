@@ -0,0 +1,3879 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+/*
+ * Copyright (C) 2018 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * This is a constant-time fixed-base scalar multiplication for computing
+ * public keys, built on top of the fiat32 field arithmetic. Rather than run
+ * the Montgomery ladder against the basepoint, it does the multiplication on
+ * the birationally equivalent Edwards curve, using the signed radix-16 comb
+ * from ref10 and a table of small multiples of the basepoint, and then maps
+ * the result back to a Montgomery u-coordinate.
+ */
+
+/* base[i][j] = (j + 1) * 256^i * B, as (y + x, y - x, 2dxy) in affine
+ * coordinates, each stored little endian.
+ */
+static const u8 curve25519_base_table[32][8][3][CURVE25519_KEY_SIZE] = {
+	{
+		{
+			{ 0x85, 0x3b, 0x8c, 0xf5, 0xc6, 0x93, 0xbc, 0x2f,
+			  0x19, 0x0e, 0x8c, 0xfb, 0xc6, 0x2d, 0x93, 0xcf,
+			  0xc2, 0x42, 0x3d, 0x64, 0x98, 0x48, 0x0b, 0x27,
+			  0x65, 0xba, 0xd4, 0x33, 0x3a, 0x9d, 0xcf, 0x07 },
+			{ 0x3e, 0x91, 0x40, 0xd7, 0x05, 0x39, 0x10, 0x9d,
+			  0xb3, 0xbe, 0x40, 0xd1, 0x05, 0x9f, 0x39, 0xfd,
+			  0x09, 0x8a, 0x8f, 0x68, 0x34, 0x84, 0xc1, 0xa5,
+			  0x67, 0x12, 0xf8, 0x98, 0x92, 0x2f, 0xfd, 0x44 },
+			{ 0x68, 0xaa, 0x7a, 0x87, 0x05, 0x12, 0xc9, 0xab,
+			  0x9e, 0xc4, 0xaa, 0xcc, 0x23, 0xe8, 0xd9, 0x26,
+			  0x8c, 0x59, 0x43, 0xdd, 0xcb, 0x7d, 0x1b, 0x5a,
+			  0xa8, 0x65, 0x0c, 0x9f, 0x68, 0x7b, 0x11, 0x6f },
+		},
+		{
+			{ 0xd7, 0x71, 0x3c, 0x93, 0xfc, 0xe7, 0x24, 0x92,
+			  0xb5, 0xf5, 0x0f, 0x7a, 0x96, 0x9d, 0x46, 0x9f,
+			  0x02, 0x07, 0xd6, 0xe1, 0x65, 0x9a, 0xa6, 0x5a,
+			  0x2e, 0x2e, 0x7d, 0xa8, 0x3f, 0x06, 0x0c, 0x59 },
+			{ 0xa8, 0xd5, 0xb4, 0x42, 0x60, 0xa5, 0x99, 0x8a,
+			  0xf6, 0xac, 0x60, 0x4e, 0x0c, 0x81, 0x2b, 0x8f,
+			  0xaa, 0x37, 0x6e, 0xb1, 0x6b, 0x23, 0x9e, 0xe0,
+			  0x55, 0x25, 0xc9, 0x69, 0xa6, 0x95, 0xb5, 0x6b },
+			{ 0x5f, 0x7a, 0x9b, 0xa5, 0xb3, 0xa8, 0xfa, 0x43,
+			  0x78, 0xcf, 0x9a, 0x5d, 0xdd, 0x6b, 0xc1, 0x36,
+			  0x31, 0x6a, 0x3d, 0x0b, 0x84, 0xa0, 0x0f, 0x50,
+			  0x73, 0x0b, 0xa5, 0x3e, 0xb1, 0xf5, 0x1a, 0x70 },
+		},
+		{
+			{ 0x30, 0x97, 0xee, 0x4c, 0xa8, 0xb0, 0x25, 0xaf,
+			  0x8a, 0x4b, 0x86, 0xe8, 0x30, 0x84, 0x5a, 0x02,
+			  0x32, 0x67, 0x01, 0x9f, 0x02, 0x50, 0x1b, 0xc1,
+			  0xf4, 0xf8, 0x80, 0x9a, 0x1b, 0x4e, 0x16, 0x7a },
+			{ 0x65, 0xd2, 0xfc, 0xa4, 0xe8, 0x1f, 0x61, 0x56,
+			  0x7d, 0xba, 0xc1, 0xe5, 0xfd, 0x53, 0xd3, 0x3b,
+			  0xbd, 0xd6, 0x4b, 0x21, 0x1a, 0xf3, 0x31, 0x81,
+			  0x62, 0xda, 0x5b, 0x55, 0x87, 0x15, 0xb9, 0x2a },
+			{ 0x89, 0xd8, 0xd0, 0x0d, 0x3f, 0x93, 0xae, 0x14,
+			  0x62, 0xda, 0x35, 0x1c, 0x22, 0x23, 0x94, 0x58,
+			  0x4c, 0xdb, 0xf2, 0x8c, 0x45, 0xe5, 0x70, 0xd1,
+			  0xc6, 0xb4, 0xb9, 0x12, 0xaf, 0x26, 0x28, 0x5a },
+		},
+		{
+			{ 0x9f, 0x09, 0xfc, 0x8e, 0xb9, 0x51, 0x73, 0x28,
+			  0x38, 0x25, 0xfd, 0x7d, 0xf4, 0xc6, 0x65, 0x67,
+			  0x65, 0x92, 0x0a, 0xfb, 0x3d, 0x8d, 0x34, 0xca,
+			  0x27, 0x87, 0xe5, 0x21, 0x03, 0x91, 0x0e, 0x68 },
+			{ 0xbf, 0x18, 0x68, 0x05, 0x0a, 0x05, 0xfe, 0x95,
+			  0xa9, 0xfa, 0x60, 0x56, 0x71, 0x89, 0x7e, 0x32,
+			  0x73, 0x50, 0xa0, 0x06, 0xcd, 0xe3, 0xe8, 0xc3,
+			  0x9a, 0xa4, 0x45, 0x74, 0x4c, 0x3f, 0x93, 0x27 },
+			{ 0x09, 0xff, 0x76, 0xc4, 0xe9, 0xfb, 0x13, 0x5a,
+			  0x72, 0xc1, 0x5c, 0x7b, 0x45, 0x39, 0x9e, 0x6e,
+			  0x94, 0x44, 0x2b, 0x10, 0xf9, 0xdc, 0xdb, 0x5d,
+			  0x2b, 0x3e, 0x55, 0x63, 0xbf, 0x0c, 0x9d, 0x7f },
+		},
+		{
+			{ 0x33, 0xbb, 0xa5, 0x08, 0x44, 0xbc, 0x12, 0xa2,
+			  0x02, 0xed, 0x5e, 0xc7, 0xc3, 0x48, 0x50, 0x8d,
+			  0x44, 0xec, 0xbf, 0x5a, 0x0c, 0xeb, 0x1b, 0xdd,
+			  0xeb, 0x06, 0xe2, 0x46, 0xf1, 0xcc, 0x45, 0x29 },
+			{ 0xba, 0xd6, 0x47, 0xa4, 0xc3, 0x82, 0x91, 0x7f,
+			  0xb7, 0x29, 0x27, 0x4b, 0xd1, 0x14, 0x00, 0xd5,
+			  0x87, 0xa0, 0x64, 0xb8, 0x1c, 0xf1, 0x3c, 0xe3,
+			  0xf3, 0x55, 0x1b, 0xeb, 0x73, 0x7e, 0x4a, 0x15 },
+			{ 0x85, 0x82, 0x2a, 0x81, 0xf1, 0xdb, 0xbb, 0xbc,
+			  0xfc, 0xd1, 0xbd, 0xd0, 0x07, 0x08, 0x0e, 0x27,
+			  0x2d, 0xa7, 0xbd, 0x1b, 0x0b, 0x67, 0x1b, 0xb4,
+			  0x9a, 0xb6, 0x3b, 0x6b, 0x69, 0xbe, 0xaa, 0x43 },
+		},
+		{
+			{ 0x31, 0x71, 0x15, 0x77, 0xeb, 0xee, 0x0c, 0x3a,
+			  0x88, 0xaf, 0xc8, 0x00, 0x89, 0x15, 0x27, 0x9b,
+			  0x36, 0xa7, 0x59, 0xda, 0x68, 0xb6, 0x65, 0x80,
+			  0xbd, 0x38, 0xcc, 0xa2, 0xb6, 0x7b, 0xe5, 0x51 },
+			{ 0xa4, 0x8c, 0x7d, 0x7b, 0xb6, 0x06, 0x98, 0x49,
+			  0x39, 0x27, 0xd2, 0x27, 0x84, 0xe2, 0x5b, 0x57,
+			  0xb9, 0x53, 0x45, 0x20, 0xe7, 0x5c, 0x08, 0xbb,
+			  0x84, 0x78, 0x41, 0xae, 0x41, 0x4c, 0xb6, 0x38 },
+			{ 0x71, 0x4b, 0xea, 0x02, 0x67, 0x32, 0xac, 0x85,
+			  0x01, 0xbb, 0xa1, 0x41, 0x03, 0xe0, 0x70, 0xbe,
+			  0x44, 0xc1, 0x3b, 0x08, 0x4b, 0xa2, 0xe4, 0x53,
+			  0xe3, 0x61, 0x0d, 0x9f, 0x1a, 0xe9, 0xb8, 0x10 },
+		},
+		{
+			{ 0xbf, 0xa3, 0x4e, 0x94, 0xd0, 0x5c, 0x1a, 0x6b,
+			  0xd2, 0xc0, 0x9d, 0xb3, 0x3a, 0x35, 0x70, 0x74,
+			  0x49, 0x2e, 0x54, 0x28, 0x82, 0x52, 0xb2, 0x71,
+			  0x7e, 0x92, 0x3c, 0x28, 0x69, 0xea, 0x1b, 0x46 },
+			{ 0xb1, 0x21, 0x32, 0xaa, 0x9a, 0x2c, 0x6f, 0xba,
+			  0xa7, 0x23, 0xba, 0x3b, 0x53, 0x21, 0xa0, 0x6c,
+			  0x3a, 0x2c, 0x19, 0x92, 0x4f, 0x76, 0xea, 0x9d,
+			  0xe0, 0x17, 0x53, 0x2e, 0x5d, 0xdd, 0x6e, 0x1d },
+			{ 0xa2, 0xb3, 0xb8, 0x01, 0xc8, 0x6d, 0x83, 0xf1,
+			  0x9a, 0xa4, 0x3e, 0x05, 0x47, 0x5f, 0x03, 0xb3,
+			  0xf3, 0xad, 0x77, 0x58, 0xba, 0x41, 0x9c, 0x52,
+			  0xa7, 0x90, 0x0f, 0x6a, 0x1c, 0xbb, 0x9f, 0x7a },
+		},
+		{
+			{ 0x8f, 0x3e, 0xdd, 0x04, 0x66, 0x59, 0xb7, 0x59,
+			  0x2c, 0x70, 0x88, 0xe2, 0x77, 0x03, 0xb3, 0x6c,
+			  0x23, 0xc3, 0xd9, 0x5e, 0x66, 0x9c, 0x33, 0xb1,
+			  0x2f, 0xe5, 0xbc, 0x61, 0x60, 0xe7, 0x15, 0x09 },
+			{ 0xd9, 0x34, 0x92, 0xf3, 0xed, 0x5d, 0xa7, 0xe2,
+			  0xf9, 0x58, 0xb5, 0xe1, 0x80, 0x76, 0x3d, 0x96,
+			  0xfb, 0x23, 0x3c, 0x6e, 0xac, 0x41, 0x27, 0x2c,
+			  0xc3, 0x01, 0x0e, 0x32, 0xa1, 0x24, 0x90, 0x3a },
+			{ 0x1a, 0x91, 0xa2, 0xc9, 0xd9, 0xf5, 0xc1, 0xe7,
+			  0xd7, 0xa7, 0xcc, 0x8b, 0x78, 0x71, 0xa3, 0xb8,
+			  0x32, 0x2a, 0xb6, 0x0e, 0x19, 0x12, 0x64, 0x63,
+			  0x95, 0x4e, 0xcc, 0x2e, 0x5c, 0x7c, 0x90, 0x26 },
+		},
+	},
+	{
+		{
+			{ 0x1d, 0x9c, 0x2f, 0x63, 0x0e, 0xdd, 0xcc, 0x2e,
+			  0x15, 0x31, 0x89, 0x76, 0x96, 0xb6, 0xd0, 0x51,
+			  0x58, 0x7a, 0x63, 0xa8, 0x6b, 0xb7, 0xdf, 0x52,
+			  0x39, 0xef, 0x0e, 0xa0, 0x49, 0x7d, 0xd3, 0x6d },
+			{ 0x5e, 0x51, 0xaa, 0x49, 0x54, 0x63, 0x5b, 0xed,
+			  0x3a, 0x82, 0xc6, 0x0b, 0x9f, 0xc4, 0x65, 0xa8,
+			  0xc4, 0xd1, 0x42, 0x5b, 0xe9, 0x1f, 0x0c, 0x85,
+			  0xb9, 0x15, 0xd3, 0x03, 0x6f, 0x6d, 0xd7, 0x30 },
+			{ 0xc7, 0xe4, 0x06, 0x21, 0x17, 0x44, 0x44, 0x6c,
+			  0x69, 0x7f, 0x8d, 0x92, 0x80, 0xd6, 0x53, 0xfb,
+			  0x26, 0x3f, 0x4d, 0x69, 0xa4, 0x9e, 0x73, 0xb4,
+			  0xb0, 0x4b, 0x86, 0x2e, 0x11, 0x97, 0xc6, 0x10 },
+		},
+		{
+			{ 0x05, 0xc8, 0x58, 0x83, 0xa0, 0x2a, 0xa6, 0x0c,
+			  0x47, 0x42, 0x20, 0x7a, 0xe3, 0x4a, 0x3d, 0x6a,
+			  0xdc, 0xed, 0x11, 0x3b, 0xa6, 0xd3, 0x64, 0x74,
+			  0xef, 0x06, 0x08, 0x55, 0xaf, 0x9b, 0xbf, 0x03 },
+			{ 0xde, 0x5f, 0xbe, 0x7d, 0x27, 0xc4, 0x93, 0x64,
+			  0xa2, 0x7e, 0xad, 0x19, 0xad, 0x4f, 0x5d, 0x26,
+			  0x90, 0x45, 0x30, 0x46, 0xc8, 0xdf, 0x00, 0x0e,
+			  0x09, 0xfe, 0x66, 0xed, 0xab, 0x1c, 0xe6, 0x25 },
+			{ 0x04, 0x66, 0x58, 0xcc, 0x28, 0xe1, 0x13, 0x3f,
+			  0x7e, 0x74, 0x59, 0xb4, 0xec, 0x73, 0x58, 0x6f,
+			  0xf5, 0x68, 0x12, 0xcc, 0xed, 0x3d, 0xb6, 0xa0,
+			  0x2c, 0xe2, 0x86, 0x45, 0x63, 0x78, 0x6d, 0x56 },
+		},
+		{
+			{ 0xd0, 0x2f, 0x5a, 0xc6, 0x85, 0x42, 0x05, 0xa1,
+			  0xc3, 0x67, 0x16, 0xf3, 0x2a, 0x11, 0x64, 0x6c,
+			  0x58, 0xee, 0x1a, 0x73, 0x40, 0xe2, 0x0a, 0x68,
+			  0x2a, 0xb2, 0x93, 0x47, 0xf3, 0xa5, 0xfb, 0x14 },
+			{ 0x34, 0x08, 0xc1, 0x9c, 0x9f, 0xa4, 0x37, 0x16,
+			  0x51, 0xc4, 0x9b, 0xa8, 0xd5, 0x56, 0x8e, 0xbc,
+			  0xdb, 0xd2, 0x7f, 0x7f, 0x0f, 0xec, 0xb5, 0x1c,
+			  0xd9, 0x35, 0xcc, 0x5e, 0xca, 0x5b, 0x97, 0x33 },
+			{ 0xd4, 0xf7, 0x85, 0x69, 0x16, 0x46, 0xd7, 0x3c,
+			  0x57, 0x00, 0xc8, 0xc9, 0x84, 0x5e, 0x3e, 0x59,
+			  0x1e, 0x13, 0x61, 0x7b, 0xb6, 0xf2, 0xc3, 0x2f,
+			  0x6c, 0x52, 0xfc, 0x83, 0xea, 0x9c, 0x82, 0x14 },
+		},
+		{
+			{ 0xb8, 0xec, 0x71, 0x4e, 0x2f, 0x0b, 0xe7, 0x21,
+			  0xe3, 0x77, 0xa4, 0x40, 0xb9, 0xdd, 0x56, 0xe6,
+			  0x80, 0x4f, 0x1d, 0xce, 0xce, 0x56, 0x65, 0xbf,
+			  0x7e, 0x7b, 0x5d, 0x53, 0xc4, 0x3b, 0xfc, 0x05 },
+			{ 0xc2, 0x95, 0xdd, 0x97, 0x84, 0x7b, 0x43, 0xff,
+			  0xa7, 0xb5, 0x4e, 0xaa, 0x30, 0x4e, 0x74, 0x6c,
+			  0x8b, 0xe8, 0x85, 0x3c, 0x61, 0x5d, 0x0c, 0x9e,
+			  0x73, 0x81, 0x75, 0x5f, 0x1e, 0xc7, 0xd9, 0x2f },
+			{ 0xdd, 0xde, 0xaf, 0x52, 0xae, 0xb3, 0xb8, 0x24,
+			  0xcf, 0x30, 0x3b, 0xed, 0x8c, 0x63, 0x95, 0x34,
+			  0x95, 0x81, 0xbe, 0xa9, 0x83, 0xbc, 0xa4, 0x33,
+			  0x04, 0x1f, 0x65, 0x5c, 0x47, 0x67, 0x37, 0x37 },
+		},
+		{
+			{ 0x90, 0x65, 0x24, 0x14, 0xcb, 0x95, 0x40, 0x63,
+			  0x35, 0x55, 0xc1, 0x16, 0x40, 0x14, 0x12, 0xef,
+			  0x60, 0xbc, 0x10, 0x89, 0x0c, 0x14, 0x38, 0x9e,
+			  0x8c, 0x7c, 0x90, 0x30, 0x57, 0x90, 0xf5, 0x6b },
+			{ 0xd9, 0xad, 0xd1, 0x40, 0xfd, 0x99, 0xba, 0x2f,
+			  0x27, 0xd0, 0xf4, 0x96, 0x6f, 0x16, 0x07, 0xb3,
+			  0xae, 0x3b, 0xf0, 0x15, 0x52, 0xf0, 0x63, 0x43,
+			  0x99, 0xf9, 0x18, 0x3b, 0x6c, 0xa5, 0xbe, 0x1f },
+			{ 0x8a, 0x5b, 0x41, 0xe1, 0xf1, 0x78, 0xa7, 0x0f,
+			  0x7e, 0xa7, 0xc3, 0xba, 0xf7, 0x9f, 0x40, 0x06,
+			  0x50, 0x9a, 0xa2, 0x9a, 0xb8, 0xd7, 0x52, 0x6f,
+			  0x56, 0x5a, 0x63, 0x7a, 0xf6, 0x1c, 0x52, 0x02 },
+		},
+		{
+			{ 0xe4, 0x5e, 0x2f, 0x77, 0x20, 0x67, 0x14, 0xb1,
+			  0xce, 0x9a, 0x07, 0x96, 0xb1, 0x94, 0xf8, 0xe8,
+			  0x4a, 0x82, 0xac, 0x00, 0x4d, 0x22, 0xf8, 0x4a,
+			  0xc4, 0x6c, 0xcd, 0xf7, 0xd9, 0x53, 0x17, 0x00 },
+			{ 0x94, 0x52, 0x9d, 0x0a, 0x0b, 0xee, 0x3f, 0x51,
+			  0x66, 0x5a, 0xdf, 0x0f, 0x5c, 0xe7, 0x98, 0x8f,
+			  0xce, 0x07, 0xe1, 0xbf, 0x88, 0x86, 0x61, 0xd4,
+			  0xed, 0x2c, 0x38, 0x71, 0x7e, 0x0a, 0xa0, 0x3f },
+			{ 0x34, 0xdb, 0x3d, 0x96, 0x2d, 0x23, 0x69, 0x3c,
+			  0x58, 0x38, 0x97, 0xb4, 0xda, 0x87, 0xde, 0x1d,
+			  0x85, 0xf2, 0x91, 0xa0, 0xf9, 0xd1, 0xd7, 0xaa,
+			  0xb6, 0xed, 0x48, 0xa0, 0x2f, 0xfe, 0xb5, 0x12 },
+		},
+		{
+			{ 0x92, 0x1e, 0x6f, 0xad, 0x26, 0x7c, 0x2b, 0xdf,
+			  0x13, 0x89, 0x4b, 0x50, 0x23, 0xd3, 0x66, 0x4b,
+			  0xc3, 0x8b, 0x1c, 0x75, 0xc0, 0x9d, 0x40, 0x8c,
+			  0xb8, 0xc7, 0x96, 0x07, 0xc2, 0x93, 0x7e, 0x6f },
+			{ 0x4d, 0xe3, 0xfc, 0x96, 0xc4, 0xfb, 0xf0, 0x71,
+			  0xed, 0x5b, 0xf3, 0xad, 0x6b, 0x82, 0xb9, 0x73,
+			  0x61, 0xc5, 0x28, 0xff, 0x61, 0x72, 0x04, 0xd2,
+			  0x6f, 0x20, 0xb1, 0x6f, 0xf9, 0x76, 0x9b, 0x74 },
+			{ 0x05, 0xae, 0xa6, 0xae, 0x04, 0xf6, 0x5a, 0x1f,
+			  0x99, 0x9c, 0xe4, 0xbe, 0xf1, 0x51, 0x23, 0xc1,
+			  0x66, 0x6b, 0xff, 0xee, 0xb5, 0x08, 0xa8, 0x61,
+			  0x51, 0x21, 0xe0, 0x01, 0x0f, 0xc1, 0xce, 0x0f },
+		},
+		{
+			{ 0x45, 0x4e, 0x24, 0xc4, 0x9d, 0xd2, 0xf2, 0x3d,
+			  0x0a, 0xde, 0xd8, 0x93, 0x74, 0x0e, 0x02, 0x2b,
+			  0x4d, 0x21, 0x0c, 0x82, 0x7e, 0x06, 0xc8, 0x6c,
+			  0x0a, 0xb9, 0xea, 0x6f, 0x16, 0x79, 0x37, 0x41 },
+			{ 0x44, 0x1e, 0xfe, 0x49, 0xa6, 0x58, 0x4d, 0x64,
+			  0x7e, 0x77, 0xad, 0x31, 0xa2, 0xae, 0xfc, 0x21,
+			  0xd2, 0xd0, 0x7f, 0x88, 0x5a, 0x1c, 0x44, 0x02,
+			  0xf3, 0x11, 0xc5, 0x83, 0x71, 0xaa, 0x01, 0x49 },
+			{ 0xf0, 0xf8, 0x1a, 0x8c, 0x54, 0xb7, 0xb1, 0x08,
+			  0xb4, 0x99, 0x62, 0x24, 0x7c, 0x7a, 0x0f, 0xce,
+			  0x39, 0xd9, 0x06, 0x1e, 0xf9, 0xb0, 0x60, 0xf7,
+			  0x13, 0x12, 0x6d, 0x72, 0x7b, 0x88, 0xbb, 0x41 },
+		},
+	},
+	{
+		{
+			{ 0xae, 0x91, 0x66, 0x7c, 0x59, 0x4c, 0x23, 0x7e,
+			  0xc8, 0xb4, 0x85, 0x0a, 0x3d, 0x9d, 0x88, 0x64,
+			  0xe7, 0xfa, 0x4a, 0x35, 0x0c, 0xc9, 0xe2, 0xda,
+			  0x1d, 0x9e, 0x6a, 0x0c, 0x07, 0x1e, 0x87, 0x0a },
+			{ 0xbe, 0x46, 0x43, 0x74, 0x44, 0x7d, 0xe8, 0x40,
+			  0x25, 0x2b, 0xb5, 0x15, 0xd4, 0xda, 0x48, 0x1d,
+			  0x3e, 0x60, 0x3b, 0xa1, 0x18, 0x8a, 0x3a, 0x7c,
+			  0xf7, 0xbd, 0xcd, 0x2f, 0xc1, 0x28, 0xb7, 0x4e },
+			{ 0x89, 0x89, 0xbc, 0x4b, 0x99, 0xb5, 0x01, 0x33,
+			  0x60, 0x42, 0xdd, 0x5b, 0x3a, 0xae, 0x6b, 0x73,
+			  0x3c, 0x9e, 0xd5, 0x19, 0xe2, 0xad, 0x61, 0x0d,
+			  0x64, 0xd4, 0x85, 0x26, 0x0f, 0x30, 0xe7, 0x3e },
+		},
+		{
+			{ 0x18, 0x75, 0x1e, 0x84, 0x47, 0x79, 0xfa, 0x43,
+			  0xd7, 0x46, 0x9c, 0x63, 0x59, 0xfa, 0xc6, 0xe5,
+			  0x74, 0x2b, 0x05, 0xe3, 0x1d, 0x5e, 0x06, 0xa1,
+			  0x30, 0x90, 0xb8, 0xcf, 0xa2, 0xc6, 0x47, 0x7d },
+			{ 0xb7, 0xd6, 0x7d, 0x9e, 0xe4, 0x55, 0xd2, 0xf5,
+			  0xac, 0x1e, 0x0b, 0x61, 0x5c, 0x11, 0x16, 0x80,
+			  0xca, 0x87, 0xe1, 0x92, 0x5d, 0x97, 0x99, 0x3c,
+			  0xc2, 0x25, 0x91, 0x97, 0x62, 0x57, 0x81, 0x13 },
+			{ 0xe0, 0xd6, 0xf0, 0x8e, 0x14, 0xd0, 0xda, 0x3f,
+			  0x3c, 0x6f, 0x54, 0x91, 0x9a, 0x74, 0x3e, 0x9d,
+			  0x57, 0x81, 0xbb, 0x26, 0x10, 0x62, 0xec, 0x71,
+			  0x80, 0xec, 0xc9, 0x34, 0x8d, 0xf5, 0x8c, 0x14 },
+		},
+		{
+			{ 0x6d, 0x75, 0xe4, 0x9a, 0x7d, 0x2f, 0x57, 0xe2,
+			  0x7f, 0x48, 0xf3, 0x88, 0xbb, 0x45, 0xc3, 0x56,
+			  0x8d, 0xa8, 0x60, 0x69, 0x6d, 0x0b, 0xd1, 0x9f,
+			  0xb9, 0xa1, 0xae, 0x4e, 0xad, 0xeb, 0x8f, 0x27 },
+			{ 0x27, 0xf0, 0x34, 0x79, 0xf6, 0x92, 0xa4, 0x46,
+			  0xa9, 0x0a, 0x84, 0xf6, 0xbe, 0x84, 0x99, 0x46,
+			  0x54, 0x18, 0x61, 0x89, 0x2a, 0xbc, 0xa1, 0x5c,
+			  0xd4, 0xbb, 0x5d, 0xbd, 0x1e, 0xfa, 0xf2, 0x3f },
+			{ 0x66, 0x39, 0x93, 0x8c, 0x1f, 0x68, 0xaa, 0xb1,
+			  0x98, 0x0c, 0x29, 0x20, 0x9c, 0x94, 0x21, 0x8c,
+			  0x52, 0x3c, 0x9d, 0x21, 0x91, 0x52, 0x11, 0x39,
+			  0x7b, 0x67, 0x9c, 0xfe, 0x02, 0xdd, 0x04, 0x41 },
+		},
+		{
+			{ 0xb8, 0x6a, 0x09, 0xdb, 0x06, 0x4e, 0x21, 0x81,
+			  0x35, 0x4f, 0xe4, 0x0c, 0xc9, 0xb6, 0xa8, 0x21,
+			  0xf5, 0x2a, 0x9e, 0x40, 0x2a, 0xc1, 0x24, 0x65,
+			  0x81, 0xa4, 0xfc, 0x8e, 0xa4, 0xb5, 0x65, 0x01 },
+			{ 0x2a, 0x42, 0x24, 0x11, 0x5e, 0xbf, 0xb2, 0x72,
+			  0xb5, 0x3a, 0xa3, 0x98, 0x33, 0x0c, 0xfa, 0xa1,
+			  0x66, 0xb6, 0x52, 0xfa, 0x01, 0x61, 0xcb, 0x94,
+			  0xd5, 0x53, 0xaf, 0xaf, 0x00, 0x3b, 0x86, 0x2c },
+			{ 0x76, 0x6a, 0x84, 0xa0, 0x74, 0xa4, 0x90, 0xf1,
+			  0xc0, 0x7c, 0x2f, 0xcd, 0x84, 0xf9, 0xef, 0x12,
+			  0x8f, 0x2b, 0xaa, 0x58, 0x06, 0x29, 0x5e, 0x69,
+			  0xb8, 0xc8, 0xfe, 0xbf, 0xd9, 0x67, 0x1b, 0x59 },
+		},
+		{
+			{ 0x5d, 0xb5, 0x18, 0x9f, 0x71, 0xb3, 0xb9, 0x99,
+			  0x1e, 0x64, 0x8c, 0xa1, 0xfa, 0xe5, 0x65, 0xe4,
+			  0xed, 0x05, 0x9f, 0xc2, 0x36, 0x11, 0x08, 0x61,
+			  0x8b, 0x12, 0x30, 0x70, 0x86, 0x4f, 0x9b, 0x48 },
+			{ 0xfa, 0x9b, 0xb4, 0x80, 0x1c, 0x0d, 0x2f, 0x31,
+			  0x8a, 0xec, 0xf3, 0xab, 0x5e, 0x51, 0x79, 0x59,
+			  0x88, 0x1c, 0xf0, 0x9e, 0xc0, 0x33, 0x70, 0x72,
+			  0xcb, 0x7b, 0x8f, 0xca, 0xc7, 0x2e, 0xe0, 0x3d },
+			{ 0xef, 0x92, 0xeb, 0x3a, 0x2d, 0x10, 0x32, 0xd2,
+			  0x61, 0xa8, 0x16, 0x61, 0xb4, 0x53, 0x62, 0xe1,
+			  0x24, 0xaa, 0x0b, 0x19, 0xe7, 0xab, 0x7e, 0x3d,
+			  0xbf, 0xbe, 0x6c, 0x49, 0xba, 0xfb, 0xf5, 0x49 },
+		},
+		{
+			{ 0x2e, 0x57, 0x9c, 0x1e, 0x8c, 0x62, 0x5d, 0x15,
+			  0x41, 0x47, 0x88, 0xc5, 0xac, 0x86, 0x4d, 0x8a,
+			  0xeb, 0x63, 0x57, 0x51, 0xf6, 0x52, 0xa3, 0x91,
+			  0x5b, 0x51, 0x67, 0x88, 0xc2, 0xa6, 0xa1, 0x06 },
+			{ 0xd4, 0xcf, 0x5b, 0x8a, 0x10, 0x9a, 0x94, 0x30,
+			  0xeb, 0x73, 0x64, 0xbc, 0x70, 0xdd, 0x40, 0xdc,
+			  0x1c, 0x0d, 0x7c, 0x30, 0xc1, 0x94, 0xc2, 0x92,
+			  0x74, 0x6e, 0xfa, 0xcb, 0x6d, 0xa8, 0x04, 0x56 },
+			{ 0xb6, 0x64, 0x17, 0x7c, 0xd4, 0xd1, 0x88, 0x72,
+			  0x51, 0x8b, 0x41, 0xe0, 0x40, 0x11, 0x54, 0x72,
+			  0xd1, 0xf6, 0xac, 0x18, 0x60, 0x1a, 0x03, 0x9f,
+			  0xc6, 0x42, 0x27, 0xfe, 0x89, 0x9e, 0x98, 0x20 },
+		},
+		{
+			{ 0x2e, 0xec, 0xea, 0x85, 0x8b, 0x27, 0x74, 0x16,
+			  0xdf, 0x2b, 0xcb, 0x7a, 0x07, 0xdc, 0x21, 0x56,
+			  0x5a, 0xf4, 0xcb, 0x61, 0x16, 0x4c, 0x0a, 0x64,
+			  0xd3, 0x95, 0x05, 0xf7, 0x50, 0x99, 0x0b, 0x73 },
+			{ 0x7f, 0xcc, 0x2d, 0x3a, 0xfd, 0x77, 0x97, 0x49,
+			  0x92, 0xd8, 0x4f, 0xa5, 0x2c, 0x7c, 0x85, 0x32,
+			  0xa0, 0xe3, 0x07, 0xd2, 0x64, 0xd8, 0x79, 0xa2,
+			  0x29, 0x7e, 0xa6, 0x0c, 0x1d, 0xed, 0x03, 0x04 },
+			{ 0x52, 0xc5, 0x4e, 0x87, 0x35, 0x2d, 0x4b, 0xc9,
+			  0x8d, 0x6f, 0x24, 0x98, 0xcf, 0xc8, 0xe6, 0xc5,
+			  0xce, 0x35, 0xc0, 0x16, 0xfa, 0x46, 0xcb, 0xf7,
+			  0xcc, 0x3d, 0x30, 0x08, 0x43, 0x45, 0xd7, 0x5b },
+		},
+		{
+			{ 0x2a, 0x79, 0xe7, 0x15, 0x21, 0x93, 0xc4, 0x85,
+			  0xc9, 0xdd, 0xcd, 0xbd, 0xa2, 0x89, 0x4c, 0xc6,
+			  0x62, 0xd7, 0xa3, 0xad, 0xa8, 0x3d, 0x1e, 0x9d,
+			  0x2c, 0xf8, 0x67, 0x30, 0x12, 0xdb, 0xb7, 0x5b },
+			{ 0xc2, 0x4c, 0xb2, 0x28, 0x95, 0xd1, 0x9a, 0x7f,
+			  0x81, 0xc1, 0x35, 0x63, 0x65, 0x54, 0x6b, 0x7f,
+			  0x36, 0x72, 0xc0, 0x4f, 0x6e, 0xb6, 0xb8, 0x66,
+			  0x83, 0xad, 0x80, 0x73, 0x00, 0x78, 0x3a, 0x13 },
+			{ 0xbe, 0x62, 0xca, 0xc6, 0x67, 0xf4, 0x61, 0x09,
+			  0xee, 0x52, 0x19, 0x21, 0xd6, 0x21, 0xec, 0x04,
+			  0x70, 0x47, 0xd5, 0x9b, 0x77, 0x60, 0x23, 0x18,
+			  0xd2, 0xe0, 0xf0, 0x58, 0x6d, 0xca, 0x0d, 0x74 },
+		},
+	},
+	{
+		{
+			{ 0x3c, 0x43, 0x78, 0x04, 0x57, 0x8c, 0x1a, 0x23,
+			  0x9d, 0x43, 0x81, 0xc2, 0x0e, 0x27, 0xb5, 0xb7,
+			  0x9f, 0x07, 0xd9, 0xe3, 0xea, 0x99, 0xaa, 0xdb,
+			  0xd9, 0x03, 0x2b, 0x6c, 0x25, 0xf5, 0x03, 0x2c },
+			{ 0x4e, 0xce, 0xcf, 0x52, 0x07, 0xee, 0x48, 0xdf,
+			  0xb7, 0x08, 0xec, 0x06, 0xf3, 0xfa, 0xff, 0xc3,
+			  0xc4, 0x59, 0x54, 0xb9, 0x2a, 0x0b, 0x71, 0x05,
+			  0x8d, 0xa3, 0x3e, 0x96, 0xfa, 0x25, 0x1d, 0x16 },
+			{ 0x7d, 0xa4, 0x53, 0x7b, 0x75, 0x18, 0x0f, 0x79,
+			  0x79, 0x58, 0x0c, 0xcf, 0x30, 0x01, 0x7b, 0x30,
+			  0xf9, 0xf7, 0x7e, 0x25, 0x77, 0x3d, 0x90, 0x31,
+			  0xaf, 0xbb, 0x96, 0xbd, 0xbd, 0x68, 0x94, 0x69 },
+		},
+		{
+			{ 0x48, 0x19, 0xa9, 0x6a, 0xe6, 0x3d, 0xdd, 0xd8,
+			  0xcc, 0xd2, 0xc0, 0x2f, 0xc2, 0x64, 0x50, 0x48,
+			  0x2f, 0xea, 0xfd, 0x34, 0x66, 0x24, 0x48, 0x9b,
+			  0x3a, 0x2e, 0x4a, 0x6c, 0x4e, 0x1c, 0x3e, 0x29 },
+			{ 0xcf, 0xfe, 0xda, 0xf4, 0x46, 0x2f, 0x1f, 0xbd,
+			  0xf7, 0xd6, 0x7f, 0xa4, 0x14, 0x01, 0xef, 0x7c,
+			  0x7f, 0xb3, 0x47, 0x4a, 0xda, 0xfd, 0x1f, 0xd3,
+			  0x85, 0x57, 0x90, 0x73, 0xa4, 0x19, 0x52, 0x52 },
+			{ 0xe1, 0x12, 0x51, 0x92, 0x4b, 0x13, 0x6e, 0x37,
+			  0xa0, 0x5d, 0xa1, 0xdc, 0xb5, 0x78, 0x37, 0x70,
+			  0x11, 0x31, 0x1c, 0x46, 0xaf, 0x89, 0x45, 0xb0,
+			  0x23, 0x28, 0x03, 0x7f, 0x44, 0x5c, 0x60, 0x5b },
+		},
+		{
+			{ 0x4c, 0xf0, 0xe7, 0xf0, 0xc6, 0xfe, 0xe9, 0x3b,
+			  0x62, 0x49, 0xe3, 0x75, 0x9e, 0x57, 0x6a, 0x86,
+			  0x1a, 0xe6, 0x1d, 0x1e, 0x16, 0xef, 0x42, 0x55,
+			  0xd5, 0xbd, 0x5a, 0xcc, 0xf4, 0xfe, 0x12, 0x2f },
+			{ 0x89, 0x7c, 0xc4, 0x20, 0x59, 0x80, 0x65, 0xb9,
+			  0xcc, 0x8f, 0x3b, 0x92, 0x0c, 0x10, 0xf0, 0xe7,
+			  0x77, 0xef, 0xe2, 0x02, 0x65, 0x25, 0x01, 0x00,
+			  0xee, 0xb3, 0xae, 0xa8, 0xce, 0x6d, 0xa7, 0x24 },
+			{ 0x40, 0xc7, 0xc0, 0xdf, 0xb2, 0x22, 0x45, 0x0a,
+			  0x07, 0xa4, 0xc9, 0x40, 0x7f, 0x6e, 0xd0, 0x10,
+			  0x68, 0xf6, 0xcf, 0x78, 0x41, 0x14, 0xcf, 0xc6,
+			  0x90, 0x37, 0xa4, 0x18, 0x25, 0x7b, 0x60, 0x5e },
+		},
+		{
+			{ 0x14, 0xcf, 0x96, 0xa5, 0x1c, 0x43, 0x2c, 0xa0,
+			  0x00, 0xe4, 0xd3, 0xae, 0x40, 0x2d, 0xc4, 0xe3,
+			  0xdb, 0x26, 0x0f, 0x2e, 0x80, 0x26, 0x45, 0xd2,
+			  0x68, 0x70, 0x45, 0x9e, 0x13, 0x33, 0x1f, 0x20 },
+			{ 0x18, 0x18, 0xdf, 0x6c, 0x8f, 0x1d, 0xb3, 0x58,
+			  0xa2, 0x58, 0x62, 0xc3, 0x4f, 0xa7, 0xcf, 0x35,
+			  0x6e, 0x1d, 0xe6, 0x66, 0x4f, 0xff, 0xb3, 0xe1,
+			  0xf7, 0xd5, 0xcd, 0x6c, 0xab, 0xac, 0x67, 0x50 },
+			{ 0x51, 0x9d, 0x03, 0x08, 0x6b, 0x7f, 0x52, 0xfd,
+			  0x06, 0x00, 0x7c, 0x01, 0x64, 0x49, 0xb1, 0x18,
+			  0xa8, 0xa4, 0x25, 0x2e, 0xb0, 0x0e, 0x22, 0xd5,
+			  0x75, 0x03, 0x46, 0x62, 0x88, 0xba, 0x7c, 0x39 },
+		},
+		{
+			{ 0xe7, 0x79, 0x13, 0xc8, 0xfb, 0xc3, 0x15, 0x78,
+			  0xf1, 0x2a, 0xe1, 0xdd, 0x20, 0x94, 0x61, 0xa6,
+			  0xd5, 0xfd, 0xa8, 0x85, 0xf8, 0xc0, 0xa9, 0xff,
+			  0x52, 0xc2, 0xe1, 0xc1, 0x22, 0x40, 0x1b, 0x77 },
+			{ 0xb2, 0x59, 0x59, 0xf0, 0x93, 0x30, 0xc1, 0x30,
+			  0x76, 0x79, 0xa9, 0xe9, 0x8d, 0xa1, 0x3a, 0xe2,
+			  0x26, 0x5e, 0x1d, 0x72, 0x91, 0xd4, 0x2f, 0x22,
+			  0x3a, 0x6c, 0x6e, 0x76, 0x20, 0xd3, 0x39, 0x23 },
+			{ 0xa7, 0x2f, 0x3a, 0x51, 0x86, 0xd9, 0x7d, 0xd8,
+			  0x08, 0xcf, 0xd4, 0xf9, 0x71, 0x9b, 0xac, 0xf5,
+			  0xb3, 0x83, 0xa2, 0x1e, 0x1b, 0xc3, 0x6b, 0xd0,
+			  0x76, 0x1a, 0x97, 0x19, 0x92, 0x18, 0x1a, 0x33 },
+		},
+		{
+			{ 0xaf, 0x72, 0x75, 0x9d, 0x3a, 0x2f, 0x51, 0x26,
+			  0x9e, 0x4a, 0x07, 0x68, 0x88, 0xe2, 0xcb, 0x5b,
+			  0xc4, 0xf7, 0x80, 0x11, 0xc1, 0xc1, 0xed, 0x84,
+			  0x7b, 0xa6, 0x49, 0xf6, 0x9f, 0x61, 0xc9, 0x1a },
+			{ 0xc6, 0x80, 0x4f, 0xfb, 0x45, 0x6f, 0x16, 0xf5,
+			  0xcf, 0x75, 0xc7, 0x61, 0xde, 0xc7, 0x36, 0x9c,
+			  0x1c, 0xd9, 0x41, 0x90, 0x1b, 0xe8, 0xd4, 0xe3,
+			  0x21, 0xfe, 0xbd, 0x83, 0x6b, 0x7c, 0x16, 0x31 },
+			{ 0x68, 0x10, 0x4b, 0x52, 0x42, 0x38, 0x2b, 0xf2,
+			  0x87, 0xe9, 0x9c, 0xee, 0x3b, 0x34, 0x68, 0x50,
+			  0xc8, 0x50, 0x62, 0x4a, 0x84, 0x71, 0x9d, 0xfc,
+			  0x11, 0xb1, 0x08, 0x1f, 0x34, 0x36, 0x24, 0x61 },
+		},
+		{
+			{ 0x38, 0x26, 0x2d, 0x1a, 0xe3, 0x49, 0x63, 0x8b,
+			  0x35, 0xfd, 0xd3, 0x9b, 0x00, 0xb7, 0xdf, 0x9d,
+			  0xa4, 0x6b, 0xa0, 0xa3, 0xb8, 0xf1, 0x8b, 0x7f,
+			  0x45, 0x04, 0xd9, 0x78, 0x31, 0xaa, 0x22, 0x15 },
+			{ 0x8d, 0x89, 0x4e, 0x87, 0xdb, 0x41, 0x9d, 0xd9,
+			  0x20, 0xdc, 0x07, 0x6c, 0xf1, 0xa5, 0xfe, 0x09,
+			  0xbc, 0x9b, 0x0f, 0xd0, 0x67, 0x2c, 0x3d, 0x79,
+			  0x40, 0xff, 0x5e, 0x9e, 0x30, 0xe2, 0xeb, 0x46 },
+			{ 0x38, 0x49, 0x61, 0x69, 0x53, 0x2f, 0x38, 0x2c,
+			  0x10, 0x6d, 0x2d, 0xb7, 0x9a, 0x40, 0xfe, 0xda,
+			  0x27, 0xf2, 0x46, 0xb6, 0x91, 0x33, 0xc8, 0xe8,
+			  0x6c, 0x30, 0x24, 0x05, 0xf5, 0x70, 0xfe, 0x45 },
+		},
+		{
+			{ 0x91, 0x14, 0x95, 0xc8, 0x20, 0x49, 0xf2, 0x62,
+			  0xa2, 0x0c, 0x63, 0x3f, 0xc8, 0x07, 0xf0, 0x05,
+			  0xb8, 0xd4, 0xc9, 0xf5, 0xd2, 0x45, 0xbb, 0x6f,
+			  0x45, 0x22, 0x7a, 0xb5, 0x6d, 0x9f, 0x61, 0x16 },
+			{ 0x8c, 0x0b, 0x0c, 0x96, 0xa6, 0x75, 0x48, 0xda,
+			  0x20, 0x2f, 0x0e, 0xef, 0x76, 0xd0, 0x68, 0x5b,
+			  0xd4, 0x8f, 0x0b, 0x3d, 0xcf, 0x51, 0xfb, 0x07,
+			  0xd4, 0x92, 0xe3, 0xa0, 0x23, 0x16, 0x8d, 0x42 },
+			{ 0xfd, 0x08, 0xa3, 0x01, 0x44, 0x4a, 0x4f, 0x08,
+			  0xac, 0xca, 0xa5, 0x76, 0xc3, 0x19, 0x22, 0xa8,
+			  0x7d, 0xbc, 0xd1, 0x43, 0x46, 0xde, 0xb8, 0xde,
+			  0xc6, 0x38, 0xbd, 0x60, 0x2d, 0x59, 0x81, 0x1d },
+		},
+	},
+	{
+		{
+			{ 0xe8, 0xc5, 0x85, 0x7b, 0x9f, 0xb6, 0x65, 0x87,
+			  0xb2, 0xba, 0x68, 0xd1, 0x8b, 0x67, 0xf0, 0x6f,
+			  0x9b, 0x0f, 0x33, 0x1d, 0x7c, 0xe7, 0x70, 0x3a,
+			  0x7c, 0x8e, 0xaf, 0xb0, 0x51, 0x6d, 0x5f, 0x3a },
+			{ 0x5f, 0xac, 0x0d, 0xa6, 0x56, 0x87, 0x36, 0x61,
+			  0x57, 0xdc, 0xab, 0xeb, 0x6a, 0x2f, 0xe0, 0x17,
+			  0x7d, 0x0f, 0xce, 0x4c, 0x2d, 0x3f, 0x19, 0x7f,
+			  0xf0, 0xdc, 0xec, 0x89, 0x77, 0x4a, 0x23, 0x20 },
+			{ 0x52, 0xb2, 0x78, 0x71, 0xb6, 0x0d, 0xd2, 0x76,
+			  0x60, 0xd1, 0x1e, 0xd5, 0xf9, 0x34, 0x1c, 0x07,
+			  0x70, 0x11, 0xe4, 0xb3, 0x20, 0x4a, 0x2a, 0xf6,
+			  0x66, 0xe3, 0xff, 0x3c, 0x35, 0x82, 0xd6, 0x7c },
+		},
+		{
+			{ 0xf3, 0xf4, 0xac, 0x68, 0x60, 0xcd, 0x65, 0xa6,
+			  0xd3, 0xe3, 0xd7, 0x3c, 0x18, 0x2d, 0xd9, 0x42,
+			  0xd9, 0x25, 0x60, 0x33, 0x9d, 0x38, 0x59, 0x57,
+			  0xff, 0xd8, 0x2c, 0x2b, 0x3b, 0x25, 0xf0, 0x3e },
+			{ 0xb6, 0xfa, 0x87, 0xd8, 0x5b, 0xa4, 0xe1, 0x0b,
+			  0x6e, 0x3b, 0x40, 0xba, 0x32, 0x6a, 0x84, 0x2a,
+			  0x00, 0x60, 0x6e, 0xe9, 0x12, 0x10, 0x92, 0xd9,
+			  0x43, 0x09, 0xdc, 0x3b, 0x86, 0xc8, 0x38, 0x28 },
+			{ 0x30, 0x50, 0x46, 0x4a, 0xcf, 0xb0, 0x6b, 0xd1,
+			  0xab, 0x77, 0xc5, 0x15, 0x41, 0x6b, 0x49, 0xfa,
+			  0x9d, 0x41, 0xab, 0xf4, 0x8a, 0xae, 0xcf, 0x82,
+			  0x12, 0x28, 0xa8, 0x06, 0xa6, 0xb8, 0xdc, 0x21 },
+		},
+		{
+			{ 0xba, 0x31, 0x77, 0xbe, 0xfa, 0x00, 0x8d, 0x9a,
+			  0x89, 0x18, 0x9e, 0x62, 0x7e, 0x60, 0x03, 0x82,
+			  0x7f, 0xd9, 0xf3, 0x43, 0x37, 0x02, 0xcc, 0xb2,
+			  0x8b, 0x67, 0x6f, 0x6c, 0xbf, 0x0d, 0x84, 0x5d },
+			{ 0xc8, 0x9f, 0x9d, 0x8c, 0x46, 0x04, 0x60, 0x5c,
+			  0xcb, 0xa3, 0x2a, 0xd4, 0x6e, 0x09, 0x40, 0x25,
+			  0x9c, 0x2f, 0xee, 0x12, 0x4c, 0x4d, 0x5b, 0x12,
+			  0xab, 0x1d, 0xa3, 0x94, 0x81, 0xd0, 0xc3, 0x0b },
+			{ 0x8b, 0xe1, 0x9f, 0x30, 0x0d, 0x38, 0x6e, 0x70,
+			  0xc7, 0x65, 0xe1, 0xb9, 0xa6, 0x2d, 0xb0, 0x6e,
+			  0xab, 0x20, 0xae, 0x7d, 0x99, 0xba, 0xbb, 0x57,
+			  0xdd, 0x96, 0xc1, 0x2a, 0x23, 0x76, 0x42, 0x3a },
+		},
+		{
+			{ 0xcb, 0x7e, 0x44, 0xdb, 0x72, 0xc1, 0xf8, 0x3b,
+			  0xbd, 0x2d, 0x28, 0xc6, 0x1f, 0xc4, 0xcf, 0x5f,
+			  0xfe, 0x15, 0xaa, 0x75, 0xc0, 0xff, 0xac, 0x80,
+			  0xf9, 0xa9, 0xe1, 0x24, 0xe8, 0xc9, 0x70, 0x07 },
+			{ 0xfa, 0x84, 0x70, 0x8a, 0x2c, 0x43, 0x42, 0x4b,
+			  0x45, 0xe5, 0xb9, 0xdf, 0xe3, 0x19, 0x8a, 0x89,
+			  0x5d, 0xe4, 0x58, 0x9c, 0x21, 0x00, 0x9f, 0xbe,
+			  0xd1, 0xeb, 0x6d, 0xa1, 0xce, 0x77, 0xf1, 0x1f },
+			{ 0xfd, 0xb5, 0xb5, 0x45, 0x9a, 0xd9, 0x61, 0xcf,
+			  0x24, 0x79, 0x3a, 0x1b, 0xe9, 0x84, 0x09, 0x86,
+			  0x89, 0x3e, 0x3e, 0x30, 0x19, 0x09, 0x30, 0xe7,
+			  0x1e, 0x0b, 0x50, 0x41, 0xfd, 0x64, 0xf2, 0x39 },
+		},
+		{
+			{ 0xe1, 0x7b, 0x09, 0xfe, 0xab, 0x4a, 0x9b, 0xd1,
+			  0x29, 0x19, 0xe0, 0xdf, 0xe1, 0xfc, 0x6d, 0xa4,
+			  0xff, 0xf1, 0xa6, 0x2c, 0x94, 0x08, 0xc9, 0xc3,
+			  0x4e, 0xf1, 0x35, 0x2c, 0x27, 0x21, 0xc6, 0x65 },
+			{ 0x9c, 0xe2, 0xe7, 0xdb, 0x17, 0x34, 0xad, 0xa7,
+			  0x9c, 0x13, 0x9c, 0x2b, 0x6a, 0x37, 0x94, 0xbd,
+			  0xa9, 0x7b, 0x59, 0x93, 0x8e, 0x1b, 0xe9, 0xa0,
+			  0x40, 0x98, 0x88, 0x68, 0x34, 0xd7, 0x12, 0x17 },
+			{ 0xdd, 0x93, 0x31, 0xce, 0xf8, 0x89, 0x2b, 0xe7,
+			  0xbb, 0xc0, 0x25, 0xa1, 0x56, 0x33, 0x10, 0x4d,
+			  0x83, 0xfe, 0x1c, 0x2e, 0x3d, 0xa9, 0x19, 0x04,
+			  0x72, 0xe2, 0x9c, 0xb1, 0x0a, 0x80, 0xf9, 0x22 },
+		},
+		{
+			{ 0xac, 0xfd, 0x6e, 0x9a, 0xdd, 0x9f, 0x02, 0x42,
+			  0x41, 0x49, 0xa5, 0x34, 0xbe, 0xce, 0x12, 0xb9,
+			  0x7b, 0xf3, 0xbd, 0x87, 0xb9, 0x64, 0x0f, 0x64,
+			  0xb4, 0xca, 0x98, 0x85, 0xd3, 0xa4, 0x71, 0x41 },
+			{ 0xcb, 0xf8, 0x9e, 0x3e, 0x8a, 0x36, 0x5a, 0x60,
+			  0x15, 0x47, 0x50, 0xa5, 0x22, 0xc0, 0xe9, 0xe3,
+			  0x8f, 0x24, 0x24, 0x5f, 0xb0, 0x48, 0x3d, 0x55,
+			  0xe5, 0x26, 0x76, 0x64, 0xcd, 0x16, 0xf4, 0x13 },
+			{ 0x8c, 0x4c, 0xc9, 0x99, 0xaa, 0x58, 0x27, 0xfa,
+			  0x07, 0xb8, 0x00, 0xb0, 0x6f, 0x6f, 0x00, 0x23,
+			  0x92, 0x53, 0xda, 0xad, 0xdd, 0x91, 0xd2, 0xfb,
+			  0xab, 0xd1, 0x4b, 0x57, 0xfa, 0x14, 0x82, 0x50 },
+		},
+		{
+			{ 0xd6, 0x03, 0xd0, 0x53, 0xbb, 0x15, 0x1a, 0x46,
+			  0x65, 0xc9, 0xf3, 0xbc, 0x88, 0x28, 0x10, 0xb2,
+			  0x5a, 0x3a, 0x68, 0x6c, 0x75, 0x76, 0xc5, 0x27,
+			  0x47, 0xb4, 0x6c, 0xc8, 0xa4, 0x58, 0x77, 0x3a },
+			{ 0x4b, 0xfe, 0xd6, 0x3e, 0x15, 0x69, 0x02, 0xc2,
+			  0xc4, 0x77, 0x1d, 0x51, 0x39, 0x67, 0x5a, 0xa6,
+			  0x94, 0xaf, 0x14, 0x2c, 0x46, 0x26, 0xde, 0xcb,
+			  0x4b, 0xa7, 0xab, 0x6f, 0xec, 0x60, 0xf9, 0x22 },
+			{ 0x76, 0x50, 0xae, 0x93, 0xf6, 0x11, 0x81, 0x54,
+			  0xa6, 0x54, 0xfd, 0x1d, 0xdf, 0x21, 0xae, 0x1d,
+			  0x65, 0x5e, 0x11, 0xf3, 0x90, 0x8c, 0x24, 0x12,
+			  0x94, 0xf4, 0xe7, 0x8d, 0x5f, 0xd1, 0x9f, 0x5d },
+		},
+		{
+			{ 0x1e, 0x52, 0xd7, 0xee, 0x2a, 0x4d, 0x24, 0x3f,
+			  0x15, 0x96, 0x2e, 0x43, 0x28, 0x90, 0x3a, 0x8e,
+			  0xd4, 0x16, 0x9c, 0x2e, 0x77, 0xba, 0x64, 0xe1,
+			  0xd8, 0x98, 0xeb, 0x47, 0xfa, 0x87, 0xc1, 0x3b },
+			{ 0x7f, 0x72, 0x63, 0x6d, 0xd3, 0x08, 0x14, 0x03,
+			  0x33, 0xb5, 0xc7, 0xd7, 0xef, 0x9a, 0x37, 0x6a,
+			  0x4b, 0xe2, 0xae, 0xcc, 0xc5, 0x8f, 0xe1, 0xa9,
+			  0xd3, 0xbe, 0x8f, 0x4f, 0x91, 0x35, 0x2f, 0x33 },
+			{ 0x0c, 0xc2, 0x86, 0xea, 0x15, 0x01, 0x47, 0x6d,
+			  0x25, 0xd1, 0x46, 0x6c, 0xcb, 0xb7, 0x8a, 0x99,
+			  0x88, 0x01, 0x66, 0x3a, 0xb5, 0x32, 0x78, 0xd7,
+			  0x03, 0xba, 0x6f, 0x90, 0xce, 0x81, 0x0d, 0x45 },
+		},
+	},
+	{
+		{
+			{ 0x3f, 0x74, 0xae, 0x1c, 0x96, 0xd8, 0x74, 0xd0,
+			  0xed, 0x63, 0x1c, 0xee, 0xf5, 0x18, 0x6d, 0xf8,
+			  0x29, 0xed, 0xf4, 0xe7, 0x5b, 0xc5, 0xbd, 0x97,
+			  0x08, 0xb1, 0x3a, 0x66, 0x79, 0xd2, 0xba, 0x4c },
+			{ 0x75, 0x52, 0x20, 0xa6, 0xa1, 0xb6, 0x7b, 0x6e,
+			  0x83, 0x8e, 0x3c, 0x41, 0xd7, 0x21, 0x4f, 0xaa,
+			  0xb2, 0x5c, 0x8f, 0xe8, 0x55, 0xd1, 0x56, 0x6f,
+			  0xe1, 0x5b, 0x34, 0xa6, 0x4b, 0x5d, 0xe2, 0x2d },
+			{ 0xcd, 0x1f, 0xd7, 0xa0, 0x24, 0x90, 0xd1, 0x80,
+			  0xf8, 0x8a, 0x28, 0xfb, 0x0a, 0xc2, 0x25, 0xc5,
+			  0x19, 0x64, 0x3a, 0x5f, 0x4b, 0x97, 0xa3, 0xb1,
+			  0x33, 0x72, 0x00, 0xe2, 0xef, 0xbc, 0x7f, 0x7d },
+		},
+		{
+			{ 0x94, 0x90, 0xc2, 0xf3, 0xc5, 0x5d, 0x7c, 0xcd,
+			  0xab, 0x05, 0x91, 0x2a, 0x9a, 0xa2, 0x81, 0xc7,
+			  0x58, 0x30, 0x1c, 0x42, 0x36, 0x1d, 0xc6, 0x80,
+			  0xd7, 0xd4, 0xd8, 0xdc, 0x96, 0xd1, 0x9c, 0x4f },
+			{ 0x01, 0x28, 0x6b, 0x26, 0x6a, 0x1e, 0xef, 0xfa,
+			  0x16, 0x9f, 0x73, 0xd5, 0xc4, 0x68, 0x6c, 0x86,
+			  0x2c, 0x76, 0x03, 0x1b, 0xbc, 0x2f, 0x8a, 0xf6,
+			  0x8d, 0x5a, 0xb7, 0x87, 0x5e, 0x43, 0x75, 0x59 },
+			{ 0x68, 0x37, 0x7b, 0x6a, 0xd8, 0x97, 0x92, 0x19,
+			  0x63, 0x7a, 0xd1, 0x1a, 0x24, 0x58, 0xd0, 0xd0,
+			  0x17, 0x0c, 0x1c, 0x5c, 0xad, 0x9c, 0x02, 0xba,
+			  0x07, 0x03, 0x7a, 0x38, 0x84, 0xd0, 0xcd, 0x7c },
+		},
+		{
+			{ 0x93, 0xcc, 0x60, 0x67, 0x18, 0x84, 0x0c, 0x9b,
+			  0x99, 0x2a, 0xb3, 0x1a, 0x7a, 0x00, 0xae, 0xcd,
+			  0x18, 0xda, 0x0b, 0x62, 0x86, 0xec, 0x8d, 0xa8,
+			  0x44, 0xca, 0x90, 0x81, 0x84, 0xca, 0x93, 0x35 },
+			{ 0x17, 0x04, 0x26, 0x6d, 0x2c, 0x42, 0xa6, 0xdc,
+			  0xbd, 0x40, 0x82, 0x94, 0x50, 0x3d, 0x15, 0xae,
+			  0x77, 0xc6, 0x68, 0xfb, 0xb4, 0xc1, 0xc0, 0xa9,
+			  0x53, 0xcf, 0xd0, 0x61, 0xed, 0xd0, 0x8b, 0x42 },
+			{ 0xa7, 0x9a, 0x84, 0x5e, 0x9a, 0x18, 0x13, 0x92,
+			  0xcd, 0xfa, 0xd8, 0x65, 0x35, 0xc3, 0xd8, 0xd4,
+			  0xd1, 0xbb, 0xfd, 0x53, 0x5b, 0x54, 0x52, 0x8c,
+			  0xe6, 0x63, 0x2d, 0xda, 0x08, 0x83, 0x39, 0x27 },
+		},
+		{
+			{ 0x53, 0x24, 0x70, 0x0a, 0x4c, 0x0e, 0xa1, 0xb9,
+			  0xde, 0x1b, 0x7d, 0xd5, 0x66, 0x58, 0xa2, 0x0f,
+			  0xf7, 0xda, 0x27, 0xcd, 0xb5, 0xd9, 0xb9, 0xff,
+			  0xfd, 0x33, 0x2c, 0x49, 0x45, 0x29, 0x2c, 0x57 },
+			{ 0x13, 0xd4, 0x5e, 0x43, 0x28, 0x8d, 0xc3, 0x42,
+			  0xc9, 0xcc, 0x78, 0x32, 0x60, 0xf3, 0x50, 0xbd,
+			  0xef, 0x03, 0xda, 0x79, 0x1a, 0xab, 0x07, 0xbb,
+			  0x55, 0x33, 0x8c, 0xbe, 0xae, 0x97, 0x95, 0x26 },
+			{ 0xbe, 0x30, 0xcd, 0xd6, 0x45, 0xc7, 0x7f, 0xc7,
+			  0xfb, 0xae, 0xba, 0xe3, 0xd3, 0xe8, 0xdf, 0xe4,
+			  0x0c, 0xda, 0x5d, 0xaa, 0x30, 0x88, 0x2c, 0xa2,
+			  0x80, 0xca, 0x5b, 0xc0, 0x98, 0x54, 0x98, 0x7f },
+		},
+		{
+			{ 0x63, 0x63, 0xbf, 0x0f, 0x52, 0x15, 0x56, 0xd3,
+			  0xa6, 0xfb, 0x4d, 0xcf, 0x45, 0x5a, 0x04, 0x08,
+			  0xc2, 0xa0, 0x3f, 0x87, 0xbc, 0x4f, 0xc2, 0xee,
+			  0xe7, 0x12, 0x9b, 0xd6, 0x3c, 0x65, 0xf2, 0x30 },
+			{ 0x17, 0xe1, 0x0b, 0x9f, 0x88, 0xce, 0x49, 0x38,
+			  0x88, 0xa2, 0x54, 0x7b, 0x1b, 0xad, 0x05, 0x80,
+			  0x1c, 0x92, 0xfc, 0x23, 0x9f, 0xc3, 0xa3, 0x3d,
+			  0x04, 0xf3, 0x31, 0x0a, 0x47, 0xec, 0xc2, 0x76 },
+			{ 0x85, 0x0c, 0xc1, 0xaa, 0x38, 0xc9, 0x08, 0x8a,
+			  0xcb, 0x6b, 0x27, 0xdb, 0x60, 0x9b, 0x17, 0x46,
+			  0x70, 0xac, 0x6f, 0x0e, 0x1e, 0xc0, 0x20, 0xa9,
+			  0xda, 0x73, 0x64, 0x59, 0xf1, 0x73, 0x12, 0x2f },
+		},
+		{
+			{ 0xc0, 0x0b, 0xa7, 0x55, 0xd7, 0x8b, 0x48, 0x30,
+			  0xe7, 0x42, 0xd4, 0xf1, 0xa4, 0xb5, 0xd6, 0x06,
+			  0x62, 0x61, 0x59, 0xbc, 0x9e, 0xa6, 0xd1, 0xea,
+			  0x84, 0xf7, 0xc5, 0xed, 0x97, 0x19, 0xac, 0x38 },
+			{ 0x11, 0x1e, 0xe0, 0x8a, 0x7c, 0xfc, 0x39, 0x47,
+			  0x9f, 0xab, 0x6a, 0x4a, 0x90, 0x74, 0x52, 0xfd,
+			  0x2e, 0x8f, 0x72, 0x87, 0x82, 0x8a, 0xd9, 0x41,
+			  0xf2, 0x69, 0x5b, 0xd8, 0x2a, 0x57, 0x9e, 0x5d },
+			{ 0x3b, 0xb1, 0x51, 0xa7, 0x17, 0xb5, 0x66, 0x06,
+			  0x8c, 0x85, 0x9b, 0x7e, 0x86, 0x06, 0x7d, 0x74,
+			  0x49, 0xde, 0x4d, 0x45, 0x11, 0xc0, 0xac, 0xac,
+			  0x9c, 0xe6, 0xe9, 0xbf, 0x9c, 0xcd, 0xdf, 0x22 },
+		},
+		{
+			{ 0xa1, 0xe0, 0x3b, 0x10, 0xb4, 0x59, 0xec, 0x56,
+			  0x69, 0xf9, 0x59, 0xd2, 0xec, 0xba, 0xe3, 0x2e,
+			  0x32, 0xcd, 0xf5, 0x13, 0x94, 0xb2, 0x7c, 0x79,
+			  0x72, 0xe4, 0xcd, 0x24, 0x78, 0x87, 0xe9, 0x0f },
+			{ 0xd9, 0x0c, 0x0d, 0xc3, 0xe0, 0xd2, 0xdb, 0x8d,
+			  0x33, 0x43, 0xbb, 0xac, 0x5f, 0x66, 0x8e, 0xad,
+			  0x1f, 0x96, 0x2a, 0x32, 0x8c, 0x25, 0x6b, 0x8f,
+			  0xc7, 0xc1, 0x48, 0x54, 0xc0, 0x16, 0x29, 0x6b },
+			{ 0x3b, 0x91, 0xba, 0x0a, 0xd1, 0x34, 0xdb, 0x7e,
+			  0x0e, 0xac, 0x6d, 0x2e, 0x82, 0xcd, 0xa3, 0x4e,
+			  0x15, 0xf8, 0x78, 0x65, 0xff, 0x3d, 0x08, 0x66,
+			  0x17, 0x0a, 0xf0, 0x7f, 0x30, 0x3f, 0x30, 0x4c },
+		},
+		{
+			{ 0x00, 0x45, 0xd9, 0x0d, 0x58, 0x03, 0xfc, 0x29,
+			  0x93, 0xec, 0xbb, 0x6f, 0xa4, 0x7a, 0xd2, 0xec,
+			  0xf8, 0xa7, 0xe2, 0xc2, 0x5f, 0x15, 0x0a, 0x13,
+			  0xd5, 0xa1, 0x06, 0xb7, 0x1a, 0x15, 0x6b, 0x41 },
+			{ 0x85, 0x8c, 0xb2, 0x17, 0xd6, 0x3b, 0x0a, 0xd3,
+			  0xea, 0x3b, 0x77, 0x39, 0xb7, 0x77, 0xd3, 0xc5,
+			  0xbf, 0x5c, 0x6a, 0x1e, 0x8c, 0xe7, 0xc6, 0xc6,
+			  0xc4, 0xb7, 0x2a, 0x8b, 0xf7, 0xb8, 0x61, 0x0d },
+			{ 0xb0, 0x36, 0xc1, 0xe9, 0xef, 0xd7, 0xa8, 0x56,
+			  0x20, 0x4b, 0xe4, 0x58, 0xcd, 0xe5, 0x07, 0xbd,
+			  0xab, 0xe0, 0x57, 0x1b, 0xda, 0x2f, 0xe6, 0xaf,
+			  0xd2, 0xe8, 0x77, 0x42, 0xf7, 0x2a, 0x1a, 0x19 },
+		},
+	},
+	{
+		{
+			{ 0xfb, 0x0e, 0x46, 0x4f, 0x43, 0x2b, 0xe6, 0x9f,
+			  0xd6, 0x07, 0x36, 0xa6, 0xd4, 0x03, 0xd3, 0xde,
+			  0x24, 0xda, 0xa0, 0xb7, 0x0e, 0x21, 0x52, 0xf0,
+			  0x93, 0x5b, 0x54, 0x00, 0xbe, 0x7d, 0x7e, 0x23 },
+			{ 0x31, 0x14, 0x3c, 0xc5, 0x4b, 0xf7, 0x16, 0xce,
+			  0xde, 0xed, 0x72, 0x20, 0xce, 0x25, 0x97, 0x2b,
+			  0xe7, 0x3e, 0xb2, 0xb5, 0x6f, 0xc3, 0xb9, 0xb8,
+			  0x08, 0xc9, 0x5c, 0x0b, 0x45, 0x0e, 0x2e, 0x7e },
+			{ 0x30, 0xb4, 0x01, 0x67, 0xed, 0x75, 0x35, 0x01,
+			  0x10, 0xfd, 0x0b, 0x9f, 0xe6, 0x94, 0x10, 0x23,
+			  0x22, 0x7f, 0xe4, 0x83, 0x15, 0x0f, 0x32, 0x75,
+			  0xe3, 0x55, 0x11, 0xb1, 0x99, 0xa6, 0xaf, 0x71 },
+		},
+		{
+			{ 0xd6, 0x50, 0x3b, 0x47, 0x1c, 0x3c, 0x42, 0xea,
+			  0x10, 0xef, 0x38, 0x3b, 0x1f, 0x7a, 0xe8, 0x51,
+			  0x95, 0xbe, 0xc9, 0xb2, 0x5f, 0xbf, 0x84, 0x9b,
+			  0x1c, 0x9a, 0xf8, 0x78, 0xbc, 0x1f, 0x73, 0x00 },
+			{ 0x1d, 0xb6, 0x53, 0x39, 0x9b, 0x6f, 0xce, 0x65,
+			  0xe6, 0x41, 0xa1, 0xaf, 0xea, 0x39, 0x58, 0xc6,
+			  0xfe, 0x59, 0xf7, 0xa9, 0xfd, 0x5f, 0x43, 0x0f,
+			  0x8e, 0xc2, 0xb1, 0xc2, 0xe9, 0x42, 0x11, 0x02 },
+			{ 0x80, 0x18, 0xf8, 0x48, 0x18, 0xc7, 0x30, 0xe4,
+			  0x19, 0xc1, 0xce, 0x5e, 0x22, 0x0c, 0x96, 0xbf,
+			  0xe3, 0x15, 0xba, 0x6b, 0x83, 0xe0, 0xda, 0xb6,
+			  0x08, 0x58, 0xe1, 0x47, 0x33, 0x6f, 0x4d, 0x4c },
+		},
+		{
+			{ 0x70, 0x19, 0x8f, 0x98, 0xfc, 0xdd, 0x0c, 0x2f,
+			  0x1b, 0xf5, 0xb9, 0xb0, 0x27, 0x62, 0x91, 0x6b,
+			  0xbe, 0x76, 0x91, 0x77, 0xc4, 0xb6, 0xc7, 0x6e,
+			  0xa8, 0x9f, 0x8f, 0xa8, 0x00, 0x95, 0xbf, 0x38 },
+			{ 0xc9, 0x1f, 0x7d, 0xc1, 0xcf, 0xec, 0xf7, 0x18,
+			  0x14, 0x3c, 0x40, 0x51, 0xa6, 0xf5, 0x75, 0x6c,
+			  0xdf, 0x0c, 0xee, 0xf7, 0x2b, 0x71, 0xde, 0xdb,
+			  0x22, 0x7a, 0xe4, 0xa7, 0xaa, 0xdd, 0x3f, 0x19 },
+			{ 0x6f, 0x87, 0xe8, 0x37, 0x3c, 0xc9, 0xd2, 0x1f,
+			  0x2c, 0x46, 0xd1, 0x18, 0x5a, 0x1e, 0xf6, 0xa2,
+			  0x76, 0x12, 0x24, 0x39, 0x82, 0xf5, 0x80, 0x50,
+			  0x69, 0x49, 0x0d, 0xbf, 0x9e, 0xb9, 0x6f, 0x6a },
+		},
+		{
+			{ 0xc6, 0x23, 0xe4, 0xb6, 0xb5, 0x22, 0xb1, 0xee,
+			  0x8e, 0xff, 0x86, 0xf2, 0x10, 0x70, 0x9d, 0x93,
+			  0x8c, 0x5d, 0xcf, 0x1d, 0x83, 0x2a, 0xa9, 0x90,
+			  0x10, 0xeb, 0xc5, 0x42, 0x9f, 0xda, 0x6f, 0x13 },
+			{ 0xeb, 0x55, 0x08, 0x56, 0xbb, 0xc1, 0x46, 0x6a,
+			  0x9d, 0xf0, 0x93, 0xf8, 0x38, 0xbb, 0x16, 0x24,
+			  0xc1, 0xac, 0x71, 0x8f, 0x37, 0x11, 0x1d, 0xd7,
+			  0xea, 0x96, 0x18, 0xa3, 0x14, 0x69, 0xf7, 0x75 },
+			{ 0xd1, 0xbd, 0x05, 0xa3, 0xb1, 0xdf, 0x4c, 0xf9,
+			  0x08, 0x2c, 0xf8, 0x9f, 0x9d, 0x4b, 0x36, 0x0f,
+			  0x8a, 0x58, 0xbb, 0xc3, 0xa5, 0xd8, 0x87, 0x2a,
+			  0xba, 0xdc, 0xe8, 0x0b, 0x51, 0x83, 0x21, 0x02 },
+		},
+		{
+			{ 0x7f, 0x7a, 0x30, 0x43, 0x01, 0x71, 0x5a, 0x9d,
+			  0x5f, 0xa4, 0x7d, 0xc4, 0x9e, 0xde, 0x63, 0xb0,
+			  0xd3, 0x7a, 0x92, 0xbe, 0x52, 0xfe, 0xbb, 0x22,
+			  0x6c, 0x42, 0x40, 0xfd, 0x41, 0xc4, 0x87, 0x13 },
+			{ 0x14, 0x2d, 0xad, 0x5e, 0x38, 0x66, 0xf7, 0x4a,
+			  0x30, 0x58, 0x7c, 0xca, 0x80, 0xd8, 0x8e, 0xa0,
+			  0x3d, 0x1e, 0x21, 0x10, 0xe6, 0xa6, 0x13, 0x0d,
+			  0x03, 0x6c, 0x80, 0x7b, 0xe1, 0x1c, 0x07, 0x6a },
+			{ 0xf8, 0x8a, 0x97, 0x87, 0xd1, 0xc3, 0xd3, 0xb5,
+			  0x13, 0x44, 0x0e, 0x7f, 0x3d, 0x5a, 0x2b, 0x72,
+			  0xa0, 0x7c, 0x47, 0xbb, 0x48, 0x48, 0x7b, 0x0d,
+			  0x92, 0xdc, 0x1e, 0xaf, 0x6a, 0xb2, 0x71, 0x31 },
+		},
+		{
+			{ 0xd1, 0x47, 0x8a, 0xb2, 0xd8, 0xb7, 0x0d, 0xa6,
+			  0xf1, 0xa4, 0x70, 0x17, 0xd6, 0x14, 0xbf, 0xa6,
+			  0x58, 0xbd, 0xdd, 0x53, 0x93, 0xf8, 0xa1, 0xd4,
+			  0xe9, 0x43, 0x42, 0x34, 0x63, 0x4a, 0x51, 0x6c },
+			{ 0xa8, 0x4c, 0x56, 0x97, 0x90, 0x31, 0x2f, 0xa9,
+			  0x19, 0xe1, 0x75, 0x22, 0x4c, 0xb8, 0x7b, 0xff,
+			  0x50, 0x51, 0x87, 0xa4, 0x37, 0xfe, 0x55, 0x4f,
+			  0x5a, 0x83, 0xf0, 0x3c, 0x87, 0xd4, 0x1f, 0x22 },
+			{ 0x41, 0x63, 0x15, 0x3a, 0x4f, 0x20, 0x22, 0x23,
+			  0x2d, 0x03, 0x0a, 0xba, 0xe9, 0xe0, 0x73, 0xfb,
+			  0x0e, 0x03, 0x0f, 0x41, 0x4c, 0xdd, 0xe0, 0xfc,
+			  0xaa, 0x4a, 0x92, 0xfb, 0x96, 0xa5, 0xda, 0x48 },
+		},
+		{
+			{ 0x93, 0x97, 0x4c, 0xc8, 0x5d, 0x1d, 0xf6, 0x14,
+			  0x06, 0x82, 0x41, 0xef, 0xe3, 0xf9, 0x41, 0x99,
+			  0xac, 0x77, 0x62, 0x34, 0x8f, 0xb8, 0xf5, 0xcd,
+			  0xa9, 0x79, 0x8a, 0x0e, 0xfa, 0x37, 0xc8, 0x58 },
+			{ 0xc7, 0x9c, 0xa5, 0x5c, 0x66, 0x8e, 0xca, 0x6e,
+			  0xa0, 0xac, 0x38, 0x2e, 0x4b, 0x25, 0x47, 0xa8,
+			  0xce, 0x17, 0x1e, 0xd2, 0x08, 0xc7, 0xaf, 0x31,
+			  0xf7, 0x4a, 0xd8, 0xca, 0xfc, 0xd6, 0x6d, 0x67 },
+			{ 0x58, 0x90, 0xfc, 0x96, 0x85, 0x68, 0xf9, 0x0c,
+			  0x1b, 0xa0, 0x56, 0x7b, 0xf3, 0xbb, 0xdc, 0x1d,
+			  0x6a, 0xd6, 0x35, 0x49, 0x7d, 0xe7, 0xc2, 0xdc,
+			  0x0a, 0x7f, 0xa5, 0xc6, 0xf2, 0x73, 0x4f, 0x1c },
+		},
+		{
+			{ 0x84, 0x34, 0x7c, 0xfc, 0x6e, 0x70, 0x6e, 0xb3,
+			  0x61, 0xcf, 0xc1, 0xc3, 0xb4, 0xc9, 0xdf, 0x73,
+			  0xe5, 0xc7, 0x1c, 0x78, 0xc9, 0x79, 0x1d, 0xeb,
+			  0x5c, 0x67, 0xaf, 0x7d, 0xdb, 0x9a, 0x45, 0x70 },
+			{ 0xbb, 0xa0, 0x5f, 0x30, 0xbd, 0x4f, 0x7a, 0x0e,
+			  0xad, 0x63, 0xc6, 0x54, 0xe0, 0x4c, 0x9d, 0x82,
+			  0x48, 0x38, 0xe3, 0x2f, 0x83, 0xc3, 0x21, 0xf4,
+			  0x42, 0x4c, 0xf6, 0x1b, 0x0d, 0xc8, 0x5a, 0x79 },
+			{ 0xb3, 0x2b, 0xb4, 0x91, 0x49, 0xdb, 0x91, 0x1b,
+			  0xca, 0xdc, 0x02, 0x4b, 0x23, 0x96, 0x26, 0x57,
+			  0xdc, 0x78, 0x8c, 0x1f, 0xe5, 0x9e, 0xdf, 0x9f,
+			  0xd3, 0x1f, 0xe2, 0x8c, 0x84, 0x62, 0xe1, 0x5f },
+		},
+	},
+	{
+		{
+			{ 0x08, 0xb2, 0x7c, 0x5d, 0x2d, 0x85, 0x79, 0x28,
+			  0xe7, 0xf2, 0x7d, 0x68, 0x70, 0xdd, 0xde, 0xb8,
+			  0x91, 0x78, 0x68, 0x21, 0xab, 0xff, 0x0b, 0xdc,
+			  0x35, 0xaa, 0x7d, 0x67, 0x43, 0xc0, 0x44, 0x2b },
+			{ 0x1a, 0x96, 0x94, 0xe1, 0x4f, 0x21, 0x59, 0x4e,
+			  0x4f, 0xcd, 0x71, 0x0d, 0xc7, 0x7d, 0xbe, 0x49,
+			  0x2d, 0xf2, 0x50, 0x3b, 0xd2, 0xcf, 0x00, 0x93,
+			  0x32, 0x72, 0x91, 0xfc, 0x46, 0xd4, 0x89, 0x47 },
+			{ 0x8e, 0xb7, 0x4e, 0x07, 0xab, 0x87, 0x1c, 0x1a,
+			  0x67, 0xf4, 0xda, 0x99, 0x8e, 0xd1, 0xc6, 0xfa,
+			  0x67, 0x90, 0x4f, 0x48, 0xcd, 0xbb, 0xac, 0x3e,
+			  0xe4, 0xa4, 0xb9, 0x2b, 0xef, 0x2e, 0xc5, 0x60 },
+		},
+		{
+			{ 0x11, 0x6d, 0xae, 0x7c, 0xc2, 0xc5, 0x2b, 0x70,
+			  0xab, 0x8c, 0xa4, 0x54, 0x9b, 0x69, 0xc7, 0x44,
+			  0xb2, 0x2e, 0x49, 0xba, 0x56, 0x40, 0xbc, 0xef,
+			  0x6d, 0x67, 0xb6, 0xd9, 0x48, 0x72, 0xd7, 0x70 },
+			{ 0xf1, 0x8b, 0xfd, 0x3b, 0xbc, 0x89, 0x5d, 0x0b,
+			  0x1a, 0x55, 0xf3, 0xc9, 0x37, 0x92, 0x6b, 0xb0,
+			  0xf5, 0x28, 0x30, 0xd5, 0xb0, 0x16, 0x4c, 0x0e,
+			  0xab, 0xca, 0xcf, 0x2c, 0x31, 0x9c, 0xbc, 0x10 },
+			{ 0x5b, 0xa0, 0xc2, 0x3e, 0x4b, 0xe8, 0x8a, 0xaa,
+			  0xe0, 0x81, 0x17, 0xed, 0xf4, 0x9e, 0x69, 0x98,
+			  0xd1, 0x85, 0x8e, 0x70, 0xe4, 0x13, 0x45, 0x79,
+			  0x13, 0xf4, 0x76, 0xa9, 0xd3, 0x5b, 0x75, 0x63 },
+		},
+		{
+			{ 0xb7, 0xac, 0xf1, 0x97, 0x18, 0x10, 0xc7, 0x3d,
+			  0xd8, 0xbb, 0x65, 0xc1, 0x5e, 0x7d, 0xda, 0x5d,
+			  0x0f, 0x02, 0xa1, 0x0f, 0x9c, 0x5b, 0x8e, 0x50,
+			  0x56, 0x2a, 0xc5, 0x37, 0x17, 0x75, 0x63, 0x27 },
+			{ 0x53, 0x08, 0xd1, 0x2a, 0x3e, 0xa0, 0x5f, 0xb5,
+			  0x69, 0x35, 0xe6, 0x9e, 0x90, 0x75, 0x6f, 0x35,
+			  0x90, 0xb8, 0x69, 0xbe, 0xfd, 0xf1, 0xf9, 0x9f,
+			  0x84, 0x6f, 0xc1, 0x8b, 0xc4, 0xc1, 0x8c, 0x0d },
+			{ 0xa9, 0x19, 0xb4, 0x6e, 0xd3, 0x02, 0x94, 0x02,
+			  0xa5, 0x60, 0xb4, 0x77, 0x7e, 0x4e, 0xb4, 0xf0,
+			  0x56, 0x49, 0x3c, 0xd4, 0x30, 0x62, 0xa8, 0xcf,
+			  0xe7, 0x66, 0xd1, 0x7a, 0x8a, 0xdd, 0xc2, 0x70 },
+		},
+		{
+			{ 0x13, 0x7e, 0xed, 0xb8, 0x7d, 0x96, 0xd4, 0x91,
+			  0x7a, 0x81, 0x76, 0xd7, 0x0a, 0x2f, 0x25, 0x74,
+			  0x64, 0x25, 0x85, 0x0d, 0xe0, 0x82, 0x09, 0xe4,
+			  0xe5, 0x3c, 0xa5, 0x16, 0x38, 0x61, 0xb8, 0x32 },
+			{ 0x0e, 0xec, 0x6f, 0x9f, 0x50, 0x94, 0x61, 0x65,
+			  0x8d, 0x51, 0xc6, 0x46, 0xa9, 0x7e, 0x2e, 0xee,
+			  0x5c, 0x9b, 0xe0, 0x67, 0xf3, 0xc1, 0x33, 0x97,
+			  0x95, 0x84, 0x94, 0x63, 0x63, 0xac, 0x0f, 0x2e },
+			{ 0x64, 0xcd, 0x48, 0xe4, 0xbe, 0xf7, 0xe7, 0x79,
+			  0xd0, 0x86, 0x78, 0x08, 0x67, 0x3a, 0xc8, 0x6a,
+			  0x2e, 0xdb, 0xe4, 0xa0, 0xd9, 0xd4, 0x9f, 0xf8,
+			  0x41, 0x4f, 0x5a, 0x73, 0x5c, 0x21, 0x79, 0x41 },
+		},
+		{
+			{ 0x34, 0xcd, 0x6b, 0x28, 0xb9, 0x33, 0xae, 0xe4,
+			  0xdc, 0xd6, 0x9d, 0x55, 0xb6, 0x7e, 0xef, 0xb7,
+			  0x1f, 0x8e, 0xd3, 0xb3, 0x1f, 0x14, 0x8b, 0x27,
+			  0x86, 0xc2, 0x41, 0x22, 0x66, 0x85, 0xfa, 0x31 },
+			{ 0x2a, 0xed, 0xdc, 0xd7, 0xe7, 0x94, 0x70, 0x8c,
+			  0x70, 0x9c, 0xd3, 0x47, 0xc3, 0x8a, 0xfb, 0x97,
+			  0x02, 0xd9, 0x06, 0xa9, 0x33, 0xe0, 0x3b, 0xe1,
+			  0x76, 0x9d, 0xd9, 0x0c, 0xa3, 0x44, 0x03, 0x70 },
+			{ 0xf4, 0x22, 0x36, 0x2e, 0x42, 0x6c, 0x82, 0xaf,
+			  0x2d, 0x50, 0x33, 0x98, 0x87, 0x29, 0x20, 0xc1,
+			  0x23, 0x91, 0x38, 0x2b, 0xe1, 0xb7, 0xc1, 0x9b,
+			  0x89, 0x24, 0x95, 0xa9, 0x12, 0x23, 0xbb, 0x24 },
+		},
+		{
+			{ 0x6b, 0x5c, 0xf8, 0xf5, 0x2a, 0x0c, 0xf8, 0x41,
+			  0x94, 0x67, 0xfa, 0x04, 0xc3, 0x84, 0x72, 0x68,
+			  0xad, 0x1b, 0xba, 0xa3, 0x99, 0xdf, 0x45, 0x89,
+			  0x16, 0x5d, 0xeb, 0xff, 0xf9, 0x2a, 0x1d, 0x0d },
+			{ 0xc3, 0x67, 0xde, 0x32, 0x17, 0xed, 0xa8, 0xb1,
+			  0x48, 0x49, 0x1b, 0x46, 0x18, 0x94, 0xb4, 0x3c,
+			  0xd2, 0xbc, 0xcf, 0x76, 0x43, 0x43, 0xbd, 0x8e,
+			  0x08, 0x80, 0x18, 0x1e, 0x87, 0x3e, 0xee, 0x0f },
+			{ 0xdf, 0x1e, 0x62, 0x32, 0xa1, 0x8a, 0xda, 0xa9,
+			  0x79, 0x65, 0x22, 0x59, 0xa1, 0x22, 0xb8, 0x30,
+			  0x93, 0xc1, 0x9a, 0xa7, 0x7b, 0x19, 0x04, 0x40,
+			  0x76, 0x1d, 0x53, 0x18, 0x97, 0xd7, 0xac, 0x16 },
+		},
+		{
+			{ 0xad, 0xb6, 0x87, 0x78, 0xc5, 0xc6, 0x59, 0xc9,
+			  0xba, 0xfe, 0x90, 0x5f, 0xad, 0x9e, 0xe1, 0x94,
+			  0x04, 0xf5, 0x42, 0xa3, 0x62, 0x4e, 0xe2, 0x16,
+			  0x00, 0x17, 0x16, 0x18, 0x4b, 0xd3, 0x4e, 0x16 },
+			{ 0x3d, 0x1d, 0x9b, 0x2d, 0xaf, 0x72, 0xdf, 0x72,
+			  0x5a, 0x24, 0x32, 0xa4, 0x36, 0x2a, 0x46, 0x63,
+			  0x37, 0x96, 0xb3, 0x16, 0x79, 0xa0, 0xce, 0x3e,
+			  0x09, 0x23, 0x30, 0xb9, 0xf6, 0x0e, 0x3e, 0x12 },
+			{ 0x9a, 0xe6, 0x2f, 0x19, 0x4c, 0xd9, 0x7e, 0x48,
+			  0x13, 0x15, 0x91, 0x3a, 0xea, 0x2c, 0xae, 0x61,
+			  0x27, 0xde, 0xa4, 0xb9, 0xd3, 0xf6, 0x7b, 0x87,
+			  0xeb, 0xf3, 0x73, 0x10, 0xc6, 0x0f, 0xda, 0x78 },
+		},
+		{
+			{ 0x94, 0x3a, 0x0c, 0x68, 0xf1, 0x80, 0x9f, 0xa2,
+			  0xe6, 0xe7, 0xe9, 0x1a, 0x15, 0x7e, 0xf7, 0x71,
+			  0x73, 0x79, 0x01, 0x48, 0x58, 0xf1, 0x00, 0x11,
+			  0xdd, 0x8d, 0xb3, 0x16, 0xb3, 0xa4, 0x4a, 0x05 },
+			{ 0x6a, 0xc6, 0x2b, 0xe5, 0x28, 0x5d, 0xf1, 0x5b,
+			  0x8e, 0x1a, 0xf0, 0x70, 0x18, 0xe3, 0x47, 0x2c,
+			  0xdd, 0x8b, 0xc2, 0x06, 0xbc, 0xaf, 0x19, 0x24,
+			  0x3a, 0x17, 0x6b, 0x25, 0xeb, 0xde, 0x25, 0x2d },
+			{ 0xb8, 0x7c, 0x26, 0x19, 0x8d, 0x46, 0xc8, 0xdf,
+			  0xaf, 0x4d, 0xe5, 0x66, 0x9c, 0x78, 0x28, 0x0b,
+			  0x17, 0xec, 0x6e, 0x66, 0x2a, 0x1d, 0xeb, 0x2a,
+			  0x60, 0xa7, 0x7d, 0xab, 0xa6, 0x10, 0x46, 0x13 },
+		},
+	},
+	{
+		{
+			{ 0x15, 0xf5, 0xd1, 0x77, 0xe7, 0x65, 0x2a, 0xcd,
+			  0xf1, 0x60, 0xaa, 0x8f, 0x87, 0x91, 0x89, 0x54,
+			  0xe5, 0x06, 0xbc, 0xda, 0xbc, 0x3b, 0xb7, 0xb1,
+			  0xfb, 0xc9, 0x7c, 0xa9, 0xcb, 0x78, 0x48, 0x65 },
+			{ 0xfe, 0xb0, 0xf6, 0x8d, 0xc7, 0x8e, 0x13, 0x51,
+			  0x1b, 0xf5, 0x75, 0xe5, 0x89, 0xda, 0x97, 0x53,
+			  0xb9, 0xf1, 0x7a, 0x71, 0x1d, 0x7a, 0x20, 0x09,
+			  0x50, 0xd6, 0x20, 0x2b, 0xba, 0xfd, 0x02, 0x21 },
+			{ 0xa1, 0xe6, 0x5c, 0x05, 0x05, 0xe4, 0x9e, 0x96,
+			  0x29, 0xad, 0x51, 0x12, 0x68, 0xa7, 0xbc, 0x36,
+			  0x15, 0xa4, 0x7d, 0xaa, 0x17, 0xf5, 0x1a, 0x3a,
+			  0xba, 0xb2, 0xec, 0x29, 0xdb, 0x25, 0xd7, 0x0a },
+		},
+		{
+			{ 0x85, 0x6f, 0x05, 0x9b, 0x0c, 0xbc, 0xc7, 0xfe,
+			  0xd7, 0xff, 0xf5, 0xe7, 0x68, 0x52, 0x7d, 0x53,
+			  0xfa, 0xae, 0x12, 0x43, 0x62, 0xc6, 0xaf, 0x77,
+			  0xd9, 0x9f, 0x39, 0x02, 0x53, 0x5f, 0x67, 0x4f },
+			{ 0x57, 0x24, 0x4e, 0x83, 0xb1, 0x67, 0x42, 0xdc,
+			  0xc5, 0x1b, 0xce, 0x70, 0xb5, 0x44, 0x75, 0xb6,
+			  0xd7, 0x5e, 0xd1, 0xf7, 0x0b, 0x7a, 0xf0, 0x1a,
+			  0x50, 0x36, 0xa0, 0x71, 0xfb, 0xcf, 0xef, 0x4a },
+			{ 0x1e, 0x17, 0x15, 0x04, 0x36, 0x36, 0x2d, 0xc3,
+			  0x3b, 0x48, 0x98, 0x89, 0x11, 0xef, 0x2b, 0xcd,
+			  0x10, 0x51, 0x94, 0xd0, 0xad, 0x6e, 0x0a, 0x87,
+			  0x61, 0x65, 0xa8, 0xa2, 0x72, 0xbb, 0xcc, 0x0b },
+		},
+		{
+			{ 0x96, 0x12, 0xfe, 0x50, 0x4c, 0x5e, 0x6d, 0x18,
+			  0x7e, 0x9f, 0xe8, 0xfe, 0x82, 0x7b, 0x39, 0xe0,
+			  0xb0, 0x31, 0x70, 0x50, 0xc5, 0xf6, 0xc7, 0x3b,
+			  0xc2, 0x37, 0x8f, 0x10, 0x69, 0xfd, 0x78, 0x66 },
+			{ 0xc8, 0xa9, 0xb1, 0xea, 0x2f, 0x96, 0x5e, 0x18,
+			  0xcd, 0x7d, 0x14, 0x65, 0x35, 0xe6, 0xe7, 0x86,
+			  0xf2, 0x6d, 0x5b, 0xbb, 0x31, 0xe0, 0x92, 0xb0,
+			  0x3e, 0xb7, 0xd6, 0x59, 0xab, 0xf0, 0x24, 0x40 },
+			{ 0xc2, 0x63, 0x68, 0x63, 0x31, 0xfa, 0x86, 0x15,
+			  0xf2, 0x33, 0x2d, 0x57, 0x48, 0x8c, 0xf6, 0x07,
+			  0xfc, 0xae, 0x9e, 0x78, 0x9f, 0xcc, 0x73, 0x4f,
+			  0x01, 0x47, 0xad, 0x8e, 0x10, 0xe2, 0x42, 0x2d },
+		},
+		{
+			{ 0x93, 0x75, 0x53, 0x0f, 0x0d, 0x7b, 0x71, 0x21,
+			  0x4c, 0x06, 0x1e, 0x13, 0x0b, 0x69, 0x4e, 0x91,
+			  0x9f, 0xe0, 0x2a, 0x75, 0xae, 0x87, 0xb6, 0x1b,
+			  0x6e, 0x3c, 0x42, 0x9b, 0xa7, 0xf3, 0x0b, 0x42 },
+			{ 0x9b, 0xd2, 0xdf, 0x94, 0x15, 0x13, 0xf5, 0x97,
+			  0x6a, 0x4c, 0x3f, 0x31, 0x5d, 0x98, 0x55, 0x61,
+			  0x10, 0x50, 0x45, 0x08, 0x07, 0x3f, 0xa1, 0xeb,
+			  0x22, 0xd3, 0xd2, 0xb8, 0x08, 0x26, 0x6b, 0x67 },
+			{ 0x47, 0x2b, 0x5b, 0x1c, 0x65, 0xba, 0x38, 0x81,
+			  0x80, 0x1b, 0x1b, 0x31, 0xec, 0xb6, 0x71, 0x86,
+			  0xb0, 0x35, 0x31, 0xbc, 0xb1, 0x0c, 0xff, 0x7b,
+			  0xe0, 0xf1, 0x0c, 0x9c, 0xfa, 0x2f, 0x5d, 0x74 },
+		},
+		{
+			{ 0x6a, 0x4e, 0xd3, 0x21, 0x57, 0xdf, 0x36, 0x60,
+			  0xd0, 0xb3, 0x7b, 0x99, 0x27, 0x88, 0xdb, 0xb1,
+			  0xfa, 0x6a, 0x75, 0xc8, 0xc3, 0x09, 0xc2, 0xd3,
+			  0x39, 0xc8, 0x1d, 0x4c, 0xe5, 0x5b, 0xe1, 0x06 },
+			{ 0xbd, 0xc8, 0xc9, 0x2b, 0x1e, 0x5a, 0x52, 0xbf,
+			  0x81, 0x9d, 0x47, 0x26, 0x08, 0x26, 0x5b, 0xea,
+			  0xdb, 0x55, 0x01, 0xdf, 0x0e, 0xc7, 0x11, 0xd5,
+			  0xd0, 0xf5, 0x0c, 0x96, 0xeb, 0x3c, 0xe2, 0x1a },
+			{ 0x4a, 0x99, 0x32, 0x19, 0x87, 0x5d, 0x72, 0x5b,
+			  0xb0, 0xda, 0xb1, 0xce, 0xb5, 0x1c, 0x35, 0x32,
+			  0x05, 0xca, 0xb7, 0xda, 0x49, 0x15, 0xc4, 0x7d,
+			  0xf7, 0xc1, 0x8e, 0x27, 0x61, 0xd8, 0xde, 0x58 },
+		},
+		{
+			{ 0xa8, 0xc9, 0xc2, 0xb6, 0xa8, 0x5b, 0xfb, 0x2d,
+			  0x8c, 0x59, 0x2c, 0xf5, 0x8e, 0xef, 0xee, 0x48,
+			  0x73, 0x15, 0x2d, 0xf1, 0x07, 0x91, 0x80, 0x33,
+			  0xd8, 0x5b, 0x1d, 0x53, 0x6b, 0x69, 0xba, 0x08 },
+			{ 0x5c, 0xc5, 0x66, 0xf2, 0x93, 0x37, 0x17, 0xd8,
+			  0x49, 0x4e, 0x45, 0xcc, 0xc5, 0x76, 0xc9, 0xc8,
+			  0xa8, 0xc3, 0x26, 0xbc, 0xf8, 0x82, 0xe3, 0x5c,
+			  0xf9, 0xf6, 0x85, 0x54, 0xe8, 0x9d, 0xf3, 0x2f },
+			{ 0x7a, 0xc5, 0xef, 0xc3, 0xee, 0x3e, 0xed, 0x77,
+			  0x11, 0x48, 0xff, 0xd4, 0x17, 0x55, 0xe0, 0x04,
+			  0xcb, 0x71, 0xa6, 0xf1, 0x3f, 0x7a, 0x3d, 0xea,
+			  0x54, 0xfe, 0x7c, 0x94, 0xb4, 0x33, 0x06, 0x12 },
+		},
+		{
+			{ 0x0a, 0x10, 0x12, 0x49, 0x47, 0x31, 0xbd, 0x82,
+			  0x06, 0xbe, 0x6f, 0x7e, 0x6d, 0x7b, 0x23, 0xde,
+			  0xc6, 0x79, 0xea, 0x11, 0x19, 0x76, 0x1e, 0xe1,
+			  0xde, 0x3b, 0x39, 0xcb, 0xe3, 0x3b, 0x43, 0x07 },
+			{ 0x42, 0x00, 0x61, 0x91, 0x78, 0x98, 0x94, 0x0b,
+			  0xe8, 0xfa, 0xeb, 0xec, 0x3c, 0xb1, 0xe7, 0x4e,
+			  0xc0, 0xa4, 0xf0, 0x94, 0x95, 0x73, 0xbe, 0x70,
+			  0x85, 0x91, 0xd5, 0xb4, 0x99, 0x0a, 0xd3, 0x35 },
+			{ 0xf4, 0x97, 0xe9, 0x5c, 0xc0, 0x44, 0x79, 0xff,
+			  0xa3, 0x51, 0x5c, 0xb0, 0xe4, 0x3d, 0x5d, 0x57,
+			  0x7c, 0x84, 0x76, 0x5a, 0xfd, 0x81, 0x33, 0x58,
+			  0x9f, 0xda, 0xf6, 0x7a, 0xde, 0x3e, 0x87, 0x2d },
+		},
+		{
+			{ 0x81, 0xf9, 0x5d, 0x4e, 0xe1, 0x02, 0x62, 0xaa,
+			  0xf5, 0xe1, 0x15, 0x50, 0x17, 0x59, 0x0d, 0xa2,
+			  0x6c, 0x1d, 0xe2, 0xba, 0xd3, 0x75, 0xa2, 0x18,
+			  0x53, 0x02, 0x60, 0x01, 0x8a, 0x61, 0x43, 0x05 },
+			{ 0x09, 0x34, 0x37, 0x43, 0x64, 0x31, 0x7a, 0x15,
+			  0xd9, 0x81, 0xaa, 0xf4, 0xee, 0xb7, 0xb8, 0xfa,
+			  0x06, 0x48, 0xa6, 0xf5, 0xe6, 0xfe, 0x93, 0xb0,
+			  0xb6, 0xa7, 0x7f, 0x70, 0x54, 0x36, 0x77, 0x2e },
+			{ 0xc1, 0x23, 0x4c, 0x97, 0xf4, 0xbd, 0xea, 0x0d,
+			  0x93, 0x46, 0xce, 0x9d, 0x25, 0x0a, 0x6f, 0xaa,
+			  0x2c, 0xba, 0x9a, 0xa2, 0xb8, 0x2c, 0x20, 0x04,
+			  0x0d, 0x96, 0x07, 0x2d, 0x36, 0x43, 0x14, 0x4b },
+		},
+	},
+	{
+		{
+			{ 0xcb, 0x9c, 0x52, 0x1c, 0xe9, 0x54, 0x7c, 0x96,
+			  0xfb, 0x35, 0xc6, 0x64, 0x92, 0x26, 0xf6, 0x30,
+			  0x65, 0x19, 0x12, 0x78, 0xf4, 0xaf, 0x47, 0x27,
+			  0x5c, 0x6f, 0xf6, 0xea, 0x18, 0x84, 0x03, 0x17 },
+			{ 0x7a, 0x1f, 0x6e, 0xb6, 0xc7, 0xb7, 0xc4, 0xcc,
+			  0x7e, 0x2f, 0x0c, 0xf5, 0x25, 0x7e, 0x15, 0x44,
+			  0x1c, 0xaf, 0x3e, 0x71, 0xfc, 0x6d, 0xf0, 0x3e,
+			  0xf7, 0x63, 0xda, 0x52, 0x67, 0x44, 0x2f, 0x58 },
+			{ 0xe4, 0x4c, 0x32, 0x20, 0xd3, 0x7b, 0x31, 0xc6,
+			  0xc4, 0x8b, 0x48, 0xa4, 0xe8, 0x42, 0x10, 0xa8,
+			  0x64, 0x13, 0x5a, 0x4e, 0x8b, 0xf1, 0x1e, 0xb2,
+			  0xc9, 0x8d, 0xa2, 0xcd, 0x4b, 0x1c, 0x2a, 0x0c },
+		},
+		{
+			{ 0x45, 0x69, 0xbd, 0x69, 0x48, 0x81, 0xc4, 0xed,
+			  0x22, 0x8d, 0x1c, 0xbe, 0x7d, 0x90, 0x6d, 0x0d,
+			  0xab, 0xc5, 0x5c, 0xd5, 0x12, 0xd2, 0x3b, 0xc6,
+			  0x83, 0xdc, 0x14, 0xa3, 0x30, 0x9b, 0x6a, 0x5a },
+			{ 0x47, 0x04, 0x1f, 0x6f, 0xd0, 0xc7, 0x4d, 0xd2,
+			  0x59, 0xc0, 0x87, 0xdb, 0x3e, 0x9e, 0x26, 0xb2,
+			  0x8f, 0xd2, 0xb2, 0xfb, 0x72, 0x02, 0x5b, 0xd1,
+			  0x77, 0x48, 0xf6, 0xc6, 0xd1, 0x8b, 0x55, 0x7c },
+			{ 0x3d, 0x46, 0x96, 0xd3, 0x24, 0x15, 0xec, 0xd0,
+			  0xf0, 0x24, 0x5a, 0xc3, 0x8a, 0x62, 0xbb, 0x12,
+			  0xa4, 0x5f, 0xbc, 0x1c, 0x79, 0x3a, 0x0c, 0xa5,
+			  0xc3, 0xaf, 0xfb, 0x0a, 0xca, 0xa5, 0x04, 0x04 },
+		},
+		{
+			{ 0xd1, 0x6f, 0x41, 0x2a, 0x1b, 0x9e, 0xbc, 0x62,
+			  0x8b, 0x59, 0x50, 0xe3, 0x28, 0xf7, 0xc6, 0xb5,
+			  0x67, 0x69, 0x5d, 0x3d, 0xd8, 0x3f, 0x34, 0x04,
+			  0x98, 0xee, 0xf8, 0xe7, 0x16, 0x75, 0x52, 0x39 },
+			{ 0xd6, 0x43, 0xa7, 0x0a, 0x07, 0x40, 0x1f, 0x8c,
+			  0xe8, 0x5e, 0x26, 0x5b, 0xcb, 0xd0, 0xba, 0xcc,
+			  0xde, 0xd2, 0x8f, 0x66, 0x6b, 0x04, 0x4b, 0x57,
+			  0x33, 0x96, 0xdd, 0xca, 0xfd, 0x5b, 0x39, 0x46 },
+			{ 0x9c, 0x9a, 0x5d, 0x1a, 0x2d, 0xdb, 0x7f, 0x11,
+			  0x2a, 0x5c, 0x00, 0xd1, 0xbc, 0x45, 0x77, 0x9c,
+			  0xea, 0x6f, 0xd5, 0x54, 0xf1, 0xbe, 0xd4, 0xef,
+			  0x16, 0xd0, 0x22, 0xe8, 0x29, 0x9a, 0x57, 0x76 },
+		},
+		{
+			{ 0xf2, 0x34, 0xb4, 0x52, 0x13, 0xb5, 0x3c, 0x33,
+			  0xe1, 0x80, 0xde, 0x93, 0x49, 0x28, 0x32, 0xd8,
+			  0xce, 0x35, 0x0d, 0x75, 0x87, 0x28, 0x51, 0xb5,
+			  0xc1, 0x77, 0x27, 0x2a, 0xbb, 0x14, 0xc5, 0x02 },
+			{ 0x17, 0x2a, 0xc0, 0x49, 0x7e, 0x8e, 0xb6, 0x45,
+			  0x7f, 0xa3, 0xa9, 0xbc, 0xa2, 0x51, 0xcd, 0x23,
+			  0x1b, 0x4c, 0x22, 0xec, 0x11, 0x5f, 0xd6, 0x3e,
+			  0xb1, 0xbd, 0x05, 0x9e, 0xdc, 0x84, 0xa3, 0x43 },
+			{ 0x45, 0xb6, 0xf1, 0x8b, 0xda, 0xd5, 0x4b, 0x68,
+			  0x53, 0x4b, 0xb5, 0xf6, 0x7e, 0xd3, 0x8b, 0xfb,
+			  0x53, 0xd2, 0xb0, 0xa9, 0xd7, 0x16, 0x39, 0x31,
+			  0x59, 0x80, 0x54, 0x61, 0x09, 0x92, 0x60, 0x11 },
+		},
+		{
+			{ 0xcd, 0x4d, 0x9b, 0x36, 0x16, 0x56, 0x38, 0x7a,
+			  0x63, 0x35, 0x5c, 0x65, 0xa7, 0x2c, 0xc0, 0x75,
+			  0x21, 0x80, 0xf1, 0xd4, 0xf9, 0x1b, 0xc2, 0x7d,
+			  0x42, 0xe0, 0xe6, 0x91, 0x74, 0x7d, 0x63, 0x2f },
+			{ 0xaa, 0xcf, 0xda, 0x29, 0x69, 0x16, 0x4d, 0xb4,
+			  0x8f, 0x59, 0x13, 0x84, 0x4c, 0x9f, 0x52, 0xda,
+			  0x59, 0x55, 0x3d, 0x45, 0xca, 0x63, 0xef, 0xe9,
+			  0x0b, 0x8e, 0x69, 0xc5, 0x5b, 0x12, 0x1e, 0x35 },
+			{ 0xbe, 0x7b, 0xf6, 0x1a, 0x46, 0x9b, 0xb4, 0xd4,
+			  0x61, 0x89, 0xab, 0xc8, 0x7a, 0x03, 0x03, 0xd6,
+			  0xfb, 0x99, 0xa6, 0xf9, 0x9f, 0xe1, 0xde, 0x71,
+			  0x9a, 0x2a, 0xce, 0xe7, 0x06, 0x2d, 0x18, 0x7f },
+		},
+		{
+			{ 0x22, 0x75, 0x21, 0x8e, 0x72, 0x4b, 0x45, 0x09,
+			  0xd8, 0xb8, 0x84, 0xd4, 0xf4, 0xe8, 0x58, 0xaa,
+			  0x3c, 0x90, 0x46, 0x7f, 0x4d, 0x25, 0x58, 0xd3,
+			  0x17, 0x52, 0x1c, 0x24, 0x43, 0xc0, 0xac, 0x44 },
+			{ 0xec, 0x68, 0x01, 0xab, 0x64, 0x8e, 0x7c, 0x7a,
+			  0x43, 0xc5, 0xed, 0x15, 0x55, 0x4a, 0x5a, 0xcb,
+			  0xda, 0x0e, 0xcd, 0x47, 0xd3, 0x19, 0x55, 0x09,
+			  0xb0, 0x93, 0x3e, 0x34, 0x8c, 0xac, 0xd4, 0x67 },
+			{ 0x77, 0x57, 0x7a, 0x4f, 0xbb, 0x6b, 0x7d, 0x1c,
+			  0xe1, 0x13, 0x83, 0x91, 0xd4, 0xfe, 0x35, 0x8b,
+			  0x84, 0x46, 0x6b, 0xc9, 0xc6, 0xa1, 0xdc, 0x4a,
+			  0xbd, 0x71, 0xad, 0x12, 0x83, 0x1c, 0x6d, 0x55 },
+		},
+		{
+			{ 0x21, 0xe8, 0x1b, 0xb1, 0x56, 0x67, 0xf0, 0x81,
+			  0xdd, 0xf3, 0xa3, 0x10, 0x23, 0xf8, 0xaf, 0x0f,
+			  0x5d, 0x46, 0x99, 0x6a, 0x55, 0xd0, 0xb2, 0xf8,
+			  0x05, 0x7f, 0x8c, 0xcc, 0x38, 0xbe, 0x7a, 0x09 },
+			{ 0x82, 0x39, 0x8d, 0x0c, 0xe3, 0x40, 0xef, 0x17,
+			  0x34, 0xfa, 0xa3, 0x15, 0x3e, 0x07, 0xf7, 0x31,
+			  0x6e, 0x64, 0x73, 0x07, 0xcb, 0xf3, 0x21, 0x4f,
+			  0xff, 0x4e, 0x82, 0x1d, 0x6d, 0x6c, 0x6c, 0x74 },
+			{ 0xa4, 0x2d, 0xa5, 0x7e, 0x87, 0xc9, 0x49, 0x0c,
+			  0x43, 0x1d, 0xdc, 0x9b, 0x55, 0x69, 0x43, 0x4c,
+			  0xd2, 0xeb, 0xcc, 0xf7, 0x09, 0x38, 0x2c, 0x02,
+			  0xbd, 0x84, 0xee, 0x4b, 0xa3, 0x14, 0x7e, 0x57 },
+		},
+		{
+			{ 0x2b, 0xd7, 0x4d, 0xbd, 0xbe, 0xce, 0xfe, 0x94,
+			  0x11, 0x22, 0x0f, 0x06, 0xda, 0x4f, 0x6a, 0xf4,
+			  0xff, 0xd1, 0xc8, 0xc0, 0x77, 0x59, 0x4a, 0x12,
+			  0x95, 0x92, 0x00, 0xfb, 0xb8, 0x04, 0x53, 0x70 },
+			{ 0x0a, 0x3b, 0xa7, 0x61, 0xac, 0x68, 0xe2, 0xf0,
+			  0xf5, 0xa5, 0x91, 0x37, 0x10, 0xfa, 0xfa, 0xf2,
+			  0xe9, 0x00, 0x6d, 0x6b, 0x82, 0x3e, 0xe1, 0xc1,
+			  0x42, 0x8f, 0xd7, 0x6f, 0xe9, 0x7e, 0xfa, 0x60 },
+			{ 0xc6, 0x6e, 0x29, 0x4d, 0x35, 0x1d, 0x3d, 0xb6,
+			  0xd8, 0x31, 0xad, 0x5f, 0x3e, 0x05, 0xc3, 0xf3,
+			  0xec, 0x42, 0xbd, 0xb4, 0x8c, 0x95, 0x0b, 0x67,
+			  0xfd, 0x53, 0x63, 0xa1, 0x0c, 0x8e, 0x39, 0x21 },
+		},
+	},
+	{
+		{
+			{ 0x01, 0x56, 0xb7, 0xb4, 0xf9, 0xaa, 0x98, 0x27,
+			  0x72, 0xad, 0x8d, 0x5c, 0x13, 0x72, 0xac, 0x5e,
+			  0x23, 0xa0, 0xb7, 0x61, 0x61, 0xaa, 0xce, 0xd2,
+			  0x4e, 0x7d, 0x8f, 0xe9, 0x84, 0xb2, 0xbf, 0x1b },
+			{ 0xf3, 0x33, 0x2b, 0x38, 0x8a, 0x05, 0xf5, 0x89,
+			  0xb4, 0xc0, 0x48, 0xad, 0x0b, 0xba, 0xe2, 0x5a,
+			  0x6e, 0xb3, 0x3d, 0xa5, 0x03, 0xb5, 0x93, 0x8f,
+			  0xe6, 0x32, 0xa2, 0x95, 0x9d, 0xed, 0xa3, 0x5a },
+			{ 0x61, 0x65, 0xd9, 0xc7, 0xe9, 0x77, 0x67, 0x65,
+			  0x36, 0x80, 0xc7, 0x72, 0x54, 0x12, 0x2b, 0xcb,
+			  0xee, 0x6e, 0x50, 0xd9, 0x99, 0x32, 0x05, 0x65,
+			  0xcc, 0x57, 0x89, 0x5e, 0x4e, 0xe1, 0x07, 0x4a },
+		},
+		{
+			{ 0x9b, 0xa4, 0x77, 0xc4, 0xcd, 0x58, 0x0b, 0x24,
+			  0x17, 0xf0, 0x47, 0x64, 0xde, 0xda, 0x38, 0xfd,
+			  0xad, 0x6a, 0xc8, 0xa7, 0x32, 0x8d, 0x92, 0x19,
+			  0x81, 0xa0, 0xaf, 0x84, 0xed, 0x7a, 0xaf, 0x50 },
+			{ 0x99, 0xf9, 0x0d, 0x98, 0xcb, 0x12, 0xe4, 0x4e,
+			  0x71, 0xc7, 0x6e, 0x3c, 0x6f, 0xd7, 0x15, 0xa3,
+			  0xfd, 0x77, 0x5c, 0x92, 0xde, 0xed, 0xa5, 0xbb,
+			  0x02, 0x34, 0x31, 0x1d, 0x39, 0xac, 0x0b, 0x3f },
+			{ 0xe5, 0x5b, 0xf6, 0x15, 0x01, 0xde, 0x4f, 0x6e,
+			  0xb2, 0x09, 0x61, 0x21, 0x21, 0x26, 0x98, 0x29,
+			  0xd9, 0xd6, 0xad, 0x0b, 0x81, 0x05, 0x02, 0x78,
+			  0x06, 0xd0, 0xeb, 0xba, 0x16, 0xa3, 0x21, 0x19 },
+		},
+		{
+			{ 0x8b, 0xc1, 0xf3, 0xd9, 0x9a, 0xad, 0x5a, 0xd7,
+			  0x9c, 0xc1, 0xb1, 0x60, 0xef, 0x0e, 0x6a, 0x56,
+			  0xd9, 0x0e, 0x5c, 0x25, 0xac, 0x0b, 0x9a, 0x3e,
+			  0xf5, 0xc7, 0x62, 0xa0, 0xec, 0x9d, 0x04, 0x7b },
+			{ 0xfc, 0x70, 0xb8, 0xdf, 0x7e, 0x2f, 0x42, 0x89,
+			  0xbd, 0xb3, 0x76, 0x4f, 0xeb, 0x6b, 0x29, 0x2c,
+			  0xf7, 0x4d, 0xc2, 0x36, 0xd4, 0xf1, 0x38, 0x07,
+			  0xb0, 0xae, 0x73, 0xe2, 0x41, 0xdf, 0x58, 0x64 },
+			{ 0x83, 0x44, 0x44, 0x35, 0x7a, 0xe3, 0xcb, 0xdc,
+			  0x93, 0xbe, 0xed, 0x0f, 0x33, 0x79, 0x88, 0x75,
+			  0x87, 0xdd, 0xc5, 0x12, 0xc3, 0x04, 0x60, 0x78,
+			  0x64, 0x0e, 0x95, 0xc2, 0xcb, 0xdc, 0x93, 0x60 },
+		},
+		{
+			{ 0x4b, 0x03, 0x84, 0x60, 0xbe, 0xee, 0xde, 0x6b,
+			  0x54, 0xb8, 0x0f, 0x78, 0xb6, 0xc2, 0x99, 0x31,
+			  0x95, 0x06, 0x2d, 0xb6, 0xab, 0x76, 0x33, 0x97,
+			  0x90, 0x7d, 0x64, 0x8b, 0xc9, 0x80, 0x31, 0x6e },
+			{ 0x6d, 0x70, 0xe0, 0x85, 0x85, 0x9a, 0xf3, 0x1f,
+			  0x33, 0x39, 0xe7, 0xb3, 0xd8, 0xa5, 0xd0, 0x36,
+			  0x3b, 0x45, 0x8f, 0x71, 0xe1, 0xf2, 0xb9, 0x43,
+			  0x7c, 0xa9, 0x27, 0x48, 0x08, 0xea, 0xd1, 0x57 },
+			{ 0x71, 0xb0, 0x28, 0xa1, 0xe7, 0xb6, 0x7a, 0xee,
+			  0xaa, 0x8b, 0xa8, 0x93, 0x6d, 0x59, 0xc1, 0xa4,
+			  0x30, 0x61, 0x21, 0xb2, 0x82, 0xde, 0xb4, 0xf7,
+			  0x18, 0xbd, 0x97, 0xdd, 0x9d, 0x99, 0x3e, 0x36 },
+		},
+		{
+			{ 0xc6, 0xae, 0x4b, 0xe2, 0xdc, 0x48, 0x18, 0x2f,
+			  0x60, 0xaf, 0xbc, 0xba, 0x55, 0x72, 0x9b, 0x76,
+			  0x31, 0xe9, 0xef, 0x3c, 0x6e, 0x3c, 0xcb, 0x90,
+			  0x55, 0xb3, 0xf9, 0xc6, 0x9b, 0x97, 0x1f, 0x23 },
+			{ 0xc4, 0x1f, 0xee, 0x35, 0xc1, 0x43, 0xa8, 0x96,
+			  0xcf, 0xc8, 0xe4, 0x08, 0x55, 0xb3, 0x6e, 0x97,
+			  0x30, 0xd3, 0x8c, 0xb5, 0x01, 0x68, 0x2f, 0xb4,
+			  0x2b, 0x05, 0x3a, 0x69, 0x78, 0x9b, 0xee, 0x48 },
+			{ 0xc6, 0xf3, 0x2a, 0xcc, 0x4b, 0xde, 0x31, 0x5c,
+			  0x1f, 0x8d, 0x20, 0xfe, 0x30, 0xb0, 0x4b, 0xb0,
+			  0x66, 0xb4, 0x4f, 0xc1, 0x09, 0x70, 0x8d, 0xb7,
+			  0x13, 0x24, 0x79, 0x08, 0x9b, 0xfa, 0x9b, 0x07 },
+		},
+		{
+			{ 0x45, 0x42, 0xd5, 0xa2, 0x80, 0xed, 0xc9, 0xf3,
+			  0x52, 0x39, 0xf6, 0x77, 0x78, 0x8b, 0xa0, 0x0a,
+			  0x75, 0x54, 0x08, 0xd1, 0x63, 0xac, 0x6d, 0xd7,
+			  0x6b, 0x63, 0x70, 0x94, 0x15, 0xfb, 0xf4, 0x1e },
+			{ 0xf4, 0x0d, 0x30, 0xda, 0x51, 0x3a, 0x90, 0xe3,
+			  0xb0, 0x5a, 0xa9, 0x3d, 0x23, 0x64, 0x39, 0x84,
+			  0x80, 0x64, 0x35, 0x0b, 0x2d, 0xf1, 0x3c, 0xed,
+			  0x94, 0x71, 0x81, 0x84, 0xf6, 0x77, 0x8c, 0x03 },
+			{ 0xec, 0x7b, 0x16, 0x5b, 0xe6, 0x5e, 0x4e, 0x85,
+			  0xc2, 0xcd, 0xd0, 0x96, 0x42, 0x0a, 0x59, 0x59,
+			  0x99, 0x21, 0x10, 0x98, 0x34, 0xdf, 0xb2, 0x72,
+			  0x56, 0xff, 0x0b, 0x4a, 0x2a, 0xe9, 0x5e, 0x57 },
+		},
+		{
+			{ 0x01, 0xd8, 0xa4, 0x0a, 0x45, 0xbc, 0x46, 0x5d,
+			  0xd8, 0xb9, 0x33, 0xa5, 0x27, 0x12, 0xaf, 0xc3,
+			  0xc2, 0x06, 0x89, 0x2b, 0x26, 0x3b, 0x9e, 0x38,
+			  0x1b, 0x58, 0x2f, 0x38, 0x7e, 0x1e, 0x0a, 0x20 },
+			{ 0xcf, 0x2f, 0x18, 0x8a, 0x90, 0x80, 0xc0, 0xd4,
+			  0xbd, 0x9d, 0x48, 0x99, 0xc2, 0x70, 0xe1, 0x30,
+			  0xde, 0x33, 0xf7, 0x52, 0x57, 0xbd, 0xba, 0x05,
+			  0x00, 0xfd, 0xd3, 0x2c, 0x11, 0xe7, 0xd4, 0x43 },
+			{ 0xc5, 0x3a, 0xf9, 0xea, 0x67, 0xb9, 0x8d, 0x51,
+			  0xc0, 0x52, 0x66, 0x05, 0x9b, 0x98, 0xbc, 0x71,
+			  0xf5, 0x97, 0x71, 0x56, 0xd9, 0x85, 0x2b, 0xfe,
+			  0x38, 0x4e, 0x1e, 0x65, 0x52, 0xca, 0x0e, 0x05 },
+		},
+		{
+			{ 0xea, 0x68, 0xe6, 0x60, 0x76, 0x39, 0xac, 0x97,
+			  0x97, 0xb4, 0x3a, 0x15, 0xfe, 0xbb, 0x19, 0x9b,
+			  0x9f, 0xa7, 0xec, 0x34, 0xb5, 0x79, 0xb1, 0x4c,
+			  0x57, 0xae, 0x31, 0xa1, 0x9f, 0xc0, 0x51, 0x61 },
+			{ 0x9c, 0x0c, 0x3f, 0x45, 0xde, 0x1a, 0x43, 0xc3,
+			  0x9b, 0x3b, 0x70, 0xff, 0x5e, 0x04, 0xf5, 0xe9,
+			  0x3d, 0x7b, 0x84, 0xed, 0xc9, 0x7a, 0xd9, 0xfc,
+			  0xc6, 0xf4, 0x58, 0x1c, 0xc2, 0xe6, 0x0e, 0x4b },
+			{ 0x96, 0x5d, 0xf0, 0xfd, 0x0d, 0x5c, 0xf5, 0x3a,
+			  0x7a, 0xee, 0xb4, 0x2a, 0xe0, 0x2e, 0x26, 0xdd,
+			  0x09, 0x17, 0x17, 0x12, 0x87, 0xbb, 0xb2, 0x11,
+			  0x0b, 0x03, 0x0f, 0x80, 0xfa, 0x24, 0xef, 0x1f },
+		},
+	},
+	{
+		{
+			{ 0x86, 0x6b, 0x97, 0x30, 0xf5, 0xaf, 0xd2, 0x22,
+			  0x04, 0x46, 0xd2, 0xc2, 0x06, 0xb8, 0x90, 0x8d,
+			  0xe5, 0xba, 0xe5, 0x4d, 0x6c, 0x89, 0xa1, 0xdc,
+			  0x17, 0x0c, 0x34, 0xc8, 0xe6, 0x5f, 0x00, 0x28 },
+			{ 0x96, 0x31, 0xa7, 0x1a, 0xfb, 0x53, 0xd6, 0x37,
+			  0x18, 0x64, 0xd7, 0x3f, 0x30, 0x95, 0x94, 0x0f,
+			  0xb2, 0x17, 0x3a, 0xfb, 0x09, 0x0b, 0x20, 0xad,
+			  0x3e, 0x61, 0xc8, 0x2f, 0x29, 0x49, 0x4d, 0x54 },
+			{ 0x88, 0x86, 0x52, 0x34, 0x9f, 0xba, 0xef, 0x6a,
+			  0xa1, 0x7d, 0x10, 0x25, 0x94, 0xff, 0x1b, 0x5c,
+			  0x36, 0x4b, 0xd9, 0x66, 0xcd, 0xbb, 0x5b, 0xf7,
+			  0xfa, 0x6d, 0x31, 0x0f, 0x93, 0x72, 0xe4, 0x72 },
+		},
+		{
+			{ 0x27, 0x76, 0x2a, 0xd3, 0x35, 0xf6, 0xf3, 0x07,
+			  0xf0, 0x66, 0x65, 0x5f, 0x86, 0x4d, 0xaa, 0x7a,
+			  0x50, 0x44, 0xd0, 0x28, 0x97, 0xe7, 0x85, 0x3c,
+			  0x38, 0x64, 0xe0, 0x0f, 0x00, 0x7f, 0xee, 0x1f },
+			{ 0x4f, 0x08, 0x81, 0x97, 0x8c, 0x20, 0x95, 0x26,
+			  0xe1, 0x0e, 0x45, 0x23, 0x0b, 0x2a, 0x50, 0xb1,
+			  0x02, 0xde, 0xef, 0x03, 0xa6, 0xae, 0x9d, 0xfd,
+			  0x4c, 0xa3, 0x33, 0x27, 0x8c, 0x2e, 0x9d, 0x5a },
+			{ 0xe5, 0xf7, 0xdb, 0x03, 0xda, 0x05, 0x53, 0x76,
+			  0xbd, 0xcd, 0x34, 0x14, 0x49, 0xf2, 0xda, 0xa4,
+			  0xec, 0x88, 0x4a, 0xd2, 0xcd, 0xd5, 0x4a, 0x7b,
+			  0x43, 0x05, 0x04, 0xee, 0x51, 0x40, 0xf9, 0x00 },
+		},
+		{
+			{ 0x53, 0x97, 0xaf, 0x07, 0xbb, 0x93, 0xef, 0xd7,
+			  0xa7, 0x66, 0xb7, 0x3d, 0xcf, 0xd0, 0x3e, 0x58,
+			  0xc5, 0x1e, 0x0b, 0x6e, 0xbf, 0x98, 0x69, 0xce,
+			  0x52, 0x04, 0xd4, 0x5d, 0xd2, 0xff, 0xb7, 0x47 },
+			{ 0xb2, 0x30, 0xd3, 0xc3, 0x23, 0x6b, 0x35, 0x8d,
+			  0x06, 0x1b, 0x47, 0xb0, 0x9b, 0x8b, 0x1c, 0xf2,
+			  0x3c, 0xb8, 0x42, 0x6e, 0x6c, 0x31, 0x6c, 0xb3,
+			  0x0d, 0xb1, 0xea, 0x8b, 0x7e, 0x9c, 0xd7, 0x07 },
+			{ 0x12, 0xdd, 0x08, 0xbc, 0x9c, 0xfb, 0xfb, 0x87,
+			  0x9b, 0xc2, 0xee, 0xe1, 0x3a, 0x6b, 0x06, 0x8a,
+			  0xbf, 0xc1, 0x1f, 0xdb, 0x2b, 0x24, 0x57, 0x0d,
+			  0xb6, 0x4b, 0xa6, 0x5e, 0xa3, 0x20, 0x35, 0x1c },
+		},
+		{
+			{ 0x59, 0xc0, 0x6b, 0x21, 0x40, 0x6f, 0xa8, 0xcd,
+			  0x7e, 0xd8, 0xbc, 0x12, 0x1d, 0x23, 0xbb, 0x1f,
+			  0x90, 0x09, 0xc7, 0x17, 0x9e, 0x6a, 0x95, 0xb4,
+			  0x55, 0x2e, 0xd1, 0x66, 0x3b, 0x0c, 0x75, 0x38 },
+			{ 0x4a, 0xa3, 0xcb, 0xbc, 0xa6, 0x53, 0xd2, 0x80,
+			  0x9b, 0x21, 0x38, 0x38, 0xa1, 0xc3, 0x61, 0x3e,
+			  0x96, 0xe3, 0x82, 0x98, 0x01, 0xb6, 0xc3, 0x90,
+			  0x6f, 0xe6, 0x0e, 0x5d, 0x77, 0x05, 0x3d, 0x1c },
+			{ 0x1a, 0xe5, 0x22, 0x94, 0x40, 0xf1, 0x2e, 0x69,
+			  0x71, 0xf6, 0x5d, 0x2b, 0x3c, 0xc7, 0xc0, 0xcb,
+			  0x29, 0xe0, 0x4c, 0x74, 0xe7, 0x4f, 0x01, 0x21,
+			  0x7c, 0x48, 0x30, 0xd3, 0xc7, 0xe2, 0x21, 0x06 },
+		},
+		{
+			{ 0xf3, 0xf0, 0xdb, 0xb0, 0x96, 0x17, 0xae, 0xb7,
+			  0x96, 0xe1, 0x7c, 0xe1, 0xb9, 0xaf, 0xdf, 0x54,
+			  0xb4, 0xa3, 0xaa, 0xe9, 0x71, 0x30, 0x92, 0x25,
+			  0x9d, 0x2e, 0x00, 0xa1, 0x9c, 0x58, 0x8e, 0x5d },
+			{ 0x8d, 0x83, 0x59, 0x82, 0xcc, 0x60, 0x98, 0xaf,
+			  0xdc, 0x9a, 0x9f, 0xc6, 0xc1, 0x48, 0xea, 0x90,
+			  0x30, 0x1e, 0x58, 0x65, 0x37, 0x48, 0x26, 0x65,
+			  0xbc, 0xa5, 0xd3, 0x7b, 0x09, 0xd6, 0x07, 0x00 },
+			{ 0x4b, 0xa9, 0x42, 0x08, 0x95, 0x1d, 0xbf, 0xc0,
+			  0x3e, 0x2e, 0x8f, 0x58, 0x63, 0xc3, 0xd3, 0xb2,
+			  0xef, 0xe2, 0x51, 0xbb, 0x38, 0x14, 0x96, 0x0a,
+			  0x86, 0xbf, 0x1c, 0x3c, 0x78, 0xd7, 0x83, 0x15 },
+		},
+		{
+			{ 0xc7, 0x28, 0x9d, 0xcc, 0x04, 0x47, 0x03, 0x90,
+			  0x8f, 0xc5, 0x2c, 0xf7, 0x9e, 0x67, 0x1b, 0x1d,
+			  0x26, 0x87, 0x5b, 0xbe, 0x5f, 0x2b, 0xe1, 0x16,
+			  0x0a, 0x58, 0xc5, 0x83, 0x4e, 0x06, 0x58, 0x49 },
+			{ 0xe1, 0x7a, 0xa2, 0x5d, 0xef, 0xa2, 0xee, 0xec,
+			  0x74, 0x01, 0x67, 0x55, 0x14, 0x3a, 0x7c, 0x59,
+			  0x7a, 0x16, 0x09, 0x66, 0x12, 0x2a, 0xa6, 0xc9,
+			  0x70, 0x8f, 0xed, 0x81, 0x2e, 0x5f, 0x2a, 0x25 },
+			{ 0x0d, 0xe8, 0x66, 0x50, 0x26, 0x94, 0x28, 0x0d,
+			  0x6b, 0x8c, 0x7c, 0x30, 0x85, 0xf7, 0xc3, 0xfc,
+			  0xfd, 0x12, 0x11, 0x0c, 0x78, 0xda, 0x53, 0x1b,
+			  0x88, 0xb3, 0x43, 0xd8, 0x0b, 0x17, 0x9c, 0x07 },
+		},
+		{
+			{ 0x56, 0xd0, 0xd5, 0xc0, 0x50, 0xcd, 0xd6, 0xcd,
+			  0x3b, 0x57, 0x03, 0xbb, 0x6d, 0x68, 0xf7, 0x9a,
+			  0x48, 0xef, 0xc3, 0xf3, 0x3f, 0x72, 0xa6, 0x3c,
+			  0xcc, 0x8a, 0x7b, 0x31, 0xd7, 0xc0, 0x68, 0x67 },
+			{ 0xff, 0x6f, 0xfa, 0x64, 0xe4, 0xec, 0x06, 0x05,
+			  0x23, 0xe5, 0x05, 0x62, 0x1e, 0x43, 0xe3, 0xbe,
+			  0x42, 0xea, 0xb8, 0x51, 0x24, 0x42, 0x79, 0x35,
+			  0x00, 0xfb, 0xc9, 0x4a, 0xe3, 0x05, 0xec, 0x6d },
+			{ 0xb3, 0xc1, 0x55, 0xf1, 0xe5, 0x25, 0xb6, 0x94,
+			  0x91, 0x7b, 0x7b, 0x99, 0xa7, 0xf3, 0x7b, 0x41,
+			  0x00, 0x26, 0x6b, 0x6d, 0xdc, 0xbd, 0x2c, 0xc2,
+			  0xf4, 0x52, 0xcd, 0xdd, 0x14, 0x5e, 0x44, 0x51 },
+		},
+		{
+			{ 0x55, 0xa4, 0xbe, 0x2b, 0xab, 0x47, 0x31, 0x89,
+			  0x29, 0x91, 0x07, 0x92, 0x4f, 0xa2, 0x53, 0x8c,
+			  0xa7, 0xf7, 0x30, 0xbe, 0x48, 0xf9, 0x49, 0x4b,
+			  0x3d, 0xd4, 0x4f, 0x6e, 0x08, 0x90, 0xe9, 0x12 },
+			{ 0x51, 0x49, 0x14, 0x3b, 0x4b, 0x2b, 0x50, 0x57,
+			  0xb3, 0xbc, 0x4b, 0x44, 0x6b, 0xff, 0x67, 0x8e,
+			  0xdb, 0x85, 0x63, 0x16, 0x27, 0x69, 0xbd, 0xb8,
+			  0xc8, 0x95, 0x92, 0xe3, 0x31, 0x6f, 0x18, 0x13 },
+			{ 0x2e, 0xbb, 0xdf, 0x7f, 0xb3, 0x96, 0x0c, 0xf1,
+			  0xf9, 0xea, 0x1c, 0x12, 0x5e, 0x93, 0x9a, 0x9f,
+			  0x3f, 0x98, 0x5b, 0x3a, 0xc4, 0x36, 0x11, 0xdf,
+			  0xaf, 0x99, 0x3e, 0x5d, 0xf0, 0xe3, 0xb2, 0x77 },
+		},
+	},
+	{
+		{
+			{ 0xa4, 0xb0, 0xdd, 0x12, 0x9c, 0x63, 0x98, 0xd5,
+			  0x6b, 0x86, 0x24, 0xc0, 0x30, 0x9f, 0xd1, 0xa5,
+			  0x60, 0xe4, 0xfc, 0x58, 0x03, 0x2f, 0x7c, 0xd1,
+			  0x8a, 0x5e, 0x09, 0x2e, 0x15, 0x95, 0xa1, 0x07 },
+			{ 0xde, 0xc4, 0x2e, 0x9c, 0xc5, 0xa9, 0x6f, 0x29,
+			  0xcb, 0xf3, 0x84, 0x4f, 0xbf, 0x61, 0x8b, 0xbc,
+			  0x08, 0xf9, 0xa8, 0x17, 0xd9, 0x06, 0x77, 0x1c,
+			  0x5d, 0x25, 0xd3, 0x7a, 0xfc, 0x95, 0xb7, 0x63 },
+			{ 0xc8, 0x5f, 0x9e, 0x38, 0x02, 0x8f, 0x36, 0xa8,
+			  0x3b, 0xe4, 0x8d, 0xcf, 0x02, 0x3b, 0x43, 0x90,
+			  0x43, 0x26, 0x41, 0xc5, 0x5d, 0xfd, 0xa1, 0xaf,
+			  0x37, 0x01, 0x2f, 0x03, 0x3d, 0xe8, 0x8f, 0x3e },
+		},
+		{
+			{ 0x3c, 0xd1, 0xef, 0xe8, 0x8d, 0x4c, 0x70, 0x08,
+			  0x31, 0x37, 0xe0, 0x33, 0x8e, 0x1a, 0xc5, 0xdf,
+			  0xe3, 0xcd, 0x60, 0x12, 0xa5, 0x5d, 0x9d, 0xa5,
+			  0x86, 0x8c, 0x25, 0xa6, 0x99, 0x08, 0xd6, 0x22 },
+			{ 0x94, 0xa2, 0x70, 0x05, 0xb9, 0x15, 0x8b, 0x2f,
+			  0x49, 0x45, 0x08, 0x67, 0x70, 0x42, 0xf2, 0x94,
+			  0x84, 0xfd, 0xbb, 0x61, 0xe1, 0x5a, 0x1c, 0xde,
+			  0x07, 0x40, 0xac, 0x7f, 0x79, 0x3b, 0xba, 0x75 },
+			{ 0x96, 0xd1, 0xcd, 0x70, 0xc0, 0xdb, 0x39, 0x62,
+			  0x9a, 0x8a, 0x7d, 0x6c, 0x8b, 0x8a, 0xfe, 0x60,
+			  0x60, 0x12, 0x40, 0xeb, 0xbc, 0x47, 0x88, 0xb3,
+			  0x5e, 0x9e, 0x77, 0x87, 0x7b, 0xd0, 0x04, 0x09 },
+		},
+		{
+			{ 0xb9, 0x40, 0xf9, 0x48, 0x66, 0x2d, 0x32, 0xf4,
+			  0x39, 0x0c, 0x2d, 0xbd, 0x0c, 0x2f, 0x95, 0x06,
+			  0x31, 0xf9, 0x81, 0xa0, 0xad, 0x97, 0x76, 0x16,
+			  0x6c, 0x2a, 0xf7, 0xba, 0xce, 0xaa, 0x40, 0x62 },
+			{ 0x9c, 0x91, 0xba, 0xdd, 0xd4, 0x1f, 0xce, 0xb4,
+			  0xaa, 0x8d, 0x4c, 0xc7, 0x3e, 0xdb, 0x31, 0xcf,
+			  0x51, 0xcc, 0x86, 0xad, 0x63, 0xcc, 0x63, 0x2c,
+			  0x07, 0xde, 0x1d, 0xbc, 0x3f, 0x14, 0xe2, 0x43 },
+			{ 0xa0, 0x95, 0xa2, 0x5b, 0x9c, 0x74, 0x34, 0xf8,
+			  0x5a, 0xd2, 0x37, 0xca, 0x5b, 0x7c, 0x94, 0xd6,
+			  0x6a, 0x31, 0xc9, 0xe7, 0xa7, 0x3b, 0xf1, 0x66,
+			  0xac, 0x0c, 0xb4, 0x8d, 0x23, 0xaf, 0xbd, 0x56 },
+		},
+		{
+			{ 0xb2, 0x3b, 0x9d, 0xc1, 0x6c, 0xd3, 0x10, 0x13,
+			  0xb9, 0x86, 0x23, 0x62, 0xb7, 0x6b, 0x2a, 0x06,
+			  0x5c, 0x4f, 0xa1, 0xd7, 0x91, 0x85, 0x9b, 0x7c,
+			  0x54, 0x57, 0x1e, 0x7e, 0x50, 0x31, 0xaa, 0x03 },
+			{ 0xeb, 0x33, 0x35, 0xf5, 0xe3, 0xb9, 0x2a, 0x36,
+			  0x40, 0x3d, 0xb9, 0x6e, 0xd5, 0x68, 0x85, 0x33,
+			  0x72, 0x55, 0x5a, 0x1d, 0x52, 0x14, 0x0e, 0x9e,
+			  0x18, 0x13, 0x74, 0x83, 0x6d, 0xa8, 0x24, 0x1d },
+			{ 0x1f, 0xce, 0xd4, 0xff, 0x48, 0x76, 0xec, 0xf4,
+			  0x1c, 0x8c, 0xac, 0x54, 0xf0, 0xea, 0x45, 0xe0,
+			  0x7c, 0x35, 0x09, 0x1d, 0x82, 0x25, 0xd2, 0x88,
+			  0x59, 0x48, 0xeb, 0x9a, 0xdc, 0x61, 0xb2, 0x43 },
+		},
+		{
+			{ 0x64, 0x13, 0x95, 0x6c, 0x8b, 0x3d, 0x51, 0x19,
+			  0x7b, 0xf4, 0x0b, 0x00, 0x26, 0x71, 0xfe, 0x94,
+			  0x67, 0x95, 0x4f, 0xd5, 0xdd, 0x10, 0x8d, 0x02,
+			  0x64, 0x09, 0x94, 0x42, 0xe2, 0xd5, 0xb4, 0x02 },
+			{ 0xbb, 0x79, 0xbb, 0x88, 0x19, 0x1e, 0x5b, 0xe5,
+			  0x9d, 0x35, 0x7a, 0xc1, 0x7d, 0xd0, 0x9e, 0xa0,
+			  0x33, 0xea, 0x3d, 0x60, 0xe2, 0x2e, 0x2c, 0xb0,
+			  0xc2, 0x6b, 0x27, 0x5b, 0xcf, 0x55, 0x60, 0x32 },
+			{ 0xf2, 0x8d, 0xd1, 0x28, 0xcb, 0x55, 0xa1, 0xb4,
+			  0x08, 0xe5, 0x6c, 0x18, 0x46, 0x46, 0xcc, 0xea,
+			  0x89, 0x43, 0x82, 0x6c, 0x93, 0xf4, 0x9c, 0xc4,
+			  0x10, 0x34, 0x5d, 0xae, 0x09, 0xc8, 0xa6, 0x27 },
+		},
+		{
+			{ 0x54, 0x69, 0x3d, 0xc4, 0x0a, 0x27, 0x2c, 0xcd,
+			  0xb2, 0xca, 0x66, 0x6a, 0x57, 0x3e, 0x4a, 0xdd,
+			  0x6c, 0x03, 0xd7, 0x69, 0x24, 0x59, 0xfa, 0x79,
+			  0x99, 0x25, 0x8c, 0x3d, 0x60, 0x03, 0x15, 0x22 },
+			{ 0x88, 0xb1, 0x0d, 0x1f, 0xcd, 0xeb, 0xa6, 0x8b,
+			  0xe8, 0x5b, 0x5a, 0x67, 0x3a, 0xd7, 0xd3, 0x37,
+			  0x5a, 0x58, 0xf5, 0x15, 0xa3, 0xdf, 0x2e, 0xf2,
+			  0x7e, 0xa1, 0x60, 0xff, 0x74, 0x71, 0xb6, 0x2c },
+			{ 0xd0, 0xe1, 0x0b, 0x39, 0xf9, 0xcd, 0xee, 0x59,
+			  0xf1, 0xe3, 0x8c, 0x72, 0x44, 0x20, 0x42, 0xa9,
+			  0xf4, 0xf0, 0x94, 0x7a, 0x66, 0x1c, 0x89, 0x82,
+			  0x36, 0xf4, 0x90, 0x38, 0xb7, 0xf4, 0x1d, 0x7b },
+		},
+		{
+			{ 0x8c, 0xf5, 0xf8, 0x07, 0x18, 0x22, 0x2e, 0x5f,
+			  0xd4, 0x09, 0x94, 0xd4, 0x9f, 0x5c, 0x55, 0xe3,
+			  0x30, 0xa6, 0xb6, 0x1f, 0x8d, 0xa8, 0xaa, 0xb2,
+			  0x3d, 0xe0, 0x52, 0xd3, 0x45, 0x82, 0x69, 0x68 },
+			{ 0x24, 0xa2, 0xb2, 0xb3, 0xe0, 0xf2, 0x92, 0xe4,
+			  0x60, 0x11, 0x55, 0x2b, 0x06, 0x9e, 0x6c, 0x7c,
+			  0x0e, 0x7b, 0x7f, 0x0d, 0xe2, 0x8f, 0xeb, 0x15,
+			  0x92, 0x59, 0xfc, 0x58, 0x26, 0xef, 0xfc, 0x61 },
+			{ 0x7a, 0x18, 0x18, 0x2a, 0x85, 0x5d, 0xb1, 0xdb,
+			  0xd7, 0xac, 0xdd, 0x86, 0xd3, 0xaa, 0xe4, 0xf3,
+			  0x82, 0xc4, 0xf6, 0x0f, 0x81, 0xe2, 0xba, 0x44,
+			  0xcf, 0x01, 0xaf, 0x3d, 0x47, 0x4c, 0xcf, 0x46 },
+		},
+		{
+			{ 0x40, 0x81, 0x49, 0xf1, 0xa7, 0x6e, 0x3c, 0x21,
+			  0x54, 0x48, 0x2b, 0x39, 0xf8, 0x7e, 0x1e, 0x7c,
+			  0xba, 0xce, 0x29, 0x56, 0x8c, 0xc3, 0x88, 0x24,
+			  0xbb, 0xc5, 0x8c, 0x0d, 0xe5, 0xaa, 0x65, 0x10 },
+			{ 0xf9, 0xe5, 0xc4, 0x9e, 0xed, 0x25, 0x65, 0x42,
+			  0x03, 0x33, 0x90, 0x16, 0x01, 0xda, 0x5e, 0x0e,
+			  0xdc, 0xca, 0xe5, 0xcb, 0xf2, 0xa7, 0xb1, 0x72,
+			  0x40, 0x5f, 0xeb, 0x14, 0xcd, 0x7b, 0x38, 0x29 },
+			{ 0x57, 0x0d, 0x20, 0xdf, 0x25, 0x45, 0x2c, 0x1c,
+			  0x4a, 0x67, 0xca, 0xbf, 0xd6, 0x2d, 0x3b, 0x5c,
+			  0x30, 0x40, 0x83, 0xe1, 0xb1, 0xe7, 0x07, 0x0a,
+			  0x16, 0xe7, 0x1c, 0x4f, 0xe6, 0x98, 0xa1, 0x69 },
+		},
+	},
+	{
+		{
+			{ 0xed, 0xca, 0xc5, 0xdc, 0x34, 0x44, 0x01, 0xe1,
+			  0x33, 0xfb, 0x84, 0x3c, 0x96, 0x5d, 0xed, 0x47,
+			  0xe7, 0xa0, 0x86, 0xed, 0x76, 0x95, 0x01, 0x70,
+			  0xe4, 0xf9, 0x67, 0xd2, 0x7b, 0x69, 0xb2, 0x25 },
+			{ 0xbc, 0x78, 0x1a, 0xd9, 0xe0, 0xb2, 0x62, 0x90,
+			  0x67, 0x96, 0x50, 0xc8, 0x9c, 0x88, 0xc9, 0x47,
+			  0xb8, 0x70, 0x50, 0x40, 0x66, 0x4a, 0xf5, 0x9d,
+			  0xbf, 0xa1, 0x93, 0x24, 0xa9, 0xe6, 0x69, 0x73 },
+			{ 0x64, 0x68, 0x98, 0x13, 0xfb, 0x3f, 0x67, 0x9d,
+			  0xb8, 0xc7, 0x5d, 0x41, 0xd9, 0xfb, 0xa5, 0x3c,
+			  0x5e, 0x3b, 0x27, 0xdf, 0x3b, 0xcc, 0x4e, 0xe0,
+			  0xd2, 0x4c, 0x4e, 0xb5, 0x3d, 0x68, 0x20, 0x14 },
+		},
+		{
+			{ 0xd0, 0x5a, 0xcc, 0xc1, 0x6f, 0xbb, 0xee, 0x34,
+			  0x8b, 0xac, 0x46, 0x96, 0xe9, 0x0c, 0x1b, 0x6a,
+			  0x53, 0xde, 0x6b, 0xa6, 0x49, 0xda, 0xb0, 0xd3,
+			  0xc1, 0x81, 0xd0, 0x61, 0x41, 0x3b, 0xe8, 0x31 },
+			{ 0x97, 0xd1, 0x9d, 0x24, 0x1e, 0xbd, 0x78, 0xb4,
+			  0x02, 0xc1, 0x58, 0x5e, 0x00, 0x35, 0x0c, 0x62,
+			  0x5c, 0xac, 0xba, 0xcc, 0x2f, 0xd3, 0x02, 0xfb,
+			  0x2d, 0xa7, 0x08, 0xf5, 0xeb, 0x3b, 0xb6, 0x60 },
+			{ 0x4f, 0x2b, 0x06, 0x9e, 0x12, 0xc7, 0xe8, 0x97,
+			  0xd8, 0x0a, 0x32, 0x29, 0x4f, 0x8f, 0xe4, 0x49,
+			  0x3f, 0x68, 0x18, 0x6f, 0x4b, 0xe1, 0xec, 0x5b,
+			  0x17, 0x03, 0x55, 0x2d, 0xb6, 0x1e, 0xcf, 0x55 },
+		},
+		{
+			{ 0x52, 0x8c, 0xf5, 0x7d, 0xe3, 0xb5, 0x76, 0x30,
+			  0x36, 0xcc, 0x99, 0xe7, 0xdd, 0xb9, 0x3a, 0xd7,
+			  0x20, 0xee, 0x13, 0x49, 0xe3, 0x1c, 0x83, 0xbd,
+			  0x33, 0x01, 0xba, 0x62, 0xaa, 0xfb, 0x56, 0x1a },
+			{ 0x58, 0x3d, 0xc2, 0x65, 0x10, 0x10, 0x79, 0x58,
+			  0x9c, 0x81, 0x94, 0x50, 0x6d, 0x08, 0x9d, 0x8b,
+			  0xa7, 0x5f, 0xc5, 0x12, 0xa9, 0x2f, 0x40, 0xe2,
+			  0xd4, 0x91, 0x08, 0x57, 0x64, 0x65, 0x9a, 0x66 },
+			{ 0xec, 0xc9, 0x9d, 0x5c, 0x50, 0x6b, 0x3e, 0x94,
+			  0x1a, 0x37, 0x7c, 0xa7, 0xbb, 0x57, 0x25, 0x30,
+			  0x51, 0x76, 0x34, 0x41, 0x56, 0xae, 0x73, 0x98,
+			  0x5c, 0x8a, 0xc5, 0x99, 0x67, 0x83, 0xc4, 0x13 },
+		},
+		{
+			{ 0x80, 0xd0, 0x8b, 0x5d, 0x6a, 0xfb, 0xdc, 0xc4,
+			  0x42, 0x48, 0x1a, 0x57, 0xec, 0xc4, 0xeb, 0xde,
+			  0x65, 0x53, 0xe5, 0xb8, 0x83, 0xe8, 0xb2, 0xd4,
+			  0x27, 0xb8, 0xe5, 0xc8, 0x7d, 0xc8, 0xbd, 0x50 },
+			{ 0xb9, 0xe1, 0xb3, 0x5a, 0x46, 0x5d, 0x3a, 0x42,
+			  0x61, 0x3f, 0xf1, 0xc7, 0x87, 0xc1, 0x13, 0xfc,
+			  0xb6, 0xb9, 0xb5, 0xec, 0x64, 0x36, 0xf8, 0x19,
+			  0x07, 0xb6, 0x37, 0xa6, 0x93, 0x0c, 0xf8, 0x66 },
+			{ 0x11, 0xe1, 0xdf, 0x6e, 0x83, 0x37, 0x6d, 0x60,
+			  0xd9, 0xab, 0x11, 0xf0, 0x15, 0x3e, 0x35, 0x32,
+			  0x96, 0x3b, 0xb7, 0x25, 0xc3, 0x3a, 0xb0, 0x64,
+			  0xae, 0xd5, 0x5f, 0x72, 0x44, 0x64, 0xd5, 0x1d },
+		},
+		{
+			{ 0x9a, 0xc8, 0xba, 0x08, 0x00, 0xe6, 0x97, 0xc2,
+			  0xe0, 0xc3, 0xe1, 0xea, 0x11, 0xea, 0x4c, 0x7d,
+			  0x7c, 0x97, 0xe7, 0x9f, 0xe1, 0x8b, 0xe3, 0xf3,
+			  0xcd, 0x05, 0xa3, 0x63, 0x0f, 0x45, 0x3a, 0x3a },
+			{ 0x7d, 0x12, 0x62, 0x33, 0xf8, 0x7f, 0xa4, 0x8f,
+			  0x15, 0x7c, 0xcd, 0x71, 0xc4, 0x6a, 0x9f, 0xbc,
+			  0x8b, 0x0c, 0x22, 0x49, 0x43, 0x45, 0x71, 0x6e,
+			  0x2e, 0x73, 0x9f, 0x21, 0x12, 0x59, 0x64, 0x0e },
+			{ 0x27, 0x46, 0x39, 0xd8, 0x31, 0x2f, 0x8f, 0x07,
+			  0x10, 0xa5, 0x94, 0xde, 0x83, 0x31, 0x9d, 0x38,
+			  0x80, 0x6f, 0x99, 0x17, 0x6d, 0x6c, 0xe3, 0xd1,
+			  0x7b, 0xa8, 0xa9, 0x93, 0x93, 0x8d, 0x8c, 0x31 },
+		},
+		{
+			{ 0x98, 0xd3, 0x1d, 0xab, 0x29, 0x9e, 0x66, 0x5d,
+			  0x3b, 0x9e, 0x2d, 0x34, 0x58, 0x16, 0x92, 0xfc,
+			  0xcd, 0x73, 0x59, 0xf3, 0xfd, 0x1d, 0x85, 0x55,
+			  0xf6, 0x0a, 0x95, 0x25, 0xc3, 0x41, 0x9a, 0x50 },
+			{ 0x19, 0xfe, 0xff, 0x2a, 0x03, 0x5d, 0x74, 0xf2,
+			  0x66, 0xdb, 0x24, 0x7f, 0x49, 0x3c, 0x9f, 0x0c,
+			  0xef, 0x98, 0x85, 0xba, 0xe3, 0xd3, 0x98, 0xbc,
+			  0x14, 0x53, 0x1d, 0x9a, 0x67, 0x7c, 0x4c, 0x22 },
+			{ 0xe9, 0x25, 0xf9, 0xa6, 0xdc, 0x6e, 0xc0, 0xbd,
+			  0x33, 0x1f, 0x1b, 0x64, 0xf4, 0xf3, 0x3e, 0x79,
+			  0x89, 0x3e, 0x83, 0x9d, 0x80, 0x12, 0xec, 0x82,
+			  0x89, 0x13, 0xa1, 0x28, 0x23, 0xf0, 0xbf, 0x05 },
+		},
+		{
+			{ 0xe4, 0x12, 0xc5, 0x0d, 0xdd, 0xa0, 0x81, 0x68,
+			  0xfe, 0xfa, 0xa5, 0x44, 0xc8, 0x0d, 0xe7, 0x4f,
+			  0x40, 0x52, 0x4a, 0x8f, 0x6b, 0x8e, 0x74, 0x1f,
+			  0xea, 0xa3, 0x01, 0xee, 0xcd, 0x77, 0x62, 0x57 },
+			{ 0x0b, 0xe0, 0xca, 0x23, 0x70, 0x13, 0x32, 0x36,
+			  0x59, 0xcf, 0xac, 0xd1, 0x0a, 0xcf, 0x4a, 0x54,
+			  0x88, 0x1c, 0x1a, 0xd2, 0x49, 0x10, 0x74, 0x96,
+			  0xa7, 0x44, 0x2a, 0xfa, 0xc3, 0x8c, 0x0b, 0x78 },
+			{ 0x5f, 0x30, 0x4f, 0x23, 0xbc, 0x8a, 0xf3, 0x1e,
+			  0x08, 0xde, 0x05, 0x14, 0xbd, 0x7f, 0x57, 0x9a,
+			  0x0d, 0x2a, 0xe6, 0x34, 0x14, 0xa5, 0x82, 0x5e,
+			  0xa1, 0xb7, 0x71, 0x62, 0x72, 0x18, 0xf4, 0x5f },
+		},
+		{
+			{ 0x40, 0x95, 0xb6, 0x13, 0xe8, 0x47, 0xdb, 0xe5,
+			  0xe1, 0x10, 0x26, 0x43, 0x3b, 0x2a, 0x5d, 0xf3,
+			  0x76, 0x12, 0x78, 0x38, 0xe9, 0x26, 0x1f, 0xac,
+			  0x69, 0xcb, 0xa0, 0xa0, 0x8c, 0xdb, 0xd4, 0x29 },
+			{ 0x9d, 0xdb, 0x89, 0x17, 0x0c, 0x08, 0x8e, 0x39,
+			  0xf5, 0x78, 0xe7, 0xf3, 0x25, 0x20, 0x60, 0xa7,
+			  0x5d, 0x03, 0xbd, 0x06, 0x4c, 0x89, 0x98, 0xfa,
+			  0xbe, 0x66, 0xa9, 0x25, 0xdc, 0x03, 0x6a, 0x10 },
+			{ 0xd0, 0x53, 0x33, 0x33, 0xaf, 0x0a, 0xad, 0xd9,
+			  0xe5, 0x09, 0xd3, 0xac, 0xa5, 0x9d, 0x66, 0x38,
+			  0xf0, 0xf7, 0x88, 0xc8, 0x8a, 0x65, 0x57, 0x3c,
+			  0xfa, 0xbe, 0x2c, 0x05, 0x51, 0x8a, 0xb3, 0x4a },
+		},
+	},
+	{
+		{
+			{ 0x9c, 0xc0, 0xdd, 0x5f, 0xef, 0xd1, 0xcf, 0xd6,
+			  0xce, 0x5d, 0x57, 0xf7, 0xfd, 0x3e, 0x2b, 0xe8,
+			  0xc2, 0x34, 0x16, 0x20, 0x5d, 0x6b, 0xd5, 0x25,
+			  0x9b, 0x2b, 0xed, 0x04, 0xbb, 0xc6, 0x41, 0x30 },
+			{ 0x93, 0xd5, 0x68, 0x67, 0x25, 0x2b, 0x7c, 0xda,
+			  0x13, 0xca, 0x22, 0x44, 0x57, 0xc0, 0xc1, 0x98,
+			  0x1d, 0xce, 0x0a, 0xca, 0xd5, 0x0b, 0xa8, 0xf1,
+			  0x90, 0xa6, 0x88, 0xc0, 0xad, 0xd1, 0xcd, 0x29 },
+			{ 0x48, 0xe1, 0x56, 0xd9, 0xf9, 0xf2, 0xf2, 0x0f,
+			  0x2e, 0x6b, 0x35, 0x9f, 0x75, 0x97, 0xe7, 0xad,
+			  0x5c, 0x02, 0x6c, 0x5f, 0xbb, 0x98, 0x46, 0x1a,
+			  0x7b, 0x9a, 0x04, 0x14, 0x68, 0xbd, 0x4b, 0x10 },
+		},
+		{
+			{ 0x63, 0xf1, 0x7f, 0xd6, 0x5f, 0x9a, 0x5d, 0xa9,
+			  0x81, 0x56, 0xc7, 0x4c, 0x9d, 0xe6, 0x2b, 0xe9,
+			  0x57, 0xf2, 0x20, 0xde, 0x4c, 0x02, 0xf8, 0xb7,
+			  0xf5, 0x2d, 0x07, 0xfb, 0x20, 0x2a, 0x4f, 0x20 },
+			{ 0x67, 0xed, 0xf1, 0x68, 0x31, 0xfd, 0xf0, 0x51,
+			  0xc2, 0x3b, 0x6f, 0xd8, 0xcd, 0x1d, 0x81, 0x2c,
+			  0xde, 0xf2, 0xd2, 0x04, 0x43, 0x5c, 0xdc, 0x44,
+			  0x49, 0x71, 0x2a, 0x09, 0x57, 0xcc, 0xe8, 0x5b },
+			{ 0x79, 0xb0, 0xeb, 0x30, 0x3d, 0x3b, 0x14, 0xc8,
+			  0x30, 0x2e, 0x65, 0xbd, 0x5a, 0x15, 0x89, 0x75,
+			  0x31, 0x5c, 0x6d, 0x8f, 0x31, 0x3c, 0x3c, 0x65,
+			  0x1f, 0x16, 0x79, 0xc2, 0x17, 0xfb, 0x70, 0x25 },
+		},
+		{
+			{ 0x5a, 0x24, 0xb8, 0x0b, 0x55, 0xa9, 0x2e, 0x19,
+			  0xd1, 0x50, 0x90, 0x8f, 0xa8, 0xfb, 0xe6, 0xc8,
+			  0x35, 0xc9, 0xa4, 0x88, 0x2d, 0xea, 0x86, 0x79,
+			  0x68, 0x86, 0x01, 0xde, 0x91, 0x5f, 0x1c, 0x24 },
+			{ 0x75, 0x15, 0xb6, 0x2c, 0x7f, 0x36, 0xfa, 0x3e,
+			  0x6c, 0x02, 0xd6, 0x1c, 0x76, 0x6f, 0xf9, 0xf5,
+			  0x62, 0x25, 0xb5, 0x65, 0x2a, 0x14, 0xc7, 0xe8,
+			  0xcd, 0x0a, 0x03, 0x53, 0xea, 0x65, 0xcb, 0x3d },
+			{ 0xaa, 0x6c, 0xde, 0x40, 0x29, 0x17, 0xd8, 0x28,
+			  0x3a, 0x73, 0xd9, 0x22, 0xf0, 0x2c, 0xbf, 0x8f,
+			  0xd1, 0x01, 0x5b, 0x23, 0xdd, 0xfc, 0xd7, 0x16,
+			  0xe5, 0xf0, 0xcd, 0x5f, 0xdd, 0x0e, 0x42, 0x08 },
+		},
+		{
+			{ 0xce, 0x10, 0xf4, 0x04, 0x4e, 0xc3, 0x58, 0x03,
+			  0x85, 0x06, 0x6e, 0x27, 0x5a, 0x5b, 0x13, 0xb6,
+			  0x21, 0x15, 0xb9, 0xeb, 0xc7, 0x70, 0x96, 0x5d,
+			  0x9c, 0x88, 0xdb, 0x21, 0xf3, 0x54, 0xd6, 0x04 },
+			{ 0x4a, 0xfa, 0x62, 0x83, 0xab, 0x20, 0xff, 0xcd,
+			  0x6e, 0x3e, 0x1a, 0xe2, 0xd4, 0x18, 0xe1, 0x57,
+			  0x2b, 0xe6, 0x39, 0xfc, 0x17, 0x96, 0x17, 0xe3,
+			  0xfd, 0x69, 0x17, 0xbc, 0xef, 0x53, 0x9a, 0x0d },
+			{ 0xd5, 0xb5, 0xbd, 0xdd, 0x16, 0xc1, 0x7d, 0x5e,
+			  0x2d, 0xdd, 0xa5, 0x8d, 0xb6, 0xde, 0x54, 0x29,
+			  0x92, 0xa2, 0x34, 0x33, 0x17, 0x08, 0xb6, 0x1c,
+			  0xd7, 0x1a, 0x99, 0x18, 0x26, 0x4f, 0x7a, 0x4a },
+		},
+		{
+			{ 0x4b, 0x2a, 0x37, 0xaf, 0x91, 0xb2, 0xc3, 0x24,
+			  0xf2, 0x47, 0x81, 0x71, 0x70, 0x82, 0xda, 0x93,
+			  0xf2, 0x9e, 0x89, 0x86, 0x64, 0x85, 0x84, 0xdd,
+			  0x33, 0xee, 0xe0, 0x23, 0x42, 0x31, 0x96, 0x4a },
+			{ 0x95, 0x5f, 0xb1, 0x5f, 0x02, 0x18, 0xa7, 0xf4,
+			  0x8f, 0x1b, 0x5c, 0x6b, 0x34, 0x5f, 0xf6, 0x3d,
+			  0x12, 0x11, 0xe0, 0x00, 0x85, 0xf0, 0xfc, 0xcd,
+			  0x48, 0x18, 0xd3, 0xdd, 0x4c, 0x0c, 0xb5, 0x11 },
+			{ 0xd6, 0xff, 0xa4, 0x08, 0x44, 0x27, 0xe8, 0xa6,
+			  0xd9, 0x76, 0x15, 0x9c, 0x7e, 0x17, 0x8e, 0x73,
+			  0xf2, 0xb3, 0x02, 0x3d, 0xb6, 0x48, 0x33, 0x77,
+			  0x51, 0xcc, 0x6b, 0xce, 0x4d, 0xce, 0x4b, 0x4f },
+		},
+		{
+			{ 0x6f, 0x0b, 0x9d, 0xc4, 0x6e, 0x61, 0xe2, 0x30,
+			  0x17, 0x23, 0xec, 0xca, 0x8f, 0x71, 0x56, 0xe4,
+			  0xa6, 0x4f, 0x6b, 0xf2, 0x9b, 0x40, 0xeb, 0x48,
+			  0x37, 0x5f, 0x59, 0x61, 0xe5, 0xce, 0x42, 0x30 },
+			{ 0x84, 0x25, 0x24, 0xe2, 0x5a, 0xce, 0x1f, 0xa7,
+			  0x9e, 0x8a, 0xf5, 0x92, 0x56, 0x72, 0xea, 0x26,
+			  0xf4, 0x3c, 0xea, 0x1c, 0xd7, 0x09, 0x1a, 0xd2,
+			  0xe6, 0x01, 0x1c, 0xb7, 0x14, 0xdd, 0xfc, 0x73 },
+			{ 0x41, 0xac, 0x9b, 0x44, 0x79, 0x70, 0x7e, 0x42,
+			  0x0a, 0x31, 0xe2, 0xbc, 0x6d, 0xe3, 0x5a, 0x85,
+			  0x7c, 0x1a, 0x84, 0x5f, 0x21, 0x76, 0xae, 0x4c,
+			  0xd6, 0xe1, 0x9c, 0x9a, 0x0c, 0x74, 0x9e, 0x38 },
+		},
+		{
+			{ 0x28, 0xac, 0x0e, 0x57, 0xf6, 0x78, 0xbd, 0xc9,
+			  0xe1, 0x9c, 0x91, 0x27, 0x32, 0x0b, 0x5b, 0xe5,
+			  0xed, 0x91, 0x9b, 0xa1, 0xab, 0x3e, 0xfc, 0x65,
+			  0x90, 0x36, 0x26, 0xd6, 0xe5, 0x25, 0xc4, 0x25 },
+			{ 0xce, 0xb9, 0xdc, 0x34, 0xae, 0xb3, 0xfc, 0x64,
+			  0xad, 0xd0, 0x48, 0xe3, 0x23, 0x03, 0x50, 0x97,
+			  0x1b, 0x38, 0xc6, 0x62, 0x7d, 0xf0, 0xb3, 0x45,
+			  0x88, 0x67, 0x5a, 0x46, 0x79, 0x53, 0x54, 0x61 },
+			{ 0x6e, 0xde, 0xd7, 0xf1, 0xa6, 0x06, 0x3e, 0x3f,
+			  0x08, 0x23, 0x06, 0x8e, 0x27, 0x76, 0xf9, 0x3e,
+			  0x77, 0x6c, 0x8a, 0x4e, 0x26, 0xf6, 0x14, 0x8c,
+			  0x59, 0x47, 0x48, 0x15, 0x89, 0xa0, 0x39, 0x65 },
+		},
+		{
+			{ 0x19, 0x4a, 0xbb, 0x14, 0xd4, 0xdb, 0xc4, 0xdd,
+			  0x8e, 0x4f, 0x42, 0x98, 0x3c, 0xbc, 0xb2, 0x19,
+			  0x69, 0x71, 0xca, 0x36, 0xd7, 0x9f, 0xa8, 0x48,
+			  0x90, 0xbd, 0x19, 0xf0, 0x0e, 0x32, 0x65, 0x0f },
+			{ 0x73, 0xf7, 0xd2, 0xc3, 0x74, 0x1f, 0xd2, 0xe9,
+			  0x45, 0x68, 0xc4, 0x25, 0x41, 0x54, 0x50, 0xc1,
+			  0x33, 0x9e, 0xb9, 0xf9, 0xe8, 0x5c, 0x4e, 0x62,
+			  0x6c, 0x18, 0xcd, 0xc5, 0xaa, 0xe4, 0xc5, 0x11 },
+			{ 0xc6, 0xe0, 0xfd, 0xca, 0xb1, 0xd1, 0x86, 0xd4,
+			  0x81, 0x51, 0x3b, 0x16, 0xe3, 0xe6, 0x3f, 0x4f,
+			  0x9a, 0x93, 0xf2, 0xfa, 0x0d, 0xaf, 0xa8, 0x59,
+			  0x2a, 0x07, 0x33, 0xec, 0xbd, 0xc7, 0xab, 0x4c },
+		},
+	},
+	{
+		{
+			{ 0x89, 0xd2, 0x78, 0x3f, 0x8f, 0x78, 0x8f, 0xc0,
+			  0x9f, 0x4d, 0x40, 0xa1, 0x2c, 0xa7, 0x30, 0xfe,
+			  0x9d, 0xcc, 0x65, 0xcf, 0xfc, 0x8b, 0x77, 0xf2,
+			  0x21, 0x20, 0xcb, 0x5a, 0x16, 0x98, 0xe4, 0x7e },
+			{ 0x2e, 0x0a, 0x9c, 0x08, 0x24, 0x96, 0x9e, 0x23,
+			  0x38, 0x47, 0xfe, 0x3a, 0xc0, 0xc4, 0x48, 0xc7,
+			  0x2a, 0xa1, 0x4f, 0x76, 0x2a, 0xed, 0xdb, 0x17,
+			  0x82, 0x85, 0x1c, 0x32, 0xf0, 0x93, 0x9b, 0x63 },
+			{ 0xc3, 0xa1, 0x11, 0x91, 0xe3, 0x08, 0xd5, 0x7b,
+			  0x89, 0x74, 0x90, 0x80, 0xd4, 0x90, 0x2b, 0x2b,
+			  0x19, 0xfd, 0x72, 0xae, 0xc2, 0xae, 0xd2, 0xe7,
+			  0xa6, 0x02, 0xb6, 0x85, 0x3c, 0x49, 0xdf, 0x0e },
+		},
+		{
+			{ 0x13, 0x41, 0x76, 0x84, 0xd2, 0xc4, 0x67, 0x67,
+			  0x35, 0xf8, 0xf5, 0xf7, 0x3f, 0x40, 0x90, 0xa0,
+			  0xde, 0xbe, 0xe6, 0xca, 0xfa, 0xcf, 0x8f, 0x1c,
+			  0x69, 0xa3, 0xdf, 0xd1, 0x54, 0x0c, 0xc0, 0x04 },
+			{ 0x68, 0x5a, 0x9b, 0x59, 0x58, 0x81, 0xcc, 0xae,
+			  0x0e, 0xe2, 0xad, 0xeb, 0x0f, 0x4f, 0x57, 0xea,
+			  0x07, 0x7f, 0xb6, 0x22, 0x74, 0x1d, 0xe4, 0x4f,
+			  0xb4, 0x4f, 0x9d, 0x01, 0xe3, 0x92, 0x3b, 0x40 },
+			{ 0xf8, 0x5c, 0x46, 0x8b, 0x81, 0x2f, 0xc2, 0x4d,
+			  0xf8, 0xef, 0x80, 0x14, 0x5a, 0xf3, 0xa0, 0x71,
+			  0x57, 0xd6, 0xc7, 0x04, 0xad, 0xbf, 0xe8, 0xae,
+			  0xf4, 0x76, 0x61, 0xb2, 0x2a, 0xb1, 0x5b, 0x35 },
+		},
+		{
+			{ 0x18, 0x73, 0x8c, 0x5a, 0xc7, 0xda, 0x01, 0xa3,
+			  0x11, 0xaa, 0xce, 0xb3, 0x9d, 0x03, 0x90, 0xed,
+			  0x2d, 0x3f, 0xae, 0x3b, 0xbf, 0x7c, 0x07, 0x6f,
+			  0x8e, 0xad, 0x52, 0xe0, 0xf8, 0xea, 0x18, 0x75 },
+			{ 0xf4, 0xbb, 0x93, 0x74, 0xcc, 0x64, 0x1e, 0xa7,
+			  0xc3, 0xb0, 0xa3, 0xec, 0xd9, 0x84, 0xbd, 0xe5,
+			  0x85, 0xe7, 0x05, 0xfa, 0x0c, 0xc5, 0x6b, 0x0a,
+			  0x12, 0xc3, 0x2e, 0x18, 0x32, 0x81, 0x9b, 0x0f },
+			{ 0x32, 0x6c, 0x7f, 0x1b, 0xc4, 0x59, 0x88, 0xa4,
+			  0x98, 0x32, 0x38, 0xf4, 0xbc, 0x60, 0x2d, 0x0f,
+			  0xd9, 0xd1, 0xb1, 0xc9, 0x29, 0xa9, 0x15, 0x18,
+			  0xc4, 0x55, 0x17, 0xbb, 0x1b, 0x87, 0xc3, 0x47 },
+		},
+		{
+			{ 0xb0, 0x66, 0x50, 0xc8, 0x50, 0x5d, 0xe6, 0xfb,
+			  0xb0, 0x99, 0xa2, 0xb3, 0xb0, 0xc4, 0xec, 0x62,
+			  0xe0, 0xe8, 0x1a, 0x44, 0xea, 0x54, 0x37, 0xe5,
+			  0x5f, 0x8d, 0xd4, 0xe8, 0x2c, 0xa0, 0xfe, 0x08 },
+			{ 0x48, 0x4f, 0xec, 0x71, 0x97, 0x53, 0x44, 0x51,
+			  0x6e, 0x5d, 0x8c, 0xc9, 0x7d, 0xb1, 0x05, 0xf8,
+			  0x6b, 0xc6, 0xc3, 0x47, 0x1a, 0xc1, 0x62, 0xf7,
+			  0xdc, 0x99, 0x46, 0x76, 0x85, 0x9b, 0xb8, 0x00 },
+			{ 0xd0, 0xea, 0xde, 0x68, 0x76, 0xdd, 0x4d, 0x82,
+			  0x23, 0x5d, 0x68, 0x4b, 0x20, 0x45, 0x64, 0xc8,
+			  0x65, 0xd6, 0x89, 0x5d, 0xcd, 0xcf, 0x14, 0xb5,
+			  0x37, 0xd5, 0x75, 0x4f, 0xa7, 0x29, 0x38, 0x47 },
+		},
+		{
+			{ 0xc9, 0x02, 0x39, 0xad, 0x3a, 0x53, 0xd9, 0x23,
+			  0x8f, 0x58, 0x03, 0xef, 0xce, 0xdd, 0xc2, 0x64,
+			  0xb4, 0x2f, 0xe1, 0xcf, 0x90, 0x73, 0x25, 0x15,
+			  0x90, 0xd3, 0xe4, 0x44, 0x4d, 0x8b, 0x66, 0x6c },
+			{ 0x18, 0xc4, 0x79, 0x46, 0x75, 0xda, 0xd2, 0x82,
+			  0xf0, 0x8d, 0x61, 0xb2, 0xd8, 0xd7, 0x3b, 0xe6,
+			  0x0a, 0xeb, 0x47, 0xac, 0x24, 0xef, 0x5e, 0x35,
+			  0xb4, 0xc6, 0x33, 0x48, 0x4c, 0x68, 0x78, 0x20 },
+			{ 0x0c, 0x82, 0x78, 0x7a, 0x21, 0xcf, 0x48, 0x3b,
+			  0x97, 0x3e, 0x27, 0x81, 0xb2, 0x0a, 0x6a, 0xf7,
+			  0x7b, 0xed, 0x8e, 0x8c, 0xa7, 0x65, 0x6c, 0xa9,
+			  0x3f, 0x43, 0x8a, 0x4f, 0x05, 0xa6, 0x11, 0x74 },
+		},
+		{
+			{ 0xb4, 0x75, 0xb1, 0x18, 0x3d, 0xe5, 0x9a, 0x57,
+			  0x02, 0xa1, 0x92, 0xf3, 0x59, 0x31, 0x71, 0x68,
+			  0xf5, 0x35, 0xef, 0x1e, 0xba, 0xec, 0x55, 0x84,
+			  0x8f, 0x39, 0x8c, 0x45, 0x72, 0xa8, 0xc9, 0x1e },
+			{ 0x6d, 0xc8, 0x9d, 0xb9, 0x32, 0x9d, 0x65, 0x4d,
+			  0x15, 0xf1, 0x3a, 0x60, 0x75, 0xdc, 0x4c, 0x04,
+			  0x88, 0xe4, 0xc2, 0xdc, 0x2c, 0x71, 0x4c, 0xb3,
+			  0xff, 0x34, 0x81, 0xfb, 0x74, 0x65, 0x13, 0x7c },
+			{ 0x9b, 0x50, 0xa2, 0x00, 0xd4, 0xa4, 0xe6, 0xb8,
+			  0xb4, 0x82, 0xc8, 0x0b, 0x02, 0xd7, 0x81, 0x9b,
+			  0x61, 0x75, 0x95, 0xf1, 0x9b, 0xcc, 0xe7, 0x57,
+			  0x60, 0x64, 0xcd, 0xc7, 0xa5, 0x88, 0xdd, 0x3a },
+		},
+		{
+			{ 0x46, 0x30, 0x39, 0x59, 0xd4, 0x98, 0xc2, 0x85,
+			  0xec, 0x59, 0xf6, 0x5f, 0x98, 0x35, 0x7e, 0x8f,
+			  0x3a, 0x6e, 0xf6, 0xf2, 0x2a, 0xa2, 0x2c, 0x1d,
+			  0x20, 0xa7, 0x06, 0xa4, 0x31, 0x11, 0xba, 0x61 },
+			{ 0xf2, 0xdc, 0x35, 0xb6, 0x70, 0x57, 0x89, 0xab,
+			  0xbc, 0x1f, 0x6c, 0xf6, 0x6c, 0xef, 0xdf, 0x02,
+			  0x87, 0xd1, 0xb6, 0xbe, 0x68, 0x02, 0x53, 0x85,
+			  0x74, 0x9e, 0x87, 0xcc, 0xfc, 0x29, 0x99, 0x24 },
+			{ 0x29, 0x90, 0x95, 0x16, 0xf1, 0xa0, 0xd0, 0xa3,
+			  0x89, 0xbd, 0x7e, 0xba, 0x6c, 0x6b, 0x3b, 0x02,
+			  0x07, 0x33, 0x78, 0x26, 0x3e, 0x5a, 0xf1, 0x7b,
+			  0xe7, 0xec, 0xd8, 0xbb, 0x0c, 0x31, 0x20, 0x56 },
+		},
+		{
+			{ 0xd6, 0x85, 0xe2, 0x77, 0xf4, 0xb5, 0x46, 0x66,
+			  0x93, 0x61, 0x8f, 0x6c, 0x67, 0xff, 0xe8, 0x40,
+			  0xdd, 0x94, 0xb5, 0xab, 0x11, 0x73, 0xec, 0xa6,
+			  0x4d, 0xec, 0x8c, 0x65, 0xf3, 0x46, 0xc8, 0x7e },
+			{ 0x43, 0xd6, 0x34, 0x49, 0x43, 0x93, 0x89, 0x52,
+			  0xf5, 0x22, 0x12, 0xa5, 0x06, 0xf8, 0xdb, 0xb9,
+			  0x22, 0x1c, 0xf4, 0xc3, 0x8f, 0x87, 0x6d, 0x8f,
+			  0x30, 0x97, 0x9d, 0x4d, 0x2a, 0x6a, 0x67, 0x37 },
+			{ 0xc7, 0x2e, 0xa2, 0x1d, 0x3f, 0x8f, 0x5e, 0x9b,
+			  0x13, 0xcd, 0x01, 0x6c, 0x77, 0x1d, 0x0f, 0x13,
+			  0xb8, 0x9f, 0x98, 0xa2, 0xcf, 0x8f, 0x4c, 0x21,
+			  0xd5, 0x9d, 0x9b, 0x39, 0x23, 0xf7, 0xaa, 0x6d },
+		},
+	},
+	{
+		{
+			{ 0xa2, 0x8e, 0xad, 0xac, 0xbf, 0x04, 0x3b, 0x58,
+			  0x84, 0xe8, 0x8b, 0x14, 0xe8, 0x43, 0xb7, 0x29,
+			  0xdb, 0xc5, 0x10, 0x08, 0x3b, 0x58, 0x1e, 0x2b,
+			  0xaa, 0xbb, 0xb3, 0x8e, 0xe5, 0x49, 0x54, 0x2b },
+			{ 0x47, 0xbe, 0x3d, 0xeb, 0x62, 0x75, 0x3a, 0x5f,
+			  0xb8, 0xa0, 0xbd, 0x8e, 0x54, 0x38, 0xea, 0xf7,
+			  0x99, 0x72, 0x74, 0x45, 0x31, 0xe5, 0xc3, 0x00,
+			  0x51, 0xd5, 0x27, 0x16, 0xe7, 0xe9, 0x04, 0x13 },
+			{ 0xfe, 0x9c, 0xdc, 0x6a, 0xd2, 0x14, 0x98, 0x78,
+			  0x0b, 0xdd, 0x48, 0x8b, 0x3f, 0xab, 0x1b, 0x3c,
+			  0x0a, 0xc6, 0x79, 0xf9, 0xff, 0xe1, 0x0f, 0xda,
+			  0x93, 0xd6, 0x2d, 0x7c, 0x2d, 0xde, 0x68, 0x44 },
+		},
+		{
+			{ 0xce, 0x07, 0x63, 0xf8, 0xc6, 0xd8, 0x9a, 0x4b,
+			  0x28, 0x0c, 0x5d, 0x43, 0x31, 0x35, 0x11, 0x21,
+			  0x2c, 0x77, 0x7a, 0x65, 0xc5, 0x66, 0xa8, 0xd4,
+			  0x52, 0x73, 0x24, 0x63, 0x7e, 0x42, 0xa6, 0x5d },
+			{ 0x9e, 0x46, 0x19, 0x94, 0x5e, 0x35, 0xbb, 0x51,
+			  0x54, 0xc7, 0xdd, 0x23, 0x4c, 0xdc, 0xe6, 0x33,
+			  0x62, 0x99, 0x7f, 0x44, 0xd6, 0xb6, 0xa5, 0x93,
+			  0x63, 0xbd, 0x44, 0xfb, 0x6f, 0x7c, 0xce, 0x6c },
+			{ 0xca, 0x22, 0xac, 0xde, 0x88, 0xc6, 0x94, 0x1a,
+			  0xf8, 0x1f, 0xae, 0xbb, 0xf7, 0x6e, 0x06, 0xb9,
+			  0x0f, 0x58, 0x59, 0x8d, 0x38, 0x8c, 0xad, 0x88,
+			  0xa8, 0x2c, 0x9f, 0xe7, 0xbf, 0x9a, 0xf2, 0x58 },
+		},
+		{
+			{ 0xf6, 0xcd, 0x0e, 0x71, 0xbf, 0x64, 0x5a, 0x4b,
+			  0x3c, 0x29, 0x2c, 0x46, 0x38, 0xe5, 0x4c, 0xb1,
+			  0xb9, 0x3a, 0x0b, 0xd5, 0x56, 0xd0, 0x43, 0x36,
+			  0x70, 0x48, 0x5b, 0x18, 0x24, 0x37, 0xf9, 0x6a },
+			{ 0x68, 0x3e, 0xe7, 0x8d, 0xab, 0xcf, 0x0e, 0xe9,
+			  0xa5, 0x76, 0x7e, 0x37, 0x9f, 0x6f, 0x03, 0x54,
+			  0x82, 0x59, 0x01, 0xbe, 0x0b, 0x5b, 0x49, 0xf0,
+			  0x36, 0x1e, 0xf4, 0xa7, 0xc4, 0x29, 0x76, 0x57 },
+			{ 0x88, 0xa8, 0xc6, 0x09, 0x45, 0x02, 0x20, 0x32,
+			  0x73, 0x89, 0x55, 0x4b, 0x13, 0x36, 0xe0, 0xd2,
+			  0x9f, 0x28, 0x33, 0x3c, 0x23, 0x36, 0xe2, 0x83,
+			  0x8f, 0xc1, 0xae, 0x0c, 0xbb, 0x25, 0x1f, 0x70 },
+		},
+		{
+			{ 0x13, 0xc1, 0xbe, 0x7c, 0xd9, 0xf6, 0x18, 0x9d,
+			  0xe4, 0xdb, 0xbf, 0x74, 0xe6, 0x06, 0x4a, 0x84,
+			  0xd6, 0x60, 0x4e, 0xac, 0x22, 0xb5, 0xf5, 0x20,
+			  0x51, 0x5e, 0x95, 0x50, 0xc0, 0x5b, 0x0a, 0x72 },
+			{ 0xed, 0x6c, 0x61, 0xe4, 0xf8, 0xb0, 0xa8, 0xc3,
+			  0x7d, 0xa8, 0x25, 0x9e, 0x0e, 0x66, 0x00, 0xf7,
+			  0x9c, 0xa5, 0xbc, 0xf4, 0x1f, 0x06, 0xe3, 0x61,
+			  0xe9, 0x0b, 0xc4, 0xbd, 0xbf, 0x92, 0x0c, 0x2e },
+			{ 0x35, 0x5a, 0x80, 0x9b, 0x43, 0x09, 0x3f, 0x0c,
+			  0xfc, 0xab, 0x42, 0x62, 0x37, 0x8b, 0x4e, 0xe8,
+			  0x46, 0x93, 0x22, 0x5c, 0xf3, 0x17, 0x14, 0x69,
+			  0xec, 0xf0, 0x4e, 0x14, 0xbb, 0x9c, 0x9b, 0x0e },
+		},
+		{
+			{ 0xee, 0xbe, 0xb1, 0x5d, 0xd5, 0x9b, 0xee, 0x8d,
+			  0xb9, 0x3f, 0x72, 0x0a, 0x37, 0xab, 0xc3, 0xc9,
+			  0x91, 0xd7, 0x68, 0x1c, 0xbf, 0xf1, 0xa8, 0x44,
+			  0xde, 0x3c, 0xfd, 0x1c, 0x19, 0x44, 0x6d, 0x36 },
+			{ 0xad, 0x20, 0x57, 0xfb, 0x8f, 0xd4, 0xba, 0xfb,
+			  0x0e, 0x0d, 0xf9, 0xdb, 0x6b, 0x91, 0x81, 0xee,
+			  0xbf, 0x43, 0x55, 0x63, 0x52, 0x31, 0x81, 0xd4,
+			  0xd8, 0x7b, 0x33, 0x3f, 0xeb, 0x04, 0x11, 0x22 },
+			{ 0x14, 0x8c, 0xbc, 0xf2, 0x43, 0x17, 0x3c, 0x9e,
+			  0x3b, 0x6c, 0x85, 0xb5, 0xfc, 0x26, 0xda, 0x2e,
+			  0x97, 0xfb, 0xa7, 0x68, 0x0e, 0x2f, 0xb8, 0xcc,
+			  0x44, 0x32, 0x59, 0xbc, 0xe6, 0xa4, 0x67, 0x41 },
+		},
+		{
+			{ 0xee, 0x8f, 0xce, 0xf8, 0x65, 0x26, 0xbe, 0xc2,
+			  0x2c, 0xd6, 0x80, 0xe8, 0x14, 0xff, 0x67, 0xe9,
+			  0xee, 0x4e, 0x36, 0x2f, 0x7e, 0x6e, 0x2e, 0xf1,
+			  0xf6, 0xd2, 0x7e, 0xcb, 0x70, 0x33, 0xb3, 0x34 },
+			{ 0x00, 0x27, 0xf6, 0x76, 0x28, 0x9d, 0x3b, 0x64,
+			  0xeb, 0x68, 0x76, 0x0e, 0x40, 0x9d, 0x1d, 0x5d,
+			  0x84, 0x06, 0xfc, 0x21, 0x03, 0x43, 0x4b, 0x1b,
+			  0x6a, 0x24, 0x55, 0x22, 0x7e, 0xbb, 0x38, 0x79 },
+			{ 0xcc, 0xd6, 0x81, 0x86, 0xee, 0x91, 0xc5, 0xcd,
+			  0x53, 0xa7, 0x85, 0xed, 0x9c, 0x10, 0x02, 0xce,
+			  0x83, 0x88, 0x80, 0x58, 0xc1, 0x85, 0x74, 0xed,
+			  0xe4, 0x65, 0xfe, 0x2d, 0x6e, 0xfc, 0x76, 0x11 },
+		},
+		{
+			{ 0xb8, 0x0e, 0x77, 0x49, 0x89, 0xe2, 0x90, 0xdb,
+			  0xa3, 0x40, 0xf4, 0xac, 0x2a, 0xcc, 0xfb, 0x98,
+			  0x9b, 0x87, 0xd7, 0xde, 0xfe, 0x4f, 0x35, 0x21,
+			  0xb6, 0x06, 0x69, 0xf2, 0x54, 0x3e, 0x6a, 0x1f },
+			{ 0x9b, 0x61, 0x9c, 0x5b, 0xd0, 0x6c, 0xaf, 0xb4,
+			  0x80, 0x84, 0xa5, 0xb2, 0xf4, 0xc9, 0xdf, 0x2d,
+			  0xc4, 0x4d, 0xe9, 0xeb, 0x02, 0xa5, 0x4f, 0x3d,
+			  0x34, 0x5f, 0x7d, 0x67, 0x4c, 0x3a, 0xfc, 0x08 },
+			{ 0xea, 0x34, 0x07, 0xd3, 0x99, 0xc1, 0xa4, 0x60,
+			  0xd6, 0x5c, 0x16, 0x31, 0xb6, 0x85, 0xc0, 0x40,
+			  0x95, 0x82, 0x59, 0xf7, 0x23, 0x3e, 0x33, 0xe2,
+			  0xd1, 0x00, 0xb9, 0x16, 0x01, 0xad, 0x2f, 0x4f },
+		},
+		{
+			{ 0x38, 0xb6, 0x3b, 0xb7, 0x1d, 0xd9, 0x2c, 0x96,
+			  0x08, 0x9c, 0x12, 0xfc, 0xaa, 0x77, 0x05, 0xe6,
+			  0x89, 0x16, 0xb6, 0xf3, 0x39, 0x9b, 0x61, 0x6f,
+			  0x81, 0xee, 0x44, 0x29, 0x5f, 0x99, 0x51, 0x34 },
+			{ 0x54, 0x4e, 0xae, 0x94, 0x41, 0xb2, 0xbe, 0x44,
+			  0x6c, 0xef, 0x57, 0x18, 0x51, 0x1c, 0x54, 0x5f,
+			  0x98, 0x04, 0x8d, 0x36, 0x2d, 0x6b, 0x1e, 0xa6,
+			  0xab, 0xf7, 0x2e, 0x97, 0xa4, 0x84, 0x54, 0x44 },
+			{ 0x7c, 0x7d, 0xea, 0x9f, 0xd0, 0xfc, 0x52, 0x91,
+			  0xf6, 0x5c, 0x93, 0xb0, 0x94, 0x6c, 0x81, 0x4a,
+			  0x40, 0x5c, 0x28, 0x47, 0xaa, 0x9a, 0x8e, 0x25,
+			  0xb7, 0x93, 0x28, 0x04, 0xa6, 0x9c, 0xb8, 0x10 },
+		},
+	},
+	{
+		{
+			{ 0x6e, 0xf0, 0x45, 0x5a, 0xbe, 0x41, 0x39, 0x75,
+			  0x65, 0x5f, 0x9c, 0x6d, 0xed, 0xae, 0x7c, 0xd0,
+			  0xb6, 0x51, 0xff, 0x72, 0x9c, 0x6b, 0x77, 0x11,
+			  0xa9, 0x4d, 0x0d, 0xef, 0xd9, 0xd1, 0xd2, 0x17 },
+			{ 0x9c, 0x28, 0x18, 0x97, 0x49, 0x47, 0x59, 0x3d,
+			  0x26, 0x3f, 0x53, 0x24, 0xc5, 0xf8, 0xeb, 0x12,
+			  0x15, 0xef, 0xc3, 0x14, 0xcb, 0xbf, 0x62, 0x02,
+			  0x8e, 0x51, 0xb7, 0x77, 0xd5, 0x78, 0xb8, 0x20 },
+			{ 0x6a, 0x3e, 0x3f, 0x07, 0x18, 0xaf, 0xf2, 0x27,
+			  0x69, 0x10, 0x52, 0xd7, 0x19, 0xe5, 0x3f, 0xfd,
+			  0x22, 0x00, 0xa6, 0x3c, 0x2c, 0xb7, 0xe3, 0x22,
+			  0xa7, 0xc6, 0x65, 0xcc, 0x63, 0x4f, 0x21, 0x72 },
+		},
+		{
+			{ 0xc9, 0x29, 0x3b, 0xf4, 0xb9, 0xb7, 0x9d, 0x1d,
+			  0x75, 0x8f, 0x51, 0x4f, 0x4a, 0x82, 0x05, 0xd6,
+			  0xc4, 0x9d, 0x2f, 0x31, 0xbd, 0x72, 0xc0, 0xf2,
+			  0xb0, 0x45, 0x15, 0x5a, 0x85, 0xac, 0x24, 0x1f },
+			{ 0x93, 0xa6, 0x07, 0x53, 0x40, 0x7f, 0xe3, 0xb4,
+			  0x95, 0x67, 0x33, 0x2f, 0xd7, 0x14, 0xa7, 0xab,
+			  0x99, 0x10, 0x76, 0x73, 0xa7, 0xd0, 0xfb, 0xd6,
+			  0xc9, 0xcb, 0x71, 0x81, 0xc5, 0x48, 0xdf, 0x5f },
+			{ 0xaa, 0x05, 0x95, 0x8e, 0x32, 0x08, 0xd6, 0x24,
+			  0xee, 0x20, 0x14, 0x0c, 0xd1, 0xc1, 0x48, 0x47,
+			  0xa2, 0x25, 0xfb, 0x06, 0x5c, 0xe4, 0xff, 0xc7,
+			  0xe6, 0x95, 0xe3, 0x2a, 0x9e, 0x73, 0xba, 0x00 },
+		},
+		{
+			{ 0x26, 0xbb, 0x88, 0xea, 0xf5, 0x26, 0x44, 0xae,
+			  0xfb, 0x3b, 0x97, 0x84, 0xd9, 0x79, 0x06, 0x36,
+			  0x50, 0x4e, 0x69, 0x26, 0x0c, 0x03, 0x9f, 0x5c,
+			  0x26, 0xd2, 0x18, 0xd5, 0xe7, 0x7d, 0x29, 0x72 },
+			{ 0xd6, 0x90, 0x87, 0x5c, 0xde, 0x98, 0x2e, 0x59,
+			  0xdf, 0xa2, 0xc2, 0x45, 0xd3, 0xb7, 0xbf, 0xe5,
+			  0x22, 0x99, 0xb4, 0xf9, 0x60, 0x3b, 0x5a, 0x11,
+			  0xf3, 0x78, 0xad, 0x67, 0x3e, 0x3a, 0x28, 0x03 },
+			{ 0x39, 0xb9, 0x0c, 0xbe, 0xc7, 0x1d, 0x24, 0x48,
+			  0x80, 0x30, 0x63, 0x8b, 0x4d, 0x9b, 0xf1, 0x32,
+			  0x08, 0x93, 0x28, 0x02, 0x0d, 0xc9, 0xdf, 0xd3,
+			  0x45, 0x19, 0x27, 0x46, 0x68, 0x29, 0xe1, 0x05 },
+		},
+		{
+			{ 0x50, 0x45, 0x2c, 0x24, 0xc8, 0xbb, 0xbf, 0xad,
+			  0xd9, 0x81, 0x30, 0xd0, 0xec, 0x0c, 0xc8, 0xbc,
+			  0x92, 0xdf, 0xc8, 0xf5, 0xa6, 0x66, 0x35, 0x84,
+			  0x4c, 0xce, 0x58, 0x82, 0xd3, 0x25, 0xcf, 0x78 },
+			{ 0x5a, 0x49, 0x9c, 0x2d, 0xb3, 0xee, 0x82, 0xba,
+			  0x7c, 0xb9, 0x2b, 0xf1, 0xfc, 0xc8, 0xef, 0xce,
+			  0xe0, 0xd1, 0xb5, 0x93, 0xae, 0xab, 0x2d, 0xb0,
+			  0x9b, 0x8d, 0x69, 0x13, 0x9c, 0x0c, 0xc0, 0x39 },
+			{ 0x68, 0x9d, 0x48, 0x31, 0x8e, 0x6b, 0xae, 0x15,
+			  0x87, 0xf0, 0x2b, 0x9c, 0xab, 0x1c, 0x85, 0xaa,
+			  0x05, 0xfa, 0x4e, 0xf0, 0x97, 0x5a, 0xa7, 0xc9,
+			  0x32, 0xf8, 0x3f, 0x6b, 0x07, 0x52, 0x6b, 0x00 },
+		},
+		{
+			{ 0x2d, 0x08, 0xce, 0xb9, 0x16, 0x7e, 0xcb, 0xf5,
+			  0x29, 0xbc, 0x7a, 0x41, 0x4c, 0xf1, 0x07, 0x34,
+			  0xab, 0xa7, 0xf4, 0x2b, 0xce, 0x6b, 0xb3, 0xd4,
+			  0xce, 0x75, 0x9f, 0x1a, 0x56, 0xe9, 0xe2, 0x7d },
+			{ 0x1c, 0x78, 0x95, 0x9d, 0xe1, 0xcf, 0xe0, 0x29,
+			  0xe2, 0x10, 0x63, 0x96, 0x18, 0xdf, 0x81, 0xb6,
+			  0x39, 0x6b, 0x51, 0x70, 0xd3, 0x39, 0xdf, 0x57,
+			  0x22, 0x61, 0xc7, 0x3b, 0x44, 0xe3, 0x57, 0x4d },
+			{ 0xcb, 0x5e, 0xa5, 0xb6, 0xf4, 0xd4, 0x70, 0xde,
+			  0x99, 0xdb, 0x85, 0x5d, 0x7f, 0x52, 0x01, 0x48,
+			  0x81, 0x9a, 0xee, 0xd3, 0x40, 0xc4, 0xc9, 0xdb,
+			  0xed, 0x29, 0x60, 0x1a, 0xaf, 0x90, 0x2a, 0x6b },
+		},
+		{
+			{ 0x0a, 0xd8, 0xb2, 0x5b, 0x24, 0xf3, 0xeb, 0x77,
+			  0x9b, 0x07, 0xb9, 0x2f, 0x47, 0x1b, 0x30, 0xd8,
+			  0x33, 0x73, 0xee, 0x4c, 0xf2, 0xe6, 0x47, 0xc6,
+			  0x09, 0x21, 0x6c, 0x27, 0xc8, 0x12, 0x58, 0x46 },
+			{ 0x97, 0x1e, 0xe6, 0x9a, 0xfc, 0xf4, 0x23, 0x69,
+			  0xd1, 0x5f, 0x3f, 0xe0, 0x1d, 0x28, 0x35, 0x57,
+			  0x2d, 0xd1, 0xed, 0xe6, 0x43, 0xae, 0x64, 0xa7,
+			  0x4a, 0x3e, 0x2d, 0xd1, 0xe9, 0xf4, 0xd8, 0x5f },
+			{ 0xd9, 0x62, 0x10, 0x2a, 0xb2, 0xbe, 0x43, 0x4d,
+			  0x16, 0xdc, 0x31, 0x38, 0x75, 0xfb, 0x65, 0x70,
+			  0xd7, 0x68, 0x29, 0xde, 0x7b, 0x4a, 0x0d, 0x18,
+			  0x90, 0x67, 0xb1, 0x1c, 0x2b, 0x2c, 0xb3, 0x05 },
+		},
+		{
+			{ 0x95, 0x81, 0xd5, 0x7a, 0x2c, 0xa4, 0xfc, 0xf7,
+			  0xcc, 0xf3, 0x33, 0x43, 0x6e, 0x28, 0x14, 0x32,
+			  0x9d, 0x97, 0x0b, 0x34, 0x0d, 0x9d, 0xc2, 0xb6,
+			  0xe1, 0x07, 0x73, 0x56, 0x48, 0x1a, 0x77, 0x31 },
+			{ 0xfd, 0xa8, 0x4d, 0xd2, 0xcc, 0x5e, 0xc0, 0xc8,
+			  0x83, 0xef, 0xdf, 0x05, 0xac, 0x1a, 0xcf, 0xa1,
+			  0x61, 0xcd, 0xf9, 0x7d, 0xf2, 0xef, 0xbe, 0xdb,
+			  0x99, 0x1e, 0x47, 0x7b, 0xa3, 0x56, 0x55, 0x3b },
+			{ 0x82, 0xd4, 0x4d, 0xe1, 0x24, 0xc5, 0xb0, 0x32,
+			  0xb6, 0xa4, 0x2b, 0x1a, 0x54, 0x51, 0xb3, 0xed,
+			  0xf3, 0x5a, 0x2b, 0x28, 0x48, 0x60, 0xd1, 0xa3,
+			  0xeb, 0x36, 0x73, 0x7a, 0xd2, 0x79, 0xc0, 0x4f },
+		},
+		{
+			{ 0x0d, 0xc5, 0x86, 0x0c, 0x44, 0x8b, 0x34, 0xdc,
+			  0x51, 0xe6, 0x94, 0xcc, 0xc9, 0xcb, 0x37, 0x13,
+			  0xb9, 0x3c, 0x3e, 0x64, 0x4d, 0xf7, 0x22, 0x64,
+			  0x08, 0xcd, 0xe3, 0xba, 0xc2, 0x70, 0x11, 0x24 },
+			{ 0x7f, 0x2f, 0xbf, 0x89, 0xb0, 0x38, 0xc9, 0x51,
+			  0xa7, 0xe9, 0xdf, 0x02, 0x65, 0xbd, 0x97, 0x24,
+			  0x53, 0xe4, 0x80, 0x78, 0x9c, 0xc0, 0xff, 0xff,
+			  0x92, 0x8e, 0xf9, 0xca, 0xce, 0x67, 0x45, 0x12 },
+			{ 0xb4, 0x73, 0xc4, 0x0a, 0x86, 0xab, 0xf9, 0x3f,
+			  0x35, 0xe4, 0x13, 0x01, 0xee, 0x1d, 0x91, 0xf0,
+			  0xaf, 0xc4, 0xc6, 0xeb, 0x60, 0x50, 0xe7, 0x4a,
+			  0x0d, 0x00, 0x87, 0x6c, 0x96, 0x12, 0x86, 0x3f },
+		},
+	},
+	{
+		{
+			{ 0x13, 0x8d, 0x04, 0x36, 0xfa, 0xfc, 0x18, 0x9c,
+			  0xdd, 0x9d, 0x89, 0x73, 0xb3, 0x9d, 0x15, 0x29,
+			  0xaa, 0xd0, 0x92, 0x9f, 0x0b, 0x35, 0x9f, 0xdc,
+			  0xd4, 0x19, 0x8a, 0x87, 0xee, 0x7e, 0xf5, 0x26 },
+			{ 0xde, 0x0d, 0x2a, 0x78, 0xc9, 0x0c, 0x9a, 0x55,
+			  0x85, 0x83, 0x71, 0xea, 0xb2, 0xcd, 0x1d, 0x55,
+			  0x8c, 0x23, 0xef, 0x31, 0x5b, 0x86, 0x62, 0x7f,
+			  0x3d, 0x61, 0x73, 0x79, 0x76, 0xa7, 0x4a, 0x50 },
+			{ 0xb1, 0xef, 0x87, 0x56, 0xd5, 0x2c, 0xab, 0x0c,
+			  0x7b, 0xf1, 0x7a, 0x24, 0x62, 0xd1, 0x80, 0x51,
+			  0x67, 0x24, 0x5a, 0x4f, 0x34, 0x5a, 0xc1, 0x85,
+			  0x69, 0x30, 0xba, 0x9d, 0x3d, 0x94, 0x41, 0x40 },
+		},
+		{
+			{ 0xdd, 0xaa, 0x6c, 0xa2, 0x43, 0x77, 0x21, 0x4b,
+			  0xce, 0xb7, 0x8a, 0x64, 0x24, 0xb4, 0xa6, 0x47,
+			  0xe3, 0xc9, 0xfb, 0x03, 0x7a, 0x4f, 0x1d, 0xcb,
+			  0x19, 0xd0, 0x00, 0x98, 0x42, 0x31, 0xd9, 0x12 },
+			{ 0x96, 0xcc, 0xeb, 0x43, 0xba, 0xee, 0xc0, 0xc3,
+			  0xaf, 0x9c, 0xea, 0x26, 0x9c, 0x9c, 0x74, 0x8d,
+			  0xc6, 0xcc, 0x77, 0x1c, 0xee, 0x95, 0xfa, 0xd9,
+			  0x0f, 0x34, 0x84, 0x76, 0xd9, 0xa1, 0x20, 0x14 },
+			{ 0x4f, 0x59, 0x37, 0xd3, 0x99, 0x77, 0xc6, 0x00,
+			  0x7b, 0xa4, 0x3a, 0xb2, 0x40, 0x51, 0x3c, 0x5e,
+			  0x95, 0xf3, 0x5f, 0xe3, 0x54, 0x28, 0x18, 0x44,
+			  0x12, 0xa0, 0x59, 0x43, 0x31, 0x92, 0x4f, 0x1b },
+		},
+		{
+			{ 0xb1, 0x66, 0x98, 0xa4, 0x30, 0x30, 0xcf, 0x33,
+			  0x59, 0x48, 0x5f, 0x21, 0xd2, 0x73, 0x1f, 0x25,
+			  0xf6, 0xf4, 0xde, 0x51, 0x40, 0xaa, 0x82, 0xab,
+			  0xf6, 0x23, 0x9a, 0x6f, 0xd5, 0x91, 0xf1, 0x5f },
+			{ 0x51, 0x09, 0x15, 0x89, 0x9d, 0x10, 0x5c, 0x3e,
+			  0x6a, 0x69, 0xe9, 0x2d, 0x91, 0xfa, 0xce, 0x39,
+			  0x20, 0x30, 0x5f, 0x97, 0x3f, 0xe4, 0xea, 0x20,
+			  0xae, 0x2d, 0x13, 0x7f, 0x2a, 0x57, 0x9b, 0x23 },
+			{ 0x68, 0x90, 0x2d, 0xac, 0x33, 0xd4, 0x9e, 0x81,
+			  0x23, 0x85, 0xc9, 0x5f, 0x79, 0xab, 0x83, 0x28,
+			  0x3d, 0xeb, 0x93, 0x55, 0x80, 0x72, 0x45, 0xef,
+			  0xcb, 0x36, 0x8f, 0x75, 0x6a, 0x52, 0x0c, 0x02 },
+		},
+		{
+			{ 0x89, 0xcc, 0x42, 0xf0, 0x59, 0xef, 0x31, 0xe9,
+			  0xb6, 0x4b, 0x12, 0x8e, 0x9d, 0x9c, 0x58, 0x2c,
+			  0x97, 0x59, 0xc7, 0xae, 0x8a, 0xe1, 0xc8, 0xad,
+			  0x0c, 0xc5, 0x02, 0x56, 0x0a, 0xfe, 0x2c, 0x45 },
+			{ 0xbc, 0xdb, 0xd8, 0x9e, 0xf8, 0x34, 0x98, 0x77,
+			  0x6c, 0xa4, 0x7c, 0xdc, 0xf9, 0xaa, 0xf2, 0xc8,
+			  0x74, 0xb0, 0xe1, 0xa3, 0xdc, 0x4c, 0x52, 0xa9,
+			  0x77, 0x38, 0x31, 0x15, 0x46, 0xcc, 0xaa, 0x02 },
+			{ 0xdf, 0x77, 0x78, 0x64, 0xa0, 0xf7, 0xa0, 0x86,
+			  0x9f, 0x7c, 0x60, 0x0e, 0x27, 0x64, 0xc4, 0xbb,
+			  0xc9, 0x11, 0xfb, 0xf1, 0x25, 0xea, 0x17, 0xab,
+			  0x7b, 0x87, 0x4b, 0x30, 0x7b, 0x7d, 0xfb, 0x4c },
+		},
+		{
+			{ 0x12, 0xef, 0x89, 0x97, 0xc2, 0x99, 0x86, 0xe2,
+			  0x0d, 0x19, 0x57, 0xdf, 0x71, 0xcd, 0x6e, 0x2b,
+			  0xd0, 0x70, 0xc9, 0xec, 0x57, 0xc8, 0x43, 0xc3,
+			  0xc5, 0x3a, 0x4d, 0x43, 0xbc, 0x4c, 0x1d, 0x5b },
+			{ 0xfe, 0x75, 0x9b, 0xb8, 0x6c, 0x3d, 0xb4, 0x72,
+			  0x80, 0xdc, 0x6a, 0x9c, 0xd9, 0x94, 0xc6, 0x54,
+			  0x9f, 0x4c, 0xe3, 0x3e, 0x37, 0xaa, 0xc3, 0xb8,
+			  0x64, 0x53, 0x07, 0x39, 0x2b, 0x62, 0xb4, 0x14 },
+			{ 0x26, 0x9f, 0x0a, 0xcc, 0x15, 0x26, 0xfb, 0xb6,
+			  0xe5, 0xcc, 0x8d, 0xb8, 0x2b, 0x0e, 0x4f, 0x3a,
+			  0x05, 0xa7, 0x69, 0x33, 0x8b, 0x49, 0x01, 0x13,
+			  0xd1, 0x2d, 0x59, 0x58, 0x12, 0xf7, 0x98, 0x2f },
+		},
+		{
+			{ 0x01, 0xa7, 0x54, 0x4f, 0x44, 0xae, 0x12, 0x2e,
+			  0xde, 0xd7, 0xcb, 0xa9, 0xf0, 0x3e, 0xfe, 0xfc,
+			  0xe0, 0x5d, 0x83, 0x75, 0x0d, 0x89, 0xbf, 0xce,
+			  0x54, 0x45, 0x61, 0xe7, 0xe9, 0x62, 0x80, 0x1d },
+			{ 0x56, 0x9e, 0x0f, 0xb5, 0x4c, 0xa7, 0x94, 0x0c,
+			  0x20, 0x13, 0x8e, 0x8e, 0xa9, 0xf4, 0x1f, 0x5b,
+			  0x67, 0x0f, 0x30, 0x82, 0x21, 0xcc, 0x2a, 0x9a,
+			  0xf9, 0xaa, 0x06, 0xd8, 0x49, 0xe2, 0x6a, 0x3a },
+			{ 0x5a, 0x7c, 0x90, 0xa9, 0x85, 0xda, 0x7a, 0x65,
+			  0x62, 0x0f, 0xb9, 0x91, 0xb5, 0xa8, 0x0e, 0x1a,
+			  0xe9, 0xb4, 0x34, 0xdf, 0xfb, 0x1d, 0x0e, 0x8d,
+			  0xf3, 0x5f, 0xf2, 0xae, 0xe8, 0x8c, 0x8b, 0x29 },
+		},
+		{
+			{ 0xde, 0x65, 0x21, 0x0a, 0xea, 0x72, 0x7a, 0x83,
+			  0xf6, 0x79, 0xcf, 0x0b, 0xb4, 0x07, 0xab, 0x3f,
+			  0x70, 0xae, 0x38, 0x77, 0xc7, 0x36, 0x16, 0x52,
+			  0xdc, 0xd7, 0xa7, 0x03, 0x18, 0x27, 0xa6, 0x6b },
+			{ 0xb2, 0x0c, 0xf7, 0xef, 0x53, 0x79, 0x92, 0x2a,
+			  0x76, 0x70, 0x15, 0x79, 0x2a, 0xc9, 0x89, 0x4b,
+			  0x6a, 0xcf, 0xa7, 0x30, 0x7a, 0x45, 0x18, 0x94,
+			  0x85, 0xe4, 0x5c, 0x4d, 0x40, 0xa8, 0xb8, 0x34 },
+			{ 0x35, 0x33, 0x69, 0x83, 0xb5, 0xec, 0x6e, 0xc2,
+			  0xfd, 0xfe, 0xb5, 0x63, 0xdf, 0x13, 0xa8, 0xd5,
+			  0x73, 0x25, 0xb2, 0xa4, 0x9a, 0xaa, 0x93, 0xa2,
+			  0x6a, 0x1c, 0x5e, 0x46, 0xdd, 0x2b, 0xd6, 0x71 },
+		},
+		{
+			{ 0xf5, 0x5e, 0xf7, 0xb1, 0xda, 0xb5, 0x2d, 0xcd,
+			  0xf5, 0x65, 0xb0, 0x16, 0xcf, 0x95, 0x7f, 0xd7,
+			  0x85, 0xf0, 0x49, 0x3f, 0xea, 0x1f, 0x57, 0x14,
+			  0x3d, 0x2b, 0x2b, 0x26, 0x21, 0x36, 0x33, 0x1c },
+			{ 0x80, 0xdf, 0x78, 0xd3, 0x28, 0xcc, 0x33, 0x65,
+			  0xb4, 0xa4, 0x0f, 0x0a, 0x79, 0x43, 0xdb, 0xf6,
+			  0x5a, 0xda, 0x01, 0xf7, 0xf9, 0x5f, 0x64, 0xe3,
+			  0xa4, 0x2b, 0x17, 0xf3, 0x17, 0xf3, 0xd5, 0x74 },
+			{ 0x81, 0xca, 0xd9, 0x67, 0x54, 0xe5, 0x6f, 0xa8,
+			  0x37, 0x8c, 0x29, 0x2b, 0x75, 0x7c, 0x8b, 0x39,
+			  0x3b, 0x62, 0xac, 0xe3, 0x92, 0x08, 0x6d, 0xda,
+			  0x8c, 0xd9, 0xe9, 0x47, 0x45, 0xcc, 0xeb, 0x4a },
+		},
+	},
+	{
+		{
+			{ 0x10, 0xb6, 0x54, 0x73, 0x9e, 0x8d, 0x40, 0x0b,
+			  0x6e, 0x5b, 0xa8, 0x5b, 0x53, 0x32, 0x6b, 0x80,
+			  0x07, 0xa2, 0x58, 0x4a, 0x03, 0x3a, 0xe6, 0xdb,
+			  0x2c, 0xdf, 0xa1, 0xc9, 0xdd, 0xd9, 0x3b, 0x17 },
+			{ 0xc9, 0x01, 0x6d, 0x27, 0x1b, 0x07, 0xf0, 0x12,
+			  0x70, 0x8c, 0xc4, 0x86, 0xc5, 0xba, 0xb8, 0xe7,
+			  0xa9, 0xfb, 0xd6, 0x71, 0x9b, 0x12, 0x08, 0x53,
+			  0x92, 0xb7, 0x3d, 0x5a, 0xf9, 0xfb, 0x88, 0x5d },
+			{ 0xdf, 0x72, 0x58, 0xfe, 0x1e, 0x0f, 0x50, 0x2b,
+			  0xc1, 0x18, 0x39, 0xd4, 0x2e, 0x58, 0xd6, 0x58,
+			  0xe0, 0x3a, 0x67, 0xc9, 0x8e, 0x27, 0xed, 0xe6,
+			  0x19, 0xa3, 0x9e, 0xb1, 0x13, 0xcd, 0xe1, 0x06 },
+		},
+		{
+			{ 0x53, 0x03, 0x5b, 0x9e, 0x62, 0xaf, 0x2b, 0x47,
+			  0x47, 0x04, 0x8d, 0x27, 0x90, 0x0b, 0xaa, 0x3b,
+			  0x27, 0xbf, 0x43, 0x96, 0x46, 0x5f, 0x78, 0x0c,
+			  0x13, 0x7b, 0x83, 0x8d, 0x1a, 0x6a, 0x3a, 0x7f },
+			{ 0x23, 0x6f, 0x16, 0x6f, 0x51, 0xad, 0xd0, 0x40,
+			  0xbe, 0x6a, 0xab, 0x1f, 0x93, 0x32, 0x8e, 0x11,
+			  0x8e, 0x08, 0x4d, 0xa0, 0x14, 0x5e, 0xe3, 0x3f,
+			  0x66, 0x62, 0xe1, 0x26, 0x35, 0x60, 0x80, 0x30 },
+			{ 0x0b, 0x80, 0x3d, 0x5d, 0x39, 0x44, 0xe6, 0xf7,
+			  0xf6, 0xed, 0x01, 0xc9, 0x55, 0xd5, 0xa8, 0x95,
+			  0x39, 0x63, 0x2c, 0x59, 0x30, 0x78, 0xcd, 0x68,
+			  0x7e, 0x30, 0x51, 0x2e, 0xed, 0xfd, 0xd0, 0x30 },
+		},
+		{
+			{ 0x50, 0x47, 0xb8, 0x68, 0x1e, 0x97, 0xb4, 0x9c,
+			  0xcf, 0xbb, 0x64, 0x66, 0x29, 0x72, 0x95, 0xa0,
+			  0x2b, 0x41, 0xfa, 0x72, 0x26, 0xe7, 0x8d, 0x5c,
+			  0xd9, 0x89, 0xc5, 0x51, 0x43, 0x08, 0x15, 0x46 },
+			{ 0xb3, 0x33, 0x12, 0xf2, 0x1a, 0x4d, 0x59, 0xe0,
+			  0x9c, 0x4d, 0xcc, 0xf0, 0x8e, 0xe7, 0xdb, 0x1b,
+			  0x77, 0x9a, 0x49, 0x8f, 0x7f, 0x18, 0x65, 0x69,
+			  0x68, 0x98, 0x09, 0x2c, 0x20, 0x14, 0x92, 0x0a },
+			{ 0x2e, 0xa0, 0xb9, 0xae, 0xc0, 0x19, 0x90, 0xbc,
+			  0xae, 0x4c, 0x03, 0x16, 0x0d, 0x11, 0xc7, 0x55,
+			  0xec, 0x32, 0x99, 0x65, 0x01, 0xf5, 0x6d, 0x0e,
+			  0xfe, 0x5d, 0xca, 0x95, 0x28, 0x0d, 0xca, 0x3b },
+		},
+		{
+			{ 0xbf, 0x01, 0xcc, 0x9e, 0xb6, 0x8e, 0x68, 0x9c,
+			  0x6f, 0x89, 0x44, 0xa6, 0xad, 0x83, 0xbc, 0xf0,
+			  0xe2, 0x9f, 0x7a, 0x5f, 0x5f, 0x95, 0x2d, 0xca,
+			  0x41, 0x82, 0xf2, 0x8d, 0x03, 0xb4, 0xa8, 0x4e },
+			{ 0xa4, 0x62, 0x5d, 0x3c, 0xbc, 0x31, 0xf0, 0x40,
+			  0x60, 0x7a, 0xf0, 0xcf, 0x3e, 0x8b, 0xfc, 0x19,
+			  0x45, 0xb5, 0x0f, 0x13, 0xa2, 0x3d, 0x18, 0x98,
+			  0xcd, 0x13, 0x8f, 0xae, 0xdd, 0xde, 0x31, 0x56 },
+			{ 0x02, 0xd2, 0xca, 0xf1, 0x0a, 0x46, 0xed, 0x2a,
+			  0x83, 0xee, 0x8c, 0xa4, 0x05, 0x53, 0x30, 0x46,
+			  0x5f, 0x1a, 0xf1, 0x49, 0x45, 0x77, 0x21, 0x91,
+			  0x63, 0xa4, 0x2c, 0x54, 0x30, 0x09, 0xce, 0x24 },
+		},
+		{
+			{ 0x85, 0x0b, 0xf3, 0xfd, 0x55, 0xa1, 0xcf, 0x3f,
+			  0xa4, 0x2e, 0x37, 0x36, 0x8e, 0x16, 0xf7, 0xd2,
+			  0x44, 0xf8, 0x92, 0x64, 0xde, 0x64, 0xe0, 0xb2,
+			  0x80, 0x42, 0x4f, 0x32, 0xa7, 0x28, 0x99, 0x54 },
+			{ 0x06, 0xc1, 0x06, 0xfd, 0xf5, 0x90, 0xe8, 0x1f,
+			  0xf2, 0x10, 0x88, 0x5d, 0x35, 0x68, 0xc4, 0xb5,
+			  0x3e, 0xaf, 0x8c, 0x6e, 0xfe, 0x08, 0x78, 0x82,
+			  0x4b, 0xd7, 0x06, 0x8a, 0xc2, 0xe3, 0xd4, 0x41 },
+			{ 0x2e, 0x1a, 0xee, 0x63, 0xa7, 0x32, 0x6e, 0xf2,
+			  0xea, 0xfd, 0x5f, 0xd2, 0xb7, 0xe4, 0x91, 0xae,
+			  0x69, 0x4d, 0x7f, 0xd1, 0x3b, 0xd3, 0x3b, 0xbc,
+			  0x6a, 0xff, 0xdc, 0xc0, 0xde, 0x66, 0x1b, 0x49 },
+		},
+		{
+			{ 0xa1, 0x64, 0xda, 0xd0, 0x8e, 0x4a, 0xf0, 0x75,
+			  0x4b, 0x28, 0xe2, 0x67, 0xaf, 0x2c, 0x22, 0xed,
+			  0xa4, 0x7b, 0x7b, 0x1f, 0x79, 0xa3, 0x34, 0x82,
+			  0x67, 0x8b, 0x01, 0xb7, 0xb0, 0xb8, 0xf6, 0x4c },
+			{ 0xa7, 0x32, 0xea, 0xc7, 0x3d, 0xb1, 0xf5, 0x98,
+			  0x98, 0xdb, 0x16, 0x7e, 0xcc, 0xf8, 0xd5, 0xe3,
+			  0x47, 0xd9, 0xf8, 0xcb, 0x52, 0xbf, 0x0a, 0xac,
+			  0xac, 0xe4, 0x5e, 0xc8, 0xd0, 0x38, 0xf3, 0x08 },
+			{ 0xbd, 0x73, 0x1a, 0x99, 0x21, 0xa8, 0x83, 0xc3,
+			  0x7a, 0x0c, 0x32, 0xdf, 0x01, 0xbc, 0x27, 0xab,
+			  0x63, 0x70, 0x77, 0x84, 0x1b, 0x33, 0x3d, 0xc1,
+			  0x99, 0x8a, 0x07, 0xeb, 0x82, 0x4a, 0x0d, 0x53 },
+		},
+		{
+			{ 0x9e, 0xbf, 0x9a, 0x6c, 0x45, 0x73, 0x69, 0x6d,
+			  0x80, 0xa8, 0x00, 0x49, 0xfc, 0xb2, 0x7f, 0x25,
+			  0x50, 0xb8, 0xcf, 0xc8, 0x12, 0xf4, 0xac, 0x2b,
+			  0x5b, 0xbd, 0xbf, 0x0c, 0xe0, 0xe7, 0xb3, 0x0d },
+			{ 0x25, 0x48, 0xf9, 0xe1, 0x30, 0x36, 0x4c, 0x00,
+			  0x5a, 0x53, 0xab, 0x8c, 0x26, 0x78, 0x2d, 0x7e,
+			  0x8b, 0xff, 0x84, 0xcc, 0x23, 0x23, 0x48, 0xc7,
+			  0xb9, 0x70, 0x17, 0x10, 0x3f, 0x75, 0xea, 0x65 },
+			{ 0x63, 0x63, 0x09, 0xe2, 0x3e, 0xfc, 0x66, 0x3d,
+			  0x6b, 0xcb, 0xb5, 0x61, 0x7f, 0x2c, 0xd6, 0x81,
+			  0x1a, 0x3b, 0x44, 0x13, 0x42, 0x04, 0xbe, 0x0f,
+			  0xdb, 0xa1, 0xe1, 0x21, 0x19, 0xec, 0xa4, 0x02 },
+		},
+		{
+			{ 0x5f, 0x79, 0xcf, 0xf1, 0x62, 0x61, 0xc8, 0xf5,
+			  0xf2, 0x57, 0xee, 0x26, 0x19, 0x86, 0x8c, 0x11,
+			  0x78, 0x35, 0x06, 0x1c, 0x85, 0x24, 0x21, 0x17,
+			  0xcf, 0x7f, 0x06, 0xec, 0x5d, 0x2b, 0xd1, 0x36 },
+			{ 0xa2, 0xb8, 0x24, 0x3b, 0x9a, 0x25, 0xe6, 0x5c,
+			  0xb8, 0xa0, 0xaf, 0x45, 0xcc, 0x7a, 0x57, 0xb8,
+			  0x37, 0x70, 0xa0, 0x8b, 0xe8, 0xe6, 0xcb, 0xcc,
+			  0xbf, 0x09, 0x78, 0x12, 0x51, 0x3c, 0x14, 0x3d },
+			{ 0x57, 0x45, 0x15, 0x79, 0x91, 0x27, 0x6d, 0x12,
+			  0x0a, 0x3a, 0x78, 0xfc, 0x5c, 0x8f, 0xe4, 0xd5,
+			  0xac, 0x9b, 0x17, 0xdf, 0xe8, 0xb6, 0xbd, 0x36,
+			  0x59, 0x28, 0xa8, 0x5b, 0x88, 0x17, 0xf5, 0x2e },
+		},
+	},
+	{
+		{
+			{ 0x51, 0x2f, 0x5b, 0x30, 0xfb, 0xbf, 0xee, 0x96,
+			  0xb8, 0x96, 0x95, 0x88, 0xad, 0x38, 0xf9, 0xd3,
+			  0x25, 0xdd, 0xd5, 0x46, 0xc7, 0x2d, 0xf5, 0xf0,
+			  0x95, 0x00, 0x3a, 0xbb, 0x90, 0x82, 0x96, 0x57 },
+			{ 0xdc, 0xae, 0x58, 0x8c, 0x4e, 0x97, 0x37, 0x46,
+			  0xa4, 0x41, 0xf0, 0xab, 0xfb, 0x22, 0xef, 0xb9,
+			  0x8a, 0x71, 0x80, 0xe9, 0x56, 0xd9, 0x85, 0xe1,
+			  0xa6, 0xa8, 0x43, 0xb1, 0xfa, 0x78, 0x1b, 0x2f },
+			{ 0x01, 0xe1, 0x20, 0x0a, 0x43, 0xb8, 0x1a, 0xf7,
+			  0x47, 0xec, 0xf0, 0x24, 0x8d, 0x65, 0x93, 0xf3,
+			  0xd1, 0xee, 0xe2, 0x6e, 0xa8, 0x09, 0x75, 0xcf,
+			  0xe1, 0xa3, 0x2a, 0xdc, 0x35, 0x3e, 0xc4, 0x7d },
+		},
+		{
+			{ 0x18, 0x97, 0x3e, 0x27, 0x5c, 0x2a, 0x78, 0x5a,
+			  0x94, 0xfd, 0x4e, 0x5e, 0x99, 0xc6, 0x76, 0x35,
+			  0x3e, 0x7d, 0x23, 0x1f, 0x05, 0xd8, 0x2e, 0x0f,
+			  0x99, 0x0a, 0xd5, 0x82, 0x1d, 0xb8, 0x4f, 0x04 },
+			{ 0xc3, 0xd9, 0x7d, 0x88, 0x65, 0x66, 0x96, 0x85,
+			  0x55, 0x53, 0xb0, 0x4b, 0x31, 0x9b, 0x0f, 0xc9,
+			  0xb1, 0x79, 0x20, 0xef, 0xf8, 0x8d, 0xe0, 0xc6,
+			  0x2f, 0xc1, 0x8c, 0x75, 0x16, 0x20, 0xf7, 0x7e },
+			{ 0xd9, 0xe3, 0x07, 0xa9, 0xc5, 0x18, 0xdf, 0xc1,
+			  0x59, 0x63, 0x4c, 0xce, 0x1d, 0x37, 0xb3, 0x57,
+			  0x49, 0xbb, 0x01, 0xb2, 0x34, 0x45, 0x70, 0xca,
+			  0x2e, 0xdd, 0x30, 0x9c, 0x3f, 0x82, 0x79, 0x7f },
+		},
+		{
+			{ 0xba, 0x87, 0xf5, 0x68, 0xf0, 0x1f, 0x9c, 0x6a,
+			  0xde, 0xc8, 0x50, 0x00, 0x4e, 0x89, 0x27, 0x08,
+			  0xe7, 0x5b, 0xed, 0x7d, 0x55, 0x99, 0xbf, 0x3c,
+			  0xf0, 0xd6, 0x06, 0x1c, 0x43, 0xb0, 0xa9, 0x64 },
+			{ 0xe8, 0x13, 0xb5, 0xa3, 0x39, 0xd2, 0x34, 0x83,
+			  0xd8, 0xa8, 0x1f, 0xb9, 0xd4, 0x70, 0x36, 0xc1,
+			  0x33, 0xbd, 0x90, 0xf5, 0x36, 0x41, 0xb5, 0x12,
+			  0xb4, 0xd9, 0x84, 0xd7, 0x73, 0x03, 0x4e, 0x0a },
+			{ 0x19, 0x29, 0x7d, 0x5b, 0xa1, 0xd6, 0xb3, 0x2e,
+			  0x35, 0x82, 0x3a, 0xd5, 0xa0, 0xf6, 0xb4, 0xb0,
+			  0x47, 0x5d, 0xa4, 0x89, 0x43, 0xce, 0x56, 0x71,
+			  0x6c, 0x34, 0x18, 0xce, 0x0a, 0x7d, 0x1a, 0x07 },
+		},
+		{
+			{ 0x31, 0x44, 0xe1, 0x20, 0x52, 0x35, 0x0c, 0xcc,
+			  0x41, 0x51, 0xb1, 0x09, 0x07, 0x95, 0x65, 0x0d,
+			  0x36, 0x5f, 0x9d, 0x20, 0x1b, 0x62, 0xf5, 0x9a,
+			  0xd3, 0x55, 0x77, 0x61, 0xf7, 0xbc, 0x69, 0x7c },
+			{ 0x0b, 0xba, 0x87, 0xc8, 0xaa, 0x2d, 0x07, 0xd3,
+			  0xee, 0x62, 0xa5, 0xbf, 0x05, 0x29, 0x26, 0x01,
+			  0x8b, 0x76, 0xef, 0xc0, 0x02, 0x30, 0x54, 0xcf,
+			  0x9c, 0x7e, 0xea, 0x46, 0x71, 0xcc, 0x3b, 0x2c },
+			{ 0x5f, 0x29, 0xe8, 0x04, 0xeb, 0xd7, 0xf0, 0x07,
+			  0x7d, 0xf3, 0x50, 0x2f, 0x25, 0x18, 0xdb, 0x10,
+			  0xd7, 0x98, 0x17, 0x17, 0xa3, 0xa9, 0x51, 0xe9,
+			  0x1d, 0xa5, 0xac, 0x22, 0x73, 0x9a, 0x5a, 0x6f },
+		},
+		{
+			{ 0xbe, 0x44, 0xd9, 0xa3, 0xeb, 0xd4, 0x29, 0xe7,
+			  0x9e, 0xaf, 0x78, 0x80, 0x40, 0x09, 0x9e, 0x8d,
+			  0x03, 0x9c, 0x86, 0x47, 0x7a, 0x56, 0x25, 0x45,
+			  0x24, 0x3b, 0x8d, 0xee, 0x80, 0x96, 0xab, 0x02 },
+			{ 0xc5, 0xc6, 0x41, 0x2f, 0x0c, 0x00, 0xa1, 0x8b,
+			  0x9b, 0xfb, 0xfe, 0x0c, 0xc1, 0x79, 0x9f, 0xc4,
+			  0x9f, 0x1c, 0xc5, 0x3c, 0x70, 0x47, 0xfa, 0x4e,
+			  0xca, 0xaf, 0x47, 0xe1, 0xa2, 0x21, 0x4e, 0x49 },
+			{ 0x9a, 0x0d, 0xe5, 0xdd, 0x85, 0x8a, 0xa4, 0xef,
+			  0x49, 0xa2, 0xb9, 0x0f, 0x4e, 0x22, 0x9a, 0x21,
+			  0xd9, 0xf6, 0x1e, 0xd9, 0x1d, 0x1f, 0x09, 0xfa,
+			  0x34, 0xbb, 0x46, 0xea, 0xcb, 0x76, 0x5d, 0x6b },
+		},
+		{
+			{ 0x22, 0x25, 0x78, 0x1e, 0x17, 0x41, 0xf9, 0xe0,
+			  0xd3, 0x36, 0x69, 0x03, 0x74, 0xae, 0xe6, 0xf1,
+			  0x46, 0xc7, 0xfc, 0xd0, 0xa2, 0x3e, 0x8b, 0x40,
+			  0x3e, 0x31, 0xdd, 0x03, 0x9c, 0x86, 0xfb, 0x16 },
+			{ 0x94, 0xd9, 0x0c, 0xec, 0x6c, 0x55, 0x57, 0x88,
+			  0xba, 0x1d, 0xd0, 0x5c, 0x6f, 0xdc, 0x72, 0x64,
+			  0x77, 0xb4, 0x42, 0x8f, 0x14, 0x69, 0x01, 0xaf,
+			  0x54, 0x73, 0x27, 0x85, 0xf6, 0x33, 0xe3, 0x0a },
+			{ 0x62, 0x09, 0xb6, 0x33, 0x97, 0x19, 0x8e, 0x28,
+			  0x33, 0xe1, 0xab, 0xd8, 0xb4, 0x72, 0xfc, 0x24,
+			  0x3e, 0xd0, 0x91, 0x09, 0xed, 0xf7, 0x11, 0x48,
+			  0x75, 0xd0, 0x70, 0x8f, 0x8b, 0xe3, 0x81, 0x3f },
+		},
+		{
+			{ 0x24, 0xc8, 0x17, 0x5f, 0x35, 0x7f, 0xdb, 0x0a,
+			  0xa4, 0x99, 0x42, 0xd7, 0xc3, 0x23, 0xb9, 0x74,
+			  0xf7, 0xea, 0xf8, 0xcb, 0x8b, 0x3e, 0x7c, 0xd5,
+			  0x3d, 0xdc, 0xde, 0x4c, 0xd3, 0xe2, 0xd3, 0x0a },
+			{ 0xfe, 0xaf, 0xd9, 0x7e, 0xcc, 0x0f, 0x91, 0x7f,
+			  0x4b, 0x87, 0x65, 0x24, 0xa1, 0xb8, 0x5c, 0x54,
+			  0x04, 0x47, 0x0c, 0x4b, 0xd2, 0x7e, 0x39, 0xa8,
+			  0x93, 0x09, 0xf5, 0x04, 0xc1, 0x0f, 0x51, 0x50 },
+			{ 0x9d, 0x24, 0x6e, 0x33, 0xc5, 0x0f, 0x0c, 0x6f,
+			  0xd9, 0xcf, 0x31, 0xc3, 0x19, 0xde, 0x5e, 0x74,
+			  0x1c, 0xfe, 0xee, 0x09, 0x00, 0xfd, 0xd6, 0xf2,
+			  0xbe, 0x1e, 0xfa, 0xf0, 0x8b, 0x15, 0x7c, 0x12 },
+		},
+		{
+			{ 0x74, 0xb9, 0x51, 0xae, 0xc4, 0x8f, 0xa2, 0xde,
+			  0x96, 0xfe, 0x4d, 0x74, 0xd3, 0x73, 0x99, 0x1d,
+			  0xa8, 0x48, 0x38, 0x87, 0x0b, 0x68, 0x40, 0x62,
+			  0x95, 0xdf, 0x67, 0xd1, 0x79, 0x24, 0xd8, 0x4e },
+			{ 0xa2, 0x79, 0x98, 0x2e, 0x42, 0x7c, 0x19, 0xf6,
+			  0x47, 0x36, 0xca, 0x52, 0xd4, 0xdd, 0x4a, 0xa4,
+			  0xcb, 0xac, 0x4e, 0x4b, 0xc1, 0x3f, 0x41, 0x9b,
+			  0x68, 0x4f, 0xef, 0x07, 0x7d, 0xf8, 0x4e, 0x35 },
+			{ 0x75, 0xd9, 0xc5, 0x60, 0x22, 0xb5, 0xe3, 0xfe,
+			  0xb8, 0xb0, 0x41, 0xeb, 0xfc, 0x2e, 0x35, 0x50,
+			  0x3c, 0x65, 0xf6, 0xa9, 0x30, 0xac, 0x08, 0x88,
+			  0x6d, 0x23, 0x39, 0x05, 0xd2, 0x92, 0x2d, 0x30 },
+		},
+	},
+	{
+		{
+			{ 0x77, 0xf1, 0xe0, 0xe4, 0xb6, 0x6f, 0xbc, 0x2d,
+			  0x93, 0x6a, 0xbd, 0xa4, 0x29, 0xbf, 0xe1, 0x04,
+			  0xe8, 0xf6, 0x7a, 0x78, 0xd4, 0x66, 0x19, 0x5e,
+			  0x60, 0xd0, 0x26, 0xb4, 0x5e, 0x5f, 0xdc, 0x0e },
+			{ 0x3d, 0x28, 0xa4, 0xbc, 0xa2, 0xc1, 0x13, 0x78,
+			  0xd9, 0x3d, 0x86, 0xa1, 0x91, 0xf0, 0x62, 0xed,
+			  0x86, 0xfa, 0x68, 0xc2, 0xb8, 0xbc, 0xc7, 0xae,
+			  0x4c, 0xae, 0x1c, 0x6f, 0xb7, 0xd3, 0xe5, 0x10 },
+			{ 0x67, 0x8e, 0xda, 0x53, 0xd6, 0xbf, 0x53, 0x54,
+			  0x41, 0xf6, 0xa9, 0x24, 0xec, 0x1e, 0xdc, 0xe9,
+			  0x23, 0x8a, 0x57, 0x03, 0x3b, 0x26, 0x87, 0xbf,
+			  0x72, 0xba, 0x1c, 0x36, 0x51, 0x6c, 0xb4, 0x45 },
+		},
+		{
+			{ 0xe4, 0xe3, 0x7f, 0x8a, 0xdd, 0x4d, 0x9d, 0xce,
+			  0x30, 0x0e, 0x62, 0x76, 0x56, 0x64, 0x13, 0xab,
+			  0x58, 0x99, 0x0e, 0xb3, 0x7b, 0x4f, 0x59, 0x4b,
+			  0xdf, 0x29, 0x12, 0x32, 0xef, 0x0a, 0x1c, 0x5c },
+			{ 0xa1, 0x7f, 0x4f, 0x31, 0xbf, 0x2a, 0x40, 0xa9,
+			  0x50, 0xf4, 0x8c, 0x8e, 0xdc, 0xf1, 0x57, 0xe2,
+			  0x84, 0xbe, 0xa8, 0x23, 0x4b, 0xd5, 0xbb, 0x1d,
+			  0x3b, 0x71, 0xcb, 0x6d, 0xa3, 0xbf, 0x77, 0x21 },
+			{ 0x8f, 0xdb, 0x79, 0xfa, 0xbc, 0x1b, 0x08, 0x37,
+			  0xb3, 0x59, 0x5f, 0xc2, 0x1e, 0x81, 0x48, 0x60,
+			  0x87, 0x24, 0x83, 0x9c, 0x65, 0x76, 0x7a, 0x08,
+			  0xbb, 0xb5, 0x8a, 0x7d, 0x38, 0x19, 0xe6, 0x4a },
+		},
+		{
+			{ 0x83, 0xfb, 0x5b, 0x98, 0x44, 0x7e, 0x11, 0x61,
+			  0x36, 0x31, 0x96, 0x71, 0x2a, 0x46, 0xe0, 0xfc,
+			  0x4b, 0x90, 0x25, 0xd4, 0x48, 0x34, 0xac, 0x83,
+			  0x64, 0x3d, 0xa4, 0x5b, 0xbe, 0x5a, 0x68, 0x75 },
+			{ 0x2e, 0xa3, 0x44, 0x53, 0xaa, 0xf6, 0xdb, 0x8d,
+			  0x78, 0x40, 0x1b, 0xb4, 0xb4, 0xea, 0x88, 0x7d,
+			  0x60, 0x0d, 0x13, 0x4a, 0x97, 0xeb, 0xb0, 0x5e,
+			  0x03, 0x3e, 0xbf, 0x17, 0x1b, 0xd9, 0x00, 0x1a },
+			{ 0xb2, 0xf2, 0x61, 0xeb, 0x33, 0x09, 0x96, 0x6e,
+			  0x52, 0x49, 0xff, 0xc9, 0xa8, 0x0f, 0x3d, 0x54,
+			  0x69, 0x65, 0xf6, 0x7a, 0x10, 0x75, 0x72, 0xdf,
+			  0xaa, 0xe6, 0xb0, 0x23, 0xb6, 0x29, 0x55, 0x13 },
+		},
+		{
+			{ 0xfe, 0x83, 0x2e, 0xe2, 0xbc, 0x16, 0xc7, 0xf5,
+			  0xc1, 0x85, 0x09, 0xe8, 0x19, 0xeb, 0x2b, 0xb4,
+			  0xae, 0x4a, 0x25, 0x14, 0x37, 0xa6, 0x9d, 0xec,
+			  0x13, 0xa6, 0x90, 0x15, 0x05, 0xea, 0x72, 0x59 },
+			{ 0x18, 0xd5, 0xd1, 0xad, 0xd7, 0xdb, 0xf0, 0x18,
+			  0x11, 0x1f, 0xc1, 0xcf, 0x88, 0x78, 0x9f, 0x97,
+			  0x9b, 0x75, 0x14, 0x71, 0xf0, 0xe1, 0x32, 0x87,
+			  0x01, 0x3a, 0xca, 0x65, 0x1a, 0xb8, 0xb5, 0x79 },
+			{ 0x11, 0x78, 0x8f, 0xdc, 0x20, 0xac, 0xd4, 0x0f,
+			  0xa8, 0x4f, 0x4d, 0xac, 0x94, 0xd2, 0x9a, 0x9a,
+			  0x34, 0x04, 0x36, 0xb3, 0x64, 0x2d, 0x1b, 0xc0,
+			  0xdb, 0x3b, 0x5f, 0x90, 0x95, 0x9c, 0x7e, 0x4f },
+		},
+		{
+			{ 0xfe, 0x99, 0x52, 0x35, 0x3d, 0x44, 0xc8, 0x71,
+			  0xd7, 0xea, 0xeb, 0xdb, 0x1c, 0x3b, 0xcd, 0x8b,
+			  0x66, 0x94, 0xa4, 0xf1, 0x9e, 0x49, 0x92, 0x80,
+			  0xc8, 0xad, 0x44, 0xa1, 0xc4, 0xee, 0x42, 0x19 },
+			{ 0x2e, 0x30, 0x81, 0x57, 0xbc, 0x4b, 0x67, 0x62,
+			  0x0f, 0xdc, 0xad, 0x89, 0x39, 0x0f, 0x52, 0xd8,
+			  0xc6, 0xd9, 0xfb, 0x53, 0xae, 0x99, 0x29, 0x8c,
+			  0x4c, 0x8e, 0x63, 0x2e, 0xd9, 0x3a, 0x99, 0x31 },
+			{ 0x92, 0x49, 0x23, 0xae, 0x19, 0x53, 0xac, 0x7d,
+			  0x92, 0x3e, 0xea, 0x0c, 0x91, 0x3d, 0x1b, 0x2c,
+			  0x22, 0x11, 0x3c, 0x25, 0x94, 0xe4, 0x3c, 0x55,
+			  0x75, 0xca, 0xf9, 0x4e, 0x31, 0x65, 0x0a, 0x2a },
+		},
+		{
+			{ 0x3a, 0x79, 0x1c, 0x3c, 0xcd, 0x1a, 0x36, 0xcf,
+			  0x3b, 0xbc, 0x35, 0x5a, 0xac, 0xbc, 0x9e, 0x2f,
+			  0xab, 0xa6, 0xcd, 0xa8, 0xe9, 0x60, 0xe8, 0x60,
+			  0x13, 0x1a, 0xea, 0x6d, 0x9b, 0xc3, 0x5d, 0x05 },
+			{ 0xc2, 0x27, 0xf9, 0xf7, 0x7f, 0x93, 0xb7, 0x2d,
+			  0x35, 0xa6, 0xd0, 0x17, 0x06, 0x1f, 0x74, 0xdb,
+			  0x76, 0xaf, 0x55, 0x11, 0xa2, 0xf3, 0x82, 0x59,
+			  0xed, 0x2d, 0x7c, 0x64, 0x18, 0xe2, 0xf6, 0x4c },
+			{ 0xb6, 0x5b, 0x8d, 0xc2, 0x7c, 0x22, 0x19, 0xb1,
+			  0xab, 0xff, 0x4d, 0x77, 0xbc, 0x4e, 0xe2, 0x07,
+			  0x89, 0x2c, 0xa3, 0xe4, 0xce, 0x78, 0x3c, 0xa8,
+			  0xb6, 0x24, 0xaa, 0x10, 0x77, 0x30, 0x1a, 0x12 },
+		},
+		{
+			{ 0xc9, 0x83, 0x74, 0xc7, 0x3e, 0x71, 0x59, 0xd6,
+			  0xaf, 0x96, 0x2b, 0xb8, 0x77, 0xe0, 0xbf, 0x88,
+			  0xd3, 0xbc, 0x97, 0x10, 0x23, 0x28, 0x9e, 0x28,
+			  0x9b, 0x3a, 0xed, 0x6c, 0x4a, 0xb9, 0x7b, 0x52 },
+			{ 0x97, 0x4a, 0x03, 0x9f, 0x5e, 0x5d, 0xdb, 0xe4,
+			  0x2d, 0xbc, 0x34, 0x30, 0x09, 0xfc, 0x53, 0xe1,
+			  0xb1, 0xd3, 0x51, 0x95, 0x91, 0x46, 0x05, 0x46,
+			  0x2d, 0xe5, 0x40, 0x7a, 0x6c, 0xc7, 0x3f, 0x33 },
+			{ 0x2e, 0x48, 0x5b, 0x99, 0x2a, 0x99, 0x3d, 0x56,
+			  0x01, 0x38, 0x38, 0x6e, 0x7c, 0xd0, 0x05, 0x34,
+			  0xe5, 0xd8, 0x64, 0x2f, 0xde, 0x35, 0x50, 0x48,
+			  0xf7, 0xa9, 0xa7, 0x20, 0x9b, 0x06, 0x89, 0x6b },
+		},
+		{
+			{ 0x77, 0xdb, 0xc7, 0xb5, 0x8c, 0xfa, 0x82, 0x40,
+			  0x55, 0xc1, 0x34, 0xc7, 0xf8, 0x86, 0x86, 0x06,
+			  0x7e, 0xa5, 0xe7, 0xf6, 0xd9, 0xc8, 0xe6, 0x29,
+			  0xcf, 0x9b, 0x63, 0xa7, 0x08, 0xd3, 0x73, 0x04 },
+			{ 0x0d, 0x22, 0x70, 0x62, 0x41, 0xa0, 0x2a, 0x81,
+			  0x4e, 0x5b, 0x24, 0xf9, 0xfa, 0x89, 0x5a, 0x99,
+			  0x05, 0xef, 0x72, 0x50, 0xce, 0xc4, 0xad, 0xff,
+			  0x73, 0xeb, 0x73, 0xaa, 0x03, 0x21, 0xbc, 0x23 },
+			{ 0x05, 0x9e, 0x58, 0x03, 0x26, 0x79, 0xee, 0xca,
+			  0x92, 0xc4, 0xdc, 0x46, 0x12, 0x42, 0x4b, 0x2b,
+			  0x4f, 0xa9, 0x01, 0xe6, 0x74, 0xef, 0xa1, 0x02,
+			  0x1a, 0x34, 0x04, 0xde, 0xbf, 0x73, 0x2f, 0x10 },
+		},
+	},
+	{
+		{
+			{ 0x9a, 0x1c, 0x51, 0xb5, 0xe0, 0xda, 0xb4, 0xa2,
+			  0x06, 0xff, 0xff, 0x2b, 0x29, 0x60, 0xc8, 0x7a,
+			  0x34, 0x42, 0x50, 0xf5, 0x5d, 0x37, 0x1f, 0x98,
+			  0x2d, 0xa1, 0x4e, 0xda, 0x25, 0xd7, 0x6b, 0x3f },
+			{ 0xc6, 0x45, 0x57, 0x7f, 0xab, 0xb9, 0x18, 0xeb,
+			  0x90, 0xc6, 0x87, 0x57, 0xee, 0x8a, 0x3a, 0x02,
+			  0xa9, 0xaf, 0xf7, 0x2d, 0xda, 0x12, 0x27, 0xb7,
+			  0x3d, 0x01, 0x5c, 0xea, 0x25, 0x7d, 0x59, 0x36 },
+			{ 0xac, 0x58, 0x60, 0x10, 0x7b, 0x8d, 0x4d, 0x73,
+			  0x5f, 0x90, 0xc6, 0x6f, 0x9e, 0x57, 0x40, 0xd9,
+			  0x2d, 0x93, 0x02, 0x92, 0xf9, 0xf8, 0x66, 0x64,
+			  0xd0, 0xd6, 0x60, 0xda, 0x19, 0xcc, 0x7e, 0x7b },
+		},
+		{
+			{ 0x9b, 0xfa, 0x7c, 0xa7, 0x51, 0x4a, 0xae, 0x6d,
+			  0x50, 0x86, 0xa3, 0xe7, 0x54, 0x36, 0x26, 0x82,
+			  0xdb, 0x82, 0x2d, 0x8f, 0xcd, 0xff, 0xbb, 0x09,
+			  0xba, 0xca, 0xf5, 0x1b, 0x66, 0xdc, 0xbe, 0x03 },
+			{ 0x0d, 0x69, 0x5c, 0x69, 0x3c, 0x37, 0xc2, 0x78,
+			  0x6e, 0x90, 0x42, 0x06, 0x66, 0x2e, 0x25, 0xdd,
+			  0xd2, 0x2b, 0xe1, 0x4a, 0x44, 0x44, 0x1d, 0x95,
+			  0x56, 0x39, 0x74, 0x01, 0x76, 0xad, 0x35, 0x42 },
+			{ 0xf5, 0x75, 0x89, 0x07, 0x0d, 0xcb, 0x58, 0x62,
+			  0x98, 0xf2, 0x89, 0x91, 0x54, 0x42, 0x29, 0x49,
+			  0xe4, 0x6e, 0xe3, 0xe2, 0x23, 0xb4, 0xca, 0xa0,
+			  0xa1, 0x66, 0xf0, 0xcd, 0xb0, 0xe2, 0x7c, 0x0e },
+		},
+		{
+			{ 0xf9, 0x70, 0x4b, 0xd9, 0xdf, 0xfe, 0xa6, 0xfe,
+			  0x2d, 0xba, 0xfc, 0xc1, 0x51, 0xc0, 0x30, 0xf1,
+			  0x89, 0xab, 0x2f, 0x7f, 0x7e, 0xd4, 0x82, 0x48,
+			  0xb5, 0xee, 0xec, 0x8a, 0x13, 0x56, 0x52, 0x61 },
+			{ 0xa3, 0x85, 0x8c, 0xc4, 0x3a, 0x64, 0x94, 0xc4,
+			  0xad, 0x39, 0x61, 0x3c, 0xf4, 0x1d, 0x36, 0xfd,
+			  0x48, 0x4d, 0xe9, 0x3a, 0xdd, 0x17, 0xdb, 0x09,
+			  0x4a, 0x67, 0xb4, 0x8f, 0x5d, 0x0a, 0x6e, 0x66 },
+			{ 0x0d, 0xcb, 0x70, 0x48, 0x4e, 0xf6, 0xbb, 0x2a,
+			  0x6b, 0x8b, 0x45, 0xaa, 0xf0, 0xbc, 0x65, 0xcd,
+			  0x5d, 0x98, 0xe8, 0x75, 0xba, 0x4e, 0xbe, 0x9a,
+			  0xe4, 0xde, 0x14, 0xd5, 0x10, 0xc8, 0x0b, 0x7f },
+		},
+		{
+			{ 0xa0, 0x13, 0x72, 0x73, 0xad, 0x9d, 0xac, 0x83,
+			  0x98, 0x2e, 0xf7, 0x2e, 0xba, 0xf8, 0xf6, 0x9f,
+			  0x57, 0x69, 0xec, 0x43, 0xdd, 0x2e, 0x1e, 0x31,
+			  0x75, 0xab, 0xc5, 0xde, 0x7d, 0x90, 0x3a, 0x1d },
+			{ 0x6f, 0x13, 0xf4, 0x26, 0xa4, 0x6b, 0x00, 0xb9,
+			  0x35, 0x30, 0xe0, 0x57, 0x9e, 0x36, 0x67, 0x8d,
+			  0x28, 0x3c, 0x46, 0x4f, 0xd9, 0xdf, 0xc8, 0xcb,
+			  0xf5, 0xdb, 0xee, 0xf8, 0xbc, 0x8d, 0x1f, 0x0d },
+			{ 0xdc, 0x81, 0xd0, 0x3e, 0x31, 0x93, 0x16, 0xba,
+			  0x80, 0x34, 0x1b, 0x85, 0xad, 0x9f, 0x32, 0x29,
+			  0xcb, 0x21, 0x03, 0x03, 0x3c, 0x01, 0x28, 0x01,
+			  0xe3, 0xfd, 0x1b, 0xa3, 0x44, 0x1b, 0x01, 0x00 },
+		},
+		{
+			{ 0x5c, 0xa7, 0x0a, 0x6a, 0x69, 0x1f, 0x56, 0x16,
+			  0x6a, 0xbd, 0x52, 0x58, 0x5c, 0x72, 0xbf, 0xc1,
+			  0xad, 0x66, 0x79, 0x9a, 0x7f, 0xdd, 0xa8, 0x11,
+			  0x26, 0x10, 0x85, 0xd2, 0xa2, 0x88, 0xd9, 0x63 },
+			{ 0x0c, 0x6c, 0xc6, 0x3f, 0x6c, 0xa0, 0xdf, 0x3f,
+			  0xd2, 0x0d, 0xd6, 0x4d, 0x8e, 0xe3, 0x40, 0x5d,
+			  0x71, 0x4d, 0x8e, 0x26, 0x38, 0x8b, 0xe3, 0x7a,
+			  0xe1, 0x57, 0x83, 0x6e, 0x91, 0x8d, 0xc4, 0x3a },
+			{ 0x2e, 0x23, 0xbd, 0xaf, 0x53, 0x07, 0x12, 0x00,
+			  0x83, 0xf6, 0xd8, 0xfd, 0xb8, 0xce, 0x2b, 0xe9,
+			  0x91, 0x2b, 0xe7, 0x84, 0xb3, 0x69, 0x16, 0xf8,
+			  0x66, 0xa0, 0x68, 0x23, 0x2b, 0xd5, 0xfa, 0x33 },
+		},
+		{
+			{ 0xe8, 0xcf, 0x22, 0xc4, 0xd0, 0xc8, 0x2c, 0x8d,
+			  0xcb, 0x3a, 0xa1, 0x05, 0x7b, 0x4f, 0x2b, 0x07,
+			  0x6f, 0xa5, 0xf6, 0xec, 0xe6, 0xb6, 0xfe, 0xa3,
+			  0xe2, 0x71, 0x0a, 0xb9, 0xcc, 0x55, 0xc3, 0x3c },
+			{ 0x16, 0x1e, 0xe4, 0xc5, 0xc6, 0x49, 0x06, 0x54,
+			  0x35, 0x77, 0x3f, 0x33, 0x30, 0x64, 0xf8, 0x0a,
+			  0x46, 0xe7, 0x05, 0xf3, 0xd2, 0xfc, 0xac, 0xb2,
+			  0xa7, 0xdc, 0x56, 0xa2, 0x29, 0xf4, 0xc0, 0x16 },
+			{ 0x31, 0x91, 0x3e, 0x90, 0x43, 0x94, 0xb6, 0xe9,
+			  0xce, 0x37, 0x56, 0x7a, 0xcb, 0x94, 0xa4, 0xb8,
+			  0x44, 0x92, 0xba, 0xba, 0xa4, 0xd1, 0x7c, 0xc8,
+			  0x68, 0x75, 0xae, 0x6b, 0x42, 0xaf, 0x1e, 0x63 },
+		},
+		{
+			{ 0xe8, 0x0d, 0x70, 0xa3, 0xb9, 0x75, 0xd9, 0x47,
+			  0x52, 0x05, 0xf8, 0xe2, 0xfb, 0xc5, 0x80, 0x72,
+			  0xe1, 0x5d, 0xe4, 0x32, 0x27, 0x8f, 0x65, 0x53,
+			  0xb5, 0x80, 0x5f, 0x66, 0x7f, 0x2c, 0x1f, 0x43 },
+			{ 0x9f, 0xfe, 0x66, 0xda, 0x10, 0x04, 0xe9, 0xb3,
+			  0xa6, 0xe5, 0x16, 0x6c, 0x52, 0x4b, 0xdd, 0x85,
+			  0x83, 0xbf, 0xf9, 0x1e, 0x61, 0x97, 0x3d, 0xbc,
+			  0xb5, 0x19, 0xa9, 0x1e, 0x8b, 0x64, 0x99, 0x55 },
+			{ 0x19, 0x7b, 0x8f, 0x85, 0x44, 0x63, 0x02, 0xd6,
+			  0x4a, 0x51, 0xea, 0xa1, 0x2f, 0x35, 0xab, 0x14,
+			  0xd7, 0xa9, 0x90, 0x20, 0x1a, 0x44, 0x00, 0x89,
+			  0x26, 0x3b, 0x25, 0x91, 0x5f, 0x71, 0x04, 0x7b },
+		},
+		{
+			{ 0xc6, 0xba, 0xe6, 0xc4, 0x80, 0xc2, 0x76, 0xb3,
+			  0x0b, 0x9b, 0x1d, 0x6d, 0xdd, 0xd3, 0x0e, 0x97,
+			  0x44, 0xf9, 0x0b, 0x45, 0x58, 0x95, 0x9a, 0xb0,
+			  0x23, 0xe2, 0xcd, 0x57, 0xfa, 0xac, 0xd0, 0x48 },
+			{ 0x43, 0xae, 0xf6, 0xac, 0x28, 0xbd, 0xed, 0x83,
+			  0xb4, 0x7a, 0x5c, 0x7d, 0x8b, 0x7c, 0x35, 0x86,
+			  0x44, 0x2c, 0xeb, 0xb7, 0x69, 0x47, 0x40, 0xc0,
+			  0x3f, 0x58, 0xf6, 0xc2, 0xf5, 0x7b, 0xb3, 0x59 },
+			{ 0x71, 0xe6, 0xab, 0x7d, 0xe4, 0x26, 0x0f, 0xb6,
+			  0x37, 0x3a, 0x2f, 0x62, 0x97, 0xa1, 0xd1, 0xf1,
+			  0x94, 0x03, 0x96, 0xe9, 0x7e, 0xce, 0x08, 0x42,
+			  0xdb, 0x3b, 0x6d, 0x33, 0x91, 0x41, 0x23, 0x16 },
+		},
+	},
+	{
+		{
+			{ 0x40, 0x86, 0xf3, 0x1f, 0xd6, 0x9c, 0x49, 0xdd,
+			  0xa0, 0x25, 0x36, 0x06, 0xc3, 0x9b, 0xcd, 0x29,
+			  0xc3, 0x3d, 0xd7, 0x3d, 0x02, 0xd8, 0xe2, 0x51,
+			  0x31, 0x92, 0x3b, 0x20, 0x7a, 0x70, 0x25, 0x4a },
+			{ 0xf6, 0x7f, 0x26, 0xf6, 0xde, 0x99, 0xe4, 0xb9,
+			  0x43, 0x08, 0x2c, 0x74, 0x7b, 0xca, 0x72, 0x77,
+			  0xb1, 0xf2, 0xa4, 0xe9, 0x3f, 0x15, 0xa0, 0x23,
+			  0x06, 0x50, 0xd0, 0xd5, 0xec, 0xdf, 0xdf, 0x2c },
+			{ 0x6a, 0xed, 0xf6, 0x53, 0x8a, 0x66, 0xb7, 0x2a,
+			  0xa1, 0x70, 0xd1, 0x1d, 0x58, 0x42, 0x42, 0x30,
+			  0x61, 0x01, 0xe2, 0x3a, 0x4c, 0x14, 0x00, 0x40,
+			  0xfc, 0x49, 0x8e, 0x24, 0x6d, 0x89, 0x21, 0x57 },
+		},
+		{
+			{ 0x4e, 0xda, 0xd0, 0xa1, 0x91, 0x50, 0x5d, 0x28,
+			  0x08, 0x3e, 0xfe, 0xb5, 0xa7, 0x6f, 0xaa, 0x4b,
+			  0xb3, 0x93, 0x93, 0xe1, 0x7c, 0x17, 0xe5, 0x63,
+			  0xfd, 0x30, 0xb0, 0xc4, 0xaf, 0x35, 0xc9, 0x03 },
+			{ 0xae, 0x1b, 0x18, 0xfd, 0x17, 0x55, 0x6e, 0x0b,
+			  0xb4, 0x63, 0xb9, 0x2b, 0x9f, 0x62, 0x22, 0x90,
+			  0x25, 0x46, 0x06, 0x32, 0xe9, 0xbc, 0x09, 0x55,
+			  0xda, 0x13, 0x3c, 0xf6, 0x74, 0xdd, 0x8e, 0x57 },
+			{ 0x3d, 0x0c, 0x2b, 0x49, 0xc6, 0x76, 0x72, 0x99,
+			  0xfc, 0x05, 0xe2, 0xdf, 0xc4, 0xc2, 0xcc, 0x47,
+			  0x3c, 0x3a, 0x62, 0xdd, 0x84, 0x9b, 0xd2, 0xdc,
+			  0xa2, 0xc7, 0x88, 0x02, 0x59, 0xab, 0xc2, 0x3e },
+		},
+		{
+			{ 0xcb, 0xd1, 0x32, 0xae, 0x09, 0x3a, 0x21, 0xa7,
+			  0xd5, 0xc2, 0xf5, 0x40, 0xdf, 0x87, 0x2b, 0x0f,
+			  0x29, 0xab, 0x1e, 0xe8, 0xc6, 0xa4, 0xae, 0x0b,
+			  0x5e, 0xac, 0xdb, 0x6a, 0x6c, 0xf6, 0x1b, 0x0e },
+			{ 0xb9, 0x7b, 0xd8, 0xe4, 0x7b, 0xd2, 0xa0, 0xa1,
+			  0xed, 0x1a, 0x39, 0x61, 0xeb, 0x4d, 0x8b, 0xa9,
+			  0x83, 0x9b, 0xcb, 0x73, 0xd0, 0xdd, 0xa0, 0x99,
+			  0xce, 0xca, 0x0f, 0x20, 0x5a, 0xc2, 0xd5, 0x2d },
+			{ 0x7e, 0x88, 0x2c, 0x79, 0xe9, 0xd5, 0xab, 0xe2,
+			  0x5d, 0x6d, 0x92, 0xcb, 0x18, 0x00, 0x02, 0x1a,
+			  0x1e, 0x5f, 0xae, 0xba, 0xcd, 0x69, 0xba, 0xbf,
+			  0x5f, 0x8f, 0xe8, 0x5a, 0xb3, 0x48, 0x05, 0x73 },
+		},
+		{
+			{ 0x34, 0xe3, 0xd6, 0xa1, 0x4b, 0x09, 0x5b, 0x80,
+			  0x19, 0x3f, 0x35, 0x09, 0x77, 0xf1, 0x3e, 0xbf,
+			  0x2b, 0x70, 0x22, 0x06, 0xcb, 0x06, 0x3f, 0x42,
+			  0xdd, 0x45, 0x78, 0xd8, 0x77, 0x22, 0x5a, 0x58 },
+			{ 0xee, 0xb8, 0xa8, 0xcb, 0xa3, 0x51, 0x35, 0xc4,
+			  0x16, 0x5f, 0x11, 0xb2, 0x1d, 0x6f, 0xa2, 0x65,
+			  0x50, 0x38, 0x8c, 0xab, 0x52, 0x4f, 0x0f, 0x76,
+			  0xca, 0xb8, 0x1d, 0x41, 0x3b, 0x44, 0x43, 0x30 },
+			{ 0x62, 0x89, 0xd4, 0x33, 0x82, 0x5f, 0x8a, 0xa1,
+			  0x7f, 0x25, 0x78, 0xec, 0xb5, 0xc4, 0x98, 0x66,
+			  0xff, 0x41, 0x3e, 0x37, 0xa5, 0x6f, 0x8e, 0xa7,
+			  0x1f, 0x98, 0xef, 0x50, 0x89, 0x27, 0x56, 0x76 },
+		},
+		{
+			{ 0x9d, 0xcf, 0x86, 0xea, 0xa3, 0x73, 0x70, 0xe1,
+			  0xdc, 0x5f, 0x15, 0x07, 0xb7, 0xfb, 0x8c, 0x3a,
+			  0x8e, 0x8a, 0x83, 0x31, 0xfc, 0xe7, 0x53, 0x48,
+			  0x16, 0xf6, 0x13, 0xb6, 0x84, 0xf4, 0xbb, 0x28 },
+			{ 0xc0, 0xc8, 0x1f, 0xd5, 0x59, 0xcf, 0xc3, 0x38,
+			  0xf2, 0xb6, 0x06, 0x05, 0xfd, 0xd2, 0xed, 0x9b,
+			  0x8f, 0x0e, 0x57, 0xab, 0x9f, 0x10, 0xbf, 0x26,
+			  0xa6, 0x46, 0xb8, 0xc1, 0xa8, 0x60, 0x41, 0x3f },
+			{ 0x7c, 0x6c, 0x13, 0x6f, 0x5c, 0x2f, 0x61, 0xf2,
+			  0xbe, 0x11, 0xdd, 0xf6, 0x07, 0xd1, 0xea, 0xaf,
+			  0x33, 0x6f, 0xde, 0x13, 0xd2, 0x9a, 0x7e, 0x52,
+			  0x5d, 0xf7, 0x88, 0x81, 0x35, 0xcb, 0x79, 0x1e },
+		},
+		{
+			{ 0x81, 0x81, 0xe0, 0xf5, 0xd8, 0x53, 0xe9, 0x77,
+			  0xd9, 0xde, 0x9d, 0x29, 0x44, 0x0c, 0xa5, 0x84,
+			  0xe5, 0x25, 0x45, 0x86, 0x0c, 0x2d, 0x6c, 0xdc,
+			  0xf4, 0xf2, 0xd1, 0x39, 0x2d, 0xb5, 0x8a, 0x47 },
+			{ 0xf1, 0xe3, 0xf7, 0xee, 0xc3, 0x36, 0x34, 0x01,
+			  0xf8, 0x10, 0x9e, 0xfe, 0x7f, 0x6a, 0x8b, 0x82,
+			  0xfc, 0xde, 0xf9, 0xbc, 0xe5, 0x08, 0xf9, 0x7f,
+			  0x31, 0x38, 0x3b, 0x3a, 0x1b, 0x95, 0xd7, 0x65 },
+			{ 0x59, 0xd1, 0x52, 0x92, 0xd3, 0xa4, 0xa6, 0x66,
+			  0x07, 0xc8, 0x1a, 0x87, 0xbc, 0xe1, 0xdd, 0xe5,
+			  0x6f, 0xc9, 0xc1, 0xa6, 0x40, 0x6b, 0x2c, 0xb8,
+			  0x14, 0x22, 0x21, 0x1a, 0x41, 0x7a, 0xd8, 0x16 },
+		},
+		{
+			{ 0x83, 0x05, 0x4e, 0xd5, 0xe2, 0xd5, 0xa4, 0xfb,
+			  0xfa, 0x99, 0xbd, 0x2e, 0xd7, 0xaf, 0x1f, 0xe2,
+			  0x8f, 0x77, 0xe9, 0x6e, 0x73, 0xc2, 0x7a, 0x49,
+			  0xde, 0x6d, 0x5a, 0x7a, 0x57, 0x0b, 0x99, 0x1f },
+			{ 0x15, 0x62, 0x06, 0x42, 0x5a, 0x7e, 0xbd, 0xb3,
+			  0xc1, 0x24, 0x5a, 0x0c, 0xcd, 0xe3, 0x9b, 0x87,
+			  0xb7, 0x94, 0xf9, 0xd6, 0xb1, 0x5d, 0xc0, 0x57,
+			  0xa6, 0x8c, 0xf3, 0x65, 0x81, 0x7c, 0xf8, 0x28 },
+			{ 0xd6, 0xf7, 0xe8, 0x1b, 0xad, 0x4e, 0x34, 0xa3,
+			  0x8f, 0x79, 0xea, 0xac, 0xeb, 0x50, 0x1e, 0x7d,
+			  0x52, 0xe0, 0x0d, 0x52, 0x9e, 0x56, 0xc6, 0x77,
+			  0x3e, 0x6d, 0x4d, 0x53, 0xe1, 0x2f, 0x88, 0x45 },
+		},
+		{
+			{ 0xe4, 0x6f, 0x3c, 0x94, 0x29, 0x99, 0xac, 0xd8,
+			  0xa2, 0x92, 0x83, 0xa3, 0x61, 0xf1, 0xf9, 0xb5,
+			  0xf3, 0x9a, 0xc8, 0xbe, 0x13, 0xdb, 0x99, 0x26,
+			  0x74, 0xf0, 0x05, 0xe4, 0x3c, 0x84, 0xcf, 0x7d },
+			{ 0xd6, 0x83, 0x79, 0x75, 0x5d, 0x34, 0x69, 0x66,
+			  0xa6, 0x11, 0xaa, 0x17, 0x11, 0xed, 0xb6, 0x62,
+			  0x8f, 0x12, 0x5e, 0x98, 0x57, 0x18, 0xdd, 0x7d,
+			  0xdd, 0xf6, 0x26, 0xf6, 0xb8, 0xe5, 0x8f, 0x68 },
+			{ 0xc0, 0x32, 0x47, 0x4a, 0x48, 0xd6, 0x90, 0x6c,
+			  0x99, 0x32, 0x56, 0xca, 0xfd, 0x43, 0x21, 0xd5,
+			  0xe1, 0xc6, 0x5d, 0x91, 0xc3, 0x28, 0xbe, 0xb3,
+			  0x1b, 0x19, 0x27, 0x73, 0x7e, 0x68, 0x39, 0x67 },
+		},
+	},
+	{
+		{
+			{ 0xc0, 0x1a, 0x0c, 0xc8, 0x9d, 0xcc, 0x6d, 0xa6,
+			  0x36, 0xa4, 0x38, 0x1b, 0xf4, 0x5c, 0xa0, 0x97,
+			  0xc6, 0xd7, 0xdb, 0x95, 0xbe, 0xf3, 0xeb, 0xa7,
+			  0xab, 0x7d, 0x7e, 0x8d, 0xf6, 0xb8, 0xa0, 0x7d },
+			{ 0xa6, 0x75, 0x56, 0x38, 0x14, 0x20, 0x78, 0xef,
+			  0xe8, 0xa9, 0xfd, 0xaa, 0x30, 0x9f, 0x64, 0xa2,
+			  0xcb, 0xa8, 0xdf, 0x5c, 0x50, 0xeb, 0xd1, 0x4c,
+			  0xb3, 0xc0, 0x4d, 0x1d, 0xba, 0x5a, 0x11, 0x46 },
+			{ 0x76, 0xda, 0xb5, 0xc3, 0x53, 0x19, 0x0f, 0xd4,
+			  0x9b, 0x9e, 0x11, 0x21, 0x73, 0x6f, 0xac, 0x1d,
+			  0x60, 0x59, 0xb2, 0xfe, 0x21, 0x60, 0xcc, 0x03,
+			  0x4b, 0x4b, 0x67, 0x83, 0x7e, 0x88, 0x5f, 0x5a },
+		},
+		{
+			{ 0xb9, 0x43, 0xa6, 0xa0, 0xd3, 0x28, 0x96, 0x9e,
+			  0x64, 0x20, 0xc3, 0xe6, 0x00, 0xcb, 0xc3, 0xb5,
+			  0x32, 0xec, 0x2d, 0x7c, 0x89, 0x02, 0x53, 0x9b,
+			  0x0c, 0xc7, 0xd1, 0xd5, 0xe2, 0x7a, 0xe3, 0x43 },
+			{ 0x11, 0x3d, 0xa1, 0x70, 0xcf, 0x01, 0x63, 0x8f,
+			  0xc4, 0xd0, 0x0d, 0x35, 0x15, 0xb8, 0xce, 0xcf,
+			  0x7e, 0xa4, 0xbc, 0xa4, 0xd4, 0x97, 0x02, 0xf7,
+			  0x34, 0x14, 0x4d, 0xe4, 0x56, 0xb6, 0x69, 0x36 },
+			{ 0x33, 0xe1, 0xa6, 0xed, 0x06, 0x3f, 0x7e, 0x38,
+			  0xc0, 0x3a, 0xa1, 0x99, 0x51, 0x1d, 0x30, 0x67,
+			  0x11, 0x38, 0x26, 0x36, 0xf8, 0xd8, 0x5a, 0xbd,
+			  0xbe, 0xe9, 0xd5, 0x4f, 0xcd, 0xe6, 0x21, 0x6a },
+		},
+		{
+			{ 0xe3, 0xb2, 0x99, 0x66, 0x12, 0x29, 0x41, 0xef,
+			  0x01, 0x13, 0x8d, 0x70, 0x47, 0x08, 0xd3, 0x71,
+			  0xbd, 0xb0, 0x82, 0x11, 0xd0, 0x32, 0x54, 0x32,
+			  0x36, 0x8b, 0x1e, 0x00, 0x07, 0x1b, 0x37, 0x45 },
+			{ 0x5f, 0xe6, 0x46, 0x30, 0x0a, 0x17, 0xc6, 0xf1,
+			  0x24, 0x35, 0xd2, 0x00, 0x2a, 0x2a, 0x71, 0x58,
+			  0x55, 0xb7, 0x82, 0x8c, 0x3c, 0xbd, 0xdb, 0x69,
+			  0x57, 0xff, 0x95, 0xa1, 0xf1, 0xf9, 0x6b, 0x58 },
+			{ 0x0b, 0x79, 0xf8, 0x5e, 0x8d, 0x08, 0xdb, 0xa6,
+			  0xe5, 0x37, 0x09, 0x61, 0xdc, 0xf0, 0x78, 0x52,
+			  0xb8, 0x6e, 0xa1, 0x61, 0xd2, 0x49, 0x03, 0xac,
+			  0x79, 0x21, 0xe5, 0x90, 0x37, 0xb0, 0xaf, 0x0e },
+		},
+		{
+			{ 0x1d, 0xae, 0x75, 0x0f, 0x5e, 0x80, 0x40, 0x51,
+			  0x30, 0xcc, 0x62, 0x26, 0xe3, 0xfb, 0x02, 0xec,
+			  0x6d, 0x39, 0x92, 0xea, 0x1e, 0xdf, 0xeb, 0x2c,
+			  0xb3, 0x5b, 0x43, 0xc5, 0x44, 0x33, 0xae, 0x44 },
+			{ 0x2f, 0x04, 0x48, 0x37, 0xc1, 0x55, 0x05, 0x96,
+			  0x11, 0xaa, 0x0b, 0x82, 0xe6, 0x41, 0x9a, 0x21,
+			  0x0c, 0x6d, 0x48, 0x73, 0x38, 0xf7, 0x81, 0x1c,
+			  0x61, 0xc6, 0x02, 0x5a, 0x67, 0xcc, 0x9a, 0x30 },
+			{ 0xee, 0x43, 0xa5, 0xbb, 0xb9, 0x89, 0xf2, 0x9c,
+			  0x42, 0x71, 0xc9, 0x5a, 0x9d, 0x0e, 0x76, 0xf3,
+			  0xaa, 0x60, 0x93, 0x4f, 0xc6, 0xe5, 0x82, 0x1d,
+			  0x8f, 0x67, 0x94, 0x7f, 0x1b, 0x22, 0xd5, 0x62 },
+		},
+		{
+			{ 0x3c, 0x7a, 0xf7, 0x3a, 0x26, 0xd4, 0x85, 0x75,
+			  0x4d, 0x14, 0xe9, 0xfe, 0x11, 0x7b, 0xae, 0xdf,
+			  0x3d, 0x19, 0xf7, 0x59, 0x80, 0x70, 0x06, 0xa5,
+			  0x37, 0x20, 0x92, 0x83, 0x53, 0x9a, 0xf2, 0x14 },
+			{ 0x6d, 0x93, 0xd0, 0x18, 0x9c, 0x29, 0x4c, 0x52,
+			  0x0c, 0x1a, 0x0c, 0x8a, 0x6c, 0xb5, 0x6b, 0xc8,
+			  0x31, 0x86, 0x4a, 0xdb, 0x2e, 0x05, 0x75, 0xa3,
+			  0x62, 0x45, 0x75, 0xbc, 0xe4, 0xfd, 0x0e, 0x5c },
+			{ 0xf5, 0xd7, 0xb2, 0x25, 0xdc, 0x7e, 0x71, 0xdf,
+			  0x40, 0x30, 0xb5, 0x99, 0xdb, 0x70, 0xf9, 0x21,
+			  0x62, 0x4c, 0xed, 0xc3, 0xb7, 0x34, 0x92, 0xda,
+			  0x3e, 0x09, 0xee, 0x7b, 0x5c, 0x36, 0x72, 0x5e },
+		},
+		{
+			{ 0x3e, 0xb3, 0x08, 0x2f, 0x06, 0x39, 0x93, 0x7d,
+			  0xbe, 0x32, 0x9f, 0xdf, 0xe5, 0x59, 0x96, 0x5b,
+			  0xfd, 0xbd, 0x9e, 0x1f, 0xad, 0x3d, 0xff, 0xac,
+			  0xb7, 0x49, 0x73, 0xcb, 0x55, 0x05, 0xb2, 0x70 },
+			{ 0x7f, 0x21, 0x71, 0x45, 0x07, 0xfc, 0x5b, 0x57,
+			  0x5b, 0xd9, 0x94, 0x06, 0x5d, 0x67, 0x79, 0x37,
+			  0x33, 0x1e, 0x19, 0xf4, 0xbb, 0x37, 0x0a, 0x9a,
+			  0xbc, 0xea, 0xb4, 0x47, 0x4c, 0x10, 0xf1, 0x77 },
+			{ 0x4c, 0x2c, 0x11, 0x55, 0xc5, 0x13, 0x51, 0xbe,
+			  0xcd, 0x1f, 0x88, 0x9a, 0x3a, 0x42, 0x88, 0x66,
+			  0x47, 0x3b, 0x50, 0x5e, 0x85, 0x77, 0x66, 0x44,
+			  0x4a, 0x40, 0x06, 0x4a, 0x8f, 0x39, 0x34, 0x0e },
+		},
+		{
+			{ 0x28, 0x19, 0x4b, 0x3e, 0x09, 0x0b, 0x93, 0x18,
+			  0x40, 0xf6, 0xf3, 0x73, 0x0e, 0xe1, 0xe3, 0x7d,
+			  0x6f, 0x5d, 0x39, 0x73, 0xda, 0x17, 0x32, 0xf4,
+			  0x3e, 0x9c, 0x37, 0xca, 0xd6, 0xde, 0x8a, 0x6f },
+			{ 0xe8, 0xbd, 0xce, 0x3e, 0xd9, 0x22, 0x7d, 0xb6,
+			  0x07, 0x2f, 0x82, 0x27, 0x41, 0xe8, 0xb3, 0x09,
+			  0x8d, 0x6d, 0x5b, 0xb0, 0x1f, 0xa6, 0x3f, 0x74,
+			  0x72, 0x23, 0x36, 0x8a, 0x36, 0x05, 0x54, 0x5e },
+			{ 0x9a, 0xb2, 0xb7, 0xfd, 0x3d, 0x12, 0x40, 0xe3,
+			  0x91, 0xb2, 0x1a, 0xa2, 0xe1, 0x97, 0x7b, 0x48,
+			  0x9e, 0x94, 0xe6, 0xfd, 0x02, 0x7d, 0x96, 0xf9,
+			  0x97, 0xde, 0xd3, 0xc8, 0x2e, 0xe7, 0x0d, 0x78 },
+		},
+		{
+			{ 0x72, 0x27, 0xf4, 0x00, 0xf3, 0xea, 0x1f, 0x67,
+			  0xaa, 0x41, 0x8c, 0x2a, 0x2a, 0xeb, 0x72, 0x8f,
+			  0x92, 0x32, 0x37, 0x97, 0xd7, 0x7f, 0xa1, 0x29,
+			  0xa6, 0x87, 0xb5, 0x32, 0xad, 0xc6, 0xef, 0x1d },
+			{ 0xbc, 0xe7, 0x9a, 0x08, 0x45, 0x85, 0xe2, 0x0a,
+			  0x06, 0x4d, 0x7f, 0x1c, 0xcf, 0xde, 0x8d, 0x38,
+			  0xb8, 0x11, 0x48, 0x0a, 0x51, 0x15, 0xac, 0x38,
+			  0xe4, 0x8c, 0x92, 0x71, 0xf6, 0x8b, 0xb2, 0x0e },
+			{ 0xa7, 0x95, 0x51, 0xef, 0x1a, 0xbe, 0x5b, 0xaf,
+			  0xed, 0x15, 0x7b, 0x91, 0x77, 0x12, 0x8c, 0x14,
+			  0x2e, 0xda, 0xe5, 0x7a, 0xfb, 0xf7, 0x91, 0x29,
+			  0x67, 0x28, 0xdd, 0xf8, 0x1b, 0x20, 0x7d, 0x46 },
+		},
+	},
+	{
+		{
+			{ 0xa9, 0xe7, 0x7a, 0x56, 0xbd, 0xf4, 0x1e, 0xbc,
+			  0xbd, 0x98, 0x44, 0xd6, 0xb2, 0x4c, 0x62, 0x3f,
+			  0xc8, 0x4e, 0x1f, 0x2c, 0xd2, 0x64, 0x10, 0xe4,
+			  0x01, 0x40, 0x38, 0xba, 0xa5, 0xc5, 0xf9, 0x2e },
+			{ 0xad, 0x4f, 0xef, 0x74, 0x9a, 0x91, 0xfe, 0x95,
+			  0xa2, 0x08, 0xa3, 0xf6, 0xec, 0x7b, 0x82, 0x3a,
+			  0x01, 0x7b, 0xa4, 0x09, 0xd3, 0x01, 0x4e, 0x96,
+			  0x97, 0xc7, 0xa3, 0x5b, 0x4f, 0x3c, 0xc4, 0x71 },
+			{ 0xcd, 0x74, 0x9e, 0xfa, 0xf6, 0x6d, 0xfd, 0xb6,
+			  0x7a, 0x26, 0xaf, 0xe4, 0xbc, 0x78, 0x82, 0xf1,
+			  0x0e, 0x99, 0xef, 0xf1, 0xd0, 0xb3, 0x55, 0x82,
+			  0x93, 0xf2, 0xc5, 0x90, 0xa3, 0x8c, 0x75, 0x5a },
+		},
+		{
+			{ 0x94, 0xdc, 0x61, 0x1d, 0x8b, 0x91, 0xe0, 0x8c,
+			  0x66, 0x30, 0x81, 0x9a, 0x46, 0x36, 0xed, 0x8d,
+			  0xd3, 0xaa, 0xe8, 0xaf, 0x29, 0xa8, 0xe6, 0xd4,
+			  0x3f, 0xd4, 0x39, 0xf6, 0x27, 0x80, 0x73, 0x0a },
+			{ 0x95, 0x24, 0x46, 0xd9, 0x10, 0x27, 0xb7, 0xa2,
+			  0x03, 0x50, 0x7d, 0xd5, 0xd2, 0xc6, 0xa8, 0x3a,
+			  0xca, 0x87, 0xb4, 0xa0, 0xbf, 0x00, 0xd4, 0xe3,
+			  0xec, 0x72, 0xeb, 0xb3, 0x44, 0xe2, 0xba, 0x2d },
+			{ 0xcc, 0xe1, 0xff, 0x57, 0x2f, 0x4a, 0x0f, 0x98,
+			  0x43, 0x98, 0x83, 0xe1, 0x0d, 0x0d, 0x67, 0x00,
+			  0xfd, 0x15, 0xfb, 0x49, 0x4a, 0x3f, 0x5c, 0x10,
+			  0x9c, 0xa6, 0x26, 0x51, 0x63, 0xca, 0x98, 0x26 },
+		},
+		{
+			{ 0x0e, 0xd9, 0x3d, 0x5e, 0x2f, 0x70, 0x3d, 0x2e,
+			  0x86, 0x53, 0xd2, 0xe4, 0x18, 0x09, 0x3f, 0x9e,
+			  0x6a, 0xa9, 0x4d, 0x02, 0xf6, 0x3e, 0x77, 0x5e,
+			  0x32, 0x33, 0xfa, 0x4a, 0x0c, 0x4b, 0x00, 0x3c },
+			{ 0x78, 0xba, 0xb0, 0x32, 0x88, 0x31, 0x65, 0xe7,
+			  0x8b, 0xff, 0x5c, 0x92, 0xf7, 0x31, 0x18, 0x38,
+			  0xcc, 0x1f, 0x29, 0xa0, 0x91, 0x1b, 0xa8, 0x08,
+			  0x07, 0xeb, 0xca, 0x49, 0xcc, 0x3d, 0xb4, 0x1f },
+			{ 0x2b, 0xb8, 0xf4, 0x06, 0xac, 0x46, 0xa9, 0x9a,
+			  0xf3, 0xc4, 0x06, 0xa8, 0xa5, 0x84, 0xa2, 0x1c,
+			  0x87, 0x47, 0xcd, 0xc6, 0x5f, 0x26, 0xd3, 0x3e,
+			  0x17, 0xd2, 0x1f, 0xcd, 0x01, 0xfd, 0x43, 0x6b },
+		},
+		{
+			{ 0xf3, 0x0e, 0x76, 0x3e, 0x58, 0x42, 0xc7, 0xb5,
+			  0x90, 0xb9, 0x0a, 0xee, 0xb9, 0x52, 0xdc, 0x75,
+			  0x3f, 0x92, 0x2b, 0x07, 0xc2, 0x27, 0x14, 0xbf,
+			  0xf0, 0xd9, 0xf0, 0x6f, 0x2d, 0x0b, 0x42, 0x73 },
+			{ 0x44, 0xc5, 0x97, 0x46, 0x4b, 0x5d, 0xa7, 0xc7,
+			  0xbf, 0xff, 0x0f, 0xdf, 0x48, 0xf8, 0xfd, 0x15,
+			  0x5a, 0x78, 0x46, 0xaa, 0xeb, 0xb9, 0x68, 0x28,
+			  0x14, 0xf7, 0x52, 0x5b, 0x10, 0xd7, 0x68, 0x5a },
+			{ 0x06, 0x1e, 0x85, 0x9e, 0xcb, 0xf6, 0x2c, 0xaf,
+			  0xc4, 0x38, 0x22, 0xc6, 0x13, 0x39, 0x59, 0x8f,
+			  0x73, 0xf3, 0xfb, 0x99, 0x96, 0xb8, 0x8a, 0xda,
+			  0x9e, 0xbc, 0x34, 0xea, 0x2f, 0x63, 0xb5, 0x3d },
+		},
+		{
+			{ 0xd5, 0x25, 0x98, 0x82, 0xb1, 0x90, 0x49, 0x2e,
+			  0x91, 0x89, 0x9a, 0x3e, 0x87, 0xeb, 0xea, 0xed,
+			  0xf8, 0x4a, 0x70, 0x4c, 0x39, 0x3d, 0xf0, 0xee,
+			  0x0e, 0x2b, 0xdf, 0x95, 0xa4, 0x7e, 0x19, 0x59 },
+			{ 0xd8, 0xd9, 0x5d, 0xf7, 0x2b, 0xee, 0x6e, 0xf4,
+			  0xa5, 0x59, 0x67, 0x39, 0xf6, 0xb1, 0x17, 0x0d,
+			  0x73, 0x72, 0x9e, 0x49, 0x31, 0xd1, 0xf2, 0x1b,
+			  0x13, 0x5f, 0xd7, 0x49, 0xdf, 0x1a, 0x32, 0x04 },
+			{ 0xae, 0x5a, 0xe5, 0xe4, 0x19, 0x60, 0xe1, 0x04,
+			  0xe9, 0x92, 0x2f, 0x7e, 0x7a, 0x43, 0x7b, 0xe7,
+			  0xa4, 0x9a, 0x15, 0x6f, 0xc1, 0x2d, 0xce, 0xc7,
+			  0xc0, 0x0c, 0xd7, 0xf4, 0xc1, 0xfd, 0xea, 0x45 },
+		},
+		{
+			{ 0xed, 0xb1, 0xcc, 0xcf, 0x24, 0x46, 0x0e, 0xb6,
+			  0x95, 0x03, 0x5c, 0xbd, 0x92, 0xc2, 0xdb, 0x59,
+			  0xc9, 0x81, 0x04, 0xdc, 0x1d, 0x9d, 0xa0, 0x31,
+			  0x40, 0xd9, 0x56, 0x5d, 0xea, 0xce, 0x73, 0x3f },
+			{ 0x2b, 0xd7, 0x45, 0x80, 0x85, 0x01, 0x84, 0x69,
+			  0x51, 0x06, 0x2f, 0xcf, 0xa2, 0xfa, 0x22, 0x4c,
+			  0xc6, 0x2d, 0x22, 0x6b, 0x65, 0x36, 0x1a, 0x94,
+			  0xde, 0xda, 0x62, 0x03, 0xc8, 0xeb, 0x5e, 0x5a },
+			{ 0xc6, 0x8d, 0x4e, 0x0a, 0xd1, 0xbf, 0xa7, 0xb7,
+			  0x39, 0xb3, 0xc9, 0x44, 0x7e, 0x00, 0x57, 0xbe,
+			  0xfa, 0xae, 0x57, 0x15, 0x7f, 0x20, 0xc1, 0x60,
+			  0xdb, 0x18, 0x62, 0x26, 0x91, 0x88, 0x05, 0x26 },
+		},
+		{
+			{ 0x42, 0xe5, 0x76, 0xc6, 0x3c, 0x8e, 0x81, 0x4c,
+			  0xad, 0xcc, 0xce, 0x03, 0x93, 0x2c, 0x42, 0x5e,
+			  0x08, 0x9f, 0x12, 0xb4, 0xca, 0xcc, 0x07, 0xec,
+			  0xb8, 0x43, 0x44, 0xb2, 0x10, 0xfa, 0xed, 0x0d },
+			{ 0x04, 0xff, 0x60, 0x83, 0xa6, 0x04, 0xf7, 0x59,
+			  0xf4, 0xe6, 0x61, 0x76, 0xde, 0x3f, 0xd9, 0xc3,
+			  0x51, 0x35, 0x87, 0x12, 0x73, 0x2a, 0x1b, 0x83,
+			  0x57, 0x5d, 0x61, 0x4e, 0x2e, 0x0c, 0xad, 0x54 },
+			{ 0x2a, 0x52, 0x2b, 0xb8, 0xd5, 0x67, 0x3b, 0xee,
+			  0xeb, 0xc1, 0xa5, 0x9f, 0x46, 0x63, 0xf1, 0x36,
+			  0xd3, 0x9f, 0xc1, 0x6e, 0xf2, 0xd2, 0xb4, 0xa5,
+			  0x08, 0x94, 0x7a, 0xa7, 0xba, 0xb2, 0xec, 0x62 },
+		},
+		{
+			{ 0x74, 0x28, 0xb6, 0xaf, 0x36, 0x28, 0x07, 0x92,
+			  0xa5, 0x04, 0xe1, 0x79, 0x85, 0x5e, 0xcd, 0x5f,
+			  0x4a, 0xa1, 0x30, 0xc6, 0xad, 0x01, 0xad, 0x5a,
+			  0x98, 0x3f, 0x66, 0x75, 0x50, 0x3d, 0x91, 0x61 },
+			{ 0x3d, 0x2b, 0x15, 0x61, 0x52, 0x79, 0xed, 0xe5,
+			  0xd1, 0xd7, 0xdd, 0x0e, 0x7d, 0x35, 0x62, 0x49,
+			  0x71, 0x4c, 0x6b, 0xb9, 0xd0, 0xc8, 0x82, 0x74,
+			  0xbe, 0xd8, 0x66, 0xa9, 0x19, 0xf9, 0x59, 0x2e },
+			{ 0xda, 0x31, 0x32, 0x1a, 0x36, 0x2d, 0xc6, 0x0d,
+			  0x70, 0x02, 0x20, 0x94, 0x32, 0x58, 0x47, 0xfa,
+			  0xce, 0x94, 0x95, 0x3f, 0x51, 0x01, 0xd8, 0x02,
+			  0x5c, 0x5d, 0xc0, 0x31, 0xa1, 0xc2, 0xdb, 0x3d },
+		},
+	},
+	{
+		{
+			{ 0x14, 0xbb, 0x96, 0x27, 0xa2, 0x57, 0xaa, 0xf3,
+			  0x21, 0xda, 0x07, 0x9b, 0xb7, 0xba, 0x3a, 0x88,
+			  0x1c, 0x39, 0xa0, 0x31, 0x18, 0xe2, 0x4b, 0xe5,
+			  0xf9, 0x05, 0x32, 0xd8, 0x38, 0xfb, 0xe7, 0x5e },
+			{ 0x4b, 0xc5, 0x5e, 0xce, 0xf9, 0x0f, 0xdc, 0x9a,
+			  0x0d, 0x13, 0x2f, 0x8c, 0x6b, 0x2a, 0x9c, 0x03,
+			  0x15, 0x95, 0xf8, 0xf0, 0xc7, 0x07, 0x80, 0x02,
+			  0x6b, 0xb3, 0x04, 0xac, 0x14, 0x83, 0x96, 0x78 },
+			{ 0x8e, 0x6a, 0x44, 0x41, 0xcb, 0xfd, 0x8d, 0x53,
+			  0xf9, 0x37, 0x49, 0x43, 0xa9, 0xfd, 0xac, 0xa5,
+			  0x78, 0x8c, 0x3c, 0x26, 0x8d, 0x90, 0xaf, 0x46,
+			  0x09, 0x0d, 0xca, 0x9b, 0x3c, 0x63, 0xd0, 0x61 },
+		},
+		{
+			{ 0xdf, 0x73, 0xfc, 0xf8, 0xbc, 0x28, 0xa3, 0xad,
+			  0xfc, 0x37, 0xf0, 0xa6, 0x5d, 0x69, 0x84, 0xee,
+			  0x09, 0xa9, 0xc2, 0x38, 0xdb, 0xb4, 0x7f, 0x63,
+			  0xdc, 0x7b, 0x06, 0xf8, 0x2d, 0xac, 0x23, 0x5b },
+			{ 0x66, 0x25, 0xdb, 0xff, 0x35, 0x49, 0x74, 0x63,
+			  0xbb, 0x68, 0x0b, 0x78, 0x89, 0x6b, 0xbd, 0xc5,
+			  0x03, 0xec, 0x3e, 0x55, 0x80, 0x32, 0x1b, 0x6f,
+			  0xf5, 0xd7, 0xae, 0x47, 0xd8, 0x5f, 0x96, 0x6e },
+			{ 0x7b, 0x52, 0x80, 0xee, 0x53, 0xb9, 0xd2, 0x9a,
+			  0x8d, 0x6d, 0xde, 0xfa, 0xaa, 0x19, 0x8f, 0xe8,
+			  0xcf, 0x82, 0x0e, 0x15, 0x04, 0x17, 0x71, 0x0e,
+			  0xdc, 0xde, 0x95, 0xdd, 0xb9, 0xbb, 0xb9, 0x79 },
+		},
+		{
+			{ 0x74, 0x73, 0x9f, 0x8e, 0xae, 0x7d, 0x99, 0xd1,
+			  0x16, 0x08, 0xbb, 0xcf, 0xf8, 0xa2, 0x32, 0xa0,
+			  0x0a, 0x5f, 0x44, 0x6d, 0x12, 0xba, 0x6c, 0xcd,
+			  0x34, 0xb8, 0xcc, 0x0a, 0x46, 0x11, 0xa8, 0x1b },
+			{ 0xc2, 0x26, 0x31, 0x6a, 0x40, 0x55, 0xb3, 0xeb,
+			  0x93, 0xc3, 0xc8, 0x68, 0xa8, 0x83, 0x63, 0xd2,
+			  0x82, 0x7a, 0xb9, 0xe5, 0x29, 0x64, 0x0c, 0x6c,
+			  0x47, 0x21, 0xfd, 0xc9, 0x58, 0xf1, 0x65, 0x50 },
+			{ 0x54, 0x99, 0x42, 0x0c, 0xfb, 0x69, 0x81, 0x70,
+			  0x67, 0xcf, 0x6e, 0xd7, 0xac, 0x00, 0x46, 0xe1,
+			  0xba, 0x45, 0xe6, 0x70, 0x8a, 0xb9, 0xaa, 0x2e,
+			  0xf2, 0xfa, 0xa4, 0x58, 0x9e, 0xf3, 0x81, 0x39 },
+		},
+		{
+			{ 0xde, 0x6f, 0xe6, 0x6d, 0xa5, 0xdf, 0x45, 0xc8,
+			  0x3a, 0x48, 0x40, 0x2c, 0x00, 0xa5, 0x52, 0xe1,
+			  0x32, 0xf6, 0xb4, 0xc7, 0x63, 0xe1, 0xd2, 0xe9,
+			  0x65, 0x1b, 0xbc, 0xdc, 0x2e, 0x45, 0xf4, 0x30 },
+			{ 0x93, 0x0a, 0x23, 0x59, 0x75, 0x8a, 0xfb, 0x18,
+			  0x5d, 0xf4, 0xe6, 0x60, 0x69, 0x8f, 0x16, 0x1d,
+			  0xb5, 0x3c, 0xa9, 0x14, 0x45, 0xa9, 0x85, 0x3a,
+			  0xfd, 0xd0, 0xac, 0x05, 0x37, 0x08, 0xdc, 0x38 },
+			{ 0x40, 0x97, 0x75, 0xc5, 0x82, 0x27, 0x6d, 0x85,
+			  0xcc, 0xbe, 0x9c, 0xf9, 0x69, 0x45, 0x13, 0xfa,
+			  0x71, 0x4e, 0xea, 0xc0, 0x73, 0xfc, 0x44, 0x88,
+			  0x69, 0x24, 0x3f, 0x59, 0x1a, 0x9a, 0x2d, 0x63 },
+		},
+		{
+			{ 0xa7, 0x84, 0x0c, 0xed, 0x11, 0xfd, 0x09, 0xbf,
+			  0x3a, 0x69, 0x9f, 0x0d, 0x81, 0x71, 0xf0, 0x63,
+			  0x79, 0x87, 0xcf, 0x57, 0x2d, 0x8c, 0x90, 0x21,
+			  0xa2, 0x4b, 0xf6, 0x8a, 0xf2, 0x7d, 0x5a, 0x3a },
+			{ 0xa6, 0xcb, 0x07, 0xb8, 0x15, 0x6b, 0xbb, 0xf6,
+			  0xd7, 0xf0, 0x54, 0xbc, 0xdf, 0xc7, 0x23, 0x18,
+			  0x0b, 0x67, 0x29, 0x6e, 0x03, 0x97, 0x1d, 0xbb,
+			  0x57, 0x4a, 0xed, 0x47, 0x88, 0xf4, 0x24, 0x0b },
+			{ 0xc7, 0xea, 0x1b, 0x51, 0xbe, 0xd4, 0xda, 0xdc,
+			  0xf2, 0xcc, 0x26, 0xed, 0x75, 0x80, 0x53, 0xa4,
+			  0x65, 0x9a, 0x5f, 0x00, 0x9f, 0xff, 0x9c, 0xe1,
+			  0x63, 0x1f, 0x48, 0x75, 0x44, 0xf7, 0xfc, 0x34 },
+		},
+		{
+			{ 0x98, 0xaa, 0xcf, 0x78, 0xab, 0x1d, 0xbb, 0xa5,
+			  0xf2, 0x72, 0x0b, 0x19, 0x67, 0xa2, 0xed, 0x5c,
+			  0x8e, 0x60, 0x92, 0x0a, 0x11, 0xc9, 0x09, 0x93,
+			  0xb0, 0x74, 0xb3, 0x2f, 0x04, 0xa3, 0x19, 0x01 },
+			{ 0xca, 0x67, 0x97, 0x78, 0x4c, 0xe0, 0x97, 0xc1,
+			  0x7d, 0x46, 0xd9, 0x38, 0xcb, 0x4d, 0x71, 0xb8,
+			  0xa8, 0x5f, 0xf9, 0x83, 0x82, 0x88, 0xde, 0x55,
+			  0xf7, 0x63, 0xfa, 0x4d, 0x16, 0xdc, 0x3b, 0x3d },
+			{ 0x7d, 0x17, 0xc2, 0xe8, 0x9c, 0xd8, 0xa2, 0x67,
+			  0xc1, 0xd0, 0x95, 0x68, 0xf6, 0xa5, 0x9d, 0x66,
+			  0xb0, 0xa2, 0x82, 0xb2, 0xe5, 0x98, 0x65, 0xf5,
+			  0x73, 0x0a, 0xe2, 0xed, 0xf1, 0x88, 0xc0, 0x56 },
+		},
+		{
+			{ 0x02, 0x8f, 0xf3, 0x24, 0xac, 0x5f, 0x1b, 0x58,
+			  0xbd, 0x0c, 0xe3, 0xba, 0xfe, 0xe9, 0x0b, 0xa9,
+			  0xf0, 0x92, 0xcf, 0x8a, 0x02, 0x69, 0x21, 0x9a,
+			  0x8f, 0x03, 0x59, 0x83, 0xa4, 0x7e, 0x8b, 0x03 },
+			{ 0x17, 0x6e, 0xa8, 0x10, 0x11, 0x3d, 0x6d, 0x33,
+			  0xfa, 0xb2, 0x75, 0x0b, 0x32, 0x88, 0xf3, 0xd7,
+			  0x88, 0x29, 0x07, 0x25, 0x76, 0x33, 0x15, 0xf9,
+			  0x87, 0x8b, 0x10, 0x99, 0x6b, 0x4c, 0x67, 0x09 },
+			{ 0xf8, 0x6f, 0x31, 0x99, 0x21, 0xf8, 0x4e, 0x9f,
+			  0x4f, 0x8d, 0xa7, 0xea, 0x82, 0xd2, 0x49, 0x2f,
+			  0x74, 0x31, 0xef, 0x5a, 0xab, 0xa5, 0x71, 0x09,
+			  0x65, 0xeb, 0x69, 0x59, 0x02, 0x31, 0x5e, 0x6e },
+		},
+		{
+			{ 0x22, 0x62, 0x06, 0x63, 0x0e, 0xfb, 0x04, 0x33,
+			  0x3f, 0xba, 0xac, 0x87, 0x89, 0x06, 0x35, 0xfb,
+			  0xa3, 0x61, 0x10, 0x8c, 0x77, 0x24, 0x19, 0xbd,
+			  0x20, 0x86, 0x83, 0xd1, 0x43, 0xad, 0x58, 0x30 },
+			{ 0xfb, 0x93, 0xe5, 0x87, 0xf5, 0x62, 0x6c, 0xb1,
+			  0x71, 0x3e, 0x5d, 0xca, 0xde, 0xed, 0x99, 0x49,
+			  0x6d, 0x3e, 0xcc, 0x14, 0xe0, 0xc1, 0x91, 0xb4,
+			  0xa8, 0xdb, 0xa8, 0x89, 0x47, 0x11, 0xf5, 0x08 },
+			{ 0xd0, 0x63, 0x76, 0xe5, 0xfd, 0x0f, 0x3c, 0x32,
+			  0x10, 0xa6, 0x2e, 0xa2, 0x38, 0xdf, 0xc3, 0x05,
+			  0x9a, 0x4f, 0x99, 0xac, 0xbd, 0x8a, 0xc7, 0xbd,
+			  0x99, 0xdc, 0xe3, 0xef, 0xa4, 0x9f, 0x54, 0x26 },
+		},
+	},
+	{
+		{
+			{ 0x6e, 0x66, 0x3f, 0xaf, 0x49, 0x85, 0x46, 0xdb,
+			  0xa5, 0x0e, 0x4a, 0xf1, 0x04, 0xcf, 0x7f, 0xd7,
+			  0x47, 0x0c, 0xba, 0xa4, 0xf7, 0x3f, 0xf2, 0x3d,
+			  0x85, 0x3c, 0xce, 0x32, 0xe1, 0xdf, 0x10, 0x3a },
+			{ 0xd6, 0xf9, 0x6b, 0x1e, 0x46, 0x5a, 0x1d, 0x74,
+			  0x81, 0xa5, 0x77, 0x77, 0xfc, 0xb3, 0x05, 0x23,
+			  0xd9, 0xd3, 0x74, 0x64, 0xa2, 0x74, 0x55, 0xd4,
+			  0xff, 0xe0, 0x01, 0x64, 0xdc, 0xe1, 0x26, 0x19 },
+			{ 0xa0, 0xce, 0x17, 0xea, 0x8a, 0x4e, 0x7f, 0xe0,
+			  0xfd, 0xc1, 0x1f, 0x3a, 0x46, 0x15, 0xd5, 0x2f,
+			  0xf1, 0xc0, 0xf2, 0x31, 0xfd, 0x22, 0x53, 0x17,
+			  0x15, 0x5d, 0x1e, 0x86, 0x1d, 0xd0, 0xa1, 0x1f },
+		},
+		{
+			{ 0xab, 0x94, 0xdf, 0xd1, 0x00, 0xac, 0xdc, 0x38,
+			  0xe9, 0x0d, 0x08, 0xd1, 0xdd, 0x2b, 0x71, 0x2e,
+			  0x62, 0xe2, 0xd5, 0xfd, 0x3e, 0xe9, 0x13, 0x7f,
+			  0xe5, 0x01, 0x9a, 0xee, 0x18, 0xed, 0xfc, 0x73 },
+			{ 0x32, 0x98, 0x59, 0x7d, 0x94, 0x55, 0x80, 0xcc,
+			  0x20, 0x55, 0xf1, 0x37, 0xda, 0x56, 0x46, 0x1e,
+			  0x20, 0x93, 0x05, 0x4e, 0x74, 0xf7, 0xf6, 0x99,
+			  0x33, 0xcf, 0x75, 0x6a, 0xbc, 0x63, 0x35, 0x77 },
+			{ 0xb3, 0x9c, 0x13, 0x63, 0x08, 0xe9, 0xb1, 0x06,
+			  0xcd, 0x3e, 0xa0, 0xc5, 0x67, 0xda, 0x93, 0xa4,
+			  0x32, 0x89, 0x63, 0xad, 0xc8, 0xce, 0x77, 0x8d,
+			  0x44, 0x4f, 0x86, 0x1b, 0x70, 0x6b, 0x42, 0x1f },
+		},
+		{
+			{ 0x52, 0x25, 0xa1, 0x91, 0xc8, 0x35, 0x7e, 0xf1,
+			  0x76, 0x9c, 0x5e, 0x57, 0x53, 0x81, 0x6b, 0xb7,
+			  0x3e, 0x72, 0x9b, 0x0d, 0x6f, 0x40, 0x83, 0xfa,
+			  0x38, 0xe4, 0xa7, 0x3f, 0x1b, 0xbb, 0x76, 0x0b },
+			{ 0x01, 0x1c, 0x91, 0x41, 0x4c, 0x26, 0xc9, 0xef,
+			  0x25, 0x2c, 0xa2, 0x17, 0xb8, 0xb7, 0xa3, 0xf1,
+			  0x47, 0x14, 0x0f, 0xf3, 0x6b, 0xda, 0x75, 0x58,
+			  0x90, 0xb0, 0x31, 0x1d, 0x27, 0xf5, 0x1a, 0x4e },
+			{ 0x9b, 0x93, 0x92, 0x7f, 0xf9, 0xc1, 0xb8, 0x08,
+			  0x6e, 0xab, 0x44, 0xd4, 0xcb, 0x71, 0x67, 0xbe,
+			  0x17, 0x80, 0xbb, 0x99, 0x63, 0x64, 0xe5, 0x22,
+			  0x55, 0xa9, 0x72, 0xb7, 0x1e, 0xd6, 0x6d, 0x7b },
+		},
+		{
+			{ 0xc7, 0xd2, 0x01, 0xab, 0xf9, 0xab, 0x30, 0x57,
+			  0x18, 0x3b, 0x14, 0x40, 0xdc, 0x76, 0xfb, 0x16,
+			  0x81, 0xb2, 0xcb, 0xa0, 0x65, 0xbe, 0x6c, 0x86,
+			  0xfe, 0x6a, 0xff, 0x9b, 0x65, 0x9b, 0xfa, 0x53 },
+			{ 0x92, 0x3d, 0xf3, 0x50, 0xe8, 0xc1, 0xad, 0xb7,
+			  0xcf, 0xd5, 0x8c, 0x60, 0x4f, 0xfa, 0x98, 0x79,
+			  0xdb, 0x5b, 0xfc, 0x8d, 0xbd, 0x2d, 0x96, 0xad,
+			  0x4f, 0x2f, 0x1d, 0xaf, 0xce, 0x9b, 0x3e, 0x70 },
+			{ 0x55, 0x54, 0x88, 0x94, 0xe9, 0xc8, 0x14, 0x6c,
+			  0xe5, 0xd4, 0xae, 0x65, 0x66, 0x5d, 0x3a, 0x84,
+			  0xf1, 0x5a, 0xd6, 0xbc, 0x3e, 0xb7, 0x1b, 0x18,
+			  0x50, 0x1f, 0xc6, 0xc4, 0xe5, 0x93, 0x8d, 0x39 },
+		},
+		{
+			{ 0xf2, 0xe3, 0xe7, 0xd2, 0x60, 0x7c, 0x87, 0xc3,
+			  0xb1, 0x8b, 0x82, 0x30, 0xa0, 0xaa, 0x34, 0x3b,
+			  0x38, 0xf1, 0x9e, 0x73, 0xe7, 0x26, 0x3e, 0x28,
+			  0x77, 0x05, 0xc3, 0x02, 0x90, 0x9c, 0x9c, 0x69 },
+			{ 0xf3, 0x48, 0xe2, 0x33, 0x67, 0xd1, 0x4b, 0x1c,
+			  0x5f, 0x0a, 0xbf, 0x15, 0x87, 0x12, 0x9e, 0xbd,
+			  0x76, 0x03, 0x0b, 0xa1, 0xf0, 0x8c, 0x3f, 0xd4,
+			  0x13, 0x1b, 0x19, 0xdf, 0x5d, 0x9b, 0xb0, 0x53 },
+			{ 0xcc, 0xf1, 0x46, 0x59, 0x23, 0xa7, 0x06, 0xf3,
+			  0x7d, 0xd9, 0xe5, 0xcc, 0xb5, 0x18, 0x17, 0x92,
+			  0x75, 0xe9, 0xb4, 0x81, 0x47, 0xd2, 0xcd, 0x28,
+			  0x07, 0xd9, 0xcd, 0x6f, 0x0c, 0xf3, 0xca, 0x51 },
+		},
+		{
+			{ 0xc7, 0x54, 0xac, 0x18, 0x9a, 0xf9, 0x7a, 0x73,
+			  0x0f, 0xb3, 0x1c, 0xc5, 0xdc, 0x78, 0x33, 0x90,
+			  0xc7, 0x0c, 0xe1, 0x4c, 0x33, 0xbc, 0x89, 0x2b,
+			  0x9a, 0xe9, 0xf8, 0x89, 0xc1, 0x29, 0xae, 0x12 },
+			{ 0x0a, 0xe0, 0x74, 0x76, 0x42, 0xa7, 0x0b, 0xa6,
+			  0xf3, 0x7b, 0x7a, 0xa1, 0x70, 0x85, 0x0e, 0x63,
+			  0xcc, 0x24, 0x33, 0xcf, 0x3d, 0x56, 0x58, 0x37,
+			  0xaa, 0xfd, 0x83, 0x23, 0x29, 0xaa, 0x04, 0x55 },
+			{ 0xcf, 0x01, 0x0d, 0x1f, 0xcb, 0xc0, 0x9e, 0xa9,
+			  0xae, 0xf7, 0x34, 0x3a, 0xcc, 0xef, 0xd1, 0x0d,
+			  0x22, 0x4e, 0x9c, 0xd0, 0x21, 0x75, 0xca, 0x55,
+			  0xea, 0xa5, 0xeb, 0x58, 0xe9, 0x4f, 0xd1, 0x5f },
+		},
+		{
+			{ 0x8e, 0xcb, 0x93, 0xbf, 0x5e, 0xfe, 0x42, 0x3c,
+			  0x5f, 0x56, 0xd4, 0x36, 0x51, 0xa8, 0xdf, 0xbe,
+			  0xe8, 0x20, 0x42, 0x88, 0x9e, 0x85, 0xf0, 0xe0,
+			  0x28, 0xd1, 0x25, 0x07, 0x96, 0x3f, 0xd7, 0x7d },
+			{ 0x2c, 0xab, 0x45, 0x28, 0xdf, 0x2d, 0xdc, 0xb5,
+			  0x93, 0xe9, 0x7f, 0x0a, 0xb1, 0x91, 0x94, 0x06,
+			  0x46, 0xe3, 0x02, 0x40, 0xd6, 0xf3, 0xaa, 0x4d,
+			  0xd1, 0x74, 0x64, 0x58, 0x6e, 0xf2, 0x3f, 0x09 },
+			{ 0x29, 0x98, 0x05, 0x68, 0xfe, 0x24, 0x0d, 0xb1,
+			  0xe5, 0x23, 0xaf, 0xdb, 0x72, 0x06, 0x73, 0x75,
+			  0x29, 0xac, 0x57, 0xb4, 0x3a, 0x25, 0x67, 0x13,
+			  0xa4, 0x70, 0xb4, 0x86, 0xbc, 0xbc, 0x59, 0x2f },
+		},
+		{
+			{ 0x01, 0xc3, 0x91, 0xb6, 0x60, 0xd5, 0x41, 0x70,
+			  0x1e, 0xe7, 0xd7, 0xad, 0x3f, 0x1b, 0x20, 0x85,
+			  0x85, 0x55, 0x33, 0x11, 0x63, 0xe1, 0xc2, 0x16,
+			  0xb1, 0x28, 0x08, 0x01, 0x3d, 0x5e, 0xa5, 0x2a },
+			{ 0x5f, 0x13, 0x17, 0x99, 0x42, 0x7d, 0x84, 0x83,
+			  0xd7, 0x03, 0x7d, 0x56, 0x1f, 0x91, 0x1b, 0xad,
+			  0xd1, 0xaa, 0x77, 0xbe, 0xd9, 0x48, 0x77, 0x7e,
+			  0x4a, 0xaf, 0x51, 0x2e, 0x2e, 0xb4, 0x58, 0x54 },
+			{ 0x4f, 0x44, 0x07, 0x0c, 0xe6, 0x92, 0x51, 0xed,
+			  0x10, 0x1d, 0x42, 0x74, 0x2d, 0x4e, 0xc5, 0x42,
+			  0x64, 0xc8, 0xb5, 0xfd, 0x82, 0x4c, 0x2b, 0x35,
+			  0x64, 0x86, 0x76, 0x8a, 0x4a, 0x00, 0xe9, 0x13 },
+		},
+	},
+	{
+		{
+			{ 0x7f, 0x87, 0x3b, 0x19, 0xc9, 0x00, 0x2e, 0xbb,
+			  0x6b, 0x50, 0xdc, 0xe0, 0x90, 0xa8, 0xe3, 0xec,
+			  0x9f, 0x64, 0xde, 0x36, 0xc0, 0xb7, 0xf3, 0xec,
+			  0x1a, 0x9e, 0xde, 0x98, 0x08, 0x04, 0x46, 0x5f },
+			{ 0xdb, 0xce, 0x2f, 0x83, 0x45, 0x88, 0x9d, 0x73,
+			  0x63, 0xf8, 0x6b, 0xae, 0xc9, 0xd6, 0x38, 0xfa,
+			  0xf7, 0xfe, 0x4f, 0xb7, 0xca, 0x0d, 0xbc, 0x32,
+			  0x5e, 0xe4, 0xbc, 0x14, 0x88, 0x7e, 0x93, 0x73 },
+			{ 0x8d, 0xf4, 0x7b, 0x29, 0x16, 0x71, 0x03, 0xb9,
+			  0x34, 0x68, 0xf0, 0xd4, 0x22, 0x3b, 0xd1, 0xa9,
+			  0xc6, 0xbd, 0x96, 0x46, 0x57, 0x15, 0x97, 0xe1,
+			  0x35, 0xe8, 0xd5, 0x91, 0xe8, 0xa4, 0xf8, 0x2c },
+		},
+		{
+			{ 0xa2, 0x6b, 0xd0, 0x17, 0x7e, 0x48, 0xb5, 0x2c,
+			  0x6b, 0x19, 0x50, 0x39, 0x1c, 0x38, 0xd2, 0x24,
+			  0x30, 0x8a, 0x97, 0x85, 0x81, 0x9c, 0x65, 0xd7,
+			  0xf6, 0xa4, 0xd6, 0x91, 0x28, 0x7f, 0x6f, 0x7a },
+			{ 0x67, 0x0f, 0x11, 0x07, 0x87, 0xfd, 0x93, 0x6d,
+			  0x49, 0xb5, 0x38, 0x7c, 0xd3, 0x09, 0x4c, 0xdd,
+			  0x86, 0x6a, 0x73, 0xc2, 0x4c, 0x6a, 0xb1, 0x7c,
+			  0x09, 0x2a, 0x25, 0x58, 0x6e, 0xbd, 0x49, 0x20 },
+			{ 0x49, 0xef, 0x9a, 0x6a, 0x8d, 0xfd, 0x09, 0x7d,
+			  0x0b, 0xb9, 0x3d, 0x5b, 0xbe, 0x60, 0xee, 0xf0,
+			  0xd4, 0xbf, 0x9e, 0x51, 0x2c, 0xb5, 0x21, 0x4c,
+			  0x1d, 0x94, 0x45, 0xc5, 0xdf, 0xaa, 0x11, 0x60 },
+		},
+		{
+			{ 0x90, 0xf8, 0xcb, 0x02, 0xc8, 0xd0, 0xde, 0x63,
+			  0xaa, 0x6a, 0xff, 0x0d, 0xca, 0x98, 0xd0, 0xfb,
+			  0x99, 0xed, 0xb6, 0xb9, 0xfd, 0x0a, 0x4d, 0x62,
+			  0x1e, 0x0b, 0x34, 0x79, 0xb7, 0x18, 0xce, 0x69 },
+			{ 0x3c, 0xf8, 0x95, 0xcf, 0x6d, 0x92, 0x67, 0x5f,
+			  0x71, 0x90, 0x28, 0x71, 0x61, 0x85, 0x7e, 0x7c,
+			  0x5b, 0x7a, 0x8f, 0x99, 0xf3, 0xe7, 0xa1, 0xd6,
+			  0xe0, 0xf9, 0x62, 0x0b, 0x1b, 0xcc, 0xc5, 0x6f },
+			{ 0xcb, 0x79, 0x98, 0xb2, 0x28, 0x55, 0xef, 0xd1,
+			  0x92, 0x90, 0x7e, 0xd4, 0x3c, 0xae, 0x1a, 0xdd,
+			  0x52, 0x23, 0x9f, 0x18, 0x42, 0x04, 0x7e, 0x12,
+			  0xf1, 0x01, 0x71, 0xe5, 0x3a, 0x6b, 0x59, 0x15 },
+		},
+		{
+			{ 0xca, 0x24, 0x51, 0x7e, 0x16, 0x31, 0xff, 0x09,
+			  0xdf, 0x45, 0xc7, 0xd9, 0x8b, 0x15, 0xe4, 0x0b,
+			  0xe5, 0x56, 0xf5, 0x7e, 0x22, 0x7d, 0x2b, 0x29,
+			  0x38, 0xd1, 0xb6, 0xaf, 0x41, 0xe2, 0xa4, 0x3a },
+			{ 0xa2, 0x79, 0x91, 0x3f, 0xd2, 0x39, 0x27, 0x46,
+			  0xcf, 0xdd, 0xd6, 0x97, 0x31, 0x12, 0x83, 0xff,
+			  0x8a, 0x14, 0xf2, 0x53, 0xb5, 0xde, 0x07, 0x13,
+			  0xda, 0x4d, 0x5f, 0x7b, 0x68, 0x37, 0x22, 0x0d },
+			{ 0xf5, 0x05, 0x33, 0x2a, 0xbf, 0x38, 0xc1, 0x2c,
+			  0xc3, 0x26, 0xe9, 0xa2, 0x8f, 0x3f, 0x58, 0x48,
+			  0xeb, 0xd2, 0x49, 0x55, 0xa2, 0xb1, 0x3a, 0x08,
+			  0x6c, 0xa3, 0x87, 0x46, 0x6e, 0xaa, 0xfc, 0x32 },
+		},
+		{
+			{ 0xdf, 0xcc, 0x87, 0x27, 0x73, 0xa4, 0x07, 0x32,
+			  0xf8, 0xe3, 0x13, 0xf2, 0x08, 0x19, 0xe3, 0x17,
+			  0x4e, 0x96, 0x0d, 0xf6, 0xd7, 0xec, 0xb2, 0xd5,
+			  0xe9, 0x0b, 0x60, 0xc2, 0x36, 0x63, 0x6f, 0x74 },
+			{ 0xf5, 0x9a, 0x7d, 0xc5, 0x8d, 0x6e, 0xc5, 0x7b,
+			  0xf2, 0xbd, 0xf0, 0x9d, 0xed, 0xd2, 0x0b, 0x3e,
+			  0xa3, 0xe4, 0xef, 0x22, 0xde, 0x14, 0xc0, 0xaa,
+			  0x5c, 0x6a, 0xbd, 0xfe, 0xce, 0xe9, 0x27, 0x46 },
+			{ 0x1c, 0x97, 0x6c, 0xab, 0x45, 0xf3, 0x4a, 0x3f,
+			  0x1f, 0x73, 0x43, 0x99, 0x72, 0xeb, 0x88, 0xe2,
+			  0x6d, 0x18, 0x44, 0x03, 0x8a, 0x6a, 0x59, 0x33,
+			  0x93, 0x62, 0xd6, 0x7e, 0x00, 0x17, 0x49, 0x7b },
+		},
+		{
+			{ 0xdd, 0xa2, 0x53, 0xdd, 0x28, 0x1b, 0x34, 0x54,
+			  0x3f, 0xfc, 0x42, 0xdf, 0x5b, 0x90, 0x17, 0xaa,
+			  0xf4, 0xf8, 0xd2, 0x4d, 0xd9, 0x92, 0xf5, 0x0f,
+			  0x7d, 0xd3, 0x8c, 0xe0, 0x0f, 0x62, 0x03, 0x1d },
+			{ 0x64, 0xb0, 0x84, 0xab, 0x5c, 0xfb, 0x85, 0x2d,
+			  0x14, 0xbc, 0xf3, 0x89, 0xd2, 0x10, 0x78, 0x49,
+			  0x0c, 0xce, 0x15, 0x7b, 0x44, 0xdc, 0x6a, 0x47,
+			  0x7b, 0xfd, 0x44, 0xf8, 0x76, 0xa3, 0x2b, 0x12 },
+			{ 0x54, 0xe5, 0xb4, 0xa2, 0xcd, 0x32, 0x02, 0xc2,
+			  0x7f, 0x18, 0x5d, 0x11, 0x42, 0xfd, 0xd0, 0x9e,
+			  0xd9, 0x79, 0xd4, 0x7d, 0xbe, 0xb4, 0xab, 0x2e,
+			  0x4c, 0xec, 0x68, 0x2b, 0xf5, 0x0b, 0xc7, 0x02 },
+		},
+		{
+			{ 0xe1, 0x72, 0x8d, 0x45, 0xbf, 0x32, 0xe5, 0xac,
+			  0xb5, 0x3c, 0xb7, 0x7c, 0xe0, 0x68, 0xe7, 0x5b,
+			  0xe7, 0xbd, 0x8b, 0xee, 0x94, 0x7d, 0xcf, 0x56,
+			  0x03, 0x3a, 0xb4, 0xfe, 0xe3, 0x97, 0x06, 0x6b },
+			{ 0xbb, 0x2f, 0x0b, 0x5d, 0x4b, 0xec, 0x87, 0xa2,
+			  0xca, 0x82, 0x48, 0x07, 0x90, 0x57, 0x5c, 0x41,
+			  0x5c, 0x81, 0xd0, 0xc1, 0x1e, 0xa6, 0x44, 0xe0,
+			  0xe0, 0xf5, 0x9e, 0x40, 0x0a, 0x4f, 0x33, 0x26 },
+			{ 0xc0, 0xa3, 0x62, 0xdf, 0x4a, 0xf0, 0xc8, 0xb6,
+			  0x5d, 0xa4, 0x6d, 0x07, 0xef, 0x00, 0xf0, 0x3e,
+			  0xa9, 0xd2, 0xf0, 0x49, 0x58, 0xb9, 0x9c, 0x9c,
+			  0xae, 0x2f, 0x1b, 0x44, 0x43, 0x7f, 0xc3, 0x1c },
+		},
+		{
+			{ 0xb9, 0xae, 0xce, 0xc9, 0xf1, 0x56, 0x66, 0xd7,
+			  0x6a, 0x65, 0xe5, 0x18, 0xf8, 0x15, 0x5b, 0x1c,
+			  0x34, 0x23, 0x4c, 0x84, 0x32, 0x28, 0xe7, 0x26,
+			  0x38, 0x68, 0x19, 0x2f, 0x77, 0x6f, 0x34, 0x3a },
+			{ 0x4f, 0x32, 0xc7, 0x5c, 0x5a, 0x56, 0x8f, 0x50,
+			  0x22, 0xa9, 0x06, 0xe5, 0xc0, 0xc4, 0x61, 0xd0,
+			  0x19, 0xac, 0x45, 0x5c, 0xdb, 0xab, 0x18, 0xfb,
+			  0x4a, 0x31, 0x80, 0x03, 0xc1, 0x09, 0x68, 0x6c },
+			{ 0xc8, 0x6a, 0xda, 0xe2, 0x12, 0x51, 0xd5, 0xd2,
+			  0xed, 0x51, 0xe8, 0xb1, 0x31, 0x03, 0xbd, 0xe9,
+			  0x62, 0x72, 0xc6, 0x8e, 0xdd, 0x46, 0x07, 0x96,
+			  0xd0, 0xc5, 0xf7, 0x6e, 0x9f, 0x1b, 0x91, 0x05 },
+		},
+	},
+	{
+		{
+			{ 0xef, 0xea, 0x2e, 0x51, 0xf3, 0xac, 0x49, 0x53,
+			  0x49, 0xcb, 0xc1, 0x1c, 0xd3, 0x41, 0xc1, 0x20,
+			  0x8d, 0x68, 0x9a, 0xa9, 0x07, 0x0c, 0x18, 0x24,
+			  0x17, 0x2d, 0x4b, 0xc6, 0xd1, 0xf9, 0x5e, 0x55 },
+			{ 0xbb, 0x0e, 0xdf, 0xf5, 0x83, 0x99, 0x33, 0xc1,
+			  0xac, 0x4c, 0x2c, 0x51, 0x8f, 0x75, 0xf3, 0xc0,
+			  0xe1, 0x98, 0xb3, 0x0b, 0x0a, 0x13, 0xf1, 0x2c,
+			  0x62, 0x0c, 0x27, 0xaa, 0xf9, 0xec, 0x3c, 0x6b },
+			{ 0x08, 0xbd, 0x73, 0x3b, 0xba, 0x70, 0xa7, 0x36,
+			  0x0c, 0xbf, 0xaf, 0xa3, 0x08, 0xef, 0x4a, 0x62,
+			  0xf2, 0x46, 0x09, 0xb4, 0x98, 0xff, 0x37, 0x57,
+			  0x9d, 0x74, 0x81, 0x33, 0xe1, 0x4d, 0x5f, 0x67 },
+		},
+		{
+			{ 0x1d, 0xb3, 0xda, 0x3b, 0xd9, 0xf6, 0x2f, 0xa1,
+			  0xfe, 0x2d, 0x65, 0x9d, 0x0f, 0xd8, 0x25, 0x07,
+			  0x87, 0x94, 0xbe, 0x9a, 0xf3, 0x4f, 0x9c, 0x01,
+			  0x43, 0x3c, 0xcd, 0x82, 0xb8, 0x50, 0xf4, 0x60 },
+			{ 0xfc, 0x82, 0x17, 0x6b, 0x03, 0x52, 0x2c, 0x0e,
+			  0xb4, 0x83, 0xad, 0x6c, 0x81, 0x6c, 0x81, 0x64,
+			  0x3e, 0x07, 0x64, 0x69, 0xd9, 0xbd, 0xdc, 0xd0,
+			  0x20, 0xc5, 0x64, 0x01, 0xf7, 0x9d, 0xd9, 0x13 },
+			{ 0xca, 0xc0, 0xe5, 0x21, 0xc3, 0x5e, 0x4b, 0x01,
+			  0xa2, 0xbf, 0x19, 0xd7, 0xc9, 0x69, 0xcb, 0x4f,
+			  0xa0, 0x23, 0x00, 0x75, 0x18, 0x1c, 0x5f, 0x4e,
+			  0x80, 0xac, 0xed, 0x55, 0x9e, 0xde, 0x06, 0x1c },
+		},
+		{
+			{ 0xaa, 0x69, 0x6d, 0xff, 0x40, 0x2b, 0xd5, 0xff,
+			  0xbb, 0x49, 0x40, 0xdc, 0x18, 0x0b, 0x53, 0x34,
+			  0x97, 0x98, 0x4d, 0xa3, 0x2f, 0x5c, 0x4a, 0x5e,
+			  0x2d, 0xba, 0x32, 0x7d, 0x8e, 0x6f, 0x09, 0x78 },
+			{ 0xe2, 0xc4, 0x3e, 0xa3, 0xd6, 0x7a, 0x0f, 0x99,
+			  0x8e, 0xe0, 0x2e, 0xbe, 0x38, 0xf9, 0x08, 0x66,
+			  0x15, 0x45, 0x28, 0x63, 0xc5, 0x43, 0xa1, 0x9c,
+			  0x0d, 0xb6, 0x2d, 0xec, 0x1f, 0x8a, 0xf3, 0x4c },
+			{ 0xe7, 0x5c, 0xfa, 0x0d, 0x65, 0xaa, 0xaa, 0xa0,
+			  0x8c, 0x47, 0xb5, 0x48, 0x2a, 0x9e, 0xc4, 0xf9,
+			  0x5b, 0x72, 0x03, 0x70, 0x7d, 0xcc, 0x09, 0x4f,
+			  0xbe, 0x1a, 0x09, 0x26, 0x3a, 0xad, 0x3c, 0x37 },
+		},
+		{
+			{ 0xad, 0xbb, 0xdd, 0x89, 0xfb, 0xa8, 0xbe, 0xf1,
+			  0xcb, 0xae, 0xae, 0x61, 0xbc, 0x2c, 0xcb, 0x3b,
+			  0x9d, 0x8d, 0x9b, 0x1f, 0xbb, 0xa7, 0x58, 0x8f,
+			  0x86, 0xa6, 0x12, 0x51, 0xda, 0x7e, 0x54, 0x21 },
+			{ 0x7c, 0xf5, 0xc9, 0x82, 0x4d, 0x63, 0x94, 0xb2,
+			  0x36, 0x45, 0x93, 0x24, 0xe1, 0xfd, 0xcb, 0x1f,
+			  0x5a, 0xdb, 0x8c, 0x41, 0xb3, 0x4d, 0x9c, 0x9e,
+			  0xfc, 0x19, 0x44, 0x45, 0xd9, 0xf3, 0x40, 0x00 },
+			{ 0xd3, 0x86, 0x59, 0xfd, 0x39, 0xe9, 0xfd, 0xde,
+			  0x0c, 0x38, 0x0a, 0x51, 0x89, 0x2c, 0x27, 0xf4,
+			  0xb9, 0x19, 0x31, 0xbb, 0x07, 0xa4, 0x2b, 0xb7,
+			  0xf4, 0x4d, 0x25, 0x4a, 0x33, 0x0a, 0x55, 0x63 },
+		},
+		{
+			{ 0x49, 0x7b, 0x54, 0x72, 0x45, 0x58, 0xba, 0x9b,
+			  0xe0, 0x08, 0xc4, 0xe2, 0xfa, 0xc6, 0x05, 0xf3,
+			  0x8d, 0xf1, 0x34, 0xc7, 0x69, 0xfa, 0xe8, 0x60,
+			  0x7a, 0x76, 0x7d, 0xaa, 0xaf, 0x2b, 0xa9, 0x39 },
+			{ 0x37, 0xcf, 0x69, 0xb5, 0xed, 0xd6, 0x07, 0x65,
+			  0xe1, 0x2e, 0xa5, 0x0c, 0xb0, 0x29, 0x84, 0x17,
+			  0x5d, 0xd6, 0x6b, 0xeb, 0x90, 0x00, 0x7c, 0xea,
+			  0x51, 0x8f, 0xf7, 0xda, 0xc7, 0x62, 0xea, 0x3e },
+			{ 0x4e, 0x27, 0x93, 0xe6, 0x13, 0xc7, 0x24, 0x9d,
+			  0x75, 0xd3, 0xdb, 0x68, 0x77, 0x85, 0x63, 0x5f,
+			  0x9a, 0xb3, 0x8a, 0xeb, 0x60, 0x55, 0x52, 0x70,
+			  0xcd, 0xc4, 0xc9, 0x65, 0x06, 0x6a, 0x43, 0x68 },
+		},
+		{
+			{ 0x7c, 0x10, 0x20, 0xe8, 0x17, 0xd3, 0x56, 0x1e,
+			  0x65, 0xe9, 0x0a, 0x84, 0x44, 0x68, 0x26, 0xc5,
+			  0x7a, 0xfc, 0x0f, 0x32, 0xc6, 0xa1, 0xe0, 0xc1,
+			  0x72, 0x14, 0x61, 0x91, 0x9c, 0x66, 0x73, 0x53 },
+			{ 0x27, 0x3f, 0x2f, 0x20, 0xe8, 0x35, 0x02, 0xbc,
+			  0xb0, 0x75, 0xf9, 0x64, 0xe2, 0x00, 0x5c, 0xc7,
+			  0x16, 0x24, 0x8c, 0xa3, 0xd5, 0xe9, 0xa4, 0x91,
+			  0xf9, 0x89, 0xb7, 0x8a, 0xf6, 0xe7, 0xb6, 0x17 },
+			{ 0x57, 0x52, 0x0e, 0x9a, 0xab, 0x14, 0x28, 0x5d,
+			  0xfc, 0xb3, 0xca, 0xc9, 0x84, 0x20, 0x8f, 0x90,
+			  0xca, 0x1e, 0x2d, 0x5b, 0x88, 0xf5, 0xca, 0xaf,
+			  0x11, 0x7d, 0xf8, 0x78, 0xa6, 0xb5, 0xb4, 0x1c },
+		},
+		{
+			{ 0xe7, 0x07, 0xa0, 0xa2, 0x62, 0xaa, 0x74, 0x6b,
+			  0xb1, 0xc7, 0x71, 0xf0, 0xb0, 0xe0, 0x11, 0xf3,
+			  0x23, 0xe2, 0x0b, 0x00, 0x38, 0xe4, 0x07, 0x57,
+			  0xac, 0x6e, 0xef, 0x82, 0x2d, 0xfd, 0xc0, 0x2d },
+			{ 0x6c, 0xfc, 0x4a, 0x39, 0x6b, 0xc0, 0x64, 0xb6,
+			  0xb1, 0x5f, 0xda, 0x98, 0x24, 0xde, 0x88, 0x0c,
+			  0x34, 0xd8, 0xca, 0x4b, 0x16, 0x03, 0x8d, 0x4f,
+			  0xa2, 0x34, 0x74, 0xde, 0x78, 0xca, 0x0b, 0x33 },
+			{ 0x4e, 0x74, 0x19, 0x11, 0x84, 0xff, 0x2e, 0x98,
+			  0x24, 0x47, 0x07, 0x2b, 0x96, 0x5e, 0x69, 0xf9,
+			  0xfb, 0x53, 0xc9, 0xbf, 0x4f, 0xc1, 0x8a, 0xc5,
+			  0xf5, 0x1c, 0x9f, 0x36, 0x1b, 0xbe, 0x31, 0x3c },
+		},
+		{
+			{ 0x72, 0x42, 0xcb, 0xf9, 0x93, 0xbc, 0x68, 0xc1,
+			  0x98, 0xdb, 0xce, 0xc7, 0x1f, 0x71, 0xb8, 0xae,
+			  0x7a, 0x8d, 0xac, 0x34, 0xaa, 0x52, 0x0e, 0x7f,
+			  0xbb, 0x55, 0x7d, 0x7e, 0x09, 0xc1, 0xce, 0x41 },
+			{ 0xee, 0x8a, 0x94, 0x08, 0x4d, 0x86, 0xf4, 0xb0,
+			  0x6f, 0x1c, 0xba, 0x91, 0xee, 0x19, 0xdc, 0x07,
+			  0x58, 0xa1, 0xac, 0xa6, 0xae, 0xcd, 0x75, 0x79,
+			  0xbb, 0xd4, 0x62, 0x42, 0x13, 0x61, 0x0b, 0x33 },
+			{ 0x8a, 0x80, 0x6d, 0xa2, 0xd7, 0x19, 0x96, 0xf7,
+			  0x6d, 0x15, 0x9e, 0x1d, 0x9e, 0xd4, 0x1f, 0xbb,
+			  0x27, 0xdf, 0xa1, 0xdb, 0x6c, 0xc3, 0xd7, 0x73,
+			  0x7d, 0x77, 0x28, 0x1f, 0xd9, 0x4c, 0xb4, 0x26 },
+		},
+	},
+	{
+		{
+			{ 0x83, 0x03, 0x73, 0x62, 0x93, 0xf2, 0xb7, 0xe1,
+			  0x2c, 0x8a, 0xca, 0xeb, 0xff, 0x79, 0x52, 0x4b,
+			  0x14, 0x13, 0xd4, 0xbf, 0x8a, 0x77, 0xfc, 0xda,
+			  0x0f, 0x61, 0x72, 0x9c, 0x14, 0x10, 0xeb, 0x7d },
+			{ 0x75, 0x74, 0x38, 0x8f, 0x47, 0x48, 0xf0, 0x51,
+			  0x3c, 0xcb, 0xbe, 0x9c, 0xf4, 0xbc, 0x5d, 0xb2,
+			  0x55, 0x20, 0x9f, 0xd9, 0x44, 0x12, 0xab, 0x9a,
+			  0xd6, 0xa5, 0x10, 0x1c, 0x6c, 0x9e, 0x70, 0x2c },
+			{ 0x7a, 0xee, 0x66, 0x87, 0x6a, 0xaf, 0x62, 0xcb,
+			  0x0e, 0xcd, 0x53, 0x55, 0x04, 0xec, 0xcb, 0x66,
+			  0xb5, 0xe4, 0x0b, 0x0f, 0x38, 0x01, 0x80, 0x58,
+			  0xea, 0xe2, 0x2c, 0xf6, 0x9f, 0x8e, 0xe6, 0x08 },
+		},
+		{
+			{ 0xf9, 0xf2, 0xb8, 0x0a, 0xd5, 0x09, 0x2d, 0x2f,
+			  0xdf, 0x23, 0x59, 0xc5, 0x8d, 0x21, 0xb9, 0xac,
+			  0xb9, 0x6c, 0x76, 0x73, 0x26, 0x34, 0x8f, 0x4a,
+			  0xf5, 0x19, 0xf7, 0x38, 0xd7, 0x3b, 0xb1, 0x4c },
+			{ 0xad, 0x30, 0xc1, 0x4b, 0x0a, 0x50, 0xad, 0x34,
+			  0x9c, 0xd4, 0x0b, 0x3d, 0x49, 0xdb, 0x38, 0x8d,
+			  0xbe, 0x89, 0x0a, 0x50, 0x98, 0x3d, 0x5c, 0xa2,
+			  0x09, 0x3b, 0xba, 0xee, 0x87, 0x3f, 0x1f, 0x2f },
+			{ 0x4a, 0xb6, 0x15, 0xe5, 0x75, 0x8c, 0x84, 0xf7,
+			  0x38, 0x90, 0x4a, 0xdb, 0xba, 0x01, 0x95, 0xa5,
+			  0x50, 0x1b, 0x75, 0x3f, 0x3f, 0x31, 0x0d, 0xc2,
+			  0xe8, 0x2e, 0xae, 0xc0, 0x53, 0xe3, 0xa1, 0x19 },
+		},
+		{
+			{ 0xbd, 0xbd, 0x96, 0xd5, 0xcd, 0x72, 0x21, 0xb4,
+			  0x40, 0xfc, 0xee, 0x98, 0x43, 0x45, 0xe0, 0x93,
+			  0xb5, 0x09, 0x41, 0xb4, 0x47, 0x53, 0xb1, 0x9f,
+			  0x34, 0xae, 0x66, 0x02, 0x99, 0xd3, 0x6b, 0x73 },
+			{ 0xc3, 0x05, 0xfa, 0xba, 0x60, 0x75, 0x1c, 0x7d,
+			  0x61, 0x5e, 0xe5, 0xc6, 0xa0, 0xa0, 0xe1, 0xb3,
+			  0x73, 0x64, 0xd6, 0xc0, 0x18, 0x97, 0x52, 0xe3,
+			  0x86, 0x34, 0x0c, 0xc2, 0x11, 0x6b, 0x54, 0x41 },
+			{ 0xb4, 0xb3, 0x34, 0x93, 0x50, 0x2d, 0x53, 0x85,
+			  0x73, 0x65, 0x81, 0x60, 0x4b, 0x11, 0xfd, 0x46,
+			  0x75, 0x83, 0x5c, 0x42, 0x30, 0x5f, 0x5f, 0xcc,
+			  0x5c, 0xab, 0x7f, 0xb8, 0xa2, 0x95, 0x22, 0x41 },
+		},
+		{
+			{ 0xc6, 0xea, 0x93, 0xe2, 0x61, 0x52, 0x65, 0x2e,
+			  0xdb, 0xac, 0x33, 0x21, 0x03, 0x92, 0x5a, 0x84,
+			  0x6b, 0x99, 0x00, 0x79, 0xcb, 0x75, 0x09, 0x46,
+			  0x80, 0xdd, 0x5a, 0x19, 0x8d, 0xbb, 0x60, 0x07 },
+			{ 0xe9, 0xd6, 0x7e, 0xf5, 0x88, 0x9b, 0xc9, 0x19,
+			  0x25, 0xc8, 0xf8, 0x6d, 0x26, 0xcb, 0x93, 0x53,
+			  0x73, 0xd2, 0x0a, 0xb3, 0x13, 0x32, 0xee, 0x5c,
+			  0x34, 0x2e, 0x2d, 0xb5, 0xeb, 0x53, 0xe1, 0x14 },
+			{ 0x8a, 0x81, 0xe6, 0xcd, 0x17, 0x1a, 0x3e, 0x41,
+			  0x84, 0xa0, 0x69, 0xed, 0xa9, 0x6d, 0x15, 0x57,
+			  0xb1, 0xcc, 0xca, 0x46, 0x8f, 0x26, 0xbf, 0x2c,
+			  0xf2, 0xc5, 0x3a, 0xc3, 0x9b, 0xbe, 0x34, 0x6b },
+		},
+		{
+			{ 0xd3, 0xf2, 0x71, 0x65, 0x65, 0x69, 0xfc, 0x11,
+			  0x7a, 0x73, 0x0e, 0x53, 0x45, 0xe8, 0xc9, 0xc6,
+			  0x35, 0x50, 0xfe, 0xd4, 0xa2, 0xe7, 0x3a, 0xe3,
+			  0x0b, 0xd3, 0x6d, 0x2e, 0xb6, 0xc7, 0xb9, 0x01 },
+			{ 0xb2, 0xc0, 0x78, 0x3a, 0x64, 0x2f, 0xdf, 0xf3,
+			  0x7c, 0x02, 0x2e, 0xf2, 0x1e, 0x97, 0x3e, 0x4c,
+			  0xa3, 0xb5, 0xc1, 0x49, 0x5e, 0x1c, 0x7d, 0xec,
+			  0x2d, 0xdd, 0x22, 0x09, 0x8f, 0xc1, 0x12, 0x20 },
+			{ 0x29, 0x9d, 0xc8, 0x5a, 0xe5, 0x55, 0x0b, 0x88,
+			  0x63, 0xa7, 0xa0, 0x45, 0x1f, 0x24, 0x83, 0x14,
+			  0x1f, 0x6c, 0xe7, 0xc2, 0xdf, 0xef, 0x36, 0x3d,
+			  0xe8, 0xad, 0x4b, 0x4e, 0x78, 0x5b, 0xaf, 0x08 },
+		},
+		{
+			{ 0x4b, 0x2c, 0xcc, 0x89, 0xd2, 0x14, 0x73, 0xe2,
+			  0x8d, 0x17, 0x87, 0xa2, 0x11, 0xbd, 0xe4, 0x4b,
+			  0xce, 0x64, 0x33, 0xfa, 0xd6, 0x28, 0xd5, 0x18,
+			  0x6e, 0x82, 0xd9, 0xaf, 0xd5, 0xc1, 0x23, 0x64 },
+			{ 0x33, 0x25, 0x1f, 0x88, 0xdc, 0x99, 0x34, 0x28,
+			  0xb6, 0x23, 0x93, 0x77, 0xda, 0x25, 0x05, 0x9d,
+			  0xf4, 0x41, 0x34, 0x67, 0xfb, 0xdd, 0x7a, 0x89,
+			  0x8d, 0x16, 0x3a, 0x16, 0x71, 0x9d, 0xb7, 0x32 },
+			{ 0x6a, 0xb3, 0xfc, 0xed, 0xd9, 0xf8, 0x85, 0xcc,
+			  0xf9, 0xe5, 0x46, 0x37, 0x8f, 0xc2, 0xbc, 0x22,
+			  0xcd, 0xd3, 0xe5, 0xf9, 0x38, 0xe3, 0x9d, 0xe4,
+			  0xcc, 0x2d, 0x3e, 0xc1, 0xfb, 0x5e, 0x0a, 0x48 },
+		},
+		{
+			{ 0x1f, 0x22, 0xce, 0x42, 0xe4, 0x4c, 0x61, 0xb6,
+			  0x28, 0x39, 0x05, 0x4c, 0xcc, 0x9d, 0x19, 0x6e,
+			  0x03, 0xbe, 0x1c, 0xdc, 0xa4, 0xb4, 0x3f, 0x66,
+			  0x06, 0x8e, 0x1c, 0x69, 0x47, 0x1d, 0xb3, 0x24 },
+			{ 0x71, 0x20, 0x62, 0x01, 0x0b, 0xe7, 0x51, 0x0b,
+			  0xc5, 0xaf, 0x1d, 0x8b, 0xcf, 0x05, 0xb5, 0x06,
+			  0xcd, 0xab, 0x5a, 0xef, 0x61, 0xb0, 0x6b, 0x2c,
+			  0x31, 0xbf, 0xb7, 0x0c, 0x60, 0x27, 0xaa, 0x47 },
+			{ 0xc3, 0xf8, 0x15, 0xc0, 0xed, 0x1e, 0x54, 0x2a,
+			  0x7c, 0x3f, 0x69, 0x7c, 0x7e, 0xfe, 0xa4, 0x11,
+			  0xd6, 0x78, 0xa2, 0x4e, 0x13, 0x66, 0xaf, 0xf0,
+			  0x94, 0xa0, 0xdd, 0x14, 0x5d, 0x58, 0x5b, 0x54 },
+		},
+		{
+			{ 0xe1, 0x21, 0xb3, 0xe3, 0xd0, 0xe4, 0x04, 0x62,
+			  0x95, 0x1e, 0xff, 0x28, 0x7a, 0x63, 0xaa, 0x3b,
+			  0x9e, 0xbd, 0x99, 0x5b, 0xfd, 0xcf, 0x0c, 0x0b,
+			  0x71, 0xd0, 0xc8, 0x64, 0x3e, 0xdc, 0x22, 0x4d },
+			{ 0x0f, 0x3a, 0xd4, 0xa0, 0x5e, 0x27, 0xbf, 0x67,
+			  0xbe, 0xee, 0x9b, 0x08, 0x34, 0x8e, 0xe6, 0xad,
+			  0x2e, 0xe7, 0x79, 0xd4, 0x4c, 0x13, 0x89, 0x42,
+			  0x54, 0x54, 0xba, 0x32, 0xc3, 0xf9, 0x62, 0x0f },
+			{ 0x39, 0x5f, 0x3b, 0xd6, 0x89, 0x65, 0xb4, 0xfc,
+			  0x61, 0xcf, 0xcb, 0x57, 0x3f, 0x6a, 0xae, 0x5c,
+			  0x05, 0xfa, 0x3a, 0x95, 0xd2, 0xc2, 0xba, 0xfe,
+			  0x36, 0x14, 0x37, 0x36, 0x1a, 0xa0, 0x0f, 0x1c },
+		},
+	},
+	{
+		{
+			{ 0x50, 0x6a, 0x93, 0x8c, 0x0e, 0x2b, 0x08, 0x69,
+			  0xb6, 0xc5, 0xda, 0xc1, 0x35, 0xa0, 0xc9, 0xf9,
+			  0x34, 0xb6, 0xdf, 0xc4, 0x54, 0x3e, 0xb7, 0x6f,
+			  0x40, 0xc1, 0x2b, 0x1d, 0x9b, 0x41, 0x05, 0x40 },
+			{ 0xff, 0x3d, 0x94, 0x22, 0xb6, 0x04, 0xc6, 0xd2,
+			  0xa0, 0xb3, 0xcf, 0x44, 0xce, 0xbe, 0x8c, 0xbc,
+			  0x78, 0x86, 0x80, 0x97, 0xf3, 0x4f, 0x25, 0x5d,
+			  0xbf, 0xa6, 0x1c, 0x3b, 0x4f, 0x61, 0xa3, 0x0f },
+			{ 0xf0, 0x82, 0xbe, 0xb9, 0xbd, 0xfe, 0x03, 0xa0,
+			  0x90, 0xac, 0x44, 0x3a, 0xaf, 0xc1, 0x89, 0x20,
+			  0x8e, 0xfa, 0x54, 0x19, 0x91, 0x9f, 0x49, 0xf8,
+			  0x42, 0xab, 0x40, 0xef, 0x8a, 0x21, 0xba, 0x1f },
+		},
+		{
+			{ 0x94, 0x01, 0x7b, 0x3e, 0x04, 0x57, 0x3e, 0x4f,
+			  0x7f, 0xaf, 0xda, 0x08, 0xee, 0x3e, 0x1d, 0xa8,
+			  0xf1, 0xde, 0xdc, 0x99, 0xab, 0xc6, 0x39, 0xc8,
+			  0xd5, 0x61, 0x77, 0xff, 0x13, 0x5d, 0x53, 0x6c },
+			{ 0x3e, 0xf5, 0xc8, 0xfa, 0x48, 0x94, 0x54, 0xab,
+			  0x41, 0x37, 0xa6, 0x7b, 0x9a, 0xe8, 0xf6, 0x81,
+			  0x01, 0x5e, 0x2b, 0x6c, 0x7d, 0x6c, 0xfd, 0x74,
+			  0x42, 0x6e, 0xc8, 0xa8, 0xca, 0x3a, 0x2e, 0x39 },
+			{ 0xaf, 0x35, 0x8a, 0x3e, 0xe9, 0x34, 0xbd, 0x4c,
+			  0x16, 0xe8, 0x87, 0x58, 0x44, 0x81, 0x07, 0x2e,
+			  0xab, 0xb0, 0x9a, 0xf2, 0x76, 0x9c, 0x31, 0x19,
+			  0x3b, 0xc1, 0x0a, 0xd5, 0xe4, 0x7f, 0xe1, 0x25 },
+		},
+		{
+			{ 0xa7, 0x21, 0xf1, 0x76, 0xf5, 0x7f, 0x5f, 0x91,
+			  0xe3, 0x87, 0xcd, 0x2f, 0x27, 0x32, 0x4a, 0xc3,
+			  0x26, 0xe5, 0x1b, 0x4d, 0xde, 0x2f, 0xba, 0xcc,
+			  0x9b, 0x89, 0x69, 0x89, 0x8f, 0x82, 0xba, 0x6b },
+			{ 0x76, 0xf6, 0x04, 0x1e, 0xd7, 0x9b, 0x28, 0x0a,
+			  0x95, 0x0f, 0x42, 0xd6, 0x52, 0x1c, 0x8e, 0x20,
+			  0xab, 0x1f, 0x69, 0x34, 0xb0, 0xd8, 0x86, 0x51,
+			  0x51, 0xb3, 0x9f, 0x2a, 0x44, 0x51, 0x57, 0x25 },
+			{ 0x01, 0x39, 0xfe, 0x90, 0x66, 0xbc, 0xd1, 0xe2,
+			  0xd5, 0x7a, 0x99, 0xa0, 0x18, 0x4a, 0xb5, 0x4c,
+			  0xd4, 0x60, 0x84, 0xaf, 0x14, 0x69, 0x1d, 0x97,
+			  0xe4, 0x7b, 0x6b, 0x7f, 0x4f, 0x50, 0x9d, 0x55 },
+		},
+		{
+			{ 0xfd, 0x66, 0xd2, 0xf6, 0xe7, 0x91, 0x48, 0x9c,
+			  0x1b, 0x78, 0x07, 0x03, 0x9b, 0xa1, 0x44, 0x07,
+			  0x3b, 0xe2, 0x61, 0x60, 0x1d, 0x8f, 0x38, 0x88,
+			  0x0e, 0xd5, 0x4b, 0x35, 0xa3, 0xa6, 0x3e, 0x12 },
+			{ 0xd5, 0x54, 0xeb, 0xb3, 0x78, 0x83, 0x73, 0xa7,
+			  0x7c, 0x3c, 0x55, 0xa5, 0x66, 0xd3, 0x69, 0x1d,
+			  0xba, 0x00, 0x28, 0xf9, 0x62, 0xcf, 0x26, 0x0a,
+			  0x17, 0x32, 0x7e, 0x80, 0xd5, 0x12, 0xab, 0x01 },
+			{ 0x96, 0x2d, 0xe3, 0x41, 0x90, 0x18, 0x8d, 0x11,
+			  0x48, 0x58, 0x31, 0xd8, 0xc2, 0xe3, 0xed, 0xb9,
+			  0xd9, 0x45, 0x32, 0xd8, 0x71, 0x42, 0xab, 0x1e,
+			  0x54, 0xa1, 0x18, 0xc9, 0xe2, 0x61, 0x39, 0x4a },
+		},
+		{
+			{ 0x1e, 0x3f, 0x23, 0xf3, 0x44, 0xd6, 0x27, 0x03,
+			  0x16, 0xf0, 0xfc, 0x34, 0x0e, 0x26, 0x9a, 0x49,
+			  0x79, 0xb9, 0xda, 0xf2, 0x16, 0xa7, 0xb5, 0x83,
+			  0x1f, 0x11, 0xd4, 0x9b, 0xad, 0xee, 0xac, 0x68 },
+			{ 0xa0, 0xbb, 0xe6, 0xf8, 0xe0, 0x3b, 0xdc, 0x71,
+			  0x0a, 0xe3, 0xff, 0x7e, 0x34, 0xf8, 0xce, 0xd6,
+			  0x6a, 0x47, 0x3a, 0xe1, 0x5f, 0x42, 0x92, 0xa9,
+			  0x63, 0xb7, 0x1d, 0xfb, 0xe3, 0xbc, 0xd6, 0x2c },
+			{ 0x10, 0xc2, 0xd7, 0xf3, 0x0e, 0xc9, 0xb4, 0x38,
+			  0x0c, 0x04, 0xad, 0xb7, 0x24, 0x6e, 0x8e, 0x30,
+			  0x23, 0x3e, 0xe7, 0xb7, 0xf1, 0xd9, 0x60, 0x38,
+			  0x97, 0xf5, 0x08, 0xb5, 0xd5, 0x60, 0x57, 0x59 },
+		},
+		{
+			{ 0x90, 0x27, 0x02, 0xfd, 0xeb, 0xcb, 0x2a, 0x88,
+			  0x60, 0x57, 0x11, 0xc4, 0x05, 0x33, 0xaf, 0x89,
+			  0xf4, 0x73, 0x34, 0x7d, 0xe3, 0x92, 0xf4, 0x65,
+			  0x2b, 0x5a, 0x51, 0x54, 0xdf, 0xc5, 0xb2, 0x2c },
+			{ 0x97, 0x63, 0xaa, 0x04, 0xe1, 0xbf, 0x29, 0x61,
+			  0xcb, 0xfc, 0xa7, 0xa4, 0x08, 0x00, 0x96, 0x8f,
+			  0x58, 0x94, 0x90, 0x7d, 0x89, 0xc0, 0x8b, 0x3f,
+			  0xa9, 0x91, 0xb2, 0xdc, 0x3e, 0xa4, 0x9f, 0x70 },
+			{ 0xca, 0x2a, 0xfd, 0x63, 0x8c, 0x5d, 0x0a, 0xeb,
+			  0xff, 0x4e, 0x69, 0x2e, 0x66, 0xc1, 0x2b, 0xd2,
+			  0x3a, 0xb0, 0xcb, 0xf8, 0x6e, 0xf3, 0x23, 0x27,
+			  0x1f, 0x13, 0xc8, 0xf0, 0xec, 0x29, 0xf0, 0x70 },
+		},
+		{
+			{ 0xb9, 0xb0, 0x10, 0x5e, 0xaa, 0xaf, 0x6a, 0x2a,
+			  0xa9, 0x1a, 0x04, 0xef, 0x70, 0xa3, 0xf0, 0x78,
+			  0x1f, 0xd6, 0x3a, 0xaa, 0x77, 0xfb, 0x3e, 0x77,
+			  0xe1, 0xd9, 0x4b, 0xa7, 0xa2, 0xa5, 0xec, 0x44 },
+			{ 0x33, 0x3e, 0xed, 0x2e, 0xb3, 0x07, 0x13, 0x46,
+			  0xe7, 0x81, 0x55, 0xa4, 0x33, 0x2f, 0x04, 0xae,
+			  0x66, 0x03, 0x5f, 0x19, 0xd3, 0x49, 0x44, 0xc9,
+			  0x58, 0x48, 0x31, 0x6c, 0x8a, 0x5d, 0x7d, 0x0b },
+			{ 0x43, 0xd5, 0x95, 0x7b, 0x32, 0x48, 0xd4, 0x25,
+			  0x1d, 0x0f, 0x34, 0xa3, 0x00, 0x83, 0xd3, 0x70,
+			  0x2b, 0xc5, 0xe1, 0x60, 0x1c, 0x53, 0x1c, 0xde,
+			  0xe4, 0xe9, 0x7d, 0x2c, 0x51, 0x24, 0x22, 0x27 },
+		},
+		{
+			{ 0xfc, 0x75, 0xa9, 0x42, 0x8a, 0xbb, 0x7b, 0xbf,
+			  0x58, 0xa3, 0xad, 0x96, 0x77, 0x39, 0x5c, 0x8c,
+			  0x48, 0xaa, 0xed, 0xcd, 0x6f, 0xc7, 0x7f, 0xe2,
+			  0xa6, 0x20, 0xbc, 0xf6, 0xd7, 0x5f, 0x73, 0x19 },
+			{ 0x2e, 0x34, 0xc5, 0x49, 0xaf, 0x92, 0xbc, 0x1a,
+			  0xd0, 0xfa, 0xe6, 0xb2, 0x11, 0xd8, 0xee, 0xff,
+			  0x29, 0x4e, 0xc8, 0xfc, 0x8d, 0x8c, 0xa2, 0xef,
+			  0x43, 0xc5, 0x4c, 0xa4, 0x18, 0xdf, 0xb5, 0x11 },
+			{ 0x66, 0x42, 0xc8, 0x42, 0xd0, 0x90, 0xab, 0xe3,
+			  0x7e, 0x54, 0x19, 0x7f, 0x0f, 0x8e, 0x84, 0xeb,
+			  0xb9, 0x97, 0xa4, 0x65, 0xd0, 0xa1, 0x03, 0x25,
+			  0x5f, 0x89, 0xdf, 0x91, 0x11, 0x91, 0xef, 0x0f },
+		},
+	},
+};
+
+typedef struct ge_p2 { fe X, Y, Z; } ge_p2;
+typedef struct ge_p3 { fe X, Y, Z, T; } ge_p3;
+typedef struct ge_p1p1 { fe_loose X, Y, Z, T; } ge_p1p1;
+typedef struct ge_precomp { fe yplusx, yminusx, xy2d; } ge_precomp;
+
+/* h = f, with limbs carried back down to the bounds of an fe. */
+static __always_inline void fe_carry(fe *h, const fe_loose *f)
+{
+	u32 v[10], c;
+	int i;
+
+	memcpy(v, f->v, sizeof(v));
+	for (i = 0; i < 9; ++i) {
+		c = v[i] >> ((i & 1) ? 25 : 26);
+		v[i] &= (i & 1) ? 0x1ffffff : 0x3ffffff;
+		v[i + 1] += c;
+	}
+	c = v[9] >> 25;
+	v[9] &= 0x1ffffff;
+	v[0] += 19 * c;
+	c = v[0] >> 26;
+	v[0] &= 0x3ffffff;
+	v[1] += c;
+	memcpy(h->v, v, sizeof(v));
+}
+
+/* Replace f with g if b == 1; leave f alone if b == 0. */
+static __always_inline void fe_cmov(fe *f, const fe *g, unsigned int b)
+{
+	unsigned int i;
+
+	b = 0 - b;
+	for (i = 0; i < 10; ++i)
+		f->v[i] ^= (f->v[i] ^ g->v[i]) & b;
+}
+
+static __always_inline void ge_p1p1_to_p2(ge_p2 *r, const ge_p1p1 *p)
+{
+	fe_mul_tll(&r->X, &p->X, &p->T);
+	fe_mul_tll(&r->Y, &p->Y, &p->Z);
+	fe_mul_tll(&r->Z, &p->Z, &p->T);
+}
+
+static __always_inline void ge_p1p1_to_p3(ge_p3 *r, const ge_p1p1 *p)
+{
+	fe_mul_tll(&r->X, &p->X, &p->T);
+	fe_mul_tll(&r->Y, &p->Y, &p->Z);
+	fe_mul_tll(&r->Z, &p->Z, &p->T);
+	fe_mul_tll(&r->T, &p->X, &p->Y);
+}
+
+/* r = 2 * p */
+static void ge_p2_dbl(ge_p1p1 *r, const ge_p2 *p)
+{
+	fe xx, yy, b, aa;
+	fe_loose t;
+
+	fe_sq_tt(&xx, &p->X);
+	fe_sq_tt(&yy, &p->Y);
+	fe_sq_tt(&b, &p->Z);
+	fe_add(&t, &b, &b);
+	fe_carry(&b, &t);
+	fe_add(&t, &p->X, &p->Y);
+	fe_sq_tl(&aa, &t);
+	fe_add(&r->Y, &yy, &xx);
+	fe_sub(&r->Z, &yy, &xx);
+	fe_carry(&yy, &r->Y);
+	fe_sub(&r->X, &aa, &yy);
+	fe_carry(&yy, &r->Z);
+	fe_sub(&r->T, &b, &yy);
+}
+
+static __always_inline void ge_p3_dbl(ge_p1p1 *r, const ge_p3 *p)
+{
+	ge_p2 q;
+
+	fe_copy(&q.X, &p->X);
+	fe_copy(&q.Y, &p->Y);
+	fe_copy(&q.Z, &p->Z);
+	ge_p2_dbl(r, &q);
+}
+
+/* r = p + q */
+static void ge_madd(ge_p1p1 *r, const ge_p3 *p, const ge_precomp *q)
+{
+	fe a, b, c, d;
+
+	fe_add(&r->X, &p->Y, &p->X);
+	fe_sub(&r->Y, &p->Y, &p->X);
+	fe_mul_tlt(&a, &r->X, &q->yplusx);
+	fe_mul_tlt(&b, &r->Y, &q->yminusx);
+	fe_mul_ttt(&c, &q->xy2d, &p->T);
+	fe_add(&r->T, &p->Z, &p->Z);
+	fe_carry(&d, &r->T);
+	fe_sub(&r->X, &a, &b);
+	fe_add(&r->Y, &a, &b);
+	fe_add(&r->Z, &d, &c);
+	fe_sub(&r->T, &d, &c);
+}
+
+static __always_inline u8 ge_equal(s8 b, s8 c)
+{
+	return (u8)(((u32)(u8)(b ^ c) - 1) >> 31);
+}
+
+static __always_inline u8 ge_negative(s8 b)
+{
+	return (u8)((u32)(s32)b >> 31);
+}
+
+/* t = b * 256^pos * B, for b in [-8, 8], without branching on b. */
+static void ge_table_select(ge_precomp *t, int pos, s8 b)
+{
+	const u8 bnegative = ge_negative(b);
+	const u8 babs = b - (((-bnegative) & b) << 1);
+	u8 entry[3][CURVE25519_KEY_SIZE] = { { 1 }, { 1 }, { 0 } };
+	fe_loose neg;
+	fe minus;
+	size_t j;
+	int i;
+
+	for (i = 0; i < 8; ++i) {
+		const u8 mask = 0 - ge_equal(babs, i + 1);
+
+		for (j = 0; j < sizeof(entry); ++j)
+			((u8 *)entry)[j] ^= (((u8 *)entry)[j] ^
+				((const u8 *)curve25519_base_table[pos][i])[j]) &
+				mask;
+	}
+	fe_frombytes(&t->yplusx, entry[0]);
+	fe_frombytes(&t->yminusx, entry[1]);
+	fe_frombytes(&t->xy2d, entry[2]);
+	memzero_explicit(entry, sizeof(entry));
+
+	fe_cswap(&t->yplusx, &t->yminusx, bnegative);
+	fe_0(&minus);
+	fe_sub(&neg, &minus, &t->xy2d);
+	fe_carry(&minus, &neg);
+	fe_cmov(&t->xy2d, &minus, bnegative);
+}
+
+static bool curve25519_base_generic(u8 pub[CURVE25519_KEY_SIZE],
+				    const u8 secret[CURVE25519_KEY_SIZE])
+{
+	ge_precomp t;
+	ge_p1p1 r;
+	ge_p3 h;
+	ge_p2 s;
+	fe_loose zplusy, zminusy;
+	fe inv;
+	s8 e[64], carry;
+	u8 a[CURVE25519_KEY_SIZE];
+	int i;
+
+	memcpy(a, secret, CURVE25519_KEY_SIZE);
+	normalize_secret(a);
+
+	/* Write a as the sum of e[i] * 16^i, with each e[i] in [-8, 8]. */
+	for (i = 0; i < 32; ++i) {
+		e[2 * i + 0] = (a[i] >> 0) & 15;
+		e[2 * i + 1] = (a[i] >> 4) & 15;
+	}
+	carry = 0;
+	for (i = 0; i < 63; ++i) {
+		e[i] += carry;
+		carry = e[i] + 8;
+		carry >>= 4;
+		e[i] -= carry * 16;
+	}
+	e[63] += carry;
+
+	fe_0(&h.X);
+	fe_1(&h.Y);
+	fe_1(&h.Z);
+	fe_0(&h.T);
+	for (i = 1; i < 64; i += 2) {
+		ge_table_select(&t, i / 2, e[i]);
+		ge_madd(&r, &h, &t);
+		ge_p1p1_to_p3(&h, &r);
+	}
+
+	ge_p3_dbl(&r, &h);
+	ge_p1p1_to_p2(&s, &r);
+	ge_p2_dbl(&r, &s);
+	ge_p1p1_to_p2(&s, &r);
+	ge_p2_dbl(&r, &s);
+	ge_p1p1_to_p2(&s, &r);
+	ge_p2_dbl(&r, &s);
+	ge_p1p1_to_p3(&h, &r);
+
+	for (i = 0; i < 64; i += 2) {
+		ge_table_select(&t, i / 2, e[i]);
+		ge_madd(&r, &h, &t);
+		ge_p1p1_to_p3(&h, &r);
+	}
+
+	/* The Montgomery u-coordinate is (1 + y) / (1 - y) = (Z + Y) / (Z - Y). */
+	fe_add(&zplusy, &h.Z, &h.Y);
+	fe_sub(&zminusy, &h.Z, &h.Y);
+	fe_loose_invert(&inv, &zminusy);
+	fe_mul_tlt(&inv, &zplusy, &inv);
+	fe_tobytes(pub, &inv);
+
+	memzero_explicit(&t, sizeof(t));
+	memzero_explicit(&r, sizeof(r));
+	memzero_explicit(&h, sizeof(h));
+	memzero_explicit(&s, sizeof(s));
+	memzero_explicit(&zplusy, sizeof(zplusy));
+	memzero_explicit(&zminusy, sizeof(zminusy));
+	memzero_explicit(e, sizeof(e));
+	memzero_explicit(a, sizeof(a));
+	return true;
+}
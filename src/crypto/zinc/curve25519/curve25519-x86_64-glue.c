@@ -3,21 +3,36 @@
  * Copyright (C) 2015-2018 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
  */
 
+#include <asm/fpu/api.h>
 #include <asm/cpufeature.h>
 #include <asm/processor.h>
 
 #include "curve25519-x86_64.c"
+#ifdef CONFIG_AS_AVX512IFMA
+#include "curve25519-x86_64-ifma.c"
+#endif
 
 static bool curve25519_use_bmi2 __ro_after_init;
 static bool curve25519_use_adx __ro_after_init;
+static bool curve25519_use_avx512ifma __ro_after_init;
 static bool *const curve25519_nobs[] __initconst = {
-	&curve25519_use_bmi2, &curve25519_use_adx };
+	&curve25519_use_bmi2, &curve25519_use_adx, &curve25519_use_avx512ifma };
 
 static void __init curve25519_fpu_init(void)
 {
 	curve25519_use_bmi2 = boot_cpu_has(X86_FEATURE_BMI2);
 	curve25519_use_adx = boot_cpu_has(X86_FEATURE_BMI2) &&
 			     boot_cpu_has(X86_FEATURE_ADX);
+#if !defined(COMPAT_CANNOT_USE_AVX512) && defined(X86_FEATURE_AVX512IFMA)
+	curve25519_use_avx512ifma =
+		boot_cpu_has(X86_FEATURE_AVX) &&
+		boot_cpu_has(X86_FEATURE_AVX2) &&
+		boot_cpu_has(X86_FEATURE_AVX512F) &&
+		boot_cpu_has(X86_FEATURE_AVX512VL) &&
+		boot_cpu_has(X86_FEATURE_AVX512IFMA) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+				  XFEATURE_MASK_AVX512, NULL);
+#endif
 }
 
 static inline bool curve25519_arch(u8 mypublic[CURVE25519_KEY_SIZE],
@@ -46,3 +61,41 @@ static inline bool curve25519_base_arch(u8 pub[CURVE25519_KEY_SIZE],
 	}
 	return false;
 }
+
+static inline unsigned int
+curve25519_batch_arch(u8 mypublic[][CURVE25519_KEY_SIZE],
+		      const u8 secret[CURVE25519_KEY_SIZE],
+		      const u8 basepoint[][CURVE25519_KEY_SIZE], unsigned int n,
+		      simd_context_t *simd_context)
+{
+#ifdef CONFIG_AS_AVX512IFMA
+	u8 in[CURVE25519_LANES][CURVE25519_KEY_SIZE];
+	u8 out[CURVE25519_LANES][CURVE25519_KEY_SIZE];
+	unsigned int i, j;
+
+	if (!curve25519_use_avx512ifma)
+		return 0;
+
+	/* SIMD disables preemption, so relax after each four points. */
+	for (i = 0; i + CURVE25519_LANES <= n; i += CURVE25519_LANES) {
+		if (!simd_use(simd_context))
+			return i;
+		curve25519_ifma_4way(mypublic + i, secret, basepoint + i);
+		simd_relax(simd_context);
+	}
+
+	/* Four lanes cost less than two points done one at a time, so a tail
+	 * of two or three is padded out with copies of its last point.
+	 */
+	if (n - i < 2 || !simd_use(simd_context))
+		return i;
+	for (j = 0; j < CURVE25519_LANES; ++j)
+		memcpy(in[j], basepoint[min(i + j, n - 1)], CURVE25519_KEY_SIZE);
+	curve25519_ifma_4way(out, secret, in);
+	memcpy(mypublic + i, out, (n - i) * CURVE25519_KEY_SIZE);
+	memzero_explicit(out, sizeof(out));
+	return n;
+#else
+	return 0;
+#endif
+}
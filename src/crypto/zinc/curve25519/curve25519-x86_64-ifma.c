@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: GPL-2.0 OR MIT
+/*
+ * Copyright (C) 2015-2018 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ *
+ * This is a four lane Montgomery ladder, for doing X25519 with one secret
+ * against four points at once. Each lane of a 256-bit vector holds one field
+ * element limb in radix 2^51, and the products are done with the 52-bit
+ * multiply-add instructions of AVX-512 IFMA on ymm registers, which only look
+ * at the low 52 bits of their inputs. Every value that reaches a multiplier is
+ * therefore carried to below 2^51 + 2^15 first:
+ *
+ *   - products are summed into 10 columns, the upper 5 folded down times 19,
+ *     which stays below 2^61, and then carried in parallel;
+ *   - sums and differences, the latter offset by 2p, are carried the same way.
+ */
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+typedef u64 u64x4 __attribute__((vector_size(32)));
+typedef struct fe4 { u64x4 v[5]; } fe4;
+
+enum { CURVE25519_LANES = 4 };
+
+/* z + low 52 bits of a * b */
+static __always_inline u64x4 madd52lo(u64x4 z, const u64x4 a, const u64x4 b)
+{
+	asm("vpmadd52luq %2, %1, %0" : "+x"(z) : "x"(a), "xm"(b));
+	return z;
+}
+
+/* z + high 52 bits of a * b */
+static __always_inline u64x4 madd52hi(u64x4 z, const u64x4 a, const u64x4 b)
+{
+	asm("vpmadd52huq %2, %1, %0" : "+x"(z) : "x"(a), "xm"(b));
+	return z;
+}
+
+static __always_inline void fe4_frombytes(fe4 *h,
+					  const u8 s[][CURVE25519_KEY_SIZE])
+{
+	u64x4 a0, a1, a2, a3;
+	int i;
+
+	for (i = 0; i < CURVE25519_LANES; ++i) {
+		a0[i] = get_unaligned_le64(s[i] + 0);
+		a1[i] = get_unaligned_le64(s[i] + 8);
+		a2[i] = get_unaligned_le64(s[i] + 16);
+		a3[i] = get_unaligned_le64(s[i] + 24);
+	}
+	/* Ignores top bit of s. */
+	h->v[0] = a0 & 0x7ffffffffffffULL;
+	h->v[1] = ((a0 >> 51) | (a1 << 13)) & 0x7ffffffffffffULL;
+	h->v[2] = ((a1 >> 38) | (a2 << 26)) & 0x7ffffffffffffULL;
+	h->v[3] = ((a2 >> 25) | (a3 << 39)) & 0x7ffffffffffffULL;
+	h->v[4] = (a3 >> 12) & 0x7ffffffffffffULL;
+}
+
+static __always_inline void fe4_carry_serial(u64x4 h[5])
+{
+	h[1] += h[0] >> 51;
+	h[0] &= 0x7ffffffffffffULL;
+	h[2] += h[1] >> 51;
+	h[1] &= 0x7ffffffffffffULL;
+	h[3] += h[2] >> 51;
+	h[2] &= 0x7ffffffffffffULL;
+	h[4] += h[3] >> 51;
+	h[3] &= 0x7ffffffffffffULL;
+}
+
+static __always_inline void fe4_tobytes(u8 s[][CURVE25519_KEY_SIZE],
+					const fe4 *f)
+{
+	u64x4 h[5], q;
+	int i;
+
+	/* f < 2p, so q = floor((f + 19) / 2^255) is 1 exactly when f >= p,
+	 * and f - q * p is f + 19q with bit 255 cleared.
+	 */
+	for (i = 0; i < 5; ++i)
+		h[i] = f->v[i];
+	h[0] += 19;
+	fe4_carry_serial(h);
+	q = h[4] >> 51;
+	for (i = 0; i < 5; ++i)
+		h[i] = f->v[i];
+	h[0] += (q << 4) + (q << 1) + q;
+	fe4_carry_serial(h);
+	h[4] &= 0x7ffffffffffffULL;
+
+	for (i = 0; i < CURVE25519_LANES; ++i) {
+		put_unaligned_le64(h[0][i] | (h[1][i] << 51), s[i] + 0);
+		put_unaligned_le64((h[1][i] >> 13) | (h[2][i] << 38), s[i] + 8);
+		put_unaligned_le64((h[2][i] >> 26) | (h[3][i] << 25), s[i] + 16);
+		put_unaligned_le64((h[3][i] >> 39) | (h[4][i] << 12), s[i] + 24);
+	}
+	memzero_explicit(h, sizeof(h));
+}
+
+/* Carries every limb into the next at once, rather than one after the other,
+ * leaving each below 2^51 + 19 * (largest input >> 51).
+ */
+static __always_inline void fe4_carry(fe4 *h, u64x4 z0, u64x4 z1, u64x4 z2,
+				      u64x4 z3, u64x4 z4)
+{
+	const u64x4 c0 = z0 >> 51, c1 = z1 >> 51, c2 = z2 >> 51,
+		    c3 = z3 >> 51, c4 = z4 >> 51;
+
+	h->v[0] = (z0 & 0x7ffffffffffffULL) + (c4 << 4) + (c4 << 1) + c4;
+	h->v[1] = (z1 & 0x7ffffffffffffULL) + c0;
+	h->v[2] = (z2 & 0x7ffffffffffffULL) + c1;
+	h->v[3] = (z3 & 0x7ffffffffffffULL) + c2;
+	h->v[4] = (z4 & 0x7ffffffffffffULL) + c3;
+}
+
+/* Folds the columns at or above 2^255 back down times 19, and carries. */
+static __always_inline void fe4_reduce(fe4 *h, u64x4 z0, u64x4 z1, u64x4 z2,
+				       u64x4 z3, u64x4 z4, const u64x4 z5,
+				       const u64x4 z6, const u64x4 z7,
+				       const u64x4 z8, const u64x4 z9)
+{
+	z0 += (z5 << 4) + (z5 << 1) + z5;
+	z1 += (z6 << 4) + (z6 << 1) + z6;
+	z2 += (z7 << 4) + (z7 << 1) + z7;
+	z3 += (z8 << 4) + (z8 << 1) + z8;
+	z4 += (z9 << 4) + (z9 << 1) + z9;
+	fe4_carry(h, z0, z1, z2, z3, z4);
+}
+
+static __always_inline void fe4_0(fe4 *h)
+{
+	memset(h, 0, sizeof(fe4));
+}
+
+static __always_inline void fe4_1(fe4 *h)
+{
+	memset(h, 0, sizeof(fe4));
+	h->v[0] += 1;
+}
+
+/* h = f + g */
+static __always_inline void fe4_add(fe4 *h, const fe4 *f, const fe4 *g)
+{
+	fe4_carry(h, f->v[0] + g->v[0], f->v[1] + g->v[1], f->v[2] + g->v[2],
+		  f->v[3] + g->v[3], f->v[4] + g->v[4]);
+}
+
+/* h = f - g, plus 2p to stay positive */
+static __always_inline void fe4_sub(fe4 *h, const fe4 *f, const fe4 *g)
+{
+	fe4_carry(h, (0xfffffffffffdaULL + f->v[0]) - g->v[0],
+		  (0xffffffffffffeULL + f->v[1]) - g->v[1],
+		  (0xffffffffffffeULL + f->v[2]) - g->v[2],
+		  (0xffffffffffffeULL + f->v[3]) - g->v[3],
+		  (0xffffffffffffeULL + f->v[4]) - g->v[4]);
+}
+
+/* The product columns are summed as lo and hi halves, l and u, of the 52-bit
+ * multiplies. A hi half is worth 2^52 = 2 * 2^51, so it lands doubled in the
+ * column above its lo half.
+ */
+#define M(k, i, j) do { \
+	l##k = madd52lo(l##k, f##i, g##j); \
+	u##k = madd52hi(u##k, f##i, g##j); \
+} while (0)
+
+static void fe4_mul(fe4 *h, const fe4 *f, const fe4 *g)
+{
+	const u64x4 f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3],
+		    f4 = f->v[4];
+	const u64x4 g0 = g->v[0], g1 = g->v[1], g2 = g->v[2], g3 = g->v[3],
+		    g4 = g->v[4];
+	u64x4 l0 = { 0 }, l1 = { 0 }, l2 = { 0 }, l3 = { 0 }, l4 = { 0 },
+	      l5 = { 0 }, l6 = { 0 }, l7 = { 0 }, l8 = { 0 };
+	u64x4 u0 = { 0 }, u1 = { 0 }, u2 = { 0 }, u3 = { 0 }, u4 = { 0 },
+	      u5 = { 0 }, u6 = { 0 }, u7 = { 0 }, u8 = { 0 };
+
+	M(0, 0, 0); M(1, 0, 1); M(2, 0, 2); M(3, 0, 3); M(4, 0, 4);
+	M(1, 1, 0); M(2, 1, 1); M(3, 1, 2); M(4, 1, 3); M(5, 1, 4);
+	M(2, 2, 0); M(3, 2, 1); M(4, 2, 2); M(5, 2, 3); M(6, 2, 4);
+	M(3, 3, 0); M(4, 3, 1); M(5, 3, 2); M(6, 3, 3); M(7, 3, 4);
+	M(4, 4, 0); M(5, 4, 1); M(6, 4, 2); M(7, 4, 3); M(8, 4, 4);
+	fe4_reduce(h, l0, l1 + (u0 << 1), l2 + (u1 << 1), l3 + (u2 << 1),
+		   l4 + (u3 << 1), l5 + (u4 << 1), l6 + (u5 << 1),
+		   l7 + (u6 << 1), l8 + (u7 << 1), u8 << 1);
+}
+
+/* The cross products are summed first and doubled, then the squares added. */
+static void fe4_sq(fe4 *h, const fe4 *f)
+{
+	const u64x4 f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3],
+		    f4 = f->v[4];
+	const u64x4 g0 = f0, g1 = f1, g2 = f2, g3 = f3, g4 = f4;
+	u64x4 l0 = { 0 }, l1 = { 0 }, l2 = { 0 }, l3 = { 0 }, l4 = { 0 },
+	      l5 = { 0 }, l6 = { 0 }, l7 = { 0 }, l8 = { 0 };
+	u64x4 u0 = { 0 }, u1 = { 0 }, u2 = { 0 }, u3 = { 0 }, u4 = { 0 },
+	      u5 = { 0 }, u6 = { 0 }, u7 = { 0 }, u8 = { 0 };
+
+	M(1, 0, 1); M(2, 0, 2); M(3, 0, 3); M(4, 0, 4);
+	M(3, 1, 2); M(4, 1, 3); M(5, 1, 4);
+	M(5, 2, 3); M(6, 2, 4);
+	M(7, 3, 4);
+	l1 <<= 1; l2 <<= 1; l3 <<= 1; l4 <<= 1; l5 <<= 1; l6 <<= 1; l7 <<= 1;
+	u1 <<= 1; u2 <<= 1; u3 <<= 1; u4 <<= 1; u5 <<= 1; u6 <<= 1; u7 <<= 1;
+	M(0, 0, 0); M(2, 1, 1); M(4, 2, 2); M(6, 3, 3); M(8, 4, 4);
+	fe4_reduce(h, l0, l1 + (u0 << 1), l2 + (u1 << 1), l3 + (u2 << 1),
+		   l4 + (u3 << 1), l5 + (u4 << 1), l6 + (u5 << 1),
+		   l7 + (u6 << 1), l8 + (u7 << 1), u8 << 1);
+}
+
+/* h = f * 121666 */
+static __always_inline void fe4_mul121666(fe4 *h, const fe4 *f)
+{
+	const u64x4 f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3],
+		    f4 = f->v[4];
+	const u64x4 g0 = { 121666, 121666, 121666, 121666 }, zero = { 0 };
+	u64x4 l0 = { 0 }, l1 = { 0 }, l2 = { 0 }, l3 = { 0 }, l4 = { 0 };
+	u64x4 u0 = { 0 }, u1 = { 0 }, u2 = { 0 }, u3 = { 0 }, u4 = { 0 };
+
+	M(0, 0, 0); M(1, 1, 0); M(2, 2, 0); M(3, 3, 0); M(4, 4, 0);
+	fe4_reduce(h, l0, l1 + (u0 << 1), l2 + (u1 << 1), l3 + (u2 << 1),
+		   l4 + (u3 << 1), u4 << 1, zero, zero, zero, zero);
+}
+
+#undef M
+
+/* Same addition chain as fe_loose_invert in curve25519-fiat32.c. */
+static noinline_for_stack void fe4_invert(fe4 *out, const fe4 *z)
+{
+	fe4 t0, t1, t2, t3;
+	int i;
+
+	fe4_sq(&t0, z);
+	fe4_sq(&t1, &t0);
+	for (i = 1; i < 2; ++i)
+		fe4_sq(&t1, &t1);
+	fe4_mul(&t1, z, &t1);
+	fe4_mul(&t0, &t0, &t1);
+	fe4_sq(&t2, &t0);
+	fe4_mul(&t1, &t1, &t2);
+	fe4_sq(&t2, &t1);
+	for (i = 1; i < 5; ++i)
+		fe4_sq(&t2, &t2);
+	fe4_mul(&t1, &t2, &t1);
+	fe4_sq(&t2, &t1);
+	for (i = 1; i < 10; ++i)
+		fe4_sq(&t2, &t2);
+	fe4_mul(&t2, &t2, &t1);
+	fe4_sq(&t3, &t2);
+	for (i = 1; i < 20; ++i)
+		fe4_sq(&t3, &t3);
+	fe4_mul(&t2, &t3, &t2);
+	fe4_sq(&t2, &t2);
+	for (i = 1; i < 10; ++i)
+		fe4_sq(&t2, &t2);
+	fe4_mul(&t1, &t2, &t1);
+	fe4_sq(&t2, &t1);
+	for (i = 1; i < 50; ++i)
+		fe4_sq(&t2, &t2);
+	fe4_mul(&t2, &t2, &t1);
+	fe4_sq(&t3, &t2);
+	for (i = 1; i < 100; ++i)
+		fe4_sq(&t3, &t3);
+	fe4_mul(&t2, &t3, &t2);
+	fe4_sq(&t2, &t2);
+	for (i = 1; i < 50; ++i)
+		fe4_sq(&t2, &t2);
+	fe4_mul(&t1, &t2, &t1);
+	fe4_sq(&t1, &t1);
+	for (i = 1; i < 5; ++i)
+		fe4_sq(&t1, &t1);
+	fe4_mul(out, &t1, &t0);
+
+	memzero_explicit(&t0, sizeof(t0));
+	memzero_explicit(&t1, sizeof(t1));
+	memzero_explicit(&t2, sizeof(t2));
+	memzero_explicit(&t3, sizeof(t3));
+}
+
+static __always_inline void fe4_cswap(fe4 *f, fe4 *g, unsigned int b)
+{
+	const u64 mask = 0 - (u64)b;
+	int i;
+
+	for (i = 0; i < 5; ++i) {
+		u64x4 x = (f->v[i] ^ g->v[i]) & mask;
+		f->v[i] ^= x;
+		g->v[i] ^= x;
+	}
+}
+
+/* The ladderstep of curve25519_generic in curve25519-fiat32.c, with its
+ * temporaries, of which no more than four are live at once, in a to d.
+ */
+static noinline_for_stack void fe4_ladderstep(const fe4 *x1, fe4 *x2, fe4 *z2,
+					      fe4 *x3, fe4 *z3)
+{
+	fe4 a, b, c, d;
+
+	fe4_sub(&a, x3, z3);
+	fe4_sub(&b, x2, z2);
+	fe4_add(&c, x2, z2);
+	fe4_add(&d, x3, z3);
+	fe4_mul(z3, &a, &c);
+	fe4_mul(z2, &d, &b);
+	fe4_sq(&a, &b);
+	fe4_sq(&b, &c);
+	fe4_add(&c, z3, z2);
+	fe4_sub(&d, z3, z2);
+	fe4_mul(x2, &b, &a);
+	fe4_sub(&b, &b, &a);
+	fe4_sq(z2, &d);
+	fe4_mul121666(z3, &b);
+	fe4_sq(x3, &c);
+	fe4_add(&a, &a, z3);
+	fe4_mul(z3, x1, z2);
+	fe4_mul(z2, &b, &a);
+
+	memzero_explicit(&a, sizeof(a));
+	memzero_explicit(&b, sizeof(b));
+	memzero_explicit(&c, sizeof(c));
+	memzero_explicit(&d, sizeof(d));
+}
+
+/* Every lane uses the same secret, so the swaps are the same in every lane,
+ * and the ladder is otherwise that of curve25519_generic.
+ */
+static void curve25519_ifma_4way(u8 out[][CURVE25519_KEY_SIZE],
+				 const u8 scalar[CURVE25519_KEY_SIZE],
+				 const u8 points[][CURVE25519_KEY_SIZE])
+{
+	fe4 x1, x2, z2, x3, z3;
+	unsigned int swap = 0;
+	int pos;
+	u8 e[32];
+
+	memcpy(e, scalar, 32);
+	clamp_secret(e);
+
+	fe4_frombytes(&x1, points);
+	fe4_1(&x2);
+	fe4_0(&z2);
+	x3 = x1;
+	fe4_1(&z3);
+
+	for (pos = 254; pos >= 0; --pos) {
+		unsigned int b = 1 & (e[pos / 8] >> (pos & 7));
+
+		swap ^= b;
+		fe4_cswap(&x2, &x3, swap);
+		fe4_cswap(&z2, &z3, swap);
+		swap = b;
+		fe4_ladderstep(&x1, &x2, &z2, &x3, &z3);
+	}
+	fe4_cswap(&x2, &x3, swap);
+	fe4_cswap(&z2, &z3, swap);
+
+	fe4_invert(&z2, &z2);
+	fe4_mul(&x2, &x2, &z2);
+	fe4_tobytes(out, &x2);
+
+	memzero_explicit(&x1, sizeof(x1));
+	memzero_explicit(&x2, sizeof(x2));
+	memzero_explicit(&z2, sizeof(z2));
+	memzero_explicit(&x3, sizeof(x3));
+	memzero_explicit(&z3, sizeof(z3));
+	memzero_explicit(&e, sizeof(e));
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
@@ -40,6 +40,14 @@ static inline bool curve25519_base_arch(u8 pub[CURVE25519_KEY_SIZE],
 {
 	return false;
 }
+static inline unsigned int
+curve25519_batch_arch(u8 mypublic[][CURVE25519_KEY_SIZE],
+		      const u8 secret[CURVE25519_KEY_SIZE],
+		      const u8 basepoint[][CURVE25519_KEY_SIZE], unsigned int n,
+		      simd_context_t *simd_context)
+{
+	return 0;
+}
 #endif
 
 static __always_inline void normalize_secret(u8 secret[CURVE25519_KEY_SIZE])
@@ -51,8 +59,14 @@ static __always_inline void normalize_secret(u8 secret[CURVE25519_KEY_SIZE])
 
 #if defined(CONFIG_ARCH_SUPPORTS_INT128) && defined(__SIZEOF_INT128__)
 #include "curve25519-hacl64.c"
+static inline bool curve25519_base_generic(u8 pub[CURVE25519_KEY_SIZE],
+					   const u8 secret[CURVE25519_KEY_SIZE])
+{
+	return false;
+}
 #else
 #include "curve25519-fiat32.c"
+#include "curve25519-fiat32-base.c"
 #endif
 
 static const u8 null_point[CURVE25519_KEY_SIZE] = { 0 };
@@ -67,6 +81,24 @@ bool curve25519(u8 mypublic[CURVE25519_KEY_SIZE],
 }
 EXPORT_SYMBOL(curve25519);
 
+void curve25519_batch(u8 mypublic[][CURVE25519_KEY_SIZE],
+		      const u8 secret[CURVE25519_KEY_SIZE],
+		      const u8 basepoint[][CURVE25519_KEY_SIZE], bool valid[],
+		      unsigned int n, simd_context_t *simd_context)
+{
+	unsigned int i = curve25519_batch_arch(mypublic, secret, basepoint, n,
+					       simd_context);
+
+	for (; i < n; ++i) {
+		if (!curve25519_arch(mypublic[i], secret, basepoint[i]))
+			curve25519_generic(mypublic[i], secret, basepoint[i]);
+	}
+	for (i = 0; i < n; ++i)
+		valid[i] = crypto_memneq(mypublic[i], null_point,
+					 CURVE25519_KEY_SIZE);
+}
+EXPORT_SYMBOL(curve25519_batch);
+
 bool curve25519_generate_public(u8 pub[CURVE25519_KEY_SIZE],
 				const u8 secret[CURVE25519_KEY_SIZE])
 {
@@ -75,7 +107,8 @@ bool curve25519_generate_public(u8 pub[CURVE25519_KEY_SIZE],
 	if (unlikely(!crypto_memneq(secret, null_point, CURVE25519_KEY_SIZE)))
 		return false;
 
-	if (curve25519_base_arch(pub, secret))
+	if (curve25519_base_arch(pub, secret) ||
+	    curve25519_base_generic(pub, secret))
 		return crypto_memneq(pub, null_point, CURVE25519_KEY_SIZE);
 	return curve25519(pub, secret, basepoint);
 }
@@ -2057,6 +2057,8 @@ static const u8 blake2s_keyed_testvecs[][BLAKE2S_HASH_SIZE] __initconst = {
 	  0x34, 0xbd, 0xe9, 0x99, 0xef, 0xd7, 0x24, 0xdd }
 };
 
+enum { BATCH_TEST_N = BLAKE2S_BATCH_LANES * 2 + 3 };
+
 static bool __init blake2s_selftest(void)
 {
 	u8 key[BLAKE2S_KEY_SIZE];
@@ -2086,5 +2088,44 @@ static bool __init blake2s_selftest(void)
 			success = false;
 		}
 	}
+
+	for (i = 0; i < ARRAY_SIZE(blake2s_keyed_testvecs) - BATCH_TEST_N;
+	     i += 7) {
+		const u8 *in[BATCH_TEST_N], *keys[BATCH_TEST_N];
+		u8 hashes[BATCH_TEST_N][BLAKE2S_HASH_SIZE];
+		size_t j, keylen = i % (BLAKE2S_KEY_SIZE + 1);
+
+		for (j = 0; j < BATCH_TEST_N; ++j) {
+			in[j] = buf + j;
+			keys[j] = buf + sizeof(buf) - BLAKE2S_KEY_SIZE - j;
+		}
+		blake2s_batch(hashes, in, keys, BLAKE2S_HASH_SIZE, i, keylen,
+			      BATCH_TEST_N);
+		for (j = 0; j < BATCH_TEST_N; ++j) {
+			blake2s(hash, in[j], keylen ? keys[j] : NULL,
+				BLAKE2S_HASH_SIZE, i, keylen);
+			if (memcmp(hash, hashes[j], BLAKE2S_HASH_SIZE)) {
+				pr_err("blake2s batch self-test %zu, lane %zu: FAIL\n",
+				       i + 1, j);
+				success = false;
+			}
+		}
+	}
+
+	for (i = 1; i < ARRAY_SIZE(blake2s_testvecs); i += 13) {
+		struct blake2s_hmac_key hkey;
+		u8 hmac[BLAKE2S_HASH_SIZE];
+		size_t keylen = (i * 5) % (sizeof(buf) + 1);
+
+		blake2s_hmac(hmac, buf, buf, BLAKE2S_HASH_SIZE, i, keylen);
+		blake2s_hmac_key_init(&hkey, buf, keylen);
+		blake2s_hmac_precomputed(hash, buf, &hkey, BLAKE2S_HASH_SIZE,
+					 i);
+		if (memcmp(hash, hmac, BLAKE2S_HASH_SIZE)) {
+			pr_err("blake2s hmac precomputed self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
 	return success;
 }
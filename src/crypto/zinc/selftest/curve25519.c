@@ -1278,12 +1278,103 @@ static const struct curve25519_test_vector curve25519_test_vectors[] __initconst
 	}
 };
 
+struct curve25519_base_test_vector {
+	u8 private[CURVE25519_KEY_SIZE];
+	u8 public[CURVE25519_KEY_SIZE];
+};
+static const struct curve25519_base_test_vector curve25519_base_test_vectors[] __initconst = {
+	{
+		.private = { 0x77, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d,
+			     0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+			     0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a,
+			     0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x2a },
+		.public = { 0x85, 0x20, 0xf0, 0x09, 0x89, 0x30, 0xa7, 0x54,
+			    0x74, 0x8b, 0x7d, 0xdc, 0xb4, 0x3e, 0xf7, 0x5a,
+			    0x0d, 0xbf, 0x3a, 0x0d, 0x26, 0x38, 0x1a, 0xf4,
+			    0xeb, 0xa4, 0xa9, 0x8e, 0xaa, 0x9b, 0x4e, 0x6a }
+	},
+	{
+		.private = { 0x5d, 0xab, 0x08, 0x7e, 0x62, 0x4a, 0x8a, 0x4b,
+			     0x79, 0xe1, 0x7f, 0x8b, 0x83, 0x80, 0x0e, 0xe6,
+			     0x6f, 0x3b, 0xb1, 0x29, 0x26, 0x18, 0xb6, 0xfd,
+			     0x1c, 0x2f, 0x8b, 0x27, 0xff, 0x88, 0xe0, 0xeb },
+		.public = { 0xde, 0x9e, 0xdb, 0x7d, 0x7b, 0x7d, 0xc1, 0xb4,
+			    0xd3, 0x5b, 0x61, 0xc2, 0xec, 0xe4, 0x35, 0x37,
+			    0x3f, 0x83, 0x43, 0xc8, 0x5b, 0x78, 0x67, 0x4d,
+			    0xad, 0xfc, 0x7e, 0x14, 0x6f, 0x88, 0x2b, 0x4f }
+	},
+	{
+		.private = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+			     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+			     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+			     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+		.public = { 0x84, 0x7c, 0x0d, 0x2c, 0x37, 0x52, 0x34, 0xf3,
+			    0x65, 0xe6, 0x60, 0x95, 0x51, 0x87, 0xa3, 0x73,
+			    0x5a, 0x0f, 0x76, 0x13, 0xd1, 0x60, 0x9d, 0x3a,
+			    0x6a, 0x4d, 0x8c, 0x53, 0xae, 0xaa, 0x5a, 0x22 }
+	},
+	{
+		.private = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		.public = { 0x2f, 0xe5, 0x7d, 0xa3, 0x47, 0xcd, 0x62, 0x43,
+			    0x15, 0x28, 0xda, 0xac, 0x5f, 0xbb, 0x29, 0x07,
+			    0x30, 0xff, 0xf6, 0x84, 0xaf, 0xc4, 0xcf, 0xc2,
+			    0xed, 0x90, 0x99, 0x5f, 0x58, 0xcb, 0x3b, 0x74 }
+	},
+	{
+		.private = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80 },
+		.public = { 0x2f, 0xe5, 0x7d, 0xa3, 0x47, 0xcd, 0x62, 0x43,
+			    0x15, 0x28, 0xda, 0xac, 0x5f, 0xbb, 0x29, 0x07,
+			    0x30, 0xff, 0xf6, 0x84, 0xaf, 0xc4, 0xcf, 0xc2,
+			    0xed, 0x90, 0x99, 0x5f, 0x58, 0xcb, 0x3b, 0x74 }
+	},
+	{
+		.private = { 0x06, 0x21, 0x20, 0x9c, 0x5d, 0x47, 0xdf, 0x12,
+			     0xf2, 0xc1, 0x31, 0x5d, 0xc0, 0xa6, 0xe7, 0x6c,
+			     0xf8, 0x79, 0xa2, 0xad, 0x8b, 0xad, 0xc6, 0xd7,
+			     0xc8, 0x2f, 0xce, 0x9f, 0x29, 0x92, 0xb4, 0x53 },
+		.public = { 0x9a, 0x31, 0x9d, 0x9c, 0xbb, 0x28, 0x6a, 0xf3,
+			    0x52, 0xa1, 0xdc, 0x4c, 0xcb, 0x7b, 0xff, 0x42,
+			    0x5c, 0x7c, 0x47, 0x8b, 0xb9, 0x7a, 0x57, 0x7b,
+			    0x66, 0x1c, 0x46, 0x00, 0x3c, 0x6b, 0xe7, 0x6c }
+	},
+	{
+		.private = { 0xe0, 0xc6, 0x0a, 0x11, 0x42, 0x4c, 0xfc, 0xfa,
+			     0x57, 0x83, 0xae, 0xd2, 0x37, 0xae, 0xa3, 0xab,
+			     0x77, 0x8b, 0xb9, 0xce, 0x8a, 0x52, 0x57, 0xbf,
+			     0xbe, 0x41, 0xa3, 0x28, 0x36, 0xc6, 0x3a, 0x9d },
+		.public = { 0x4b, 0xe2, 0x6a, 0x7a, 0x2d, 0x7c, 0xda, 0x2e,
+			    0x9b, 0x7e, 0xfb, 0x0a, 0x92, 0xa4, 0x36, 0x44,
+			    0x6c, 0xa2, 0x6a, 0xb9, 0xbc, 0x85, 0xc1, 0x91,
+			    0x84, 0xf4, 0x7b, 0xb6, 0x9d, 0xfe, 0x99, 0x31 }
+	},
+	{
+		.private = { 0x1e, 0xee, 0xc0, 0xa7, 0x81, 0xa0, 0x5a, 0xb2,
+			     0x3c, 0xaa, 0x74, 0x33, 0x5f, 0x30, 0x89, 0xcc,
+			     0x3a, 0x49, 0x20, 0x09, 0x66, 0xd1, 0x3a, 0x2b,
+			     0x14, 0x22, 0xaf, 0xeb, 0x2f, 0xf5, 0x86, 0x66 },
+		.public = { 0x11, 0xa1, 0x38, 0xbc, 0xed, 0x16, 0x1f, 0xfc,
+			    0x67, 0x78, 0x33, 0xd9, 0xc6, 0xb9, 0x48, 0xb9,
+			    0xe2, 0x9e, 0x32, 0x59, 0x95, 0x45, 0x26, 0x84,
+			    0xb0, 0x64, 0xe1, 0x62, 0x0f, 0x51, 0x28, 0x45 }
+	}
+};
+
+
 static bool __init curve25519_selftest(void)
 {
 	bool success = true, ret, ret2;
-	size_t i = 0, j;
+	size_t i = 0, j, k;
 	u8 in[CURVE25519_KEY_SIZE];
 	u8 out[CURVE25519_KEY_SIZE], out2[CURVE25519_KEY_SIZE];
+	u8 batch_in[9][CURVE25519_KEY_SIZE], batch_out[9][CURVE25519_KEY_SIZE];
+	bool batch_valid[9];
+	simd_context_t simd_context;
 
 	for (i = 0; i < ARRAY_SIZE(curve25519_test_vectors); ++i) {
 		memset(out, 0, CURVE25519_KEY_SIZE);
@@ -1297,6 +1388,18 @@ static bool __init curve25519_selftest(void)
 		}
 	}
 
+	for (i = 0; i < ARRAY_SIZE(curve25519_base_test_vectors); ++i) {
+		memset(out, 0, CURVE25519_KEY_SIZE);
+		ret = curve25519_generate_public(out,
+				curve25519_base_test_vectors[i].private);
+		if (!ret || memcmp(out, curve25519_base_test_vectors[i].public,
+				   CURVE25519_KEY_SIZE)) {
+			pr_err("curve25519 fixed-base self-test %zu: FAIL\n",
+			       i + 1);
+			success = false;
+		}
+	}
+
 	for (i = 0; i < 5; ++i) {
 		get_random_bytes(in, sizeof(in));
 		ret = curve25519_generate_public(out, in);
@@ -1311,5 +1414,35 @@ static bool __init curve25519_selftest(void)
 		}
 	}
 
+	/* Every batch length up to 9 covers full groups of lanes and every
+	 * tail, and every other point comes from the vectors above, so that
+	 * the batches mix random points with zero and low order ones.
+	 */
+	simd_get(&simd_context);
+	for (i = 1; i <= ARRAY_SIZE(batch_in); ++i) {
+		get_random_bytes(in, sizeof(in));
+		for (j = 0; j < i; ++j) {
+			k = (i * 7 + j) % ARRAY_SIZE(curve25519_test_vectors);
+			if (j & 1)
+				memcpy(batch_in[j], curve25519_test_vectors[k].public,
+				       CURVE25519_KEY_SIZE);
+			else
+				get_random_bytes(batch_in[j], CURVE25519_KEY_SIZE);
+		}
+		curve25519_batch(batch_out, in, batch_in, batch_valid, i,
+				 &simd_context);
+		for (j = 0; j < i; ++j) {
+			curve25519_generic(out, in, batch_in[j]);
+			ret = crypto_memneq(out, null_point, CURVE25519_KEY_SIZE);
+			if (batch_valid[j] != ret ||
+			    memcmp(out, batch_out[j], CURVE25519_KEY_SIZE)) {
+				pr_err("curve25519 batch self-test %zu/%zu: FAIL\n",
+				       i, j + 1);
+				success = false;
+			}
+		}
+	}
+	simd_put(&simd_context);
+
 	return success;
 }
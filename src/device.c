@@ -83,7 +83,8 @@ static int wg_pm_notification(struct notifier_block *nb, unsigned long action,
 			wg_noise_handshake_clear(&peer->handshake);
 			wg_noise_keypairs_clear(&peer->keypairs);
 			if (peer->timers_enabled)
-				del_timer(&peer->timer_zero_key_material);
+				WRITE_ONCE(peer->timer_deadlines[
+					WG_TIMER_ZERO_KEY_MATERIAL], 0);
 		}
 		mutex_unlock(&wg->device_update_lock);
 	}
@@ -110,7 +111,8 @@ static int wg_stop(struct net_device *dev)
 				     (u64)(REKEY_TIMEOUT + 1) * NSEC_PER_SEC);
 	}
 	mutex_unlock(&wg->device_update_lock);
-	skb_queue_purge(&wg->incoming_handshakes);
+	wg_noise_ephemeral_pool_clear(&wg->ephemeral_pool);
+	wg_packet_handshake_queue_purge(wg);
 	wg_socket_reinit(wg, NULL, NULL);
 	return 0;
 }
@@ -218,6 +220,16 @@ static const struct net_device_ops netdev_ops = {
 	.ndo_get_stats64	= ip_tunnel_get_stats64
 };
 
+static void wg_allowedips_worker(struct work_struct *work)
+{
+	struct wg_device *wg = container_of(to_delayed_work(work),
+					    struct wg_device, allowedips_work);
+
+	mutex_lock(&wg->device_update_lock);
+	wg_allowedips_compile(&wg->peer_allowedips, &wg->device_update_lock);
+	mutex_unlock(&wg->device_update_lock);
+}
+
 static void wg_destruct(struct net_device *dev)
 {
 	struct wg_device *wg = netdev_priv(dev);
@@ -225,6 +237,7 @@ static void wg_destruct(struct net_device *dev)
 	rtnl_lock();
 	list_del(&wg->device_list);
 	rtnl_unlock();
+	cancel_delayed_work_sync(&wg->allowedips_work);
 	mutex_lock(&wg->device_update_lock);
 	wg->incoming_port = 0;
 	wg_socket_reinit(wg, NULL, NULL);
@@ -233,15 +246,21 @@ static void wg_destruct(struct net_device *dev)
 	wg_peer_remove_all(wg);
 	destroy_workqueue(wg->handshake_receive_wq);
 	destroy_workqueue(wg->handshake_send_wq);
+	/* Nothing can ask for more ephemerals now. */
+	wg_noise_ephemeral_pool_free(&wg->ephemeral_pool);
 	destroy_workqueue(wg->packet_crypt_wq);
+	wg_packet_rx_napi_free(wg);
 	wg_packet_queue_free(&wg->decrypt_queue, true);
 	wg_packet_queue_free(&wg->encrypt_queue, true);
 	rcu_barrier_bh(); /* Wait for all the peers to be actually freed. */
+	wg_timer_wheel_free(&wg->timer_wheel);
+	wg_index_hashtable_free(&wg->index_hashtable);
+	wg_pubkey_hashtable_free(&wg->peer_hashtable);
 	wg_ratelimiter_uninit();
 	memzero_explicit(&wg->static_identity, sizeof(wg->static_identity));
-	skb_queue_purge(&wg->incoming_handshakes);
+	wg_packet_handshake_queue_free(wg);
 	free_percpu(dev->tstats);
-	free_percpu(wg->incoming_handshakes_worker);
+	free_percpu(wg->rx_early_drops);
 	if (wg->have_creating_net_ref)
 		put_net(wg->creating_net);
 	mutex_unlock(&wg->device_update_lock);
@@ -293,17 +312,20 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 		      struct netlink_ext_ack *extack)
 {
 	struct wg_device *wg = netdev_priv(dev);
-	int ret = -ENOMEM;
+	int ret = -ENOMEM, cpu;
 
 	wg->creating_net = src_net;
 	init_rwsem(&wg->static_identity.lock);
 	mutex_init(&wg->socket_update_lock);
 	mutex_init(&wg->device_update_lock);
-	skb_queue_head_init(&wg->incoming_handshakes);
-	wg_pubkey_hashtable_init(&wg->peer_hashtable);
-	wg_index_hashtable_init(&wg->index_hashtable);
 	wg_allowedips_init(&wg->peer_allowedips);
+	INIT_DELAYED_WORK(&wg->allowedips_work, wg_allowedips_worker);
 	wg_cookie_checker_init(&wg->cookie_checker, wg);
+	wg_noise_ephemeral_pool_init(&wg->ephemeral_pool);
+	spin_lock_init(&wg->handshake_load.lock);
+	wg_known_endpoints_init(&wg->known_endpoints);
+	spin_lock_init(&wg->rekey_bucket.lock);
+	wg_timer_wheel_init(&wg->timer_wheel);
 	INIT_LIST_HEAD(&wg->peer_list);
 	wg->device_update_gen = 1;
 
@@ -311,10 +333,7 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 	if (!dev->tstats)
 		goto error_1;
 
-	wg->incoming_handshakes_worker =
-		wg_packet_alloc_percpu_multicore_worker(
-				wg_packet_handshake_receive_worker, wg);
-	if (!wg->incoming_handshakes_worker)
+	if (wg_packet_handshake_queue_init(wg) < 0)
 		goto error_2;
 
 	wg->handshake_receive_wq = alloc_workqueue("wg-kex-%s",
@@ -340,13 +359,28 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 				 true, MAX_QUEUED_PACKETS) < 0)
 		goto error_7;
 
+	if (wg_packet_rx_napi_init(wg) < 0)
+		goto error_8;
+
+	wg->rx_early_drops = alloc_percpu(struct rx_early_drops);
+	if (!wg->rx_early_drops)
+		goto error_9;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(wg->rx_early_drops, cpu)->syncp);
+
+	if (wg_pubkey_hashtable_init(&wg->peer_hashtable) < 0)
+		goto error_10;
+
+	if (wg_index_hashtable_init(&wg->index_hashtable) < 0)
+		goto error_11;
+
 	ret = wg_ratelimiter_init();
 	if (ret < 0)
-		goto error_8;
+		goto error_12;
 
 	ret = register_netdevice(dev);
 	if (ret < 0)
-		goto error_9;
+		goto error_13;
 
 	list_add(&wg->device_list, &device_list);
 
@@ -358,8 +392,16 @@ static int wg_newlink(struct net *src_net, struct net_device *dev,
 	pr_debug("%s: Interface created\n", dev->name);
 	return ret;
 
-error_9:
+error_13:
 	wg_ratelimiter_uninit();
+error_12:
+	wg_index_hashtable_free(&wg->index_hashtable);
+error_11:
+	wg_pubkey_hashtable_free(&wg->peer_hashtable);
+error_10:
+	free_percpu(wg->rx_early_drops);
+error_9:
+	wg_packet_rx_napi_free(wg);
 error_8:
 	wg_packet_queue_free(&wg->decrypt_queue, true);
 error_7:
@@ -371,7 +413,7 @@ error_5:
 error_4:
 	destroy_workqueue(wg->handshake_receive_wq);
 error_3:
-	free_percpu(wg->incoming_handshakes_worker);
+	wg_packet_handshake_queue_free(wg);
 error_2:
 	free_percpu(dev->tstats);
 error_1:
@@ -10,6 +10,7 @@
 #include "allowedips.h"
 #include "hashtables.h"
 #include "cookie.h"
+#include "timers.h"
 
 #include <linux/types.h>
 #include <linux/netdevice.h>
@@ -17,6 +18,7 @@
 #include <linux/mutex.h>
 #include <linux/net.h>
 #include <linux/ptr_ring.h>
+#include <linux/u64_stats_sync.h>
 
 struct wg_device;
 
@@ -36,6 +38,64 @@ struct crypt_queue {
 	};
 };
 
+/* Decrypted packets are handed to the stack through one of these per CPU,
+ * rather than through one napi_struct per peer. Peers that have packets ready
+ * sit on the list of the CPU that noticed it first, and their rx_queue is then
+ * drained in order by whichever napi owns them.
+ */
+struct rx_napi {
+	struct napi_struct napi;
+	struct list_head peers;
+	spinlock_t lock;
+};
+
+/* Incoming handshakes are queued on the CPU that received them, and whichever
+ * worker is kicked drains its own queue first before stealing from others.
+ * Handshakes from known endpoints have their own class, which every worker
+ * drains before looking at any of the others. Everything the receive path
+ * writes for a handshake is in here, so that a flood spread over many CPUs
+ * doesn't have them all writing to the same line.
+ */
+enum handshake_class {
+	HANDSHAKE_CLASS_KNOWN,
+	HANDSHAKE_CLASS_UNKNOWN,
+	HANDSHAKE_CLASSES
+};
+
+struct handshake_queue {
+	struct multicore_worker worker;
+	struct sk_buff_head skbs[HANDSHAKE_CLASSES];
+	unsigned long arrivals;
+	int next_cpu;
+};
+
+/* An average of how many handshakes per second this device is being sent,
+ * from which the receive workers decide whether to demand cookies. Cookie mode
+ * is entered above one rate and only left below a lower one, so that a flood
+ * hovering around a single threshold doesn't flap it.
+ */
+struct handshake_load {
+	spinlock_t lock;
+	unsigned long arrivals;
+	u64 last_sample, last_overloaded;
+	unsigned int rate;
+	bool backed_up, under_load;
+};
+
+/* Paces the rekeys that keypairs are allowed to start before they're strictly
+ * due. Tokens are nanoseconds of credit.
+ */
+struct rekey_bucket {
+	spinlock_t lock;
+	u64 last_time_ns, tokens;
+};
+
+/* Packets shed by the receive path before any real parsing, by reason. */
+struct rx_early_drops {
+	u64 invalid_type, invalid_length, unknown_index;
+	struct u64_stats_sync syncp;
+};
+
 struct wg_device {
 	struct net_device *dev;
 	struct crypt_queue encrypt_queue, decrypt_queue;
@@ -44,13 +104,19 @@ struct wg_device {
 	struct noise_static_identity static_identity;
 	struct workqueue_struct *handshake_receive_wq, *handshake_send_wq;
 	struct workqueue_struct *packet_crypt_wq;
-	struct sk_buff_head incoming_handshakes;
-	int incoming_handshake_cpu;
-	struct multicore_worker __percpu *incoming_handshakes_worker;
+	struct handshake_queue __percpu *incoming_handshakes;
+	struct handshake_load handshake_load;
+	struct known_endpoints known_endpoints;
+	struct rekey_bucket rekey_bucket;
+	struct timer_wheel timer_wheel;
+	struct rx_napi __percpu *rx_napi;
+	struct rx_early_drops __percpu *rx_early_drops;
 	struct cookie_checker cookie_checker;
+	struct noise_ephemeral_pool ephemeral_pool;
 	struct pubkey_hashtable peer_hashtable;
 	struct index_hashtable index_hashtable;
 	struct allowedips peer_allowedips;
+	struct delayed_work allowedips_work;
 	struct mutex device_update_lock, socket_update_lock;
 	struct list_head device_list, peer_list;
 	unsigned int num_peers, device_update_gen;
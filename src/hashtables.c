@@ -6,41 +6,214 @@
 #include "hashtables.h"
 #include "peer.h"
 #include "noise.h"
+#include "netlink.h"
 
-static struct hlist_head *pubkey_bucket(struct pubkey_hashtable *table,
-					const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/log2.h>
+
+struct hashtable_buckets {
+	unsigned int mask;
+	struct hlist_head heads[];
+};
+
+static struct hashtable_buckets *buckets_alloc(unsigned int bits)
+{
+	struct hashtable_buckets *buckets;
+
+	buckets = kvzalloc(sizeof(*buckets) +
+			   (sizeof(struct hlist_head) << bits), GFP_KERNEL);
+	if (likely(buckets))
+		buckets->mask = (1U << bits) - 1;
+	return buckets;
+}
+
+/* Enough buckets that there are fewer entries than buckets, but not twice as
+ * many, which leaves room to grow or shrink a while before resizing again.
+ */
+static unsigned int buckets_bits(unsigned int count)
+{
+	return clamp_t(unsigned int, fls(count), HASHTABLE_MIN_BITS,
+		       HASHTABLE_MAX_BITS);
+}
+
+static struct hlist_head *buckets_head(struct hashtable_buckets *buckets,
+				       u32 hash)
+{
+	return &buckets->heads[hash & buckets->mask];
+}
+
+static spinlock_t *buckets_lock(struct resizable_buckets *rb, u32 hash)
+{
+	return &rb->locks[hash & (ARRAY_SIZE(rb->locks) - 1)];
+}
+
+static void buckets_maybe_resize(struct resizable_buckets *rb,
+				 unsigned int count)
+{
+	struct hashtable_buckets *buckets = rcu_dereference_bh(rb->buckets);
+
+	if (buckets_bits(count) > ilog2(buckets->mask + 1) ||
+	    buckets_bits(count * 4) < ilog2(buckets->mask + 1))
+		queue_work(system_power_efficient_wq, &rb->resize_work);
+}
+
+/* Must hold the lock of hash's stripe */
+static void buckets_add(struct resizable_buckets *rb, struct hlist_node *node,
+			u32 hash)
+{
+	hlist_add_head_rcu(node, buckets_head(rcu_dereference_bh(rb->buckets),
+					      hash));
+	buckets_maybe_resize(rb, atomic_inc_return(&rb->count));
+}
+
+/* Must hold the lock of node's stripe */
+static void buckets_del(struct resizable_buckets *rb, struct hlist_node *node)
+{
+	hlist_del_init_rcu(node);
+	buckets_maybe_resize(rb, atomic_dec_return(&rb->count));
+}
+
+/* Moves every entry over to new buckets, one stripe at a time, so that only
+ * writers to the stripe being moved ever wait on it.
+ */
+static void buckets_resize(struct work_struct *work)
+{
+	struct resizable_buckets *rb = container_of(work,
+					struct resizable_buckets, resize_work);
+	struct hashtable_buckets *old, *new;
+	struct hlist_node *node, *tmp;
+	unsigned int bits, lock, i;
+
+	old = rcu_dereference_protected(rb->buckets, true);
+	bits = buckets_bits(atomic_read(&rb->count));
+	if (bits == ilog2(old->mask + 1))
+		return;
+	new = buckets_alloc(bits);
+	if (unlikely(!new))
+		return;
+
+	local_bh_disable();
+	write_seqcount_begin(&rb->resize_seq);
+	rcu_assign_pointer(rb->old_buckets, old);
+	rcu_assign_pointer(rb->buckets, new);
+	write_seqcount_end(&rb->resize_seq);
+	local_bh_enable();
+
+	for (lock = 0; lock < ARRAY_SIZE(rb->locks); ++lock) {
+		spin_lock_bh(&rb->locks[lock]);
+		write_seqcount_begin(&rb->resize_seq);
+		for (i = lock; i <= old->mask; i += ARRAY_SIZE(rb->locks)) {
+			hlist_for_each_safe (node, tmp, &old->heads[i]) {
+				hlist_del_rcu(node);
+				hlist_add_head_rcu(node, buckets_head(new,
+							rb->hash(node)));
+			}
+		}
+		write_seqcount_end(&rb->resize_seq);
+		spin_unlock_bh(&rb->locks[lock]);
+		cond_resched();
+	}
+
+	RCU_INIT_POINTER(rb->old_buckets, NULL);
+	synchronize_rcu_bh();
+	kvfree(old);
+}
+
+static int buckets_init(struct resizable_buckets *rb,
+			u32 (*hash)(const struct hlist_node *node))
+{
+	unsigned int i;
+
+	rb->buckets = buckets_alloc(HASHTABLE_MIN_BITS);
+	if (unlikely(!rb->buckets))
+		return -ENOMEM;
+	rb->old_buckets = NULL;
+	seqcount_init(&rb->resize_seq);
+	atomic_set(&rb->count, 0);
+	INIT_WORK(&rb->resize_work, buckets_resize);
+	rb->hash = hash;
+	for (i = 0; i < ARRAY_SIZE(rb->locks); ++i)
+		spin_lock_init(&rb->locks[i]);
+	return 0;
+}
+
+/* Must only be called once every entry has been removed. */
+static void buckets_free(struct resizable_buckets *rb)
+{
+	cancel_work_sync(&rb->resize_work);
+	kvfree(rcu_dereference_protected(rb->buckets, true));
+}
+
+static u32 pubkey_hash(const struct hlist_node *node)
+{
+	return container_of(node, struct wg_peer, pubkey_hash)->pubkey_fingerprint;
+}
+
+static u64 pubkey_fingerprint(struct pubkey_hashtable *table,
+			      const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
 {
 	/* siphash gives us a secure 64bit number based on a random key. Since
 	 * the bits are uniformly distributed, we can then mask off to get the
-	 * bits we need.
+	 * bits we need, and compare all of them to skip peers that can't match
+	 * before comparing whole keys.
 	 */
-	return &table->hashtable[
-		siphash(pubkey, NOISE_PUBLIC_KEY_LEN, &table->key) &
-			(HASH_SIZE(table->hashtable) - 1)];
+	return siphash(pubkey, NOISE_PUBLIC_KEY_LEN, &table->key);
 }
 
-void wg_pubkey_hashtable_init(struct pubkey_hashtable *table)
+static struct wg_peer *
+pubkey_bucket_find(struct hashtable_buckets *buckets,
+		   const u8 pubkey[NOISE_PUBLIC_KEY_LEN], u64 fingerprint)
+{
+	struct wg_peer *peer;
+
+	hlist_for_each_entry_rcu_bh (peer, buckets_head(buckets, fingerprint),
+				     pubkey_hash) {
+		if (peer->pubkey_fingerprint == fingerprint &&
+		    !memcmp(pubkey, peer->handshake.remote_static,
+			    NOISE_PUBLIC_KEY_LEN))
+			return peer;
+	}
+	return NULL;
+}
+
+int wg_pubkey_hashtable_init(struct pubkey_hashtable *table)
 {
 	get_random_bytes(&table->key, sizeof(table->key));
-	hash_init(table->hashtable);
-	mutex_init(&table->lock);
+	return buckets_init(&table->buckets, pubkey_hash);
+}
+
+/* Must only be called once every peer has been removed. */
+void wg_pubkey_hashtable_free(struct pubkey_hashtable *table)
+{
+	buckets_free(&table->buckets);
 }
 
 void wg_pubkey_hashtable_add(struct pubkey_hashtable *table,
 			     struct wg_peer *peer)
 {
-	mutex_lock(&table->lock);
-	hlist_add_head_rcu(&peer->pubkey_hash,
-			   pubkey_bucket(table, peer->handshake.remote_static));
-	mutex_unlock(&table->lock);
+	spinlock_t *lock;
+
+	peer->pubkey_fingerprint = pubkey_fingerprint(table,
+					peer->handshake.remote_static);
+	lock = buckets_lock(&table->buckets, peer->pubkey_fingerprint);
+	spin_lock_bh(lock);
+	buckets_add(&table->buckets, &peer->pubkey_hash,
+		    peer->pubkey_fingerprint);
+	spin_unlock_bh(lock);
 }
 
 void wg_pubkey_hashtable_remove(struct pubkey_hashtable *table,
 				struct wg_peer *peer)
 {
-	mutex_lock(&table->lock);
-	hlist_del_init_rcu(&peer->pubkey_hash);
-	mutex_unlock(&table->lock);
+	spinlock_t *lock = buckets_lock(&table->buckets,
+					peer->pubkey_fingerprint);
+
+	spin_lock_bh(lock);
+	if (!hlist_unhashed(&peer->pubkey_hash))
+		buckets_del(&table->buckets, &peer->pubkey_hash);
+	spin_unlock_bh(lock);
 }
 
 /* Returns a strong reference to a peer */
@@ -48,36 +221,127 @@ struct wg_peer *
 wg_pubkey_hashtable_lookup(struct pubkey_hashtable *table,
 			   const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
 {
-	struct wg_peer *iter_peer, *peer = NULL;
+	struct resizable_buckets *rb = &table->buckets;
+	u64 fingerprint = pubkey_fingerprint(table, pubkey);
+	struct hashtable_buckets *old;
+	struct wg_peer *peer;
+	unsigned int seq;
 
 	rcu_read_lock_bh();
-	hlist_for_each_entry_rcu_bh (iter_peer, pubkey_bucket(table, pubkey),
-				     pubkey_hash) {
-		if (!memcmp(pubkey, iter_peer->handshake.remote_static,
-			    NOISE_PUBLIC_KEY_LEN)) {
-			peer = iter_peer;
-			break;
-		}
-	}
+	/* A peer moved by a resize might be missed by a walk that was underway,
+	 * so misses are retried if one moved anything in the meantime.
+	 */
+	do {
+		seq = read_seqcount_begin(&rb->resize_seq);
+		peer = pubkey_bucket_find(rcu_dereference_bh(rb->buckets),
+					  pubkey, fingerprint);
+		old = rcu_dereference_bh(rb->old_buckets);
+		if (!peer && old)
+			peer = pubkey_bucket_find(old, pubkey, fingerprint);
+	} while (!peer && read_seqcount_retry(&rb->resize_seq, seq));
 	peer = wg_peer_get_maybe_zero(peer);
 	rcu_read_unlock_bh();
 	return peer;
 }
 
-static struct hlist_head *index_bucket(struct index_hashtable *table,
-				       const __le32 index)
+static u32 index_hash(const struct hlist_node *node)
 {
 	/* Since the indices are random and thus all bits are uniformly
 	 * distributed, we can find its bucket simply by masking.
 	 */
-	return &table->hashtable[(__force u32)index &
-				 (HASH_SIZE(table->hashtable) - 1)];
+	return (__force u32)container_of(node, struct index_hashtable_entry,
+					 index_hash)->index;
+}
+
+static struct index_hashtable_entry *
+index_bucket_find(struct hashtable_buckets *buckets, const __le32 index)
+{
+	struct index_hashtable_entry *entry;
+
+	hlist_for_each_entry_rcu_bh (entry,
+				     buckets_head(buckets, (__force u32)index),
+				     index_hash) {
+		if (entry->index == index)
+			return entry;
+	}
+	return NULL;
 }
 
-void wg_index_hashtable_init(struct index_hashtable *table)
+/* Must hold rcu_read_lock_bh. An entry moved by a resize might be missed by a
+ * walk that was underway, so misses are retried if one moved anything in the
+ * meantime.
+ */
+static struct index_hashtable_entry *index_find(struct index_hashtable *table,
+						const __le32 index)
 {
-	hash_init(table->hashtable);
-	spin_lock_init(&table->lock);
+	struct resizable_buckets *rb = &table->buckets;
+	struct index_hashtable_entry *entry;
+	struct hashtable_buckets *old;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&rb->resize_seq);
+		entry = index_bucket_find(rcu_dereference_bh(rb->buckets),
+					  index);
+		old = rcu_dereference_bh(rb->old_buckets);
+		if (!entry && old)
+			entry = index_bucket_find(old, index);
+	} while (!entry && read_seqcount_retry(&rb->resize_seq, seq));
+	return entry;
+}
+
+static spinlock_t *index_lock(struct index_hashtable *table,
+			      const __le32 index)
+{
+	return buckets_lock(&table->buckets, (__force u32)index);
+}
+
+/* Takes the lock of the stripe that entry is in, which might change under us
+ * if it's being reinserted.
+ */
+static spinlock_t *index_lock_entry(struct index_hashtable *table,
+				    struct index_hashtable_entry *entry)
+{
+	spinlock_t *lock;
+
+	for (;;) {
+		lock = index_lock(table, READ_ONCE(entry->index));
+		spin_lock_bh(lock);
+		if (likely(lock == index_lock(table, entry->index)))
+			return lock;
+		spin_unlock_bh(lock);
+	}
+}
+
+/* Must hold the lock of index's stripe, so that events about the same index go
+ * out in the order it changed.
+ */
+static void index_notify(struct index_hashtable *table, const __le32 index,
+			 bool live)
+{
+	wg_genetlink_notify_index(container_of(table, struct wg_device,
+					       index_hashtable), index, live);
+}
+
+/* Must hold the lock of entry's stripe */
+static void index_unhash(struct index_hashtable *table,
+			 struct index_hashtable_entry *entry)
+{
+	if (hlist_unhashed(&entry->index_hash))
+		return;
+	buckets_del(&table->buckets, &entry->index_hash);
+	index_notify(table, entry->index, false);
+}
+
+int wg_index_hashtable_init(struct index_hashtable *table)
+{
+	return buckets_init(&table->buckets, index_hash);
+}
+
+/* Must only be called once every entry has been removed. */
+void wg_index_hashtable_free(struct index_hashtable *table)
+{
+	buckets_free(&table->buckets);
 }
 
 /* At the moment, we limit ourselves to 2^20 total peers, which generally might
@@ -98,53 +362,45 @@ void wg_index_hashtable_init(struct index_hashtable *table)
  * 3.9261394135792216e-10
  *
  * At the moment, we don't do any masking, so this algorithm isn't exactly
- * constant time in either the random guessing or in the hash list lookup. We
- * could require a minimum of 3 tries, which would successfully mask the
- * guessing. this would not, however, help with the growing hash lengths, which
- * is another thing to consider moving forward.
+ * constant time in the random guessing. We could require a minimum of 3
+ * tries, which would successfully mask the guessing. The buckets, on the
+ * other hand, stay short however many entries there are, since the table
+ * grows with them.
  */
 
 __le32 wg_index_hashtable_insert(struct index_hashtable *table,
 				 struct index_hashtable_entry *entry)
 {
-	struct index_hashtable_entry *existing_entry;
+	spinlock_t *lock;
 
-	spin_lock_bh(&table->lock);
-	hlist_del_init_rcu(&entry->index_hash);
-	spin_unlock_bh(&table->lock);
+	wg_index_hashtable_remove(table, entry);
 
 	rcu_read_lock_bh();
 
 search_unused_slot:
 	/* First we try to find an unused slot, randomly, while unlocked. */
-	entry->index = (__force __le32)get_random_u32();
-	hlist_for_each_entry_rcu_bh (existing_entry,
-				     index_bucket(table, entry->index),
-				     index_hash) {
-		if (existing_entry->index == entry->index)
-			/* If it's already in use, we continue searching. */
-			goto search_unused_slot;
-	}
+	WRITE_ONCE(entry->index, (__force __le32)get_random_u32());
+	if (index_find(table, entry->index))
+		/* If it's already in use, we continue searching. */
+		goto search_unused_slot;
 
-	/* Once we've found an unused slot, we lock it, and then double-check
-	 * that nobody else stole it from us.
+	/* Once we've found an unused slot, we lock its stripe, and then
+	 * double-check that nobody else stole it from us.
 	 */
-	spin_lock_bh(&table->lock);
-	hlist_for_each_entry_rcu_bh (existing_entry,
-				     index_bucket(table, entry->index),
-				     index_hash) {
-		if (existing_entry->index == entry->index) {
-			spin_unlock_bh(&table->lock);
-			/* If it was stolen, we start over. */
-			goto search_unused_slot;
-		}
+	lock = index_lock(table, entry->index);
+	spin_lock_bh(lock);
+	if (index_find(table, entry->index)) {
+		spin_unlock_bh(lock);
+		/* If it was stolen, we start over. */
+		goto search_unused_slot;
 	}
 	/* Otherwise, we know we have it exclusively (since we're locked),
 	 * so we insert.
 	 */
-	hlist_add_head_rcu(&entry->index_hash,
-			   index_bucket(table, entry->index));
-	spin_unlock_bh(&table->lock);
+	buckets_add(&table->buckets, &entry->index_hash,
+		    (__force u32)entry->index);
+	index_notify(table, entry->index, true);
+	spin_unlock_bh(lock);
 
 	rcu_read_unlock_bh();
 
@@ -155,9 +411,15 @@ bool wg_index_hashtable_replace(struct index_hashtable *table,
 				struct index_hashtable_entry *old,
 				struct index_hashtable_entry *new)
 {
+	spinlock_t *lock;
+
 	if (unlikely(hlist_unhashed(&old->index_hash)))
 		return false;
-	spin_lock_bh(&table->lock);
+	lock = index_lock_entry(table, old);
+	if (unlikely(hlist_unhashed(&old->index_hash))) {
+		spin_unlock_bh(lock);
+		return false;
+	}
 	new->index = old->index;
 	hlist_replace_rcu(&old->index_hash, &new->index_hash);
 
@@ -168,16 +430,17 @@ bool wg_index_hashtable_replace(struct index_hashtable *table,
 	 * simply gets dropped, which isn't terrible.
 	 */
 	INIT_HLIST_NODE(&old->index_hash);
-	spin_unlock_bh(&table->lock);
+	spin_unlock_bh(lock);
 	return true;
 }
 
 void wg_index_hashtable_remove(struct index_hashtable *table,
 			       struct index_hashtable_entry *entry)
 {
-	spin_lock_bh(&table->lock);
-	hlist_del_init_rcu(&entry->index_hash);
-	spin_unlock_bh(&table->lock);
+	spinlock_t *lock = index_lock_entry(table, entry);
+
+	index_unhash(table, entry);
+	spin_unlock_bh(lock);
 }
 
 /* Returns a strong reference to a entry->peer */
@@ -186,17 +449,12 @@ wg_index_hashtable_lookup(struct index_hashtable *table,
 			  const enum index_hashtable_type type_mask,
 			  const __le32 index, struct wg_peer **peer)
 {
-	struct index_hashtable_entry *iter_entry, *entry = NULL;
+	struct index_hashtable_entry *entry;
 
 	rcu_read_lock_bh();
-	hlist_for_each_entry_rcu_bh (iter_entry, index_bucket(table, index),
-				     index_hash) {
-		if (iter_entry->index == index) {
-			if (likely(iter_entry->type & type_mask))
-				entry = iter_entry;
-			break;
-		}
-	}
+	entry = index_find(table, index);
+	if (entry && unlikely(!(entry->type & type_mask)))
+		entry = NULL;
 	if (likely(entry)) {
 		entry->peer = wg_peer_get_maybe_zero(entry->peer);
 		if (likely(entry->peer))
@@ -207,3 +465,152 @@ wg_index_hashtable_lookup(struct index_hashtable *table,
 	rcu_read_unlock_bh();
 	return entry;
 }
+
+/* Returns whether index is live, without taking any references or locks, so
+ * that the receive path can shed packets for indices that aren't ours.
+ */
+bool wg_index_hashtable_contains(struct index_hashtable *table,
+				 const __le32 index)
+{
+	bool ret;
+
+	rcu_read_lock_bh();
+	ret = index_find(table, index);
+	rcu_read_unlock_bh();
+	return ret;
+}
+
+static int index_bucket_walk_slice(struct hashtable_buckets *buckets,
+				   unsigned int slice,
+				   int (*cb)(void *ctx, const __le32 index),
+				   void *ctx)
+{
+	struct index_hashtable_entry *entry;
+	unsigned int i;
+	int ret;
+
+	/* Smaller tables share a bucket between slices, while larger ones
+	 * spread a slice over several buckets.
+	 */
+	for (i = slice & buckets->mask; i <= buckets->mask;
+	     i += 1U << HASHTABLE_SLICE_BITS) {
+		hlist_for_each_entry_rcu_bh (entry, &buckets->heads[i],
+					     index_hash) {
+			if (((__force u32)entry->index &
+			     ((1U << HASHTABLE_SLICE_BITS) - 1)) != slice)
+				continue;
+			ret = cb(ctx, entry->index);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/* Calls cb on each live index whose bottom HASHTABLE_SLICE_BITS are slice.
+ * Holding the slice's stripe keeps both inserts and resizes out of it, so
+ * walking every slice in turn sees each index that is live throughout exactly
+ * once.
+ */
+int wg_index_hashtable_walk_slice(struct index_hashtable *table,
+				  unsigned int slice,
+				  int (*cb)(void *ctx, const __le32 index),
+				  void *ctx)
+{
+	struct resizable_buckets *rb = &table->buckets;
+	struct hashtable_buckets *buckets, *old;
+	spinlock_t *lock = buckets_lock(rb, slice);
+	unsigned int seq;
+	int ret;
+
+	rcu_read_lock_bh();
+	spin_lock_bh(lock);
+	do {
+		seq = read_seqcount_begin(&rb->resize_seq);
+		buckets = rcu_dereference_bh(rb->buckets);
+		old = rcu_dereference_bh(rb->old_buckets);
+	} while (read_seqcount_retry(&rb->resize_seq, seq));
+	ret = index_bucket_walk_slice(buckets, slice, cb, ctx);
+	if (!ret && old)
+		ret = index_bucket_walk_slice(old, slice, cb, ctx);
+	spin_unlock_bh(lock);
+	rcu_read_unlock_bh();
+	return ret;
+}
+
+void wg_known_endpoints_init(struct known_endpoints *set)
+{
+	get_random_bytes(&set->key, sizeof(set->key));
+	memset(set->tags, 0, sizeof(set->tags));
+}
+
+/* The top bits pick the slot and the bottom ones are the tag, with zero kept
+ * for empty slots.
+ */
+static u32 *known_endpoint_slot(struct known_endpoints *set, const void *addr,
+				size_t len, u32 *tag)
+{
+	u64 hash = siphash(addr, len, &set->key);
+
+	*tag = (u32)hash | 1;
+	return &set->tags[hash >> (64 - KNOWN_ENDPOINTS_BITS)];
+}
+
+static const void *skb_source_addr(const struct sk_buff *skb, size_t *len)
+{
+	if (skb->protocol == htons(ETH_P_IP)) {
+		*len = sizeof(struct in_addr);
+		return &ip_hdr(skb)->saddr;
+	} else if (skb->protocol == htons(ETH_P_IPV6)) {
+		*len = sizeof(struct in6_addr);
+		return &ipv6_hdr(skb)->saddr;
+	}
+	return NULL;
+}
+
+void wg_known_endpoints_add(struct known_endpoints *set,
+			    const struct sockaddr *addr)
+{
+	u32 *slot, tag;
+
+	if (addr->sa_family == AF_INET)
+		slot = known_endpoint_slot(set,
+			&((const struct sockaddr_in *)addr)->sin_addr,
+			sizeof(struct in_addr), &tag);
+	else if (addr->sa_family == AF_INET6)
+		slot = known_endpoint_slot(set,
+			&((const struct sockaddr_in6 *)addr)->sin6_addr,
+			sizeof(struct in6_addr), &tag);
+	else
+		return;
+	WRITE_ONCE(*slot, tag);
+}
+
+void wg_known_endpoints_add_skb(struct known_endpoints *set,
+				const struct sk_buff *skb)
+{
+	const void *addr;
+	u32 *slot, tag;
+	size_t len;
+
+	addr = skb_source_addr(skb, &len);
+	if (unlikely(!addr))
+		return;
+	slot = known_endpoint_slot(set, addr, len, &tag);
+	if (READ_ONCE(*slot) != tag)
+		WRITE_ONCE(*slot, tag);
+}
+
+bool wg_known_endpoints_contains(struct known_endpoints *set,
+				 const struct sk_buff *skb)
+{
+	const void *addr;
+	u32 *slot, tag;
+	size_t len;
+
+	addr = skb_source_addr(skb, &len);
+	if (unlikely(!addr))
+		return false;
+	slot = known_endpoint_slot(set, addr, len, &tag);
+	return READ_ONCE(*slot) == tag;
+}
@@ -8,20 +8,54 @@
 
 #include "messages.h"
 
-#include <linux/hashtable.h>
-#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/seqlock.h>
 #include <linux/siphash.h>
+#include <linux/workqueue.h>
 
 struct wg_peer;
+struct sockaddr;
+struct sk_buff;
+
+enum {
+	HASHTABLE_LOCK_BITS = 8,
+	HASHTABLE_MIN_BITS = HASHTABLE_LOCK_BITS,
+	HASHTABLE_MAX_BITS = 22,
+	/* Indices are walked in slices of those sharing their bottom bits,
+	 * which is also enough bits to pick a lock stripe.
+	 */
+	HASHTABLE_SLICE_BITS = 16
+};
+
+struct hashtable_buckets;
+
+/* Buckets that grow and shrink with the number of entries, so that they stay
+ * short. Writers lock the stripe of buckets that an entry's hash falls in
+ * rather than the whole table. Since both come from the bottom bits of the
+ * hash, a stripe covers the same hashes whatever the size of the table, which
+ * lets a resize move entries over one stripe at a time while writers carry on
+ * elsewhere.
+ */
+struct resizable_buckets {
+	struct hashtable_buckets __rcu *buckets;
+	/* While resizing, the buckets that entries are still being moved out
+	 * of, which lookups check too.
+	 */
+	struct hashtable_buckets __rcu *old_buckets;
+	seqcount_t resize_seq;
+	atomic_t count;
+	struct work_struct resize_work;
+	u32 (*hash)(const struct hlist_node *node);
+	spinlock_t locks[1 << HASHTABLE_LOCK_BITS];
+};
 
 struct pubkey_hashtable {
-	/* TODO: move to rhashtable */
-	DECLARE_HASHTABLE(hashtable, 11);
+	struct resizable_buckets buckets;
 	siphash_key_t key;
-	struct mutex lock;
 };
 
-void wg_pubkey_hashtable_init(struct pubkey_hashtable *table);
+int wg_pubkey_hashtable_init(struct pubkey_hashtable *table);
+void wg_pubkey_hashtable_free(struct pubkey_hashtable *table);
 void wg_pubkey_hashtable_add(struct pubkey_hashtable *table,
 			     struct wg_peer *peer);
 void wg_pubkey_hashtable_remove(struct pubkey_hashtable *table,
@@ -31,9 +65,7 @@ wg_pubkey_hashtable_lookup(struct pubkey_hashtable *table,
 			   const u8 pubkey[NOISE_PUBLIC_KEY_LEN]);
 
 struct index_hashtable {
-	/* TODO: move to rhashtable */
-	DECLARE_HASHTABLE(hashtable, 13);
-	spinlock_t lock;
+	struct resizable_buckets buckets;
 };
 
 enum index_hashtable_type {
@@ -48,7 +80,8 @@ struct index_hashtable_entry {
 	__le32 index;
 };
 
-void wg_index_hashtable_init(struct index_hashtable *table);
+int wg_index_hashtable_init(struct index_hashtable *table);
+void wg_index_hashtable_free(struct index_hashtable *table);
 __le32 wg_index_hashtable_insert(struct index_hashtable *table,
 				 struct index_hashtable_entry *entry);
 bool wg_index_hashtable_replace(struct index_hashtable *table,
@@ -60,5 +93,31 @@ struct index_hashtable_entry *
 wg_index_hashtable_lookup(struct index_hashtable *table,
 			  const enum index_hashtable_type type_mask,
 			  const __le32 index, struct wg_peer **peer);
+bool wg_index_hashtable_contains(struct index_hashtable *table,
+				 const __le32 index);
+int wg_index_hashtable_walk_slice(struct index_hashtable *table,
+				  unsigned int slice,
+				  int (*cb)(void *ctx, const __le32 index),
+				  void *ctx);
+
+enum { KNOWN_ENDPOINTS_BITS = 12 };
+
+/* A lossy set of the source addresses that peers have recently completed
+ * handshakes from, so that their handshakes can be queued ahead of everyone
+ * else's when under attack. Each slot holds a tag of the address hashed to it,
+ * and is simply overwritten by the next address that lands there.
+ */
+struct known_endpoints {
+	u32 tags[1 << KNOWN_ENDPOINTS_BITS];
+	siphash_key_t key;
+};
+
+void wg_known_endpoints_init(struct known_endpoints *set);
+void wg_known_endpoints_add(struct known_endpoints *set,
+			    const struct sockaddr *addr);
+void wg_known_endpoints_add_skb(struct known_endpoints *set,
+				const struct sk_buff *skb);
+bool wg_known_endpoints_contains(struct known_endpoints *set,
+				 const struct sk_buff *skb);
 
 #endif /* _WG_HASHTABLES_H */
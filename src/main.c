@@ -27,12 +27,20 @@ static int __init mod_init(void)
 	    (ret = curve25519_mod_init()))
 		return ret;
 
+	ret = wg_allowedips_slab_init();
+	if (ret < 0)
+		goto err_allowedips;
+
+	ret = wg_noise_init();
+	if (ret < 0)
+		goto err_noise;
+
 #ifdef DEBUG
+	ret = -ENOTRECOVERABLE;
 	if (!wg_allowedips_selftest() || !wg_packet_counter_selftest() ||
 	    !wg_ratelimiter_selftest())
-		return -ENOTRECOVERABLE;
+		goto err_device;
 #endif
-	wg_noise_init();
 
 	ret = wg_device_init();
 	if (ret < 0)
@@ -50,6 +58,10 @@ static int __init mod_init(void)
 err_netlink:
 	wg_device_uninit();
 err_device:
+	wg_noise_uninit();
+err_noise:
+	wg_allowedips_slab_uninit();
+err_allowedips:
 	return ret;
 }
 
@@ -57,6 +69,8 @@ static void __exit mod_exit(void)
 {
 	wg_genetlink_uninit();
 	wg_device_uninit();
+	wg_noise_uninit();
+	wg_allowedips_slab_uninit();
 	pr_debug("WireGuard unloaded\n");
 }
 
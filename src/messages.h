@@ -43,12 +43,18 @@ enum limits {
 	REKEY_TIMEOUT = 5,
 	REKEY_TIMEOUT_JITTER_MAX_JIFFIES = HZ / 3,
 	REKEY_AFTER_TIME = 120,
+	REKEY_AFTER_TIME_JITTER_MAX = REKEY_AFTER_TIME / 4,
+	MIN_EARLY_REKEYS_PER_SECOND = 16,
 	REJECT_AFTER_TIME = 180,
 	INITIATIONS_PER_SECOND = 50,
 	MAX_PEERS_PER_DEVICE = 1U << 20,
 	KEEPALIVE_TIMEOUT = 10,
 	MAX_TIMER_HANDSHAKES = 90 / REKEY_TIMEOUT,
 	MAX_QUEUED_INCOMING_HANDSHAKES = 4096, /* TODO: replace this with DQL */
+	MAX_QUEUED_UNKNOWN_HANDSHAKES = MAX_QUEUED_INCOMING_HANDSHAKES / 4 * 3,
+	MAX_HANDSHAKE_BATCH = 8,
+	HANDSHAKE_LOAD_HIGH_RATE = 1024,
+	HANDSHAKE_LOAD_LOW_RATE = HANDSHAKE_LOAD_HIGH_RATE / 4,
 	MAX_STAGED_PACKETS = 128,
 	MAX_QUEUED_PACKETS = 1024 /* TODO: replace this with DQL */
 };
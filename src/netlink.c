@@ -16,6 +16,17 @@
 
 static struct genl_family genl_family;
 
+enum { WG_MULTICAST_INDICES };
+
+#ifndef COMPAT_CANNOT_USE_CONST_GENL_OPS
+static const
+#else
+static
+#endif
+struct genl_multicast_group genl_mcgrps[] = {
+	[WG_MULTICAST_INDICES] = { .name = WG_MULTICAST_GROUP_INDICES }
+};
+
 static const struct nla_policy device_policy[WGDEVICE_A_MAX + 1] = {
 	[WGDEVICE_A_IFINDEX]		= { .type = NLA_U32 },
 	[WGDEVICE_A_IFNAME]		= { .type = NLA_NUL_STRING, .len = IFNAMSIZ - 1 },
@@ -24,7 +35,15 @@ static const struct nla_policy device_policy[WGDEVICE_A_MAX + 1] = {
 	[WGDEVICE_A_FLAGS]		= { .type = NLA_U32 },
 	[WGDEVICE_A_LISTEN_PORT]	= { .type = NLA_U16 },
 	[WGDEVICE_A_FWMARK]		= { .type = NLA_U32 },
-	[WGDEVICE_A_PEERS]		= { .type = NLA_NESTED }
+	[WGDEVICE_A_PEERS]		= { .type = NLA_NESTED },
+	[WGDEVICE_A_DROPPED_INVALID_TYPE]	= { .type = NLA_U64 },
+	[WGDEVICE_A_DROPPED_INVALID_LENGTH]	= { .type = NLA_U64 },
+	[WGDEVICE_A_DROPPED_UNKNOWN_INDEX]	= { .type = NLA_U64 },
+	[WGDEVICE_A_HANDSHAKE_RATE]		= { .type = NLA_U32 },
+	[WGDEVICE_A_HANDSHAKE_UNDER_LOAD]	= { .type = NLA_FLAG },
+	[WGDEVICE_A_ALLOWEDIPS_MEMORY]		= { .type = NLA_U64 },
+	[WGDEVICE_A_INDICES]			= { .type = NLA_NESTED },
+	[WGDEVICE_A_INDEX]			= { .type = NLA_U32 }
 };
 
 static const struct nla_policy peer_policy[WGPEER_A_MAX + 1] = {
@@ -37,7 +56,9 @@ static const struct nla_policy peer_policy[WGPEER_A_MAX + 1] = {
 	[WGPEER_A_RX_BYTES]				= { .type = NLA_U64 },
 	[WGPEER_A_TX_BYTES]				= { .type = NLA_U64 },
 	[WGPEER_A_ALLOWEDIPS]				= { .type = NLA_NESTED },
-	[WGPEER_A_PROTOCOL_VERSION]			= { .type = NLA_U32 }
+	[WGPEER_A_PROTOCOL_VERSION]			= { .type = NLA_U32 },
+	[WGPEER_A_RX_PACKETS]				= { .type = NLA_U64 },
+	[WGPEER_A_TX_PACKETS]				= { .type = NLA_U64 }
 };
 
 static const struct nla_policy allowedip_policy[WGALLOWEDIP_A_MAX + 1] = {
@@ -107,6 +128,9 @@ static int get_peer(struct wg_peer *peer, struct allowedips_cursor *rt_cursor,
 		goto err;
 
 	if (!rt_cursor->seq) {
+		struct wg_peer_stats stats;
+
+		wg_peer_get_stats(peer, &stats);
 		down_read(&peer->handshake.lock);
 		fail = nla_put(skb, WGPEER_A_PRESHARED_KEY,
 			       NOISE_SYMMETRIC_KEY_LEN,
@@ -120,10 +144,14 @@ static int get_peer(struct wg_peer *peer, struct allowedips_cursor *rt_cursor,
 			    &peer->walltime_last_handshake) ||
 		    nla_put_u16(skb, WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL,
 				peer->persistent_keepalive_interval) ||
-		    nla_put_u64_64bit(skb, WGPEER_A_TX_BYTES, peer->tx_bytes,
+		    nla_put_u64_64bit(skb, WGPEER_A_TX_BYTES, stats.tx_bytes,
 				      WGPEER_A_UNSPEC) ||
-		    nla_put_u64_64bit(skb, WGPEER_A_RX_BYTES, peer->rx_bytes,
+		    nla_put_u64_64bit(skb, WGPEER_A_RX_BYTES, stats.rx_bytes,
 				      WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_TX_PACKETS,
+				      stats.tx_packets, WGPEER_A_UNSPEC) ||
+		    nla_put_u64_64bit(skb, WGPEER_A_RX_PACKETS,
+				      stats.rx_packets, WGPEER_A_UNSPEC) ||
 		    nla_put_u32(skb, WGPEER_A_PROTOCOL_VERSION, 1))
 			goto err;
 
@@ -184,6 +212,48 @@ static int wg_get_device_start(struct netlink_callback *cb)
 	return 0;
 }
 
+static int get_early_drops(struct wg_device *wg, struct sk_buff *skb)
+{
+	struct rx_early_drops sum = { 0 };
+	unsigned int start;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct rx_early_drops *drops =
+			per_cpu_ptr(wg->rx_early_drops, cpu);
+		u64 invalid_type, invalid_length, unknown_index;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&drops->syncp);
+			invalid_type = drops->invalid_type;
+			invalid_length = drops->invalid_length;
+			unknown_index = drops->unknown_index;
+		} while (u64_stats_fetch_retry_irq(&drops->syncp, start));
+		sum.invalid_type += invalid_type;
+		sum.invalid_length += invalid_length;
+		sum.unknown_index += unknown_index;
+	}
+	if (nla_put_u64_64bit(skb, WGDEVICE_A_DROPPED_INVALID_TYPE,
+			      sum.invalid_type, WGDEVICE_A_UNSPEC) ||
+	    nla_put_u64_64bit(skb, WGDEVICE_A_DROPPED_INVALID_LENGTH,
+			      sum.invalid_length, WGDEVICE_A_UNSPEC) ||
+	    nla_put_u64_64bit(skb, WGDEVICE_A_DROPPED_UNKNOWN_INDEX,
+			      sum.unknown_index, WGDEVICE_A_UNSPEC))
+		return -EMSGSIZE;
+	return 0;
+}
+
+static int get_handshake_load(struct wg_device *wg, struct sk_buff *skb)
+{
+	unsigned int rate;
+	bool under_load = wg_packet_handshake_load(wg, &rate);
+
+	if (nla_put_u32(skb, WGDEVICE_A_HANDSHAKE_RATE, rate) ||
+	    (under_load && nla_put_flag(skb, WGDEVICE_A_HANDSHAKE_UNDER_LOAD)))
+		return -EMSGSIZE;
+	return 0;
+}
+
 static int wg_get_device_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
 	struct wg_peer *peer, *next_peer_cursor, *last_peer_cursor;
@@ -214,7 +284,12 @@ static int wg_get_device_dump(struct sk_buff *skb, struct netlink_callback *cb)
 				wg->incoming_port) ||
 		    nla_put_u32(skb, WGDEVICE_A_FWMARK, wg->fwmark) ||
 		    nla_put_u32(skb, WGDEVICE_A_IFINDEX, wg->dev->ifindex) ||
-		    nla_put_string(skb, WGDEVICE_A_IFNAME, wg->dev->name))
+		    nla_put_string(skb, WGDEVICE_A_IFNAME, wg->dev->name) ||
+		    get_early_drops(wg, skb) || get_handshake_load(wg, skb) ||
+		    nla_put_u64_64bit(skb, WGDEVICE_A_ALLOWEDIPS_MEMORY,
+				      wg_allowedips_memory(&wg->peer_allowedips,
+						&wg->device_update_lock),
+				      WGDEVICE_A_UNSPEC))
 			goto out;
 
 		down_read(&wg->static_identity.lock);
@@ -311,32 +386,64 @@ static int set_port(struct wg_device *wg, u16 port)
 	return wg_socket_init(wg, port);
 }
 
-static int set_allowedip(struct wg_peer *peer, struct nlattr **attrs)
+static int get_allowedip_prefix(struct allowedips_prefix *prefix,
+				struct wg_peer *peer, struct nlattr **attrs)
 {
-	int ret = -EINVAL;
-	u16 family;
-	u8 cidr;
-
 	if (!attrs[WGALLOWEDIP_A_FAMILY] || !attrs[WGALLOWEDIP_A_IPADDR] ||
 	    !attrs[WGALLOWEDIP_A_CIDR_MASK])
-		return ret;
-	family = nla_get_u16(attrs[WGALLOWEDIP_A_FAMILY]);
-	cidr = nla_get_u8(attrs[WGALLOWEDIP_A_CIDR_MASK]);
+		return -EINVAL;
+	prefix->family = nla_get_u16(attrs[WGALLOWEDIP_A_FAMILY]);
+	prefix->cidr = nla_get_u8(attrs[WGALLOWEDIP_A_CIDR_MASK]);
+	prefix->peer = peer;
 
-	if (family == AF_INET && cidr <= 32 &&
+	if (prefix->family == AF_INET && prefix->cidr <= 32 &&
 	    nla_len(attrs[WGALLOWEDIP_A_IPADDR]) == sizeof(struct in_addr))
-		ret = wg_allowedips_insert_v4(
-			&peer->device->peer_allowedips,
-			nla_data(attrs[WGALLOWEDIP_A_IPADDR]), cidr, peer,
-			&peer->device->device_update_lock);
-	else if (family == AF_INET6 && cidr <= 128 &&
-		 nla_len(attrs[WGALLOWEDIP_A_IPADDR]) == sizeof(struct in6_addr))
-		ret = wg_allowedips_insert_v6(
-			&peer->device->peer_allowedips,
-			nla_data(attrs[WGALLOWEDIP_A_IPADDR]), cidr, peer,
-			&peer->device->device_update_lock);
+		memcpy(&prefix->ip4, nla_data(attrs[WGALLOWEDIP_A_IPADDR]),
+		       sizeof(struct in_addr));
+	else if (prefix->family == AF_INET6 && prefix->cidr <= 128 &&
+		 nla_len(attrs[WGALLOWEDIP_A_IPADDR]) ==
+			 sizeof(struct in6_addr))
+		memcpy(&prefix->ip6, nla_data(attrs[WGALLOWEDIP_A_IPADDR]),
+		       sizeof(struct in6_addr));
+	else
+		return -EINVAL;
+	return 0;
+}
 
-	return ret;
+static int set_allowedips(struct wg_peer *peer, struct nlattr *allowedips)
+{
+	struct nlattr *attr, *allowedip[WGALLOWEDIP_A_MAX + 1];
+	struct allowedips_prefix *prefixes;
+	size_t len = 0;
+	int ret = 0, err, rem;
+
+	nla_for_each_nested (attr, allowedips, rem)
+		++len;
+	if (!len)
+		return 0;
+	prefixes = kvmalloc(len * sizeof(*prefixes), GFP_KERNEL);
+	if (!prefixes)
+		return -ENOMEM;
+
+	len = 0;
+	nla_for_each_nested (attr, allowedips, rem) {
+		ret = nla_parse_nested(allowedip, WGALLOWEDIP_A_MAX, attr,
+				       allowedip_policy, NULL);
+		if (ret < 0)
+			break;
+		ret = get_allowedip_prefix(&prefixes[len], peer, allowedip);
+		if (ret < 0)
+			break;
+		++len;
+	}
+	/* As when they were inserted one at a time, the ones before a bad one
+	 * still make it in.
+	 */
+	err = wg_allowedips_insert_bulk(&peer->device->peer_allowedips,
+					prefixes, len,
+					&peer->device->device_update_lock);
+	kvfree(prefixes);
+	return ret < 0 ? ret : err;
 }
 
 static int set_peer(struct wg_device *wg, struct nlattr **attrs)
@@ -422,6 +529,8 @@ static int set_peer(struct wg_device *wg, struct nlattr **attrs)
 
 			memcpy(&endpoint.addr, addr, len);
 			wg_socket_set_peer_endpoint(peer, &endpoint);
+			wg_known_endpoints_add(&wg->known_endpoints,
+					       &endpoint.addr);
 		}
 	}
 
@@ -430,18 +539,9 @@ static int set_peer(struct wg_device *wg, struct nlattr **attrs)
 					     &wg->device_update_lock);
 
 	if (attrs[WGPEER_A_ALLOWEDIPS]) {
-		struct nlattr *attr, *allowedip[WGALLOWEDIP_A_MAX + 1];
-		int rem;
-
-		nla_for_each_nested (attr, attrs[WGPEER_A_ALLOWEDIPS], rem) {
-			ret = nla_parse_nested(allowedip, WGALLOWEDIP_A_MAX,
-					       attr, allowedip_policy, NULL);
-			if (ret < 0)
-				goto out;
-			ret = set_allowedip(peer, allowedip);
-			if (ret < 0)
-				goto out;
-		}
+		ret = set_allowedips(peer, attrs[WGPEER_A_ALLOWEDIPS]);
+		if (ret < 0)
+			goto out;
 	}
 
 	if (attrs[WGPEER_A_PERSISTENT_KEEPALIVE_INTERVAL]) {
@@ -471,6 +571,7 @@ out:
 static int wg_set_device(struct sk_buff *skb, struct genl_info *info)
 {
 	struct wg_device *wg = lookup_interface(info->attrs, skb);
+	u64 allowedips_seq;
 	int ret;
 
 	if (IS_ERR(wg)) {
@@ -481,6 +582,7 @@ static int wg_set_device(struct sk_buff *skb, struct genl_info *info)
 	rtnl_lock();
 	mutex_lock(&wg->device_update_lock);
 	++wg->device_update_gen;
+	allowedips_seq = wg->peer_allowedips.seq;
 
 	if (info->attrs[WGDEVICE_A_FWMARK]) {
 		struct wg_peer *peer;
@@ -550,6 +652,13 @@ static int wg_set_device(struct sk_buff *skb, struct genl_info *info)
 	ret = 0;
 
 out:
+	/* Until the allowedips snapshot is compiled again, lookups fall back to
+	 * the trie, so we wait for a burst of updates to settle down first.
+	 */
+	if (wg->peer_allowedips.seq != allowedips_seq &&
+	    wg_allowedips_needs_compile(&wg->peer_allowedips))
+		mod_delayed_work(system_power_efficient_wq,
+				 &wg->allowedips_work, HZ / 10);
 	mutex_unlock(&wg->device_update_lock);
 	rtnl_unlock();
 	dev_put(wg->dev);
@@ -560,6 +669,104 @@ out_nodev:
 	return ret;
 }
 
+static int get_index(void *ctx, const __le32 index)
+{
+	return nla_put_u32(ctx, 0, (__force u32)index) ? -EMSGSIZE : 0;
+}
+
+static int wg_get_indices_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct wg_device *wg = (struct wg_device *)cb->args[0];
+	unsigned int slice = cb->args[1], first_slice = slice;
+	struct nlattr *indices_nest;
+	unsigned char *mark;
+	void *hdr;
+	int ret;
+
+	if (!wg) {
+		struct nlattr *attrs[WGDEVICE_A_MAX + 1];
+
+		ret = nlmsg_parse(cb->nlh, GENL_HDRLEN + genl_family.hdrsize,
+				  attrs, WGDEVICE_A_MAX, device_policy, NULL);
+		if (ret < 0)
+			return ret;
+		wg = lookup_interface(attrs, cb->skb);
+		if (IS_ERR(wg))
+			return PTR_ERR(wg);
+		cb->args[0] = (long)wg;
+	}
+	if (slice >= 1U << HASHTABLE_SLICE_BITS)
+		return 0;
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			  &genl_family, NLM_F_MULTI, WG_CMD_GET_INDICES);
+	if (!hdr)
+		return -EMSGSIZE;
+	if (nla_put_u32(skb, WGDEVICE_A_IFINDEX, wg->dev->ifindex))
+		goto err;
+	indices_nest = nla_nest_start(skb, WGDEVICE_A_INDICES);
+	if (!indices_nest)
+		goto err;
+	/* A slice is only ever sent whole, so that a dump that picks up where
+	 * the last message left off doesn't skip or repeat anything.
+	 */
+	for (; slice < 1U << HASHTABLE_SLICE_BITS; ++slice) {
+		mark = skb_tail_pointer(skb);
+		if (wg_index_hashtable_walk_slice(&wg->index_hashtable, slice,
+						  get_index, skb)) {
+			nlmsg_trim(skb, mark);
+			if (slice == first_slice)
+				goto err;
+			break;
+		}
+	}
+	nla_nest_end(skb, indices_nest);
+	genlmsg_end(skb, hdr);
+	cb->args[1] = slice;
+	return skb->len;
+
+err:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+static int wg_get_indices_done(struct netlink_callback *cb)
+{
+	struct wg_device *wg = (struct wg_device *)cb->args[0];
+
+	if (wg)
+		dev_put(wg->dev);
+	return 0;
+}
+
+/* Called with the lock of index's stripe held, from any context. The indices
+ * are already on the wire in the clear, so anyone in the namespace may listen.
+ */
+void wg_genetlink_notify_index(struct wg_device *wg, const __le32 index,
+			       bool live)
+{
+	struct net *net = dev_net(wg->dev);
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!genl_has_listeners(&genl_family, net, WG_MULTICAST_INDICES))
+		return;
+	skb = genlmsg_new(2 * nla_total_size(sizeof(u32)), GFP_ATOMIC);
+	if (unlikely(!skb))
+		return;
+	hdr = genlmsg_put(skb, 0, 0, &genl_family, 0,
+			  live ? WG_CMD_NEW_INDEX : WG_CMD_DEL_INDEX);
+	if (!hdr ||
+	    nla_put_u32(skb, WGDEVICE_A_IFINDEX, wg->dev->ifindex) ||
+	    nla_put_u32(skb, WGDEVICE_A_INDEX, (__force u32)index)) {
+		kfree_skb(skb);
+		return;
+	}
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast_netns(&genl_family, net, skb, 0,
+				WG_MULTICAST_INDICES, GFP_ATOMIC);
+}
+
 #ifndef COMPAT_CANNOT_USE_CONST_GENL_OPS
 static const
 #else
@@ -580,6 +787,12 @@ struct genl_ops genl_ops[] = {
 		.doit = wg_set_device,
 		.policy = device_policy,
 		.flags = GENL_UNS_ADMIN_PERM
+	}, {
+		.cmd = WG_CMD_GET_INDICES,
+		.dumpit = wg_get_indices_dump,
+		.done = wg_get_indices_done,
+		.policy = device_policy,
+		.flags = GENL_UNS_ADMIN_PERM
 	}
 };
 
@@ -588,6 +801,8 @@ static struct genl_family genl_family
 __ro_after_init = {
 	.ops = genl_ops,
 	.n_ops = ARRAY_SIZE(genl_ops),
+	.mcgrps = genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(genl_mcgrps),
 #else
 = {
 #endif
@@ -6,6 +6,12 @@
 #ifndef _WG_NETLINK_H
 #define _WG_NETLINK_H
 
+#include <linux/types.h>
+
+struct wg_device;
+
+void wg_genetlink_notify_index(struct wg_device *wg, const __le32 index,
+			       bool live);
 int wg_genetlink_init(void);
 void wg_genetlink_uninit(void);
 
@@ -9,6 +9,7 @@
 #include "messages.h"
 #include "queueing.h"
 #include "hashtables.h"
+#include "timers.h"
 
 #include <linux/rcupdate.h>
 #include <linux/slab.h>
@@ -29,18 +30,36 @@ static const u8 handshake_name[37] = "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s";
 static const u8 identifier_name[34] = "WireGuard v1 zx2c4 Jason@zx2c4.com";
 static u8 handshake_init_hash[NOISE_HASH_LEN] __ro_after_init;
 static u8 handshake_init_chaining_key[NOISE_HASH_LEN] __ro_after_init;
+static struct blake2s_hmac_key handshake_init_chaining_hkey __ro_after_init;
 static atomic64_t keypair_counter = ATOMIC64_INIT(0);
 
-void __init wg_noise_init(void)
+static struct kmem_cache *keypair_cache __read_mostly;
+
+int __init wg_noise_init(void)
 {
 	struct blake2s_state blake;
 
+	keypair_cache = kmem_cache_create("wg_noise_keypair",
+					  sizeof(struct noise_keypair), 0,
+					  SLAB_HWCACHE_ALIGN, NULL);
+	if (!keypair_cache)
+		return -ENOMEM;
+
 	blake2s(handshake_init_chaining_key, handshake_name, NULL,
 		NOISE_HASH_LEN, sizeof(handshake_name), 0);
 	blake2s_init(&blake, NOISE_HASH_LEN);
 	blake2s_update(&blake, handshake_init_chaining_key, NOISE_HASH_LEN);
 	blake2s_update(&blake, identifier_name, sizeof(identifier_name));
 	blake2s_final(&blake, handshake_init_hash, NOISE_HASH_LEN);
+	blake2s_hmac_key_init(&handshake_init_chaining_hkey,
+			      handshake_init_chaining_key, NOISE_HASH_LEN);
+	return 0;
+}
+
+void wg_noise_uninit(void)
+{
+	rcu_barrier_bh();
+	kmem_cache_destroy(keypair_cache);
 }
 
 /* Must hold peer->handshake.static_identity->lock */
@@ -105,7 +124,8 @@ void wg_noise_handshake_clear(struct noise_handshake *handshake)
 
 static struct noise_keypair *keypair_create(struct wg_peer *peer)
 {
-	struct noise_keypair *keypair = kzalloc(sizeof(*keypair), GFP_KERNEL);
+	struct noise_keypair *keypair = kmem_cache_zalloc(keypair_cache,
+							  GFP_KERNEL);
 
 	if (unlikely(!keypair))
 		return NULL;
@@ -116,9 +136,15 @@ static struct noise_keypair *keypair_create(struct wg_peer *peer)
 	return keypair;
 }
 
+static void keypair_free(struct noise_keypair *keypair)
+{
+	memzero_explicit(keypair, sizeof(*keypair));
+	kmem_cache_free(keypair_cache, keypair);
+}
+
 static void keypair_free_rcu(struct rcu_head *rcu)
 {
-	kzfree(container_of(rcu, struct noise_keypair, rcu));
+	keypair_free(container_of(rcu, struct noise_keypair, rcu));
 }
 
 static void keypair_free_kref(struct kref *kref)
@@ -269,6 +295,116 @@ bool wg_noise_received_with_keypair(struct noise_keypairs *keypairs,
 	return true;
 }
 
+/* Must hold pool->lock */
+static void ephemeral_pool_expire(struct noise_ephemeral_pool *pool)
+{
+	unsigned int expired = 0;
+
+	while (expired < pool->count &&
+	       wg_birthdate_has_expired(pool->entries[expired].birthdate,
+					NOISE_EPHEMERAL_LIFETIME))
+		++expired;
+	if (!expired)
+		return;
+	pool->count -= expired;
+	memmove(pool->entries, pool->entries + expired,
+		pool->count * sizeof(*pool->entries));
+	memzero_explicit(pool->entries + pool->count,
+			 expired * sizeof(*pool->entries));
+}
+
+static void ephemeral_pool_worker(struct work_struct *work)
+{
+	struct noise_ephemeral_pool *pool = container_of(
+		to_delayed_work(work), struct noise_ephemeral_pool, work);
+	struct noise_ephemeral ephemeral;
+	bool refill, remaining;
+
+	spin_lock_bh(&pool->lock);
+	ephemeral_pool_expire(pool);
+	refill = pool->wants_refill;
+	pool->wants_refill = false;
+	spin_unlock_bh(&pool->lock);
+
+	while (refill) {
+		curve25519_generate_secret(ephemeral.private);
+		if (!curve25519_generate_public(ephemeral.public,
+						ephemeral.private))
+			continue;
+		ephemeral.birthdate = ktime_get_boot_fast_ns();
+		spin_lock_bh(&pool->lock);
+		if (pool->count < NOISE_EPHEMERAL_POOL_SIZE)
+			pool->entries[pool->count++] = ephemeral;
+		refill = pool->count < NOISE_EPHEMERAL_POOL_SIZE;
+		spin_unlock_bh(&pool->lock);
+		cond_resched();
+	}
+	memzero_explicit(&ephemeral, sizeof(ephemeral));
+
+	/* Come back to wipe whatever goes unused. */
+	spin_lock_bh(&pool->lock);
+	remaining = pool->count;
+	spin_unlock_bh(&pool->lock);
+	if (remaining)
+		queue_delayed_work(system_power_efficient_wq, &pool->work,
+				   NOISE_EPHEMERAL_LIFETIME * HZ);
+}
+
+void wg_noise_ephemeral_pool_init(struct noise_ephemeral_pool *pool)
+{
+	memset(pool, 0, sizeof(*pool));
+	spin_lock_init(&pool->lock);
+	INIT_DELAYED_WORK(&pool->work, ephemeral_pool_worker);
+}
+
+void wg_noise_ephemeral_pool_clear(struct noise_ephemeral_pool *pool)
+{
+	spin_lock_bh(&pool->lock);
+	memzero_explicit(pool->entries, sizeof(pool->entries));
+	pool->count = 0;
+	spin_unlock_bh(&pool->lock);
+}
+
+void wg_noise_ephemeral_pool_free(struct noise_ephemeral_pool *pool)
+{
+	cancel_delayed_work_sync(&pool->work);
+	wg_noise_ephemeral_pool_clear(pool);
+}
+
+/* Takes the freshest keypair from the pool, or makes one here if the pool
+ * has run dry, asking for a refill either way once it's getting low.
+ */
+static bool ephemeral_generate(struct noise_ephemeral_pool *pool,
+			       u8 private[NOISE_PUBLIC_KEY_LEN],
+			       u8 public[NOISE_PUBLIC_KEY_LEN])
+{
+	bool found = false, kick;
+
+	spin_lock_bh(&pool->lock);
+	ephemeral_pool_expire(pool);
+	if (pool->count) {
+		struct noise_ephemeral *ephemeral =
+			&pool->entries[--pool->count];
+
+		memcpy(private, ephemeral->private, NOISE_PUBLIC_KEY_LEN);
+		memcpy(public, ephemeral->public, NOISE_PUBLIC_KEY_LEN);
+		memzero_explicit(ephemeral, sizeof(*ephemeral));
+		found = true;
+	}
+	kick = pool->count < NOISE_EPHEMERAL_POOL_LOW_WATER &&
+	       !pool->wants_refill;
+	if (kick)
+		pool->wants_refill = true;
+	spin_unlock_bh(&pool->lock);
+	if (kick)
+		mod_delayed_work(system_power_efficient_wq, &pool->work, 0);
+
+	if (found)
+		return true;
+	curve25519_generate_secret(private);
+	return curve25519_generate_public(public, private);
+}
+
 /* Must hold static_identity->lock */
 void wg_noise_set_static_identity_private_key(
 	struct noise_static_identity *static_identity,
@@ -280,35 +416,24 @@ void wg_noise_set_static_identity_private_key(
 		static_identity->static_public, private_key);
 }
 
-/* This is Hugo Krawczyk's HKDF:
- *  - https://eprint.iacr.org/2010/264.pdf
- *  - https://tools.ietf.org/html/rfc5869
+/* The expand half of HKDF, with the inner and outer HMAC states of secret
+ * computed once and shared by every output rather than once per output.
  */
-static void kdf(u8 *first_dst, u8 *second_dst, u8 *third_dst, const u8 *data,
-		size_t first_len, size_t second_len, size_t third_len,
-		size_t data_len, const u8 chaining_key[NOISE_HASH_LEN])
+static void kdf_expand(u8 *first_dst, u8 *second_dst, u8 *third_dst,
+		       size_t first_len, size_t second_len, size_t third_len,
+		       const u8 secret[BLAKE2S_HASH_SIZE])
 {
+	struct blake2s_hmac_key hkey;
 	u8 output[BLAKE2S_HASH_SIZE + 1];
-	u8 secret[BLAKE2S_HASH_SIZE];
-
-	WARN_ON(IS_ENABLED(DEBUG) &&
-		(first_len > BLAKE2S_HASH_SIZE || second_len > BLAKE2S_HASH_SIZE ||
-		 third_len > BLAKE2S_HASH_SIZE ||
-		 ((second_len || second_dst || third_len || third_dst) &&
-		  (!first_len || !first_dst)) ||
-		 ((third_len || third_dst) && (!second_len || !second_dst))));
-
-	/* Extract entropy from data into secret */
-	blake2s_hmac(secret, data, chaining_key, BLAKE2S_HASH_SIZE, data_len,
-		     NOISE_HASH_LEN);
 
 	if (!first_dst || !first_len)
-		goto out;
+		return;
+
+	blake2s_hmac_key_init(&hkey, secret, BLAKE2S_HASH_SIZE);
 
 	/* Expand first key: key = secret, data = 0x1 */
 	output[0] = 1;
-	blake2s_hmac(output, output, secret, BLAKE2S_HASH_SIZE, 1,
-		     BLAKE2S_HASH_SIZE);
+	blake2s_hmac_precomputed(output, output, &hkey, BLAKE2S_HASH_SIZE, 1);
 	memcpy(first_dst, output, first_len);
 
 	if (!second_dst || !second_len)
@@ -316,8 +441,8 @@ static void kdf(u8 *first_dst, u8 *second_dst, u8 *third_dst, const u8 *data,
 
 	/* Expand second key: key = secret, data = first-key || 0x2 */
 	output[BLAKE2S_HASH_SIZE] = 2;
-	blake2s_hmac(output, output, secret, BLAKE2S_HASH_SIZE,
-		     BLAKE2S_HASH_SIZE + 1, BLAKE2S_HASH_SIZE);
+	blake2s_hmac_precomputed(output, output, &hkey, BLAKE2S_HASH_SIZE,
+				 BLAKE2S_HASH_SIZE + 1);
 	memcpy(second_dst, output, second_len);
 
 	if (!third_dst || !third_len)
@@ -325,16 +450,44 @@ static void kdf(u8 *first_dst, u8 *second_dst, u8 *third_dst, const u8 *data,
 
 	/* Expand third key: key = secret, data = second-key || 0x3 */
 	output[BLAKE2S_HASH_SIZE] = 3;
-	blake2s_hmac(output, output, secret, BLAKE2S_HASH_SIZE,
-		     BLAKE2S_HASH_SIZE + 1, BLAKE2S_HASH_SIZE);
+	blake2s_hmac_precomputed(output, output, &hkey, BLAKE2S_HASH_SIZE,
+				 BLAKE2S_HASH_SIZE + 1);
 	memcpy(third_dst, output, third_len);
 
 out:
 	/* Clear sensitive data from stack */
-	memzero_explicit(secret, BLAKE2S_HASH_SIZE);
+	memzero_explicit(&hkey, sizeof(hkey));
 	memzero_explicit(output, BLAKE2S_HASH_SIZE + 1);
 }
 
+/* This is Hugo Krawczyk's HKDF:
+ *  - https://eprint.iacr.org/2010/264.pdf
+ *  - https://tools.ietf.org/html/rfc5869
+ */
+static void kdf(u8 *first_dst, u8 *second_dst, u8 *third_dst, const u8 *data,
+		size_t first_len, size_t second_len, size_t third_len,
+		size_t data_len, const u8 chaining_key[NOISE_HASH_LEN])
+{
+	u8 secret[BLAKE2S_HASH_SIZE];
+
+	WARN_ON(IS_ENABLED(DEBUG) &&
+		(first_len > BLAKE2S_HASH_SIZE || second_len > BLAKE2S_HASH_SIZE ||
+		 third_len > BLAKE2S_HASH_SIZE ||
+		 ((second_len || second_dst || third_len || third_dst) &&
+		  (!first_len || !first_dst)) ||
+		 ((third_len || third_dst) && (!second_len || !second_dst))));
+
+	/* Extract entropy from data into secret */
+	blake2s_hmac(secret, data, chaining_key, BLAKE2S_HASH_SIZE, data_len,
+		     NOISE_HASH_LEN);
+
+	kdf_expand(first_dst, second_dst, third_dst, first_len, second_len,
+		   third_len, secret);
+
+	/* Clear sensitive data from stack */
+	memzero_explicit(secret, BLAKE2S_HASH_SIZE);
+}
+
 static void symmetric_key_init(struct noise_symmetric_key *key)
 {
 	spin_lock_init(&key->counter.receive.lock);
@@ -371,6 +524,14 @@ static bool __must_check mix_dh(u8 chaining_key[NOISE_HASH_LEN],
 	return true;
 }
 
+static void mix_precomputed_dh(u8 chaining_key[NOISE_HASH_LEN],
+			       u8 key[NOISE_SYMMETRIC_KEY_LEN],
+			       const u8 dh_calculation[NOISE_PUBLIC_KEY_LEN])
+{
+	kdf(chaining_key, key, NULL, dh_calculation, NOISE_HASH_LEN,
+	    NOISE_SYMMETRIC_KEY_LEN, 0, NOISE_PUBLIC_KEY_LEN, chaining_key);
+}
+
 static void mix_hash(u8 hash[NOISE_HASH_LEN], const u8 *src, size_t src_len)
 {
 	struct blake2s_state blake;
@@ -436,6 +597,26 @@ static void message_ephemeral(u8 ephemeral_dst[NOISE_PUBLIC_KEY_LEN],
 	    NOISE_PUBLIC_KEY_LEN, chaining_key);
 }
 
+/* The first mix of an initiation is always keyed by the constant initial
+ * chaining key, whose HMAC states are computed once in wg_noise_init.
+ */
+static void message_initial_ephemeral(u8 ephemeral_dst[NOISE_PUBLIC_KEY_LEN],
+				      const u8 ephemeral_src[NOISE_PUBLIC_KEY_LEN],
+				      u8 chaining_key[NOISE_HASH_LEN],
+				      u8 hash[NOISE_HASH_LEN])
+{
+	u8 secret[BLAKE2S_HASH_SIZE];
+
+	if (ephemeral_dst != ephemeral_src)
+		memcpy(ephemeral_dst, ephemeral_src, NOISE_PUBLIC_KEY_LEN);
+	mix_hash(hash, ephemeral_src, NOISE_PUBLIC_KEY_LEN);
+	blake2s_hmac_precomputed(secret, ephemeral_src,
+				 &handshake_init_chaining_hkey,
+				 BLAKE2S_HASH_SIZE, NOISE_PUBLIC_KEY_LEN);
+	kdf_expand(chaining_key, NULL, NULL, NOISE_HASH_LEN, 0, 0, secret);
+	memzero_explicit(secret, BLAKE2S_HASH_SIZE);
+}
+
 static void tai64n_now(u8 output[NOISE_TIMESTAMP_LEN])
 {
 	struct timespec64 now;
@@ -471,13 +652,13 @@ wg_noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 		       handshake->remote_static);
 
 	/* e */
-	curve25519_generate_secret(handshake->ephemeral_private);
-	if (!curve25519_generate_public(dst->unencrypted_ephemeral,
-					handshake->ephemeral_private))
+	if (!ephemeral_generate(&handshake->entry.peer->device->ephemeral_pool,
+				handshake->ephemeral_private,
+				dst->unencrypted_ephemeral))
 		goto out;
-	message_ephemeral(dst->unencrypted_ephemeral,
-			  dst->unencrypted_ephemeral, handshake->chaining_key,
-			  handshake->hash);
+	message_initial_ephemeral(dst->unencrypted_ephemeral,
+				  dst->unencrypted_ephemeral,
+				  handshake->chaining_key, handshake->hash);
 
 	/* es */
 	if (!mix_dh(handshake->chaining_key, key, handshake->ephemeral_private,
@@ -514,8 +695,42 @@ out:
 	return ret;
 }
 
+/* The es term is the only DH of an initiation that doesn't depend on which
+ * peer sent it, so it can be done for a whole batch of them up front, several
+ * points at a time where the CPU allows. If the static identity changes before
+ * they are consumed, the results are simply wrong and those initiations fail
+ * to decrypt.
+ */
+void wg_noise_handshake_precompute_initiations(
+	u8 es[][NOISE_PUBLIC_KEY_LEN], bool valid[],
+	struct message_handshake_initiation *const src[], unsigned int n,
+	struct wg_device *wg)
+{
+	u8 e[MAX_HANDSHAKE_BATCH][NOISE_PUBLIC_KEY_LEN];
+	simd_context_t simd_context;
+	unsigned int i;
+
+	if (WARN_ON(n > MAX_HANDSHAKE_BATCH))
+		n = MAX_HANDSHAKE_BATCH;
+	for (i = 0; i < n; ++i)
+		memcpy(e[i], src[i]->unencrypted_ephemeral,
+		       NOISE_PUBLIC_KEY_LEN);
+
+	down_read(&wg->static_identity.lock);
+	if (likely(wg->static_identity.has_identity)) {
+		simd_get(&simd_context);
+		curve25519_batch(es, wg->static_identity.static_private, e,
+				 valid, n, &simd_context);
+		simd_put(&simd_context);
+	} else {
+		memset(valid, 0, n * sizeof(*valid));
+	}
+	up_read(&wg->static_identity.lock);
+}
+
 struct wg_peer *
 wg_noise_handshake_consume_initiation(struct message_handshake_initiation *src,
+				      const u8 es[NOISE_PUBLIC_KEY_LEN],
 				      struct wg_device *wg)
 {
 	struct wg_peer *peer = NULL, *ret_peer = NULL;
@@ -535,11 +750,11 @@ wg_noise_handshake_consume_initiation(struct message_handshake_initiation *src,
 	handshake_init(chaining_key, hash, wg->static_identity.static_public);
 
 	/* e */
-	message_ephemeral(e, src->unencrypted_ephemeral, chaining_key, hash);
+	message_initial_ephemeral(e, src->unencrypted_ephemeral, chaining_key,
+				  hash);
 
-	/* es */
-	if (!mix_dh(chaining_key, key, wg->static_identity.static_private, e))
-		goto out;
+	/* es, from wg_noise_handshake_precompute_initiations */
+	mix_precomputed_dh(chaining_key, key, es);
 
 	/* s */
 	if (!message_decrypt(s, src->encrypted_static,
@@ -615,9 +830,9 @@ bool wg_noise_handshake_create_response(struct message_handshake_response *dst,
 	dst->receiver_index = handshake->remote_index;
 
 	/* e */
-	curve25519_generate_secret(handshake->ephemeral_private);
-	if (!curve25519_generate_public(dst->unencrypted_ephemeral,
-					handshake->ephemeral_private))
+	if (!ephemeral_generate(&handshake->entry.peer->device->ephemeral_pool,
+				handshake->ephemeral_private,
+				dst->unencrypted_ephemeral))
 		goto out;
 	message_ephemeral(dst->unencrypted_ephemeral,
 			  dst->unencrypted_ephemeral, handshake->chaining_key,
@@ -757,10 +972,19 @@ bool wg_noise_handshake_begin_session(struct noise_handshake *handshake,
 					  HANDSHAKE_CONSUMED_RESPONSE;
 	new_keypair->remote_index = handshake->remote_index;
 
-	if (new_keypair->i_am_the_initiator)
+	if (new_keypair->i_am_the_initiator) {
 		derive_keys(&new_keypair->sending, &new_keypair->receiving,
 			    handshake->chaining_key);
-	else
+		/* Somewhere in the last REKEY_AFTER_TIME_JITTER_MAX seconds
+		 * before the rekey is due, so that sessions that were made
+		 * together drift apart rather than rekeying in lockstep.
+		 */
+		new_keypair->rekey_after = new_keypair->sending.birthdate +
+			(u64)(REKEY_AFTER_TIME - REKEY_AFTER_TIME_JITTER_MAX) *
+				NSEC_PER_SEC +
+			(u64)prandom_u32_max(REKEY_AFTER_TIME_JITTER_MAX *
+					     MSEC_PER_SEC) * NSEC_PER_MSEC;
+	} else
 		derive_keys(&new_keypair->receiving, &new_keypair->sending,
 			    handshake->chaining_key);
 
@@ -777,7 +1001,7 @@ bool wg_noise_handshake_begin_session(struct noise_handshake *handshake,
 			&handshake->entry.peer->device->index_hashtable,
 			&handshake->entry, &new_keypair->entry);
 	} else
-		kzfree(new_keypair);
+		keypair_free(new_keypair);
 	rcu_read_unlock_bh();
 
 out:
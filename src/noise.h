@@ -15,6 +15,7 @@
 #include <linux/mutex.h>
 #include <linux/ktime.h>
 #include <linux/kref.h>
+#include <linux/workqueue.h>
 
 union noise_counter {
 	struct {
@@ -32,15 +33,21 @@ struct noise_symmetric_key {
 	bool is_valid;
 };
 
+/* The sending counter is bumped by whichever CPUs are transmitting and the
+ * receiving one by whichever is running its napi, so each half gets its own
+ * cachelines. The refcount stays in the shared header, and every packet in
+ * either direction still takes and drops a reference there.
+ */
 struct noise_keypair {
 	struct index_hashtable_entry entry;
-	struct noise_symmetric_key sending;
-	struct noise_symmetric_key receiving;
 	__le32 remote_index;
 	bool i_am_the_initiator;
+	u64 rekey_after;
 	struct kref refcount;
 	struct rcu_head rcu;
 	u64 internal_id;
+	struct noise_symmetric_key sending ____cacheline_aligned_in_smp;
+	struct noise_symmetric_key receiving ____cacheline_aligned_in_smp;
 };
 
 struct noise_keypairs {
@@ -57,6 +64,29 @@ struct noise_static_identity {
 	bool has_identity;
 };
 
+enum noise_ephemeral_pool_limits {
+	NOISE_EPHEMERAL_POOL_SIZE = 16,
+	NOISE_EPHEMERAL_POOL_LOW_WATER = NOISE_EPHEMERAL_POOL_SIZE / 2,
+	NOISE_EPHEMERAL_LIFETIME = 30 /* seconds */
+};
+
+struct noise_ephemeral {
+	u8 private[NOISE_PUBLIC_KEY_LEN];
+	u8 public[NOISE_PUBLIC_KEY_LEN];
+	u64 birthdate;
+};
+
+/* Single-use ephemeral keypairs generated ahead of time, oldest first, so
+ * that the handshake path only needs to do the DH that depends on the peer.
+ */
+struct noise_ephemeral_pool {
+	struct noise_ephemeral entries[NOISE_EPHEMERAL_POOL_SIZE];
+	unsigned int count;
+	bool wants_refill;
+	spinlock_t lock;
+	struct delayed_work work;
+};
+
 enum noise_handshake_state {
 	HANDSHAKE_ZEROED,
 	HANDSHAKE_CREATED_INITIATION,
@@ -94,7 +124,11 @@ struct noise_handshake {
 
 struct wg_device;
 
-void wg_noise_init(void);
+int wg_noise_init(void);
+void wg_noise_uninit(void);
+void wg_noise_ephemeral_pool_init(struct noise_ephemeral_pool *pool);
+void wg_noise_ephemeral_pool_clear(struct noise_ephemeral_pool *pool);
+void wg_noise_ephemeral_pool_free(struct noise_ephemeral_pool *pool);
 bool wg_noise_handshake_init(struct noise_handshake *handshake,
 			   struct noise_static_identity *static_identity,
 			   const u8 peer_public_key[NOISE_PUBLIC_KEY_LEN],
@@ -115,8 +149,13 @@ bool wg_noise_precompute_static_static(struct wg_peer *peer);
 bool
 wg_noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 				     struct noise_handshake *handshake);
+void wg_noise_handshake_precompute_initiations(
+	u8 es[][NOISE_PUBLIC_KEY_LEN], bool valid[],
+	struct message_handshake_initiation *const src[], unsigned int n,
+	struct wg_device *wg);
 struct wg_peer *
 wg_noise_handshake_consume_initiation(struct message_handshake_initiation *src,
+				      const u8 es[NOISE_PUBLIC_KEY_LEN],
 				      struct wg_device *wg);
 
 bool wg_noise_handshake_create_response(struct message_handshake_response *dst,
@@ -23,6 +23,21 @@ struct wg_peer *wg_peer_create(struct wg_device *wg,
 {
 	struct wg_peer *peer;
 
+	/* The read-mostly group of struct wg_peer ends at last_sent_handshake
+	 * and must not spill past 128 bytes, though debugging and RT locks are
+	 * allowed to make it; the written group and the handshake each start a
+	 * line of their own.
+	 */
+#if !defined(CONFIG_DEBUG_SPINLOCK) && !defined(CONFIG_DEBUG_LOCK_ALLOC) && \
+	!defined(CONFIG_PREEMPT_RT)
+	BUILD_BUG_ON(offsetof(struct wg_peer, last_sent_handshake) +
+		     sizeof(atomic64_t) > 128);
+#endif
+#ifdef CONFIG_SMP
+	BUILD_BUG_ON(offsetof(struct wg_peer, endpoint_lock) % SMP_CACHE_BYTES ||
+		     offsetof(struct wg_peer, handshake) % SMP_CACHE_BYTES);
+#endif
+
 	lockdep_assert_held(&wg->device_update_lock);
 
 	if (wg->num_peers >= MAX_PEERS_PER_DEVICE)
@@ -44,6 +59,9 @@ struct wg_peer *wg_peer_create(struct wg_device *wg,
 	if (wg_packet_queue_init(&peer->rx_queue, NULL, false,
 				 MAX_QUEUED_PACKETS))
 		goto err_3;
+	peer->stats = netdev_alloc_pcpu_stats(struct wg_peer_stats);
+	if (!peer->stats)
+		goto err_4;
 
 	peer->internal_id = atomic64_inc_return(&peer_counter);
 	peer->serial_work_cpu = nr_cpumask_bits;
@@ -59,16 +77,16 @@ struct wg_peer *wg_peer_create(struct wg_device *wg,
 	atomic64_set(&peer->last_sent_handshake,
 		     ktime_get_boot_fast_ns() -
 			     (u64)(REKEY_TIMEOUT + 1) * NSEC_PER_SEC);
-	set_bit(NAPI_STATE_NO_BUSY_POLL, &peer->napi.state);
-	netif_napi_add(wg->dev, &peer->napi, wg_packet_rx_poll,
-		       NAPI_POLL_WEIGHT);
-	napi_enable(&peer->napi);
+	INIT_LIST_HEAD(&peer->rx_napi_entry);
+	INIT_LIST_HEAD(&peer->allowedips_list);
 	list_add_tail(&peer->peer_list, &wg->peer_list);
 	wg_pubkey_hashtable_add(&wg->peer_hashtable, peer);
 	++wg->num_peers;
 	pr_debug("%s: Peer %llu created\n", wg->dev->name, peer->internal_id);
 	return peer;
 
+err_4:
+	wg_packet_queue_free(&peer->rx_queue, false);
 err_3:
 	wg_packet_queue_free(&peer->tx_queue, false);
 err_2:
@@ -130,12 +148,11 @@ void wg_peer_remove(struct wg_peer *peer)
 	flush_workqueue(peer->device->packet_crypt_wq);
 	/* b.1) For send (but not receive, since that's napi). */
 	flush_workqueue(peer->device->packet_crypt_wq);
-	/* b.2.1) For receive (but not send, since that's wq). */
-	napi_disable(&peer->napi);
-	/* b.2.1) It's now safe to remove the napi struct, which must be done
-	 * here from process context.
+	/* b.2) For receive, the device's shared napi holds its own reference
+	 * for as long as we're on one of its lists, and either drops whatever
+	 * is left in rx_queue now that we're dead, or has it purged when it is
+	 * disabled, so there's nothing to wait for.
 	 */
-	netif_napi_del(&peer->napi);
 
 	/* Ensure any workstructs we own (like transmit_handshake_work or
 	 * clear_peer_work) no longer are in use.
@@ -153,6 +170,7 @@ static void rcu_release(struct rcu_head *rcu)
 	dst_cache_destroy(&peer->endpoint_cache);
 	wg_packet_queue_free(&peer->rx_queue, false);
 	wg_packet_queue_free(&peer->tx_queue, false);
+	free_percpu(peer->stats);
 	kzfree(peer);
 }
 
@@ -191,3 +209,28 @@ void wg_peer_remove_all(struct wg_device *wg)
 	list_for_each_entry_safe (peer, temp, &wg->peer_list, peer_list)
 		wg_peer_remove(peer);
 }
+
+void wg_peer_get_stats(struct wg_peer *peer, struct wg_peer_stats *sum)
+{
+	unsigned int start;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		const struct wg_peer_stats *stats =
+			per_cpu_ptr(peer->stats, cpu);
+		u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+
+		do {
+			start = u64_stats_fetch_begin_irq(&stats->syncp);
+			rx_packets = stats->rx_packets;
+			rx_bytes = stats->rx_bytes;
+			tx_packets = stats->tx_packets;
+			tx_bytes = stats->tx_bytes;
+		} while (u64_stats_fetch_retry_irq(&stats->syncp, start));
+		sum->rx_packets += rx_packets;
+		sum->rx_bytes += rx_bytes;
+		sum->tx_packets += tx_packets;
+		sum->tx_bytes += tx_bytes;
+	}
+}
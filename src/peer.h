@@ -14,6 +14,7 @@
 #include <linux/netfilter.h>
 #include <linux/spinlock.h>
 #include <linux/kref.h>
+#include <linux/u64_stats_sync.h>
 #include <net/dst_cache.h>
 
 struct wg_device;
@@ -34,35 +35,59 @@ struct endpoint {
 	};
 };
 
+struct wg_peer_stats {
+	u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+	struct u64_stats_sync syncp;
+};
+
+/* The data path goes through the first two groups for every packet. The first
+ * is read-mostly and ordered so that, without lock debugging, it packs into
+ * 128 bytes, two lines on most machines. The second, starting on a line of its
+ * own, is what gets written per packet: the endpoint lock, the timer starts,
+ * the refcount and the queues. The handshake, cookie and configuration state
+ * after that is only touched by the slow paths. wg_peer_create() checks this.
+ */
 struct wg_peer {
 	struct wg_device *device;
-	struct crypt_queue tx_queue, rx_queue;
-	struct sk_buff_head staged_packet_queue;
-	int serial_work_cpu;
+	struct wg_peer_stats __percpu *stats;
 	struct noise_keypairs keypairs;
 	struct endpoint endpoint;
+	int serial_work_cpu;
+	u16 persistent_keepalive_interval;
+	bool timer_need_another_keepalive, sent_lastminute_handshake;
+	bool is_dead;
 	struct dst_cache endpoint_cache;
-	rwlock_t endpoint_lock;
-	struct noise_handshake handshake;
 	atomic64_t last_sent_handshake;
-	struct work_struct transmit_handshake_work, clear_peer_work;
+
+	rwlock_t endpoint_lock ____cacheline_aligned_in_smp;
+	/* When the data path last (re)started each of the timers it keeps
+	 * pushing back, in jiffies with the bottom bit set, or zero when
+	 * stopped.
+	 */
+	unsigned long timer_starts[WG_TIMER_COUNT];
+	struct kref refcount;
+	struct list_head rx_napi_entry;
+	unsigned long rx_napi_state;
+	struct sk_buff_head staged_packet_queue;
+	struct allowedips_src_cache allowedips_src_cache;
+	struct crypt_queue tx_queue, rx_queue;
+
+	struct noise_handshake handshake ____cacheline_aligned_in_smp;
 	struct cookie latest_cookie;
-	struct hlist_node pubkey_hash;
-	u64 rx_bytes, tx_bytes;
-	struct timer_list timer_retransmit_handshake, timer_send_keepalive;
-	struct timer_list timer_new_handshake, timer_zero_key_material;
-	struct timer_list timer_persistent_keepalive;
+	struct work_struct transmit_handshake_work, clear_peer_work;
+	/* In the same format, but for when the wheel has to look at them. */
+	unsigned long timer_deadlines[WG_TIMER_COUNT];
+	struct hlist_node timer_node;
+	unsigned long timer_wake;
 	unsigned int timer_handshake_attempts;
-	u16 persistent_keepalive_interval;
-	bool timers_enabled, timer_need_another_keepalive;
-	bool sent_lastminute_handshake;
+	bool timers_enabled;
 	struct timespec walltime_last_handshake;
-	struct kref refcount;
+	struct hlist_node pubkey_hash;
+	u64 pubkey_fingerprint;
 	struct rcu_head rcu;
 	struct list_head peer_list;
+	struct list_head allowedips_list;
 	u64 internal_id;
-	struct napi_struct napi;
-	bool is_dead;
 };
 
 struct wg_peer *wg_peer_create(struct wg_device *wg,
@@ -76,6 +101,8 @@ static inline struct wg_peer *wg_peer_get(struct wg_peer *peer)
 	return peer;
 }
 void wg_peer_put(struct wg_peer *peer);
+
+void wg_peer_get_stats(struct wg_peer *peer, struct wg_peer_stats *sum);
 void wg_peer_remove(struct wg_peer *peer);
 void wg_peer_remove_all(struct wg_device *wg);
 
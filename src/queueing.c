@@ -4,6 +4,7 @@
  */
 
 #include "queueing.h"
+#include "device.h"
 
 struct multicore_worker __percpu *
 wg_packet_alloc_percpu_multicore_worker(work_func_t function, void *ptr)
@@ -22,6 +23,87 @@ wg_packet_alloc_percpu_multicore_worker(work_func_t function, void *ptr)
 	return worker;
 }
 
+int wg_packet_handshake_queue_init(struct wg_device *wg)
+{
+	struct handshake_queue *queue;
+	int cpu, class;
+
+	wg->incoming_handshakes = alloc_percpu(struct handshake_queue);
+	if (!wg->incoming_handshakes)
+		return -ENOMEM;
+
+	for_each_possible_cpu (cpu) {
+		queue = per_cpu_ptr(wg->incoming_handshakes, cpu);
+		queue->worker.ptr = wg;
+		queue->next_cpu = cpu;
+		INIT_WORK(&queue->worker.work,
+			  wg_packet_handshake_receive_worker);
+		for (class = 0; class < HANDSHAKE_CLASSES; ++class)
+			skb_queue_head_init(&queue->skbs[class]);
+	}
+	return 0;
+}
+
+void wg_packet_handshake_queue_purge(struct wg_device *wg)
+{
+	struct handshake_queue *queue;
+	struct sk_buff *skb;
+	int cpu, class;
+
+	for_each_possible_cpu (cpu) {
+		queue = per_cpu_ptr(wg->incoming_handshakes, cpu);
+		for (class = 0; class < HANDSHAKE_CLASSES; ++class) {
+			while ((skb = skb_dequeue(&queue->skbs[class])) !=
+			       NULL)
+				dev_kfree_skb(skb);
+		}
+	}
+}
+
+void wg_packet_handshake_queue_free(struct wg_device *wg)
+{
+	wg_packet_handshake_queue_purge(wg);
+	free_percpu(wg->incoming_handshakes);
+}
+
+int wg_packet_rx_napi_init(struct wg_device *wg)
+{
+	struct rx_napi *rx;
+	int cpu;
+
+	wg->rx_napi = alloc_percpu(struct rx_napi);
+	if (!wg->rx_napi)
+		return -ENOMEM;
+
+	for_each_possible_cpu (cpu) {
+		rx = per_cpu_ptr(wg->rx_napi, cpu);
+		INIT_LIST_HEAD(&rx->peers);
+		spin_lock_init(&rx->lock);
+		set_bit(NAPI_STATE_NO_BUSY_POLL, &rx->napi.state);
+		netif_napi_add(wg->dev, &rx->napi, wg_packet_rx_poll,
+			       NAPI_POLL_WEIGHT);
+		napi_enable(&rx->napi);
+	}
+	return 0;
+}
+
+/* This must be called only once all peers are gone and nothing more can be
+ * decrypted, since disabling waits for the last scheduled poll to drain.
+ */
+void wg_packet_rx_napi_free(struct wg_device *wg)
+{
+	struct rx_napi *rx;
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		rx = per_cpu_ptr(wg->rx_napi, cpu);
+		napi_disable(&rx->napi);
+		netif_napi_del(&rx->napi);
+		wg_packet_rx_napi_purge(rx);
+	}
+	free_percpu(wg->rx_napi);
+}
+
 int wg_packet_queue_init(struct crypt_queue *queue, work_func_t function,
 			 bool multicore, unsigned int len)
 {
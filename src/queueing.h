@@ -24,12 +24,20 @@ int wg_packet_queue_init(struct crypt_queue *queue, work_func_t function,
 void wg_packet_queue_free(struct crypt_queue *queue, bool multicore);
 struct multicore_worker __percpu *
 wg_packet_alloc_percpu_multicore_worker(work_func_t function, void *ptr);
+int wg_packet_handshake_queue_init(struct wg_device *wg);
+void wg_packet_handshake_queue_purge(struct wg_device *wg);
+void wg_packet_handshake_queue_free(struct wg_device *wg);
+int wg_packet_rx_napi_init(struct wg_device *wg);
+void wg_packet_rx_napi_free(struct wg_device *wg);
 
 /* receive.c APIs: */
 void wg_packet_receive(struct wg_device *wg, struct sk_buff *skb);
 void wg_packet_handshake_receive_worker(struct work_struct *work);
+bool wg_packet_handshake_load(struct wg_device *wg, unsigned int *rate);
 /* NAPI poll function: */
 int wg_packet_rx_poll(struct napi_struct *napi, int budget);
+void wg_packet_rx_napi_schedule(struct wg_peer *peer);
+void wg_packet_rx_napi_purge(struct rx_napi *rx);
 /* Workqueue worker: */
 void wg_packet_decrypt_worker(struct work_struct *work);
 
@@ -175,8 +183,7 @@ static inline void wg_queue_enqueue_per_peer(struct crypt_queue *queue,
 	wg_peer_put(peer);
 }
 
-static inline void wg_queue_enqueue_per_peer_napi(struct crypt_queue *queue,
-						  struct sk_buff *skb,
+static inline void wg_queue_enqueue_per_peer_napi(struct sk_buff *skb,
 						  enum packet_state state)
 {
 	/* We take a reference, because as soon as we call atomic_set, the
@@ -185,7 +192,7 @@ static inline void wg_queue_enqueue_per_peer_napi(struct crypt_queue *queue,
 	struct wg_peer *peer = wg_peer_get(PACKET_PEER(skb));
 
 	atomic_set_release(&PACKET_CB(skb)->state, state);
-	napi_schedule(&peer->napi);
+	wg_packet_rx_napi_schedule(peer);
 	wg_peer_put(peer);
 }
 
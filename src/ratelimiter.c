@@ -9,147 +9,95 @@
 #include <linux/slab.h>
 #include <net/ip.h>
 
-static struct kmem_cache *entry_cache;
-static hsiphash_key_t key;
-static spinlock_t table_lock = __SPIN_LOCK_UNLOCKED("ratelimiter_table_lock");
+static siphash_key_t key;
 static DEFINE_MUTEX(init_lock);
 static atomic64_t refcnt = ATOMIC64_INIT(0);
-static atomic_t total_entries = ATOMIC_INIT(0);
-static unsigned int max_entries, table_size;
-static void wg_ratelimiter_gc_entries(struct work_struct *);
-static DECLARE_DEFERRABLE_WORK(gc_work, wg_ratelimiter_gc_entries);
-static struct hlist_head *table_v4;
-#if IS_ENABLED(CONFIG_IPV6)
-static struct hlist_head *table_v6;
-#endif
-
+static unsigned int table_size;
+static struct ratelimiter_entry *table;
+
+/* An entry is claimed by writing the fingerprint of its source into it, after
+ * which it holds the time at which that source's bucket would next be full,
+ * in the manner of GCRA. Once that time has passed, the entry is in exactly
+ * the state of a fresh one, so any other source may take it over right away,
+ * and nothing ever needs to sweep the table.
+ */
 struct ratelimiter_entry {
-	u64 last_time_ns, tokens;
-	__be64 ip;
-	void *net;
-	spinlock_t lock;
-	struct hlist_node hash;
-	struct rcu_head rcu;
+	atomic64_t fingerprint;
+	atomic64_t full_time_ns;
 };
 
 enum {
 	PACKETS_PER_SECOND = 20,
 	PACKETS_BURSTABLE = 5,
 	PACKET_COST = NSEC_PER_SEC / PACKETS_PER_SECOND,
-	TOKEN_MAX = PACKET_COST * PACKETS_BURSTABLE
+	TOKEN_MAX = PACKET_COST * PACKETS_BURSTABLE,
+	ENTRIES_PER_WINDOW = 8 /* Two cachelines */
 };
 
-static void entry_free(struct rcu_head *rcu)
-{
-	kmem_cache_free(entry_cache,
-			container_of(rcu, struct ratelimiter_entry, rcu));
-	atomic_dec(&total_entries);
-}
-
-static void entry_uninit(struct ratelimiter_entry *entry)
-{
-	hlist_del_rcu(&entry->hash);
-	call_rcu(&entry->rcu, entry_free);
-}
-
-/* Calling this function with a NULL work uninits all entries. */
-static void wg_ratelimiter_gc_entries(struct work_struct *work)
+bool wg_ratelimiter_allow(struct sk_buff *skb, struct net *net)
 {
-	const u64 now = ktime_get_boot_fast_ns();
-	struct ratelimiter_entry *entry;
-	struct hlist_node *temp;
+	struct ratelimiter_entry *window, *entry = NULL;
+	u64 fingerprint, now, seen, full, old = 0;
+	__be64 ip = 0;
 	unsigned int i;
 
-	for (i = 0; i < table_size; ++i) {
-		spin_lock(&table_lock);
-		hlist_for_each_entry_safe (entry, temp, &table_v4[i], hash) {
-			if (unlikely(!work) ||
-			    now - entry->last_time_ns > NSEC_PER_SEC)
-				entry_uninit(entry);
-		}
-#if IS_ENABLED(CONFIG_IPV6)
-		hlist_for_each_entry_safe (entry, temp, &table_v6[i], hash) {
-			if (unlikely(!work) ||
-			    now - entry->last_time_ns > NSEC_PER_SEC)
-				entry_uninit(entry);
-		}
-#endif
-		spin_unlock(&table_lock);
-		if (likely(work))
-			cond_resched();
-	}
-	if (likely(work))
-		queue_delayed_work(system_power_efficient_wq, &gc_work, HZ);
-}
-
-bool wg_ratelimiter_allow(struct sk_buff *skb, struct net *net)
-{
-	struct { __be64 ip; u32 net; } data = {
-		.net = (unsigned long)net & 0xffffffff };
-	struct ratelimiter_entry *entry;
-	struct hlist_head *bucket;
-
-	if (skb->protocol == htons(ETH_P_IP)) {
-		data.ip = (__force __be64)ip_hdr(skb)->saddr;
-		bucket = &table_v4[hsiphash(&data, sizeof(u32) * 3, &key) &
-				   (table_size - 1)];
-	}
+	if (skb->protocol == htons(ETH_P_IP))
+		ip = (__force __be64)ip_hdr(skb)->saddr;
 #if IS_ENABLED(CONFIG_IPV6)
-	else if (skb->protocol == htons(ETH_P_IPV6)) {
-		memcpy(&data.ip, &ipv6_hdr(skb)->saddr,
+	else if (skb->protocol == htons(ETH_P_IPV6))
+		memcpy(&ip, &ipv6_hdr(skb)->saddr,
 		       sizeof(__be64)); /* Only 64 bits */
-		bucket = &table_v6[hsiphash(&data, sizeof(u32) * 3, &key) &
-				   (table_size - 1)];
-	}
 #endif
 	else
 		return false;
-	rcu_read_lock();
-	hlist_for_each_entry_rcu (entry, bucket, hash) {
-		if (entry->net == net && entry->ip == data.ip) {
-			u64 now, tokens;
-			bool ret;
-			/* Quasi-inspired by nft_limit.c, but this is actually a
-			 * slightly different algorithm. Namely, we incorporate
-			 * the burst as part of the maximum tokens, rather than
-			 * as part of the rate.
-			 */
-			spin_lock(&entry->lock);
-			now = ktime_get_boot_fast_ns();
-			tokens = min_t(u64, TOKEN_MAX,
-				       entry->tokens + now -
-					       entry->last_time_ns);
-			entry->last_time_ns = now;
-			ret = tokens >= PACKET_COST;
-			entry->tokens = ret ? tokens - PACKET_COST : tokens;
-			spin_unlock(&entry->lock);
-			rcu_read_unlock();
-			return ret;
+
+	fingerprint = siphash_3u64((__force u64)ip, (unsigned long)net,
+				   (__force u16)skb->protocol, &key) ?: 1;
+	window = &table[fingerprint & (table_size - 1) &
+			~(ENTRIES_PER_WINDOW - 1)];
+	now = ktime_get_boot_fast_ns();
+
+	/* Entries for a source only ever live in its own window, so it's
+	 * enough to look there, while noting the first one we could take.
+	 */
+	for (i = 0; i < ENTRIES_PER_WINDOW; ++i) {
+		seen = atomic64_read(&window[i].fingerprint);
+		if (seen == fingerprint) {
+			entry = &window[i];
+			goto found;
+		}
+		if (!entry && (!seen || (s64)(atomic64_read(
+				&window[i].full_time_ns) - now) <= 0)) {
+			entry = &window[i];
+			old = seen;
 		}
 	}
-	rcu_read_unlock();
-
-	if (atomic_inc_return(&total_entries) > max_entries)
-		goto err_oom;
-
-	entry = kmem_cache_alloc(entry_cache, GFP_KERNEL);
-	if (unlikely(!entry))
-		goto err_oom;
-
-	entry->net = net;
-	entry->ip = data.ip;
-	INIT_HLIST_NODE(&entry->hash);
-	spin_lock_init(&entry->lock);
-	entry->last_time_ns = ktime_get_boot_fast_ns();
-	entry->tokens = TOKEN_MAX - PACKET_COST;
-	spin_lock(&table_lock);
-	hlist_add_head_rcu(&entry->hash, bucket);
-	spin_unlock(&table_lock);
-	return true;
-
-err_oom:
-	atomic_dec(&total_entries);
-	return false;
+	/* Every source in this window is still being limited, or we raced
+	 * with someone else for the same entry; in either case, drop.
+	 */
+	if (!entry ||
+	    atomic64_cmpxchg(&entry->fingerprint, old, fingerprint) != old)
+		return false;
+	/* Its previous owner may have charged it again after we looked, so
+	 * start the bucket afresh rather than inherit that.
+	 */
+	atomic64_set(&entry->full_time_ns, now);
+
+found:
+	/* Quasi-inspired by nft_limit.c, but this is actually a slightly
+	 * different algorithm. Namely, we incorporate the burst as part of the
+	 * maximum tokens, rather than as part of the rate. Tokens are the
+	 * distance between the time the bucket is full and now.
+	 */
+	for (old = atomic64_read(&entry->full_time_ns);; old = seen) {
+		full = (s64)(old - now) > 0 ? old : now;
+		if (full - now > TOKEN_MAX - PACKET_COST)
+			return false;
+		seen = atomic64_cmpxchg(&entry->full_time_ns, old,
+					full + PACKET_COST);
+		if (seen == old)
+			return true;
+	}
 }
 
 int wg_ratelimiter_init(void)
@@ -158,41 +106,27 @@ int wg_ratelimiter_init(void)
 	if (atomic64_inc_return(&refcnt) != 1)
 		goto out;
 
-	entry_cache = KMEM_CACHE(ratelimiter_entry, 0);
-	if (!entry_cache)
-		goto err;
-
 	/* xt_hashlimit.c uses a slightly different algorithm for ratelimiting,
 	 * but what it shares in common is that it uses a massive hashtable. So,
 	 * we borrow their wisdom about good table sizes on different systems
-	 * dependent on RAM. This calculation here comes from there.
+	 * dependent on RAM. This calculation here comes from there, scaled up
+	 * to hold as many entries as its chains would have, for both families.
 	 */
 	table_size = (totalram_pages > (1U << 30) / PAGE_SIZE) ? 8192 :
 		max_t(unsigned long, 16, roundup_pow_of_two(
 			(totalram_pages << PAGE_SHIFT) /
 			(1U << 14) / sizeof(struct hlist_head)));
-	max_entries = table_size * 8;
+	table_size *= 16;
 
-	table_v4 = kvzalloc(table_size * sizeof(*table_v4), GFP_KERNEL);
-	if (unlikely(!table_v4))
-		goto err_kmemcache;
-
-#if IS_ENABLED(CONFIG_IPV6)
-	table_v6 = kvzalloc(table_size * sizeof(*table_v6), GFP_KERNEL);
-	if (unlikely(!table_v6)) {
-		kvfree(table_v4);
-		goto err_kmemcache;
-	}
-#endif
+	table = kvzalloc(table_size * sizeof(*table), GFP_KERNEL);
+	if (unlikely(!table))
+		goto err;
 
-	queue_delayed_work(system_power_efficient_wq, &gc_work, HZ);
 	get_random_bytes(&key, sizeof(key));
 out:
 	mutex_unlock(&init_lock);
 	return 0;
 
-err_kmemcache:
-	kmem_cache_destroy(entry_cache);
 err:
 	atomic64_dec(&refcnt);
 	mutex_unlock(&init_lock);
@@ -205,14 +139,7 @@ void wg_ratelimiter_uninit(void)
 	if (atomic64_dec_if_positive(&refcnt))
 		goto out;
 
-	cancel_delayed_work_sync(&gc_work);
-	wg_ratelimiter_gc_entries(NULL);
-	rcu_barrier();
-	kvfree(table_v4);
-#if IS_ENABLED(CONFIG_IPV6)
-	kvfree(table_v6);
-#endif
-	kmem_cache_destroy(entry_cache);
+	kvfree(table);
 out:
 	mutex_unlock(&init_lock);
 }
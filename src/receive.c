@@ -22,12 +22,16 @@ static void update_rx_stats(struct wg_peer *peer, size_t len)
 {
 	struct pcpu_sw_netstats *tstats =
 		get_cpu_ptr(peer->device->dev->tstats);
+	struct wg_peer_stats *stats = this_cpu_ptr(peer->stats);
 
 	u64_stats_update_begin(&tstats->syncp);
 	++tstats->rx_packets;
 	tstats->rx_bytes += len;
-	peer->rx_bytes += len;
 	u64_stats_update_end(&tstats->syncp);
+	u64_stats_update_begin(&stats->syncp);
+	++stats->rx_packets;
+	stats->rx_bytes += len;
+	u64_stats_update_end(&stats->syncp);
 	put_cpu_ptr(tstats);
 }
 
@@ -52,6 +56,63 @@ static size_t validate_header_len(struct sk_buff *skb)
 	return 0;
 }
 
+enum early_verdict {
+	EARLY_PASS,
+	EARLY_DROP_INVALID_TYPE,
+	EARLY_DROP_INVALID_LENGTH,
+	EARLY_DROP_UNKNOWN_INDEX
+};
+
+/* This looks only at what's already in the linear area, without pulling,
+ * trimming, or writing anything shared, so that floods of garbage can be shed
+ * for about the price of a couple of cache lines and an index lookup. Anything
+ * it can't see is passed through to prepare_skb_header, which remains the
+ * authority.
+ */
+static enum early_verdict classify_skb_header(struct sk_buff *skb,
+					      struct wg_device *wg)
+{
+	const u8 *tail = skb_tail_pointer(skb);
+	const struct message_header *header;
+	const struct udphdr *udp;
+	size_t len;
+
+	if (unlikely(skb_transport_header(skb) < skb->head ||
+		     skb_transport_header(skb) + sizeof(*udp) +
+			     sizeof(*header) > tail))
+		return EARLY_PASS;
+	udp = udp_hdr(skb);
+	header = (const struct message_header *)(udp + 1);
+	len = ntohs(udp->len);
+	if (unlikely(len < sizeof(*udp) + sizeof(*header)))
+		return EARLY_DROP_INVALID_LENGTH;
+	len -= sizeof(*udp);
+
+	switch (header->type) {
+	case cpu_to_le32(MESSAGE_DATA): {
+		const struct message_data *data = (const void *)header;
+
+		if (unlikely(len < MESSAGE_MINIMUM_LENGTH))
+			return EARLY_DROP_INVALID_LENGTH;
+		if ((const u8 *)&data->counter <= tail &&
+		    unlikely(!wg_index_hashtable_contains(
+				&wg->index_hashtable, data->key_idx)))
+			return EARLY_DROP_UNKNOWN_INDEX;
+		return EARLY_PASS;
+	}
+	case cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION):
+		return likely(len == sizeof(struct message_handshake_initiation)) ?
+			EARLY_PASS : EARLY_DROP_INVALID_LENGTH;
+	case cpu_to_le32(MESSAGE_HANDSHAKE_RESPONSE):
+		return likely(len == sizeof(struct message_handshake_response)) ?
+			EARLY_PASS : EARLY_DROP_INVALID_LENGTH;
+	case cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE):
+		return likely(len == sizeof(struct message_handshake_cookie)) ?
+			EARLY_PASS : EARLY_DROP_INVALID_LENGTH;
+	}
+	return EARLY_DROP_INVALID_TYPE;
+}
+
 static int prepare_skb_header(struct sk_buff *skb, struct wg_device *wg)
 {
 	size_t data_offset, data_len, header_len;
@@ -97,44 +158,91 @@ static int prepare_skb_header(struct sk_buff *skb, struct wg_device *wg)
 	return 0;
 }
 
-static void wg_receive_handshake_packet(struct wg_device *wg,
-					struct sk_buff *skb)
+enum handshake_verdict {
+	HANDSHAKE_DROP,
+	HANDSHAKE_SEND_COOKIE,
+	HANDSHAKE_CONSUME
+};
+
+/* The arrival rate is folded into the average at most sixteen times a second.
+ * The old average decays by a quarter for every sixteenth of a second that has
+ * gone by since the last sample, and the rate over that time makes up the
+ * rest, so an idle device forgets a flood at the same pace whether or not any
+ * handshakes arrive afterwards. A backed up queue means cookies from the next
+ * sample on regardless, since the average takes a few samples to catch up.
+ * Arrivals and queue lengths are kept per CPU, and only summed here. Returns
+ * whether the device is under load, and optionally its current rate.
+ */
+bool wg_packet_handshake_load(struct wg_device *wg, unsigned int *rate)
 {
-	enum cookie_mac_state mac_state;
-	struct wg_peer *peer = NULL;
-	/* This is global, so that our load calculation applies to the whole
-	 * system. We don't care about races with it at all.
-	 */
-	static u64 last_under_load;
-	bool packet_needs_cookie;
+	struct handshake_load *load = &wg->handshake_load;
+	u64 now = ktime_get_boot_fast_ns(), elapsed, periods, i;
+	unsigned long arrivals = 0, queued = 0;
+	struct handshake_queue *queue;
+	u32 keep = 1U << 16;
+	int cpu, class;
 	bool under_load;
-
-	if (SKB_TYPE_LE32(skb) == cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE)) {
-		net_dbg_skb_ratelimited("%s: Receiving cookie response from %pISpfsc\n",
-					wg->dev->name, skb);
-		wg_cookie_message_consume(
-			(struct message_handshake_cookie *)skb->data, wg);
-		return;
+	u64 sample;
+
+	spin_lock(&load->lock);
+	elapsed = now - load->last_sample;
+	if (elapsed >= NSEC_PER_SEC / 16) {
+		for_each_possible_cpu (cpu) {
+			queue = per_cpu_ptr(wg->incoming_handshakes, cpu);
+			arrivals += READ_ONCE(queue->arrivals);
+			for (class = 0; class < HANDSHAKE_CLASSES; ++class)
+				queued += skb_queue_len(&queue->skbs[class]);
+		}
+		periods = div64_u64(elapsed, NSEC_PER_SEC / 16);
+		for (i = 0; i < periods && keep; ++i)
+			keep = keep * 3 / 4;
+		sample = min_t(u64, div64_u64((u64)(arrivals - load->arrivals) *
+					      NSEC_PER_SEC, elapsed),
+			       U32_MAX / 4);
+		load->rate = ((u64)load->rate * keep +
+			      sample * ((1U << 16) - keep)) >> 16;
+		load->arrivals = arrivals;
+		load->backed_up = queued >= MAX_QUEUED_INCOMING_HANDSHAKES / 8;
+		load->last_sample = now;
 	}
+	if (load->backed_up || load->rate >= HANDSHAKE_LOAD_HIGH_RATE) {
+		load->under_load = true;
+		load->last_overloaded = now;
+	} else if (load->under_load && load->rate < HANDSHAKE_LOAD_LOW_RATE &&
+		   wg_birthdate_has_expired(load->last_overloaded, 1)) {
+		load->under_load = false;
+	}
+	under_load = load->under_load;
+	if (rate)
+		*rate = load->rate;
+	spin_unlock(&load->lock);
+	return under_load;
+}
 
-	under_load = skb_queue_len(&wg->incoming_handshakes) >=
-		     MAX_QUEUED_INCOMING_HANDSHAKES / 8;
-	if (under_load)
-		last_under_load = ktime_get_boot_fast_ns();
-	else if (last_under_load)
-		under_load = !wg_birthdate_has_expired(last_under_load, 1);
-	mac_state = wg_cookie_validate_packet(&wg->cookie_checker, skb,
-					      under_load);
+static enum handshake_verdict triage_handshake_packet(struct wg_device *wg,
+						      struct sk_buff *skb,
+						      enum cookie_mac_state mac_state,
+						      bool under_load)
+{
 	if ((under_load && mac_state == VALID_MAC_WITH_COOKIE) ||
 	    (!under_load && mac_state == VALID_MAC_BUT_NO_COOKIE))
-		packet_needs_cookie = false;
+		return HANDSHAKE_CONSUME;
 	else if (under_load && mac_state == VALID_MAC_BUT_NO_COOKIE)
-		packet_needs_cookie = true;
-	else {
-		net_dbg_skb_ratelimited("%s: Invalid MAC of handshake, dropping packet from %pISpfsc\n",
-					wg->dev->name, skb);
-		return;
-	}
+		return HANDSHAKE_SEND_COOKIE;
+	net_dbg_skb_ratelimited("%s: Invalid MAC of handshake, dropping packet from %pISpfsc\n",
+				wg->dev->name, skb);
+	return HANDSHAKE_DROP;
+}
+
+/* For initiations, es is the precomputed DH of our static key with the
+ * sender's ephemeral, or NULL if that turned out to be invalid.
+ */
+static void wg_receive_handshake_packet(struct wg_device *wg,
+					struct sk_buff *skb,
+					bool packet_needs_cookie,
+					const u8 es[NOISE_PUBLIC_KEY_LEN])
+{
+	struct wg_peer *peer = NULL;
 
 	switch (SKB_TYPE_LE32(skb)) {
 	case cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION): {
@@ -146,13 +254,16 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 							message->sender_index);
 			return;
 		}
-		peer = wg_noise_handshake_consume_initiation(message, wg);
+		if (likely(es))
+			peer = wg_noise_handshake_consume_initiation(message,
+								     es, wg);
 		if (unlikely(!peer)) {
 			net_dbg_skb_ratelimited("%s: Invalid handshake initiation from %pISpfsc\n",
 						wg->dev->name, skb);
 			return;
 		}
 		wg_socket_set_peer_endpoint_from_skb(peer, skb);
+		wg_known_endpoints_add_skb(&wg->known_endpoints, skb);
 		net_dbg_ratelimited("%s: Receiving handshake initiation from peer %llu (%pISpfsc)\n",
 				    wg->dev->name, peer->internal_id,
 				    &peer->endpoint.addr);
@@ -175,6 +286,7 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 			return;
 		}
 		wg_socket_set_peer_endpoint_from_skb(peer, skb);
+		wg_known_endpoints_add_skb(&wg->known_endpoints, skb);
 		net_dbg_ratelimited("%s: Receiving handshake response from peer %llu (%pISpfsc)\n",
 				    wg->dev->name, peer->internal_id,
 				    &peer->endpoint.addr);
@@ -208,15 +320,140 @@ static void wg_receive_handshake_packet(struct wg_device *wg,
 	wg_peer_put(peer);
 }
 
-void wg_packet_handshake_receive_worker(struct work_struct *work)
+/* Handshakes have their macs checked and then their fixed-key DH done
+ * together, which is where the bulk of the time goes when many clients
+ * connect at once, or when someone floods us with garbage.
+ */
+static void wg_receive_handshake_batch(struct wg_device *wg,
+				       struct sk_buff *skbs[], unsigned int n)
 {
-	struct wg_device *wg = container_of(work, struct multicore_worker,
-					    work)->ptr;
-	struct sk_buff *skb;
+	struct message_handshake_initiation *initiations[MAX_HANDSHAKE_BATCH];
+	enum handshake_verdict verdicts[MAX_HANDSHAKE_BATCH];
+	enum cookie_mac_state mac_states[MAX_HANDSHAKE_BATCH];
+	struct sk_buff *macs_skbs[MAX_HANDSHAKE_BATCH];
+	u8 es[MAX_HANDSHAKE_BATCH][NOISE_PUBLIC_KEY_LEN];
+	bool es_valid[MAX_HANDSHAKE_BATCH];
+	unsigned int i, j, num_initiations = 0, num_macs = 0;
+	bool under_load = wg_packet_handshake_load(wg, NULL);
+
+	for (i = 0; i < n; ++i) {
+		if (SKB_TYPE_LE32(skbs[i]) ==
+		    cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE)) {
+			net_dbg_skb_ratelimited("%s: Receiving cookie response from %pISpfsc\n",
+						wg->dev->name, skbs[i]);
+			wg_cookie_message_consume(
+				(struct message_handshake_cookie *)skbs[i]->data,
+				wg);
+			continue;
+		}
+		macs_skbs[num_macs++] = skbs[i];
+	}
+	wg_cookie_validate_packets(&wg->cookie_checker, macs_skbs, mac_states,
+				   num_macs, under_load);
+
+	for (i = 0, j = 0; i < n; ++i) {
+		if (SKB_TYPE_LE32(skbs[i]) ==
+		    cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE)) {
+			verdicts[i] = HANDSHAKE_DROP;
+			continue;
+		}
+		verdicts[i] = triage_handshake_packet(wg, skbs[i],
+						      mac_states[j++],
+						      under_load);
+		if (verdicts[i] == HANDSHAKE_CONSUME &&
+		    SKB_TYPE_LE32(skbs[i]) ==
+			    cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION))
+			initiations[num_initiations++] =
+				(struct message_handshake_initiation *)
+					skbs[i]->data;
+	}
+	if (num_initiations)
+		wg_noise_handshake_precompute_initiations(es, es_valid,
+							  initiations,
+							  num_initiations, wg);
+
+	for (i = 0, j = 0; i < n; ++i) {
+		const u8 *dh = NULL;
+
+		if (verdicts[i] == HANDSHAKE_DROP)
+			continue;
+		if (verdicts[i] == HANDSHAKE_CONSUME &&
+		    SKB_TYPE_LE32(skbs[i]) ==
+			    cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION)) {
+			if (es_valid[j])
+				dh = es[j];
+			++j;
+		}
+		wg_receive_handshake_packet(wg, skbs[i],
+					    verdicts[i] == HANDSHAKE_SEND_COOKIE,
+					    dh);
+	}
+	memzero_explicit(es, sizeof(es));
+}
+
+static unsigned int dequeue_handshakes(struct wg_device *wg,
+				       struct sk_buff_head *queue,
+				       struct sk_buff *skbs[])
+{
+	unsigned int n = 0;
+
+	if (!skb_queue_len(queue))
+		return 0;
+	spin_lock_bh(&queue->lock);
+	while (n < MAX_HANDSHAKE_BATCH &&
+	       (skbs[n] = __skb_dequeue(queue)) != NULL)
+		++n;
+	spin_unlock_bh(&queue->lock);
+	return n;
+}
+
+/* Takes from our own CPU's queue if there's anything there, and otherwise
+ * from the next busy one after us, wrapping around, so that a flood arriving on
+ * a single CPU is still spread over all of the workers that wg_packet_receive
+ * kicks, without them all starting at the same queue. Every possible CPU is
+ * looked at, so that nothing is stranded on one that went offline. Known
+ * endpoints are served from every CPU before any unknown ones are.
+ */
+static unsigned int next_handshakes(struct wg_device *wg,
+				    struct handshake_queue *own,
+				    struct sk_buff *skbs[])
+{
+	int cpu, class, start = raw_smp_processor_id();
+	unsigned int n;
+
+	for (class = 0; class < HANDSHAKE_CLASSES; ++class) {
+		n = dequeue_handshakes(wg, &own->skbs[class], skbs);
+		if (n)
+			return n;
+		for (cpu = start;;) {
+			cpu = cpumask_next(cpu, cpu_possible_mask);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpu_possible_mask);
+			if (cpu == start)
+				break;
+			n = dequeue_handshakes(wg,
+				&per_cpu_ptr(wg->incoming_handshakes,
+					     cpu)->skbs[class], skbs);
+			if (n)
+				return n;
+		}
+	}
+	return 0;
+}
 
-	while ((skb = skb_dequeue(&wg->incoming_handshakes)) != NULL) {
-		wg_receive_handshake_packet(wg, skb);
-		dev_kfree_skb(skb);
+void wg_packet_handshake_receive_worker(struct work_struct *work)
+{
+	struct handshake_queue *queue = container_of(work,
+						     struct handshake_queue,
+						     worker.work);
+	struct wg_device *wg = queue->worker.ptr;
+	struct sk_buff *skbs[MAX_HANDSHAKE_BATCH];
+	unsigned int i, n;
+
+	while ((n = next_handshakes(wg, queue, skbs)) != 0) {
+		wg_receive_handshake_batch(wg, skbs, n);
+		for (i = 0; i < n; ++i)
+			dev_kfree_skb(skbs[i]);
 		cond_resched();
 	}
 }
@@ -339,11 +576,11 @@ out:
 
 static void wg_packet_consume_data_done(struct wg_peer *peer,
 					struct sk_buff *skb,
-					struct endpoint *endpoint)
+					struct endpoint *endpoint,
+					struct napi_struct *napi)
 {
 	struct net_device *dev = peer->device->dev;
 	unsigned int len, len_before_trim;
-	struct wg_peer *routed_peer;
 
 	wg_socket_set_peer_endpoint(peer, endpoint);
 
@@ -400,14 +637,12 @@ static void wg_packet_consume_data_done(struct wg_peer *peer,
 	if (unlikely(pskb_trim(skb, len)))
 		goto packet_processed;
 
-	routed_peer = wg_allowedips_lookup_src(&peer->device->peer_allowedips,
-					       skb);
-	wg_peer_put(routed_peer); /* We don't need the extra reference. */
-
-	if (unlikely(routed_peer != peer))
+	if (unlikely(!wg_allowedips_src_is_peer(&peer->device->peer_allowedips,
+						&peer->allowedips_src_cache,
+						peer, skb)))
 		goto dishonest_packet_peer;
 
-	if (unlikely(napi_gro_receive(&peer->napi, skb) == GRO_DROP)) {
+	if (unlikely(napi_gro_receive(napi, skb) == GRO_DROP)) {
 		++dev->stats.rx_dropped;
 		net_dbg_ratelimited("%s: Failed to give packet to userspace from peer %llu (%pISpfsc)\n",
 				    dev->name, peer->internal_id,
@@ -439,9 +674,56 @@ packet_processed:
 	dev_kfree_skb(skb);
 }
 
-int wg_packet_rx_poll(struct napi_struct *napi, int budget)
+enum {
+	RX_NAPI_SCHEDULED = 1UL << 0,
+	RX_NAPI_MISSED = 1UL << 1
+};
+
+/* Puts the peer on this CPU's napi list, unless it's already on one, in which
+ * case whoever is draining it is told to have another look before letting go.
+ */
+void wg_packet_rx_napi_schedule(struct wg_peer *peer)
+{
+	unsigned long old, new;
+	struct rx_napi *rx;
+
+	do {
+		old = READ_ONCE(peer->rx_napi_state);
+		new = old | RX_NAPI_SCHEDULED;
+		if (old & RX_NAPI_SCHEDULED)
+			new |= RX_NAPI_MISSED;
+	} while (cmpxchg(&peer->rx_napi_state, old, new) != old);
+	if (old & RX_NAPI_SCHEDULED)
+		return;
+
+	/* The list owns this reference until rx_napi_complete lets go. */
+	wg_peer_get(peer);
+	local_bh_disable();
+	rx = this_cpu_ptr(peer->device->rx_napi);
+	spin_lock(&rx->lock);
+	list_add_tail(&peer->rx_napi_entry, &rx->peers);
+	spin_unlock(&rx->lock);
+	napi_schedule(&rx->napi);
+	local_bh_enable();
+}
+
+/* Returns false if more packets became ready while we were draining, in which
+ * case we still own the peer and must look again.
+ */
+static bool rx_napi_complete(struct wg_peer *peer)
+{
+	unsigned long old, new;
+
+	do {
+		old = READ_ONCE(peer->rx_napi_state);
+		new = (old & RX_NAPI_MISSED) ? RX_NAPI_SCHEDULED : 0;
+	} while (cmpxchg(&peer->rx_napi_state, old, new) != old);
+	return !(old & RX_NAPI_MISSED);
+}
+
+static int rx_poll_peer(struct wg_peer *peer, struct napi_struct *napi,
+			int budget)
 {
-	struct wg_peer *peer = container_of(napi, struct wg_peer, napi);
 	struct crypt_queue *queue = &peer->rx_queue;
 	struct noise_keypair *keypair;
 	struct endpoint endpoint;
@@ -450,18 +732,16 @@ int wg_packet_rx_poll(struct napi_struct *napi, int budget)
 	int work_done = 0;
 	bool free;
 
-	if (unlikely(budget <= 0))
-		return 0;
-
-	while ((skb = __ptr_ring_peek(&queue->ring)) != NULL &&
+	while (work_done < budget &&
+	       (skb = __ptr_ring_peek(&queue->ring)) != NULL &&
 	       (state = atomic_read_acquire(&PACKET_CB(skb)->state)) !=
 		       PACKET_STATE_UNCRYPTED) {
 		__ptr_ring_discard_one(&queue->ring);
-		peer = PACKET_PEER(skb);
 		keypair = PACKET_CB(skb)->keypair;
 		free = true;
 
-		if (unlikely(state != PACKET_STATE_CRYPTED))
+		if (unlikely(state != PACKET_STATE_CRYPTED ||
+			     READ_ONCE(peer->is_dead)))
 			goto next;
 
 		if (unlikely(!counter_validate(&keypair->receiving.counter,
@@ -477,25 +757,85 @@ int wg_packet_rx_poll(struct napi_struct *napi, int budget)
 			goto next;
 
 		wg_reset_packet(skb);
-		wg_packet_consume_data_done(peer, skb, &endpoint);
+		wg_packet_consume_data_done(peer, skb, &endpoint, napi);
 		free = false;
 
 next:
 		wg_noise_keypair_put(keypair, false);
+		/* This is the packet's reference; the list still holds one. */
 		wg_peer_put(peer);
 		if (unlikely(free))
 			dev_kfree_skb(skb);
+		++work_done;
+	}
+	return work_done;
+}
 
-		if (++work_done >= budget)
+int wg_packet_rx_poll(struct napi_struct *napi, int budget)
+{
+	struct rx_napi *rx = container_of(napi, struct rx_napi, napi);
+	struct wg_peer *peer;
+	int work_done = 0;
+
+	if (unlikely(budget <= 0))
+		return 0;
+
+	while (work_done < budget) {
+		spin_lock(&rx->lock);
+		peer = list_first_entry_or_null(&rx->peers, struct wg_peer,
+						rx_napi_entry);
+		if (peer)
+			list_del_init(&peer->rx_napi_entry);
+		spin_unlock(&rx->lock);
+		if (!peer)
 			break;
+
+		do {
+			work_done += rx_poll_peer(peer, napi,
+						  budget - work_done);
+			if (work_done >= budget) {
+				/* We still own it, so it goes to the back of
+				 * the line for the next round.
+				 */
+				spin_lock(&rx->lock);
+				list_add_tail(&peer->rx_napi_entry, &rx->peers);
+				spin_unlock(&rx->lock);
+				goto out;
+			}
+		} while (!rx_napi_complete(peer));
+		wg_peer_put(peer);
 	}
 
+out:
 	if (work_done < budget)
 		napi_complete_done(napi, work_done);
 
 	return work_done;
 }
 
+/* Once napi is disabled, whatever it left behind on its list is dropped here,
+ * along with the references held by the list and by the peers' packets.
+ */
+void wg_packet_rx_napi_purge(struct rx_napi *rx)
+{
+	struct wg_peer *peer;
+	struct sk_buff *skb;
+
+	spin_lock_bh(&rx->lock);
+	while ((peer = list_first_entry_or_null(&rx->peers, struct wg_peer,
+						rx_napi_entry)) != NULL) {
+		list_del_init(&peer->rx_napi_entry);
+		while ((skb = __ptr_ring_consume(&peer->rx_queue.ring)) != NULL) {
+			wg_noise_keypair_put(PACKET_CB(skb)->keypair, false);
+			wg_peer_put(peer);
+			dev_kfree_skb(skb);
+		}
+		WRITE_ONCE(peer->rx_napi_state, 0);
+		wg_peer_put(peer);
+	}
+	spin_unlock_bh(&rx->lock);
+}
+
 void wg_packet_decrypt_worker(struct work_struct *work)
 {
 	struct crypt_queue *queue = container_of(work, struct multicore_worker,
@@ -509,8 +849,7 @@ void wg_packet_decrypt_worker(struct work_struct *work)
 					   &PACKET_CB(skb)->keypair->receiving,
 					   &simd_context)) ?
 				PACKET_STATE_CRYPTED : PACKET_STATE_DEAD;
-		wg_queue_enqueue_per_peer_napi(&PACKET_PEER(skb)->rx_queue, skb,
-					       state);
+		wg_queue_enqueue_per_peer_napi(skb, state);
 		simd_relax(&simd_context);
 	}
 
@@ -539,7 +878,7 @@ static void wg_packet_consume_data(struct wg_device *wg, struct sk_buff *skb)
 						   wg->packet_crypt_wq,
 						   &wg->decrypt_queue.last_cpu);
 	if (unlikely(ret == -EPIPE))
-		wg_queue_enqueue_per_peer(&peer->rx_queue, skb, PACKET_STATE_DEAD);
+		wg_queue_enqueue_per_peer_napi(skb, PACKET_STATE_DEAD);
 	if (likely(!ret || ret == -EPIPE)) {
 		rcu_read_unlock_bh();
 		return;
@@ -552,30 +891,65 @@ err_keypair:
 	dev_kfree_skb(skb);
 }
 
+static void count_early_drop(struct wg_device *wg, enum early_verdict verdict)
+{
+	struct rx_early_drops *drops = this_cpu_ptr(wg->rx_early_drops);
+
+	u64_stats_update_begin(&drops->syncp);
+	if (verdict == EARLY_DROP_INVALID_TYPE)
+		++drops->invalid_type;
+	else if (verdict == EARLY_DROP_INVALID_LENGTH)
+		++drops->invalid_length;
+	else
+		++drops->unknown_index;
+	u64_stats_update_end(&drops->syncp);
+}
+
 void wg_packet_receive(struct wg_device *wg, struct sk_buff *skb)
 {
+	enum early_verdict verdict = classify_skb_header(skb, wg);
+
+	if (unlikely(verdict != EARLY_PASS)) {
+		count_early_drop(wg, verdict);
+		goto err;
+	}
 	if (unlikely(prepare_skb_header(skb, wg) < 0))
 		goto err;
 	switch (SKB_TYPE_LE32(skb)) {
 	case cpu_to_le32(MESSAGE_HANDSHAKE_INITIATION):
 	case cpu_to_le32(MESSAGE_HANDSHAKE_RESPONSE):
 	case cpu_to_le32(MESSAGE_HANDSHAKE_COOKIE): {
+		struct handshake_queue *queue =
+			this_cpu_ptr(wg->incoming_handshakes);
+		unsigned int queued, cpus = num_online_cpus();
+		bool known;
 		int cpu;
 
-		if (skb_queue_len(&wg->incoming_handshakes) >
-			    MAX_QUEUED_INCOMING_HANDSHAKES ||
+		++queue->arrivals;
+		/* Each CPU gets its share of the queue limits. Unknown sources
+		 * may only fill it up to the point that leaves room for known
+		 * endpoints to still get in.
+		 */
+		known = wg_known_endpoints_contains(&wg->known_endpoints, skb);
+		queued = skb_queue_len(&queue->skbs[HANDSHAKE_CLASS_KNOWN]) +
+			 skb_queue_len(&queue->skbs[HANDSHAKE_CLASS_UNKNOWN]);
+		if (queued > (known ? MAX_QUEUED_INCOMING_HANDSHAKES :
+				      MAX_QUEUED_UNKNOWN_HANDSHAKES) / cpus ||
 		    unlikely(!rng_is_initialized())) {
 			net_dbg_skb_ratelimited("%s: Dropping handshake packet from %pISpfsc\n",
 						wg->dev->name, skb);
 			goto err;
 		}
-		skb_queue_tail(&wg->incoming_handshakes, skb);
+		skb_queue_tail(&queue->skbs[known ? HANDSHAKE_CLASS_KNOWN :
+						    HANDSHAKE_CLASS_UNKNOWN],
+			       skb);
 		/* Queues up a call to packet_process_queued_handshake_
-		 * packets(skb):
+		 * packets(skb), on the next CPU in turn, which will steal
+		 * from ours if its own queue is empty:
 		 */
-		cpu = wg_cpumask_next_online(&wg->incoming_handshake_cpu);
+		cpu = wg_cpumask_next_online(&queue->next_cpu);
 		queue_work_on(cpu, wg->handshake_receive_wq,
-			&per_cpu_ptr(wg->incoming_handshakes_worker, cpu)->work);
+			&per_cpu_ptr(wg->incoming_handshakes, cpu)->worker.work);
 		break;
 	}
 	case cpu_to_le32(MESSAGE_DATA):
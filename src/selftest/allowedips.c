@@ -10,9 +10,12 @@
  * to graphviz (the dot command) to visualize it. If you define the macro
  * DEBUG_RANDOM_TRIE to be 1, then there will be an extremely costly set of
  * randomized tests done against a trivial implementation, which may take
- * upwards of a half-hour to complete. There's no set of users who should be
- * enabling these, and the only developers that should go anywhere near these
- * nobs are the ones who are reading this comment.
+ * upwards of a half-hour to complete. A much smaller set of randomized tests of
+ * the bulk insert path against that same implementation always runs, since
+ * its tree surgery has too many cases to cover by hand. There's no set of users
+ * who should be
+ * enabling the other two, and the only developers that should go anywhere near
+ * these nobs are the ones who are reading this comment.
  */
 
 #ifdef DEBUG
@@ -79,11 +82,61 @@ static __init void print_tree(struct allowedips_node *top, u8 bits)
 	printk(KERN_DEBUG "}\n");
 }
 
+static __init unsigned long count_nodes(struct allowedips_node __rcu *root)
+{
+	struct allowedips_node *node = rcu_dereference_raw(root);
+
+	if (!node)
+		return 0;
+	return 1 + count_nodes(node->bit[0]) + count_nodes(node->bit[1]);
+}
+
+static __init bool nodes_accounted(struct allowedips *table)
+{
+	return table->nodes4 == count_nodes(table->root4) &&
+	       table->nodes6 == count_nodes(table->root6);
+}
+
+static __init unsigned long count_peer_nodes(struct allowedips_node __rcu *root)
+{
+	struct allowedips_node *node = rcu_dereference_raw(root);
+
+	if (!node)
+		return 0;
+	return !!rcu_access_pointer(node->peer) +
+	       count_peer_nodes(node->bit[0]) + count_peer_nodes(node->bit[1]);
+}
+
+/* Every node with a peer must be on that peer's list, and on no other. */
+static __init bool peer_lists_accounted(struct allowedips *table,
+					struct wg_peer **peers,
+					unsigned int num_peers)
+{
+	struct allowedips_node *node;
+	unsigned long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < num_peers; ++i) {
+		list_for_each_entry (node, &peers[i]->allowedips_list,
+				     peer_list) {
+			if (rcu_access_pointer(node->peer) != peers[i])
+				return false;
+			++count;
+		}
+	}
+	return count == count_peer_nodes(table->root4) +
+			count_peer_nodes(table->root6);
+}
+
 enum {
 	NUM_PEERS = 2000,
 	NUM_RAND_ROUTES = 400,
 	NUM_MUTATED_ROUTES = 100,
-	NUM_QUERIES = NUM_RAND_ROUTES * NUM_MUTATED_ROUTES * 30
+	NUM_QUERIES = NUM_RAND_ROUTES * NUM_MUTATED_ROUTES * 30,
+	NUM_BULK_PEERS = 64,
+	NUM_BULK_ROUNDS = 6,
+	NUM_BULK_PREFIXES = 500,
+	NUM_BULK_QUERIES = NUM_BULK_PREFIXES * 4
 };
 
 struct horrible_allowedips {
@@ -114,6 +167,21 @@ static __init void horrible_allowedips_free(struct horrible_allowedips *table)
 	}
 }
 
+static __init void
+horrible_allowedips_remove_by_value(struct horrible_allowedips *table,
+				    void *value)
+{
+	struct horrible_allowedips_node *node;
+	struct hlist_node *h;
+
+	hlist_for_each_entry_safe (node, h, &table->head, table) {
+		if (node->value != value)
+			continue;
+		hlist_del(&node->table);
+		kfree(node);
+	}
+}
+
 static __init inline union nf_inet_addr horrible_cidr_to_mask(uint8_t cidr)
 {
 	union nf_inet_addr mask;
@@ -172,6 +240,9 @@ horrible_insert_ordered(struct horrible_allowedips *table,
 	struct horrible_allowedips_node *other = NULL, *where = NULL;
 	uint8_t my_cidr = horrible_mask_to_cidr(node->mask);
 
+	/* A duplicate may sit anywhere among those of the same cidr, so it has
+	 * to be looked for apart from where the node would go.
+	 */
 	hlist_for_each_entry (other, &table->head, table) {
 		if (!memcmp(&other->mask, &node->mask,
 			    sizeof(union nf_inet_addr)) &&
@@ -182,6 +253,8 @@ horrible_insert_ordered(struct horrible_allowedips *table,
 			kfree(node);
 			return;
 		}
+	}
+	hlist_for_each_entry (other, &table->head, table) {
 		where = other;
 		if (horrible_mask_to_cidr(other->mask) <= my_cidr)
 			break;
@@ -293,6 +366,7 @@ static __init bool randomized_test(void)
 			goto free;
 		}
 		kref_init(&peers[i]->refcount);
+		INIT_LIST_HEAD(&peers[i]->allowedips_list);
 	}
 
 	mutex_lock(&mutex);
@@ -393,22 +467,213 @@ static __init bool randomized_test(void)
 		print_tree(t.root6, 128);
 	}
 
-	for (i = 0; i < NUM_QUERIES; ++i) {
-		prandom_bytes(ip, 4);
-		if (lookup(t.root4, 32, ip) !=
-		    horrible_allowedips_lookup_v4(&h, (struct in_addr *)ip)) {
+	for (j = 0;; ++j) {
+		for (i = 0; i < NUM_QUERIES; ++i) {
+			prandom_bytes(ip, 4);
+			if (lookup(&t, 32, ip) != horrible_allowedips_lookup_v4(
+						&h, (struct in_addr *)ip)) {
+				pr_err("allowedips random self-test: FAIL\n");
+				goto free;
+			}
+		}
+
+		for (i = 0; i < NUM_QUERIES; ++i) {
+			prandom_bytes(ip, 16);
+			if (lookup(&t, 128, ip) != horrible_allowedips_lookup_v6(
+						&h, (struct in6_addr *)ip)) {
+				pr_err("allowedips random self-test: FAIL\n");
+				goto free;
+			}
+		}
+
+		if (j == 2)
+			break;
+
+		/* Then do it all again against the compiled snapshot, and once
+		 * more after some peers have taken their nodes with them.
+		 */
+		mutex_lock(&mutex);
+		if (!j) {
+			wg_allowedips_compile(&t, &mutex);
+			mutex_unlock(&mutex);
+			if (!rcu_access_pointer(t.snapshot4) ||
+			    !rcu_access_pointer(t.snapshot6)) {
+				pr_err("allowedips random self-test malloc: FAIL\n");
+				goto free;
+			}
+			continue;
+		}
+		for (i = 0; i < NUM_PEERS / 4; ++i) {
+			peer = peers[prandom_u32_max(NUM_PEERS)];
+			wg_allowedips_remove_by_peer(&t, peer, &mutex);
+			horrible_allowedips_remove_by_value(&h, peer);
+			if (!list_empty(&peer->allowedips_list)) {
+				mutex_unlock(&mutex);
+				pr_err("allowedips random self-test: FAIL\n");
+				goto free;
+			}
+		}
+		mutex_unlock(&mutex);
+		if (!nodes_accounted(&t)) {
 			pr_err("allowedips random self-test: FAIL\n");
 			goto free;
 		}
 	}
+	ret = true;
 
-	for (i = 0; i < NUM_QUERIES; ++i) {
-		prandom_bytes(ip, 16);
-		if (lookup(t.root6, 128, ip) !=
-		    horrible_allowedips_lookup_v6(&h, (struct in6_addr *)ip)) {
-			pr_err("allowedips random self-test: FAIL\n");
+free:
+	mutex_lock(&mutex);
+	wg_allowedips_free(&t, &mutex);
+	mutex_unlock(&mutex);
+	horrible_allowedips_free(&h);
+	if (peers) {
+		for (i = 0; i < NUM_PEERS; ++i)
+			kfree(peers[i]);
+	}
+	kfree(peers);
+	return ret;
+}
+
+/* Makes up the next prefix of a batch. Some are exact duplicates of an earlier
+ * one in the batch, or of one from the previous batch, given to another peer.
+ * Others share some leading bits with an earlier one, so that they nest in it,
+ * cover it, or branch off from it. The rest are entirely random.
+ */
+static __init void random_bulk_prefix(struct allowedips_prefix *batch,
+				      unsigned int i,
+				      const struct allowedips_prefix *previous,
+				      unsigned int previous_len,
+				      struct wg_peer **peers)
+{
+	struct allowedips_prefix *prefix = &batch[i];
+	unsigned int choice = prandom_u32_max(8), bits, keep = 0, k;
+	u8 *ip = (u8 *)&prefix->ip6;
+
+	if (choice == 0 && i) {
+		*prefix = batch[prandom_u32_max(i)];
+	} else if (choice == 1 && previous_len) {
+		*prefix = previous[prandom_u32_max(previous_len)];
+	} else {
+		if (choice < 5 && i) {
+			*prefix = batch[prandom_u32_max(i)];
+			keep = prandom_u32_max(prefix->cidr + 1);
+		} else {
+			prandom_bytes(ip, 16);
+			prefix->family = prandom_u32_max(2) ? AF_INET :
+							      AF_INET6;
+		}
+		bits = prefix->family == AF_INET ? 32 : 128;
+		for (k = keep; k < bits; ++k) {
+			if (prandom_u32_max(2))
+				ip[k / 8] ^= 0x80 >> (k % 8);
+		}
+		prefix->cidr = prandom_u32_max(bits + 1);
+	}
+	prefix->peer = peers[prandom_u32_max(NUM_BULK_PEERS)];
+}
+
+static __init bool randomized_bulk_test(void)
+{
+	struct allowedips_prefix *batch = NULL, *previous = NULL;
+	unsigned int i, j, k, round, previous_len = 0;
+	u8 ip[16] __aligned(__alignof(u64));
+	struct wg_peer **peers, *peer;
+	struct horrible_allowedips h;
+	DEFINE_MUTEX(mutex);
+	struct allowedips t;
+	bool ret = false;
+
+	mutex_init(&mutex);
+
+	wg_allowedips_init(&t);
+	horrible_allowedips_init(&h);
+
+	peers = kcalloc(NUM_BULK_PEERS, sizeof(*peers), GFP_KERNEL);
+	batch = kcalloc(NUM_BULK_PREFIXES, sizeof(*batch), GFP_KERNEL);
+	previous = kcalloc(NUM_BULK_PREFIXES, sizeof(*previous), GFP_KERNEL);
+	if (unlikely(!peers || !batch || !previous)) {
+		pr_err("allowedips random bulk self-test malloc: FAIL\n");
+		goto free;
+	}
+	for (i = 0; i < NUM_BULK_PEERS; ++i) {
+		peers[i] = kzalloc(sizeof(*peers[i]), GFP_KERNEL);
+		if (unlikely(!peers[i])) {
+			pr_err("allowedips random bulk self-test malloc: FAIL\n");
+			goto free;
+		}
+		kref_init(&peers[i]->refcount);
+		INIT_LIST_HEAD(&peers[i]->allowedips_list);
+	}
+
+	/* The first batch goes into an empty trie, and the rest into whatever
+	 * the ones before them, less the peers removed on the way, left.
+	 */
+	for (round = 0; round < NUM_BULK_ROUNDS; ++round) {
+		for (i = 0; i < NUM_BULK_PREFIXES; ++i) {
+			random_bulk_prefix(batch, i, previous, previous_len,
+					   peers);
+			if ((batch[i].family == AF_INET ?
+				horrible_allowedips_insert_v4(&h, &batch[i].ip4,
+					batch[i].cidr, batch[i].peer) :
+				horrible_allowedips_insert_v6(&h, &batch[i].ip6,
+					batch[i].cidr, batch[i].peer)) < 0) {
+				pr_err("allowedips random bulk self-test malloc: FAIL\n");
+				goto free;
+			}
+		}
+		mutex_lock(&mutex);
+		if (wg_allowedips_insert_bulk(&t, batch, NUM_BULK_PREFIXES,
+					      &mutex) < 0) {
+			mutex_unlock(&mutex);
+			pr_err("allowedips random bulk self-test malloc: FAIL\n");
+			goto free;
+		}
+		if (round % 2) {
+			peer = peers[prandom_u32_max(NUM_BULK_PEERS)];
+			wg_allowedips_remove_by_peer(&t, peer, &mutex);
+			horrible_allowedips_remove_by_value(&h, peer);
+		}
+		mutex_unlock(&mutex);
+		memcpy(previous, batch, NUM_BULK_PREFIXES * sizeof(*batch));
+		previous_len = NUM_BULK_PREFIXES;
+
+		if (!nodes_accounted(&t) ||
+		    !peer_lists_accounted(&t, peers, NUM_BULK_PEERS)) {
+			pr_err("allowedips random bulk self-test: FAIL\n");
 			goto free;
 		}
+
+		/* Look up both random addresses and ones in or right next to
+		 * what was just inserted, and after the last batch, do it all
+		 * again against the compiled snapshot.
+		 */
+		for (j = 0; j < (round == NUM_BULK_ROUNDS - 1 ? 2 : 1); ++j) {
+			if (j) {
+				mutex_lock(&mutex);
+				wg_allowedips_compile(&t, &mutex);
+				mutex_unlock(&mutex);
+			}
+			for (i = 0; i < NUM_BULK_QUERIES; ++i) {
+				if (i % 2) {
+					prandom_bytes(ip, 16);
+				} else {
+					memcpy(ip, &batch[prandom_u32_max(
+						NUM_BULK_PREFIXES)].ip6, 16);
+					k = prandom_u32_max(128);
+					if (i % 4)
+						ip[k / 8] ^= 0x80 >> (k % 8);
+				}
+				if (lookup(&t, 32, ip) !=
+					    horrible_allowedips_lookup_v4(&h,
+						(struct in_addr *)ip) ||
+				    lookup(&t, 128, ip) !=
+					    horrible_allowedips_lookup_v6(&h,
+						(struct in6_addr *)ip)) {
+					pr_err("allowedips random bulk self-test: FAIL\n");
+					goto free;
+				}
+			}
+		}
 	}
 	ret = true;
 
@@ -418,10 +683,12 @@ free:
 	mutex_unlock(&mutex);
 	horrible_allowedips_free(&h);
 	if (peers) {
-		for (i = 0; i < NUM_PEERS; ++i)
+		for (i = 0; i < NUM_BULK_PEERS; ++i)
 			kfree(peers[i]);
 	}
 	kfree(peers);
+	kfree(previous);
+	kfree(batch);
 	return ret;
 }
 
@@ -449,6 +716,26 @@ static __init inline struct in6_addr *ip6(u32 a, u32 b, u32 c, u32 d)
 	return &ip;
 }
 
+static __init void prefix4(struct allowedips_prefix *prefix,
+			   struct wg_peer *peer, u8 a, u8 b, u8 c, u8 d,
+			   u8 cidr)
+{
+	prefix->ip4 = *ip4(a, b, c, d);
+	prefix->family = AF_INET;
+	prefix->cidr = cidr;
+	prefix->peer = peer;
+}
+
+static __init void prefix6(struct allowedips_prefix *prefix,
+			   struct wg_peer *peer, u32 a, u32 b, u32 c, u32 d,
+			   u8 cidr)
+{
+	prefix->ip6 = *ip6(a, b, c, d);
+	prefix->family = AF_INET6;
+	prefix->cidr = cidr;
+	prefix->peer = peer;
+}
+
 struct walk_ctx {
 	int count;
 	bool found_a, found_b, found_c, found_d, found_e;
@@ -484,10 +771,12 @@ static __init int walk_callback(void *ctx, const u8 *ip, u8 cidr, int family)
 	return 0;
 }
 
-#define init_peer(name) do {                               \
-		name = kzalloc(sizeof(*name), GFP_KERNEL); \
-		if (name)                                  \
-			kref_init(&name->refcount);        \
+#define init_peer(name) do {                                       \
+		name = kzalloc(sizeof(*name), GFP_KERNEL);         \
+		if (name) {                                        \
+			kref_init(&name->refcount);                \
+			INIT_LIST_HEAD(&name->allowedips_list);    \
+		}                                                  \
 	} while (0)
 
 #define insert(version, mem, ipa, ipb, ipc, ipd, cidr)                       \
@@ -503,17 +792,31 @@ static __init int walk_callback(void *ctx, const u8 *ip, u8 cidr, int family)
 	} while (0)
 
 #define test(version, mem, ipa, ipb, ipc, ipd) do {                        \
-		bool _s = lookup(t.root##version, version == 4 ? 32 : 128, \
+		bool _s = lookup(&t, version == 4 ? 32 : 128,              \
 				 ip##version(ipa, ipb, ipc, ipd)) == mem;  \
 		maybe_fail();                                              \
 	} while (0)
 
 #define test_negative(version, mem, ipa, ipb, ipc, ipd) do {               \
-		bool _s = lookup(t.root##version, version == 4 ? 32 : 128, \
+		bool _s = lookup(&t, version == 4 ? 32 : 128,              \
 				 ip##version(ipa, ipb, ipc, ipd)) != mem;  \
 		maybe_fail();                                              \
 	} while (0)
 
+#define test_src(version, cache, mem, ipa, ipb, ipc, ipd) do {             \
+		bool _s = src_is_peer(&t, version == 4 ? 32 : 128,         \
+				      ip##version(ipa, ipb, ipc, ipd), mem, \
+				      cache);                              \
+		maybe_fail();                                              \
+	} while (0)
+
+#define test_src_negative(version, cache, mem, ipa, ipb, ipc, ipd) do {    \
+		bool _s = !src_is_peer(&t, version == 4 ? 32 : 128,        \
+				       ip##version(ipa, ipb, ipc, ipd),     \
+				       mem, cache);                         \
+		maybe_fail();                                              \
+	} while (0)
+
 #define test_boolean(cond) do {   \
 		bool _s = (cond); \
 		maybe_fail();     \
@@ -523,9 +826,11 @@ bool __init wg_allowedips_selftest(void)
 {
 	struct wg_peer *a = NULL, *b = NULL, *c = NULL, *d = NULL, *e = NULL,
 		       *f = NULL, *g = NULL, *h = NULL;
+	struct allowedips_src_cache cache_a = { 0 }, cache_b = { 0 };
+	struct allowedips_prefix prefixes[6] = { { { { 0 } } } };
 	struct allowedips_cursor *cursor = NULL;
 	struct walk_ctx wctx = { 0 };
-	bool success = false;
+	bool success = false, compiled;
 	struct allowedips t;
 	DEFINE_MUTEX(mutex);
 	struct in6_addr ip;
@@ -586,46 +891,68 @@ bool __init wg_allowedips_selftest(void)
 
 	success = true;
 
-	test(4, a, 192, 168, 4, 20);
-	test(4, a, 192, 168, 4, 0);
-	test(4, b, 192, 168, 4, 4);
-	test(4, c, 192, 168, 200, 182);
-	test(4, c, 192, 95, 5, 68);
-	test(4, e, 192, 95, 5, 96);
-	test(6, d, 0x26075300, 0x60006b00, 0, 0xc05f0543);
-	test(6, c, 0x26075300, 0x60006b00, 0, 0xc02e01ee);
-	test(6, f, 0x26075300, 0x60006b01, 0, 0);
-	test(6, g, 0x24046800, 0x40040806, 0, 0x1006);
-	test(6, g, 0x24046800, 0x40040806, 0x1234, 0x5678);
-	test(6, f, 0x240467ff, 0x40040806, 0x1234, 0x5678);
-	test(6, f, 0x24046801, 0x40040806, 0x1234, 0x5678);
-	test(6, h, 0x24046800, 0x40040800, 0x1234, 0x5678);
-	test(6, h, 0x24046800, 0x40040800, 0, 0);
-	test(6, h, 0x24046800, 0x40040800, 0x10101010, 0x10101010);
-	test(6, a, 0x24046800, 0x40040800, 0xdeadbeef, 0xdeadbeef);
-	test(4, g, 64, 15, 116, 26);
-	test(4, g, 64, 15, 127, 3);
-	test(4, g, 64, 15, 123, 1);
-	test(4, h, 64, 15, 123, 128);
-	test(4, h, 64, 15, 123, 129);
-	test(4, a, 10, 0, 0, 52);
-	test(4, b, 10, 0, 0, 220);
-	test(4, a, 10, 1, 0, 2);
-	test(4, b, 10, 1, 0, 6);
-	test(4, c, 10, 1, 0, 10);
-	test(4, d, 10, 1, 0, 20);
+	for (compiled = false;; compiled = true) {
+		test(4, a, 192, 168, 4, 20);
+		test(4, a, 192, 168, 4, 0);
+		test(4, b, 192, 168, 4, 4);
+		test(4, c, 192, 168, 200, 182);
+		test(4, c, 192, 95, 5, 68);
+		test(4, e, 192, 95, 5, 96);
+		test(6, d, 0x26075300, 0x60006b00, 0, 0xc05f0543);
+		test(6, c, 0x26075300, 0x60006b00, 0, 0xc02e01ee);
+		test(6, f, 0x26075300, 0x60006b01, 0, 0);
+		test(6, g, 0x24046800, 0x40040806, 0, 0x1006);
+		test(6, g, 0x24046800, 0x40040806, 0x1234, 0x5678);
+		test(6, f, 0x240467ff, 0x40040806, 0x1234, 0x5678);
+		test(6, f, 0x24046801, 0x40040806, 0x1234, 0x5678);
+		test(6, h, 0x24046800, 0x40040800, 0x1234, 0x5678);
+		test(6, h, 0x24046800, 0x40040800, 0, 0);
+		test(6, h, 0x24046800, 0x40040800, 0x10101010, 0x10101010);
+		test(6, a, 0x24046800, 0x40040800, 0xdeadbeef, 0xdeadbeef);
+		test(4, g, 64, 15, 116, 26);
+		test(4, g, 64, 15, 127, 3);
+		test(4, g, 64, 15, 123, 1);
+		test(4, h, 64, 15, 123, 128);
+		test(4, h, 64, 15, 123, 129);
+		test(4, a, 10, 0, 0, 52);
+		test(4, b, 10, 0, 0, 220);
+		test(4, a, 10, 1, 0, 2);
+		test(4, b, 10, 1, 0, 6);
+		test(4, c, 10, 1, 0, 10);
+		test(4, d, 10, 1, 0, 20);
+		if (compiled)
+			break;
+		wg_allowedips_compile(&t, &mutex);
+		test_boolean(rcu_access_pointer(t.snapshot4) &&
+			     rcu_access_pointer(t.snapshot6));
+	}
+
+	test_src(4, &cache_a, a, 192, 168, 4, 20);
+	test_src(4, &cache_a, a, 192, 168, 4, 20);
+	test_src(6, &cache_a, a, 0x24046800, 0x40040800, 0xdeadbeef, 0xdeadbeef);
+	test_src(4, &cache_a, a, 192, 168, 4, 20);
+	test_src_negative(4, &cache_b, b, 192, 168, 4, 20);
+	test_src(4, &cache_b, b, 192, 168, 4, 4);
+	test_src_negative(4, &cache_a, a, 192, 168, 4, 4);
 
 	insert(4, a, 1, 0, 0, 0, 32);
+	test_boolean(!rcu_access_pointer(t.snapshot4) &&
+		     rcu_access_pointer(t.snapshot6));
 	insert(4, a, 64, 0, 0, 0, 32);
 	insert(4, a, 128, 0, 0, 0, 32);
 	insert(4, a, 192, 0, 0, 0, 32);
 	insert(4, a, 255, 0, 0, 0, 32);
 	wg_allowedips_remove_by_peer(&t, a, &mutex);
+	test_boolean(list_empty(&a->allowedips_list));
 	test_negative(4, a, 1, 0, 0, 0);
 	test_negative(4, a, 64, 0, 0, 0);
 	test_negative(4, a, 128, 0, 0, 0);
 	test_negative(4, a, 192, 0, 0, 0);
 	test_negative(4, a, 255, 0, 0, 0);
+	test_src_negative(4, &cache_a, a, 192, 168, 4, 20);
+	test_src_negative(6, &cache_a, a, 0x24046800, 0x40040800, 0xdeadbeef,
+			  0xdeadbeef);
+	test_src(4, &cache_b, b, 192, 168, 4, 4);
 
 	wg_allowedips_free(&t, &mutex);
 	wg_allowedips_init(&t);
@@ -661,6 +988,37 @@ bool __init wg_allowedips_selftest(void)
 	test_boolean(wctx.found_e);
 	test_boolean(!wctx.found_other);
 
+	wg_allowedips_free(&t, &mutex);
+	wg_allowedips_init(&t);
+	insert(4, c, 10, 0, 0, 0, 8);
+	prefix4(&prefixes[0], a, 10, 1, 0, 0, 16);
+	prefix4(&prefixes[1], b, 10, 1, 2, 0, 24);
+	/* later duplicates win */
+	prefix4(&prefixes[2], d, 10, 1, 2, 77, 24);
+	prefix6(&prefixes[3], a, 0x26075300, 0, 0, 0, 32);
+	/* replaces what was already there */
+	prefix4(&prefixes[4], b, 10, 0, 0, 0, 8);
+	prefix4(&prefixes[5], e, 0, 0, 0, 0, 0);
+	test_boolean(!wg_allowedips_insert_bulk(&t, prefixes,
+						ARRAY_SIZE(prefixes), &mutex));
+	test(4, a, 10, 1, 3, 4);
+	test(4, d, 10, 1, 2, 3);
+	test(4, b, 10, 2, 0, 0);
+	test(4, e, 11, 0, 0, 0);
+	test(6, a, 0x26075300, 1, 2, 3);
+	test_negative(6, a, 0x26075301, 1, 2, 3);
+	test_boolean(list_empty(&c->allowedips_list));
+	test_boolean(nodes_accounted(&t));
+	test_boolean(wg_allowedips_memory(&t, &mutex) >=
+		     6 * sizeof(struct allowedips_node));
+
+	wg_allowedips_remove_by_peer(&t, b, &mutex);
+	test_boolean(nodes_accounted(&t));
+	wg_allowedips_free(&t, &mutex);
+	test_boolean(!wg_allowedips_memory(&t, &mutex));
+
+	if (success)
+		success = randomized_bulk_test();
 	if (IS_ENABLED(DEBUG_RANDOM_TRIE) && success)
 		success = randomized_test();
 
@@ -682,6 +1040,8 @@ free:
 
 	return success;
 }
+#undef test_src_negative
+#undef test_src
 #undef test_negative
 #undef test
 #undef remove
@@ -121,6 +121,40 @@ void wg_packet_send_handshake_cookie(struct wg_device *wg,
 					      sizeof(packet));
 }
 
+/* The device as a whole may start enough early rekeys for each of its peers
+ * to rekey twice per REKEY_AFTER_TIME, with a second's worth of burst. A
+ * keypair that doesn't get a token backs off for up to a second before asking
+ * again, and at REKEY_AFTER_TIME it rekeys regardless.
+ */
+static bool may_rekey_early(struct wg_peer *peer,
+			    struct noise_keypair *keypair)
+{
+	struct rekey_bucket *bucket = &peer->device->rekey_bucket;
+	unsigned int rate = max_t(unsigned int, MIN_EARLY_REKEYS_PER_SECOND,
+				  2 * READ_ONCE(peer->device->num_peers) /
+					  REKEY_AFTER_TIME);
+	u64 cost = NSEC_PER_SEC / rate, now, tokens;
+	bool ret;
+
+	if (!wg_birthdate_has_expired(atomic64_read(&peer->last_sent_handshake),
+				      REKEY_TIMEOUT))
+		return false;
+
+	spin_lock_bh(&bucket->lock);
+	now = ktime_get_boot_fast_ns();
+	tokens = min_t(u64, NSEC_PER_SEC,
+		       bucket->tokens + now - bucket->last_time_ns);
+	ret = tokens >= cost;
+	bucket->tokens = ret ? tokens - cost : tokens;
+	bucket->last_time_ns = now;
+	spin_unlock_bh(&bucket->lock);
+
+	if (!ret)
+		WRITE_ONCE(keypair->rekey_after,
+			   now + prandom_u32_max(NSEC_PER_SEC));
+	return ret;
+}
+
 static void keep_key_fresh(struct wg_peer *peer)
 {
 	struct noise_keypair *keypair;
@@ -128,13 +162,18 @@ static void keep_key_fresh(struct wg_peer *peer)
 
 	rcu_read_lock_bh();
 	keypair = rcu_dereference_bh(peer->keypairs.current_keypair);
-	if (likely(keypair && keypair->sending.is_valid) &&
-	    (unlikely(atomic64_read(&keypair->sending.counter.counter) >
-		      REKEY_AFTER_MESSAGES) ||
-	     (keypair->i_am_the_initiator &&
-	      unlikely(wg_birthdate_has_expired(keypair->sending.birthdate,
-						REKEY_AFTER_TIME)))))
+	if (unlikely(!keypair || !keypair->sending.is_valid))
+		goto out;
+	if (unlikely(atomic64_read(&keypair->sending.counter.counter) >
+		     REKEY_AFTER_MESSAGES))
 		send = true;
+	else if (keypair->i_am_the_initiator &&
+		 unlikely(wg_birthdate_has_expired(
+			 READ_ONCE(keypair->rekey_after), 0)))
+		send = wg_birthdate_has_expired(keypair->sending.birthdate,
+						REKEY_AFTER_TIME) ||
+		       may_rekey_early(peer, keypair);
+out:
 	rcu_read_unlock_bh();
 
 	if (send)
@@ -186,8 +186,14 @@ int wg_socket_send_skb_to_peer(struct wg_peer *peer, struct sk_buff *skb, u8 ds)
 			    &peer->endpoint_cache);
 	else
 		dev_kfree_skb(skb);
-	if (likely(!ret))
-		peer->tx_bytes += skb_len;
+	if (likely(!ret)) {
+		struct wg_peer_stats *stats = this_cpu_ptr(peer->stats);
+
+		u64_stats_update_begin(&stats->syncp);
+		++stats->tx_packets;
+		stats->tx_bytes += skb_len;
+		u64_stats_update_end(&stats->syncp);
+	}
 	read_unlock_bh(&peer->endpoint_lock);
 
 	return ret;
@@ -269,6 +269,39 @@ n2 ping -W 1 -c 1 192.168.241.1
 pp sleep 3
 n2 ping -W 1 -c 1 192.168.241.1
 
+# Garbage sent to the listening port is counted as an early drop, as is a data message for a receiver index that isn't live; the pings behind it on the same path ensure it has been seen.
+send_garbage() {
+	n1 ncat -u 10.0.0.100 2 <<<"garbage that is not a wireguard message"
+	n1 bash -c 'printf "\x04\x00\x00\x00short" | ncat -u 10.0.0.100 2'
+	n1 bash -c 'printf "\x04\x00\x00\x00\xef\xbe\xad\xde%024d" 0 | ncat -u 10.0.0.100 2'
+	n1 ping -W 1 -c 1 192.168.241.2
+	n2 ping -W 1 -c 1 192.168.241.1
+}
+read -r invalid_type invalid_length unknown_index < <(n2 wg show wg0 dropped)
+send_garbage
+read -r dropped < <(n2 wg show wg0 dropped)
+[[ $dropped == "$((invalid_type + 1))	$((invalid_length + 1))	$((unknown_index + 1))" ]]
+
+# If the companion XDP pre-filter has been built for port 2, show that it sheds that garbage before it reaches us, including the bogus index once sync-indices has filled in the live ones, without getting in the way of real traffic.
+if [[ -n $XDP_PREFILTER ]]; then
+	bpffs="$(mktemp -d)"
+	mount -t bpf bpf "$bpffs"
+	TC_BPF_MNT="$bpffs" ip2 link set dev veths xdpgeneric obj "$XDP_PREFILTER" sec xdp
+	exec {sync_fd}< <(n2 "${XDP_PREFILTER%/*}/sync-indices" wg0 "$bpffs/xdp/globals")
+	sync_pid=$!
+	read -r -u $sync_fd synced
+	[[ $synced == synced ]]
+	read -r before < <(n2 wg show wg0 dropped)
+	send_garbage
+	read -r after < <(n2 wg show wg0 dropped)
+	[[ $after == "$before" ]]
+	kill $sync_pid
+	exec {sync_fd}<&-
+	ip2 link set dev veths xdpgeneric off
+	umount "$bpffs"
+	rmdir "$bpffs"
+fi
+
 n0 iptables -t nat -F
 ip0 link del vethrc
 ip0 link del vethrs
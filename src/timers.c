@@ -24,45 +24,348 @@
  *
  * - Timer for, if enabled, sending an empty authenticated packet every user-
  * specified seconds.
+ *
+ * Rather than each being a timer_list, these are just deadlines in the peer,
+ * and the peer is filed in its device's timer wheel under the earliest of
+ * them. Pushing a deadline back, which is what the data path mostly does,
+ * leaves the wheel alone, and the peer is simply refiled once the wheel gets to
+ * it and finds nothing due yet. Deadlines are rounded up to the wheel's tick,
+ * so they may run up to a tick late, but never early.
+ *
+ * The timers that the data path restarts or stops on every packet don't even
+ * touch their deadlines for that, and just note when they were last started,
+ * if they still are. When their deadline comes round, they work out from that
+ * whether they're actually due, or push the deadline back to when they will
+ * be. Restarting one again within the same jiffy is just a load and a
+ * compare; the first restart in a new jiffy also takes rcu_read_lock_bh and a
+ * full barrier against the wheel claiming the deadline, and only arming one
+ * that has no deadline at all goes to the wheel's lock. Stopping one is a
+ * plain load and store.
+ */
+
+/* Somewhere from a sixtieth to a thirtieth of a second, depending on HZ. */
+#define TIMER_WHEEL_TICK_SHIFT (ilog2(HZ) > 5 ? ilog2(HZ) - 5 : 0)
+#define TIMER_WHEEL_TICK (1UL << TIMER_WHEEL_TICK_SHIFT)
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_SLOT_BITS)
+
+static void wg_expired_retransmit_handshake(struct wg_peer *peer);
+static void wg_expired_send_keepalive(struct wg_peer *peer);
+static void wg_expired_new_handshake(struct wg_peer *peer);
+static void wg_expired_zero_key_material(struct wg_peer *peer);
+static void wg_expired_send_persistent_keepalive(struct wg_peer *peer);
+
+static void (*const timer_handlers[WG_TIMER_COUNT])(struct wg_peer *peer) = {
+	[WG_TIMER_RETRANSMIT_HANDSHAKE] = wg_expired_retransmit_handshake,
+	[WG_TIMER_SEND_KEEPALIVE] = wg_expired_send_keepalive,
+	[WG_TIMER_NEW_HANDSHAKE] = wg_expired_new_handshake,
+	[WG_TIMER_ZERO_KEY_MATERIAL] = wg_expired_zero_key_material,
+	[WG_TIMER_PERSISTENT_KEEPALIVE] = wg_expired_send_persistent_keepalive
+};
+
+/* Must hold wheel->lock */
+static void wheel_insert(struct timer_wheel *wheel, struct wg_peer *peer)
+{
+	unsigned long expires = (peer->timer_wake + TIMER_WHEEL_TICK - 1) &
+				~(TIMER_WHEEL_TICK - 1);
+	unsigned long ticks = (expires - wheel->clock) >> TIMER_WHEEL_TICK_SHIFT;
+	unsigned int level;
+
+	if ((long)(expires - wheel->clock) < 0) {
+		expires = wheel->clock;
+		ticks = 0;
+	}
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+		if (ticks < 1UL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))
+			break;
+	}
+	/* Anything beyond the top level is filed at its end, and is refiled
+	 * when it comes round without being due.
+	 */
+	if (ticks >= 1UL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS))
+		expires = wheel->clock + (((1UL << (TIMER_WHEEL_LEVELS *
+					   TIMER_WHEEL_SLOT_BITS)) - 1) <<
+					  TIMER_WHEEL_TICK_SHIFT);
+	hlist_add_head(&peer->timer_node,
+		       &wheel->slots[level][(expires >> (TIMER_WHEEL_TICK_SHIFT +
+					     level * TIMER_WHEEL_SLOT_BITS)) &
+					    (TIMER_WHEEL_SLOTS - 1)]);
+}
+
+/* Must hold wheel->lock. Returns the next tick with anything to run, which is
+ * at the latest when the bottom level wraps and the ones above need cascading.
  */
+static unsigned long wheel_next_tick(struct timer_wheel *wheel)
+{
+	unsigned long clock = wheel->clock;
+	unsigned int i = (clock >> TIMER_WHEEL_TICK_SHIFT) &
+			 (TIMER_WHEEL_SLOTS - 1);
 
-#define peer_get_from_timer(timer_name)                                        \
-	struct wg_peer *peer;                                                  \
-	rcu_read_lock_bh();                                                    \
-	peer = wg_peer_get_maybe_zero(from_timer(peer, timer, timer_name));    \
-	rcu_read_unlock_bh();                                                  \
-	if (unlikely(!peer))                                                   \
+	while (i && hlist_empty(&wheel->slots[0][i])) {
+		i = (i + 1) & (TIMER_WHEEL_SLOTS - 1);
+		clock += TIMER_WHEEL_TICK;
+	}
+	return clock;
+}
+
+/* Must hold wheel->lock. Files peer to run by expires, unless it's already
+ * filed to run by then.
+ */
+static void wheel_file(struct timer_wheel *wheel, struct wg_peer *peer,
+		       unsigned long expires)
+{
+	unsigned long next;
+
+	if (!hlist_unhashed(&peer->timer_node)) {
+		if (time_before_eq(peer->timer_wake, expires))
+			return;
+		hlist_del(&peer->timer_node);
+	} else if (!wheel->count++) {
+		/* Nothing has been running the clock while it was empty. */
+		wheel->clock = jiffies & ~(TIMER_WHEEL_TICK - 1);
+	}
+	WRITE_ONCE(peer->timer_wake, expires);
+	wheel_insert(wheel, peer);
+	next = wheel_next_tick(wheel);
+	if (!timer_pending(&wheel->timer) ||
+	    time_before(next, wheel->timer.expires))
+		mod_timer(&wheel->timer, next);
+}
+
+/* Must hold wheel->lock */
+static void wheel_unfile(struct timer_wheel *wheel, struct wg_peer *peer)
+{
+	if (hlist_unhashed(&peer->timer_node))
 		return;
+	hlist_del_init(&peer->timer_node);
+	--wheel->count;
+}
+
+/* Must hold wheel->lock. Returns the index of the slot cascaded, so that the
+ * caller knows whether this level has wrapped too.
+ */
+static unsigned int wheel_cascade(struct timer_wheel *wheel,
+				  unsigned int level)
+{
+	unsigned int index = (wheel->clock >> (TIMER_WHEEL_TICK_SHIFT +
+			      level * TIMER_WHEEL_SLOT_BITS)) &
+			     (TIMER_WHEEL_SLOTS - 1);
+	struct wg_peer *peer;
+	struct hlist_node *tmp;
+	HLIST_HEAD(list);
+
+	hlist_move_list(&wheel->slots[level][index], &list);
+	hlist_for_each_entry_safe (peer, tmp, &list, timer_node) {
+		__hlist_del(&peer->timer_node);
+		wheel_insert(wheel, peer);
+	}
+	return index;
+}
+
+static bool peer_timers_active(struct wg_peer *peer)
+{
+	return netif_running(peer->device->dev) && !peer->is_dead;
+}
+
+/* Makes sure that peer is filed to run by expires. */
+static void wheel_schedule(struct wg_peer *peer, unsigned long expires)
+{
+	struct timer_wheel *wheel = &peer->device->timer_wheel;
+
+	/* Pairs with the barrier in run_peer_timers, so that either it sees the
+	 * deadline we just set, or we see that it took the peer out to run.
+	 */
+	smp_mb();
+	if (!hlist_unhashed(&peer->timer_node) &&
+	    time_before_eq(READ_ONCE(peer->timer_wake), expires))
+		return;
+	spin_lock_bh(&wheel->lock);
+	wheel_file(wheel, peer, expires);
+	spin_unlock_bh(&wheel->lock);
+}
+
+static void run_peer_timers(struct wg_peer *peer)
+{
+	unsigned long deadline, next = 0;
+	unsigned int i;
+
+	smp_mb();
+	for (i = 0; i < WG_TIMER_COUNT; ++i) {
+		deadline = READ_ONCE(peer->timer_deadlines[i]);
+		/* Only whoever swaps out a due deadline gets to run it, so a
+		 * timer rearmed in the meantime is left alone.
+		 */
+		if (deadline && time_after_eq(jiffies, deadline) &&
+		    cmpxchg(&peer->timer_deadlines[i], deadline, 0) == deadline)
+			timer_handlers[i](peer);
+	}
+	for (i = 0; i < WG_TIMER_COUNT; ++i) {
+		deadline = READ_ONCE(peer->timer_deadlines[i]);
+		if (deadline && (!next || time_before(deadline, next)))
+			next = deadline;
+	}
+	if (!next)
+		return;
+	rcu_read_lock_bh();
+	if (likely(peer_timers_active(peer)))
+		wheel_schedule(peer, next);
+	rcu_read_unlock_bh();
+}
 
-static inline void mod_peer_timer(struct wg_peer *peer,
-				  struct timer_list *timer,
+static void wg_timer_wheel_tick(struct timer_list *timer)
+{
+	struct timer_wheel *wheel = from_timer(wheel, timer, timer);
+	struct wg_peer *peer;
+	unsigned int index;
+	HLIST_HEAD(expired);
+
+	spin_lock(&wheel->lock);
+	while (wheel->count && time_after_eq(jiffies, wheel->clock)) {
+		index = (wheel->clock >> TIMER_WHEEL_TICK_SHIFT) &
+			(TIMER_WHEEL_SLOTS - 1);
+		if (!index && !wheel_cascade(wheel, 1) &&
+		    !wheel_cascade(wheel, 2))
+			wheel_cascade(wheel, 3);
+		hlist_move_list(&wheel->slots[0][index], &expired);
+		wheel->clock += TIMER_WHEEL_TICK;
+
+		while (!hlist_empty(&expired)) {
+			peer = hlist_entry(expired.first, struct wg_peer,
+					   timer_node);
+			wheel_unfile(wheel, peer);
+			/* Filed peers are still around, though possibly on
+			 * their way out, which wg_timers_stop waits for.
+			 */
+			peer = wg_peer_get_maybe_zero(peer);
+			if (unlikely(!peer))
+				continue;
+			wheel->running = peer;
+			spin_unlock(&wheel->lock);
+			run_peer_timers(peer);
+			wg_peer_put(peer);
+			spin_lock(&wheel->lock);
+			wheel->running = NULL;
+		}
+	}
+	if (wheel->count)
+		mod_timer(&wheel->timer, wheel_next_tick(wheel));
+	spin_unlock(&wheel->lock);
+}
+
+void wg_timer_wheel_init(struct timer_wheel *wheel)
+{
+	unsigned int i, j;
+
+	spin_lock_init(&wheel->lock);
+	timer_setup(&wheel->timer, wg_timer_wheel_tick, 0);
+	wheel->clock = jiffies & ~(TIMER_WHEEL_TICK - 1);
+	wheel->count = 0;
+	wheel->running = NULL;
+	for (i = 0; i < TIMER_WHEEL_LEVELS; ++i) {
+		for (j = 0; j < TIMER_WHEEL_SLOTS; ++j)
+			INIT_HLIST_HEAD(&wheel->slots[i][j]);
+	}
+}
+
+/* Must only be called once every peer's timers have been stopped. */
+void wg_timer_wheel_free(struct timer_wheel *wheel)
+{
+	del_timer_sync(&wheel->timer);
+}
+
+static inline bool peer_timer_pending(struct wg_peer *peer,
+				      enum wg_timer timer)
+{
+	return READ_ONCE(peer->timer_deadlines[timer]);
+}
+
+static inline void mod_peer_timer(struct wg_peer *peer, enum wg_timer timer,
 				  unsigned long expires)
+{
+	/* Zero means unarmed, so armed deadlines always have the bottom bit
+	 * set, which at most makes them a jiffy later.
+	 */
+	expires |= 1;
+	rcu_read_lock_bh();
+	if (likely(peer_timers_active(peer))) {
+		WRITE_ONCE(peer->timer_deadlines[timer], expires);
+		wheel_schedule(peer, expires);
+	}
+	rcu_read_unlock_bh();
+}
+
+static inline void del_peer_timer(struct wg_peer *peer, enum wg_timer timer)
 {
 	rcu_read_lock_bh();
-	if (likely(netif_running(peer->device->dev) && !peer->is_dead))
-		mod_timer(timer, expires);
+	if (likely(peer_timers_active(peer)))
+		WRITE_ONCE(peer->timer_deadlines[timer], 0);
 	rcu_read_unlock_bh();
 }
 
-static inline void del_peer_timer(struct wg_peer *peer,
-				  struct timer_list *timer)
+/* (Re)starts a lazy timer from now, only going to the wheel if it has no
+ * deadline yet, since otherwise whatever is there comes before this one.
+ */
+static inline void start_lazy_timer(struct wg_peer *peer, enum wg_timer timer,
+				    unsigned long timeout)
 {
+	unsigned long now = jiffies | 1;
+
+	if (READ_ONCE(peer->timer_starts[timer]) == now)
+		return;
 	rcu_read_lock_bh();
-	if (likely(netif_running(peer->device->dev) && !peer->is_dead))
-		del_timer(timer);
+	if (likely(peer_timers_active(peer))) {
+		WRITE_ONCE(peer->timer_starts[timer], now);
+		/* Pairs with claiming the deadline in run_peer_timers, so that
+		 * either we see that it's gone, or it sees that we've started.
+		 */
+		smp_mb();
+		if (!READ_ONCE(peer->timer_deadlines[timer])) {
+			WRITE_ONCE(peer->timer_deadlines[timer],
+				   (now + timeout) | 1);
+			wheel_schedule(peer, (now + timeout) | 1);
+		}
+	}
 	rcu_read_unlock_bh();
 }
 
-static void wg_expired_retransmit_handshake(struct timer_list *timer)
+static inline void stop_lazy_timer(struct wg_peer *peer, enum wg_timer timer)
 {
-	peer_get_from_timer(timer_retransmit_handshake);
+	if (READ_ONCE(peer->timer_starts[timer]))
+		WRITE_ONCE(peer->timer_starts[timer], 0);
+}
 
+/* Called once a lazy timer's deadline has come round, to see whether it's due,
+ * or else to push its deadline back to when it will be. A due timer is claimed
+ * by swapping its start out for zero, so that a restart racing with us is never
+ * wiped out: either it lands first and we look at it again, or after, and it
+ * arms a fresh deadline of its own.
+ */
+static bool lazy_timer_due(struct wg_peer *peer, enum wg_timer timer,
+			   unsigned long timeout)
+{
+	unsigned long start = READ_ONCE(peer->timer_starts[timer]), prev;
+
+	for (;;) {
+		if (!start)
+			return false;
+		if (time_before(jiffies, start + timeout)) {
+			mod_peer_timer(peer, timer, start + timeout);
+			return false;
+		}
+		prev = cmpxchg(&peer->timer_starts[timer], start, 0);
+		if (prev == start)
+			return true;
+		start = prev;
+	}
+}
+
+static void wg_expired_retransmit_handshake(struct wg_peer *peer)
+{
 	if (peer->timer_handshake_attempts > MAX_TIMER_HANDSHAKES) {
 		pr_debug("%s: Handshake for peer %llu (%pISpfsc) did not complete after %d attempts, giving up\n",
 			 peer->device->dev->name, peer->internal_id,
 			 &peer->endpoint.addr, MAX_TIMER_HANDSHAKES + 2);
 
-		del_peer_timer(peer, &peer->timer_send_keepalive);
+		stop_lazy_timer(peer, WG_TIMER_SEND_KEEPALIVE);
 		/* We drop all packets without a keypair and don't try again,
 		 * if we try unsuccessfully for too long to make a handshake.
 		 */
@@ -71,8 +374,8 @@ static void wg_expired_retransmit_handshake(struct timer_list *timer)
 		/* We set a timer for destroying any residue that might be left
 		 * of a partial exchange.
 		 */
-		if (!timer_pending(&peer->timer_zero_key_material))
-			mod_peer_timer(peer, &peer->timer_zero_key_material,
+		if (!peer_timer_pending(peer, WG_TIMER_ZERO_KEY_MATERIAL))
+			mod_peer_timer(peer, WG_TIMER_ZERO_KEY_MATERIAL,
 				       jiffies + REJECT_AFTER_TIME * 3 * HZ);
 	} else {
 		++peer->timer_handshake_attempts;
@@ -88,25 +391,27 @@ static void wg_expired_retransmit_handshake(struct timer_list *timer)
 
 		wg_packet_send_queued_handshake_initiation(peer, true);
 	}
-	wg_peer_put(peer);
 }
 
-static void wg_expired_send_keepalive(struct timer_list *timer)
+static void wg_expired_send_keepalive(struct wg_peer *peer)
 {
-	peer_get_from_timer(timer_send_keepalive);
+	if (!lazy_timer_due(peer, WG_TIMER_SEND_KEEPALIVE,
+			    KEEPALIVE_TIMEOUT * HZ))
+		return;
 
 	wg_packet_send_keepalive(peer);
 	if (peer->timer_need_another_keepalive) {
 		peer->timer_need_another_keepalive = false;
-		mod_peer_timer(peer, &peer->timer_send_keepalive,
-			       jiffies + KEEPALIVE_TIMEOUT * HZ);
+		start_lazy_timer(peer, WG_TIMER_SEND_KEEPALIVE,
+				 KEEPALIVE_TIMEOUT * HZ);
 	}
-	wg_peer_put(peer);
 }
 
-static void wg_expired_new_handshake(struct timer_list *timer)
+static void wg_expired_new_handshake(struct wg_peer *peer)
 {
-	peer_get_from_timer(timer_new_handshake);
+	if (!lazy_timer_due(peer, WG_TIMER_NEW_HANDSHAKE,
+			    (KEEPALIVE_TIMEOUT + REKEY_TIMEOUT) * HZ))
+		return;
 
 	pr_debug("%s: Retrying handshake with peer %llu (%pISpfsc) because we stopped hearing back after %d seconds\n",
 		 peer->device->dev->name, peer->internal_id,
@@ -116,18 +421,15 @@ static void wg_expired_new_handshake(struct timer_list *timer)
 	 */
 	wg_socket_clear_peer_endpoint_src(peer);
 	wg_packet_send_queued_handshake_initiation(peer, false);
-	wg_peer_put(peer);
 }
 
-static void wg_expired_zero_key_material(struct timer_list *timer)
+static void wg_expired_zero_key_material(struct wg_peer *peer)
 {
-	peer_get_from_timer(timer_zero_key_material);
-
 	rcu_read_lock_bh();
 	if (!peer->is_dead) {
-		 /* Should take our reference. */
+		/* Should take our reference. */
 		if (!queue_work(peer->device->handshake_send_wq,
-				&peer->clear_peer_work))
+				&wg_peer_get(peer)->clear_peer_work))
 			/* If the work was already on the queue, we want to drop the extra reference */
 			wg_peer_put(peer);
 	}
@@ -146,31 +448,32 @@ static void wg_queued_expired_zero_key_material(struct work_struct *work)
 	wg_peer_put(peer);
 }
 
-static void wg_expired_send_persistent_keepalive(struct timer_list *timer)
+static void wg_expired_send_persistent_keepalive(struct wg_peer *peer)
 {
-	peer_get_from_timer(timer_persistent_keepalive);
+	if (!lazy_timer_due(peer, WG_TIMER_PERSISTENT_KEEPALIVE,
+			    peer->persistent_keepalive_interval * HZ))
+		return;
 
 	if (likely(peer->persistent_keepalive_interval))
 		wg_packet_send_keepalive(peer);
-	wg_peer_put(peer);
 }
 
 /* Should be called after an authenticated data packet is sent. */
 void wg_timers_data_sent(struct wg_peer *peer)
 {
-	if (!timer_pending(&peer->timer_new_handshake))
-		mod_peer_timer(peer, &peer->timer_new_handshake,
-			jiffies + (KEEPALIVE_TIMEOUT + REKEY_TIMEOUT) * HZ);
+	if (!READ_ONCE(peer->timer_starts[WG_TIMER_NEW_HANDSHAKE]))
+		start_lazy_timer(peer, WG_TIMER_NEW_HANDSHAKE,
+				 (KEEPALIVE_TIMEOUT + REKEY_TIMEOUT) * HZ);
 }
 
 /* Should be called after an authenticated data packet is received. */
 void wg_timers_data_received(struct wg_peer *peer)
 {
 	if (likely(netif_running(peer->device->dev))) {
-		if (!timer_pending(&peer->timer_send_keepalive))
-			mod_peer_timer(peer, &peer->timer_send_keepalive,
-				       jiffies + KEEPALIVE_TIMEOUT * HZ);
-		else
+		if (!READ_ONCE(peer->timer_starts[WG_TIMER_SEND_KEEPALIVE]))
+			start_lazy_timer(peer, WG_TIMER_SEND_KEEPALIVE,
+					 KEEPALIVE_TIMEOUT * HZ);
+		else if (!peer->timer_need_another_keepalive)
 			peer->timer_need_another_keepalive = true;
 	}
 }
@@ -180,7 +483,7 @@ void wg_timers_data_received(struct wg_peer *peer)
  */
 void wg_timers_any_authenticated_packet_sent(struct wg_peer *peer)
 {
-	del_peer_timer(peer, &peer->timer_send_keepalive);
+	stop_lazy_timer(peer, WG_TIMER_SEND_KEEPALIVE);
 }
 
 /* Should be called after any type of authenticated packet is received, whether
@@ -188,13 +491,13 @@ void wg_timers_any_authenticated_packet_sent(struct wg_peer *peer)
  */
 void wg_timers_any_authenticated_packet_received(struct wg_peer *peer)
 {
-	del_peer_timer(peer, &peer->timer_new_handshake);
+	stop_lazy_timer(peer, WG_TIMER_NEW_HANDSHAKE);
 }
 
 /* Should be called after a handshake initiation message is sent. */
 void wg_timers_handshake_initiated(struct wg_peer *peer)
 {
-	mod_peer_timer(peer, &peer->timer_retransmit_handshake,
+	mod_peer_timer(peer, WG_TIMER_RETRANSMIT_HANDSHAKE,
 		       jiffies + REKEY_TIMEOUT * HZ +
 		       prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX_JIFFIES));
 }
@@ -204,7 +507,7 @@ void wg_timers_handshake_initiated(struct wg_peer *peer)
  */
 void wg_timers_handshake_complete(struct wg_peer *peer)
 {
-	del_peer_timer(peer, &peer->timer_retransmit_handshake);
+	del_peer_timer(peer, WG_TIMER_RETRANSMIT_HANDSHAKE);
 	peer->timer_handshake_attempts = 0;
 	peer->sent_lastminute_handshake = false;
 	getnstimeofday(&peer->walltime_last_handshake);
@@ -215,7 +518,7 @@ void wg_timers_handshake_complete(struct wg_peer *peer)
  */
 void wg_timers_session_derived(struct wg_peer *peer)
 {
-	mod_peer_timer(peer, &peer->timer_zero_key_material,
+	mod_peer_timer(peer, WG_TIMER_ZERO_KEY_MATERIAL,
 		       jiffies + REJECT_AFTER_TIME * 3 * HZ);
 }
 
@@ -225,19 +528,16 @@ void wg_timers_session_derived(struct wg_peer *peer)
 void wg_timers_any_authenticated_packet_traversal(struct wg_peer *peer)
 {
 	if (peer->persistent_keepalive_interval)
-		mod_peer_timer(peer, &peer->timer_persistent_keepalive,
-			jiffies + peer->persistent_keepalive_interval * HZ);
+		start_lazy_timer(peer, WG_TIMER_PERSISTENT_KEEPALIVE,
+				 peer->persistent_keepalive_interval * HZ);
 }
 
 void wg_timers_init(struct wg_peer *peer)
 {
-	timer_setup(&peer->timer_retransmit_handshake,
-		    wg_expired_retransmit_handshake, 0);
-	timer_setup(&peer->timer_send_keepalive, wg_expired_send_keepalive, 0);
-	timer_setup(&peer->timer_new_handshake, wg_expired_new_handshake, 0);
-	timer_setup(&peer->timer_zero_key_material, wg_expired_zero_key_material, 0);
-	timer_setup(&peer->timer_persistent_keepalive,
-		    wg_expired_send_persistent_keepalive, 0);
+	memset(peer->timer_deadlines, 0, sizeof(peer->timer_deadlines));
+	memset(peer->timer_starts, 0, sizeof(peer->timer_starts));
+	INIT_HLIST_NODE(&peer->timer_node);
+	peer->timer_wake = 0;
 	INIT_WORK(&peer->clear_peer_work, wg_queued_expired_zero_key_material);
 	peer->timer_handshake_attempts = 0;
 	peer->sent_lastminute_handshake = false;
@@ -246,10 +546,23 @@ void wg_timers_init(struct wg_peer *peer)
 
 void wg_timers_stop(struct wg_peer *peer)
 {
-	del_timer_sync(&peer->timer_retransmit_handshake);
-	del_timer_sync(&peer->timer_send_keepalive);
-	del_timer_sync(&peer->timer_new_handshake);
-	del_timer_sync(&peer->timer_zero_key_material);
-	del_timer_sync(&peer->timer_persistent_keepalive);
+	struct timer_wheel *wheel = &peer->device->timer_wheel;
+	unsigned int i;
+
+	spin_lock_bh(&wheel->lock);
+	/* Wait for the wheel to finish running this peer's timers, since it
+	 * may refile it on its way out.
+	 */
+	while (unlikely(READ_ONCE(wheel->running) == peer)) {
+		spin_unlock_bh(&wheel->lock);
+		cpu_relax();
+		spin_lock_bh(&wheel->lock);
+	}
+	for (i = 0; i < WG_TIMER_COUNT; ++i) {
+		WRITE_ONCE(peer->timer_deadlines[i], 0);
+		WRITE_ONCE(peer->timer_starts[i], 0);
+	}
+	wheel_unfile(wheel, peer);
+	spin_unlock_bh(&wheel->lock);
 	flush_work(&peer->clear_peer_work);
 }
@@ -7,9 +7,42 @@
 #define _WG_TIMERS_H
 
 #include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
 
 struct wg_peer;
 
+enum wg_timer {
+	WG_TIMER_RETRANSMIT_HANDSHAKE,
+	WG_TIMER_SEND_KEEPALIVE,
+	WG_TIMER_NEW_HANDSHAKE,
+	WG_TIMER_ZERO_KEY_MATERIAL,
+	WG_TIMER_PERSISTENT_KEEPALIVE,
+	WG_TIMER_COUNT
+};
+
+enum { TIMER_WHEEL_LEVELS = 4, TIMER_WHEEL_SLOT_BITS = 6 };
+
+/* Each peer is filed once, under the earliest of its deadlines, in one of
+ * these per device, which runs everything that's due in batches every tick.
+ * The levels get coarser by a factor of the number of slots each, and their
+ * slots are cascaded down into the level below as it comes round to them.
+ */
+struct timer_wheel {
+	spinlock_t lock;
+	struct timer_list timer;
+	/* The jiffies of the next tick to run. */
+	unsigned long clock;
+	unsigned int count;
+	/* The peer whose timers are running right now, if any. */
+	struct wg_peer *running;
+	struct hlist_head slots[TIMER_WHEEL_LEVELS][1 << TIMER_WHEEL_SLOT_BITS];
+};
+
+void wg_timer_wheel_init(struct timer_wheel *wheel);
+void wg_timer_wheel_free(struct timer_wheel *wheel);
+
 void wg_timers_init(struct wg_peer *peer);
 void wg_timers_stop(struct wg_peer *peer);
 void wg_timers_data_sent(struct wg_peer *peer);
@@ -73,6 +73,8 @@ struct wgdevice {
 	uint32_t fwmark;
 	uint16_t listen_port;
 
+	uint64_t dropped_invalid_type, dropped_invalid_length, dropped_unknown_index;
+
 	struct wgpeer *first_peer, *last_peer;
 };
 
@@ -5,6 +5,7 @@
 
 #include "curve25519.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -14,11 +15,15 @@ typedef __u64 u64;
 typedef __u32 u32;
 typedef __u8 u8;
 typedef __s64 s64;
+typedef __s32 s32;
+typedef __s8 s8;
 #else
 typedef uint64_t u64, __le64;
 typedef uint32_t u32, __le32;
 typedef uint8_t u8;
 typedef int64_t s64;
+typedef int32_t s32;
+typedef int8_t s8;
 #endif
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define le64_to_cpup(a) __builtin_bswap64(*(a))
@@ -56,13 +61,18 @@ static noinline void memzero_explicit(void *s, size_t count)
 #include "../crypto/zinc/curve25519/curve25519-hacl64.c"
 #else
 #include "../crypto/zinc/curve25519/curve25519-fiat32.c"
+#include "../crypto/zinc/curve25519/curve25519-fiat32-base.c"
 #endif
 
 void curve25519_generate_public(uint8_t pub[static CURVE25519_KEY_SIZE], const uint8_t secret[static CURVE25519_KEY_SIZE])
 {
+#ifdef __SIZEOF_INT128__
 	static const uint8_t basepoint[CURVE25519_KEY_SIZE] = { 9 };
 
 	curve25519(pub, secret, basepoint);
+#else
+	curve25519_base_generic(pub, secret);
+#endif
 }
 
 void curve25519(uint8_t mypublic[static CURVE25519_KEY_SIZE], const uint8_t secret[static CURVE25519_KEY_SIZE], const uint8_t basepoint[static CURVE25519_KEY_SIZE])
@@ -844,6 +844,18 @@ static int parse_device(const struct nlattr *attr, void *data)
 		if (!mnl_attr_validate(attr, MNL_TYPE_U32))
 			device->fwmark = mnl_attr_get_u32(attr);
 		break;
+	case WGDEVICE_A_DROPPED_INVALID_TYPE:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			device->dropped_invalid_type = mnl_attr_get_u64(attr);
+		break;
+	case WGDEVICE_A_DROPPED_INVALID_LENGTH:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			device->dropped_invalid_length = mnl_attr_get_u64(attr);
+		break;
+	case WGDEVICE_A_DROPPED_UNKNOWN_INDEX:
+		if (!mnl_attr_validate(attr, MNL_TYPE_U64))
+			device->dropped_unknown_index = mnl_attr_get_u64(attr);
+		break;
 	case WGDEVICE_A_PEERS:
 		return mnl_attr_parse_nested(attr, parse_peers, device);
 	}
@@ -9,7 +9,9 @@
  * netlink, with family WG_GENL_NAME and version WG_GENL_VERSION. It defines two
  * methods: get and set. Note that while they share many common attributes,
  * these two functions actually accept a slightly different set of inputs and
- * outputs.
+ * outputs. There is also a dump of the receiver indices that are live, with
+ * events for changes to them, which is enough to filter data packets outside
+ * of the kernel.
  *
  * WG_CMD_GET_DEVICE
  * -----------------
@@ -29,6 +31,12 @@
  *    WGDEVICE_A_PUBLIC_KEY: len WG_KEY_LEN
  *    WGDEVICE_A_LISTEN_PORT: NLA_U16
  *    WGDEVICE_A_FWMARK: NLA_U32
+ *    WGDEVICE_A_DROPPED_INVALID_TYPE: NLA_U64
+ *    WGDEVICE_A_DROPPED_INVALID_LENGTH: NLA_U64
+ *    WGDEVICE_A_DROPPED_UNKNOWN_INDEX: NLA_U64
+ *    WGDEVICE_A_HANDSHAKE_RATE: NLA_U32, averaged handshakes per second
+ *    WGDEVICE_A_HANDSHAKE_UNDER_LOAD: NLA_FLAG, present if demanding cookies
+ *    WGDEVICE_A_ALLOWEDIPS_MEMORY: NLA_U64, bytes used by the allowed IPs
  *    WGDEVICE_A_PEERS: NLA_NESTED
  *        0: NLA_NESTED
  *            WGPEER_A_PUBLIC_KEY: len WG_KEY_LEN
@@ -49,6 +57,8 @@
  *                    ...
  *                ...
  *            WGPEER_A_PROTOCOL_VERSION: NLA_U32
+ *            WGPEER_A_RX_PACKETS: NLA_U64
+ *            WGPEER_A_TX_PACKETS: NLA_U64
  *        0: NLA_NESTED
  *            ...
  *        ...
@@ -124,6 +134,42 @@
  * of a peer, it likely should not be specified in subsequent fragments.
  *
  * If an error occurs, NLMSG_ERROR will reply containing an errno.
+ *
+ * WG_CMD_GET_INDICES
+ * ------------------
+ *
+ * May only be called via NLM_F_REQUEST | NLM_F_DUMP. The command should contain
+ * one but not both of:
+ *
+ *    WGDEVICE_A_IFINDEX: NLA_U32
+ *    WGDEVICE_A_IFNAME: NLA_NUL_STRING, maxlen IFNAMESIZ - 1
+ *
+ * The kernel will then return several messages (NLM_F_MULTI) containing:
+ *
+ *    WGDEVICE_A_IFINDEX: NLA_U32
+ *    WGDEVICE_A_INDICES: NLA_NESTED
+ *        0: NLA_U32
+ *        0: NLA_U32
+ *        ...
+ *
+ * Each index is a receiver index that data and response messages addressed to
+ * this interface may carry, as the four bytes appear in the packet, which is
+ * to say little endian. The receiver should take the union of the messages.
+ *
+ * WG_CMD_NEW_INDEX and WG_CMD_DEL_INDEX
+ * -------------------------------------
+ *
+ * These are never requested, but are sent to the WG_MULTICAST_GROUP_INDICES
+ * group of the interface's network namespace whenever a receiver index is
+ * added or removed, containing:
+ *
+ *    WGDEVICE_A_IFINDEX: NLA_U32
+ *    WGDEVICE_A_INDEX: NLA_U32
+ *
+ * Events about an index arrive in the order that the index changed. To keep a
+ * copy of the set, join the group first and then dump with WG_CMD_GET_INDICES,
+ * applying queued events only after the dump has finished. Should the socket
+ * overrun, with ENOBUFS, start over.
  */
 
 #ifndef _WG_UAPI_WIREGUARD_H
@@ -131,12 +177,16 @@
 
 #define WG_GENL_NAME "wireguard"
 #define WG_GENL_VERSION 1
+#define WG_MULTICAST_GROUP_INDICES "indices"
 
 #define WG_KEY_LEN 32
 
 enum wg_cmd {
 	WG_CMD_GET_DEVICE,
 	WG_CMD_SET_DEVICE,
+	WG_CMD_GET_INDICES,
+	WG_CMD_NEW_INDEX,
+	WG_CMD_DEL_INDEX,
 	__WG_CMD_MAX
 };
 #define WG_CMD_MAX (__WG_CMD_MAX - 1)
@@ -154,6 +204,14 @@ enum wgdevice_attribute {
 	WGDEVICE_A_LISTEN_PORT,
 	WGDEVICE_A_FWMARK,
 	WGDEVICE_A_PEERS,
+	WGDEVICE_A_DROPPED_INVALID_TYPE,
+	WGDEVICE_A_DROPPED_INVALID_LENGTH,
+	WGDEVICE_A_DROPPED_UNKNOWN_INDEX,
+	WGDEVICE_A_HANDSHAKE_RATE,
+	WGDEVICE_A_HANDSHAKE_UNDER_LOAD,
+	WGDEVICE_A_ALLOWEDIPS_MEMORY,
+	WGDEVICE_A_INDICES,
+	WGDEVICE_A_INDEX,
 	__WGDEVICE_A_LAST
 };
 #define WGDEVICE_A_MAX (__WGDEVICE_A_LAST - 1)
@@ -174,6 +232,8 @@ enum wgpeer_attribute {
 	WGPEER_A_TX_BYTES,
 	WGPEER_A_ALLOWEDIPS,
 	WGPEER_A_PROTOCOL_VERSION,
+	WGPEER_A_RX_PACKETS,
+	WGPEER_A_TX_PACKETS,
 	__WGPEER_A_LAST
 };
 #define WGPEER_A_MAX (__WGPEER_A_LAST - 1)